@@ -0,0 +1,52 @@
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "memory/block.h"
+#include "memory/block_allocator.h"
+
+using namespace llm;
+
+// allocate a batch of blocks and release them all
+static void BM_block_allocate_release(benchmark::State& state) {
+  const auto num_blocks = static_cast<uint32_t>(state.range(0));
+  BlockAllocator allocator(num_blocks, /*block_size=*/16);
+  for (auto _ : state) {
+    std::vector<Block> blocks = allocator.allocate(num_blocks);
+    benchmark::DoNotOptimize(blocks.data());
+  }
+  state.SetItemsProcessed(state.iterations() * num_blocks);
+}
+
+// share blocks among sequences by copying, i.e. prefix cache matches
+static void BM_block_share(benchmark::State& state) {
+  const auto num_blocks = static_cast<uint32_t>(state.range(0));
+  BlockAllocator allocator(num_blocks, /*block_size=*/16);
+  const std::vector<Block> blocks = allocator.allocate(num_blocks);
+  for (auto _ : state) {
+    // NOLINTNEXTLINE
+    std::vector<Block> shared_blocks = blocks;
+    benchmark::DoNotOptimize(shared_blocks.data());
+  }
+  state.SetItemsProcessed(state.iterations() * num_blocks);
+}
+
+// check if blocks are shared, i.e. picking victims for preemption
+static void BM_block_is_shared(benchmark::State& state) {
+  const auto num_blocks = static_cast<uint32_t>(state.range(0));
+  BlockAllocator allocator(num_blocks, /*block_size=*/16);
+  const std::vector<Block> blocks = allocator.allocate(num_blocks);
+  for (auto _ : state) {
+    size_t num_shared_blocks = 0;
+    for (const Block& block : blocks) {
+      num_shared_blocks += block.is_shared() ? 1 : 0;
+    }
+    benchmark::DoNotOptimize(num_shared_blocks);
+  }
+  state.SetItemsProcessed(state.iterations() * num_blocks);
+}
+
+BENCHMARK(BM_block_allocate_release)->Arg(16)->Arg(256)->Arg(4096);
+BENCHMARK(BM_block_share)->Arg(16)->Arg(256)->Arg(4096);
+BENCHMARK(BM_block_is_shared)->Arg(16)->Arg(256)->Arg(4096);
@@ -0,0 +1,67 @@
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "memory/block.h"
+#include "memory/block_allocator.h"
+#include "memory/prefix_cache.h"
+
+using namespace llm;
+
+namespace {
+constexpr uint32_t kBlockSize = 16;
+// prompts with a distinct first block, each taking 4 blocks
+constexpr uint32_t kBlocksPerPrompt = 4;
+
+std::vector<int32_t> prompt_tokens(int64_t index) {
+  std::vector<int32_t> tokens(kBlocksPerPrompt * kBlockSize);
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    tokens[i] = static_cast<int32_t>(index * tokens.size() + i);
+  }
+  return tokens;
+}
+}  // namespace
+
+// match a cached prompt with the given number of prompts in the cache
+static void BM_prefix_cache_match(benchmark::State& state) {
+  const int64_t num_prompts = state.range(0);
+  BlockAllocator allocator(num_prompts * kBlocksPerPrompt, kBlockSize);
+  PrefixCache cache(kBlockSize);
+  for (int64_t i = 0; i < num_prompts; ++i) {
+    const std::vector<Block> blocks = allocator.allocate(kBlocksPerPrompt);
+    cache.insert(prompt_tokens(i), blocks);
+  }
+
+  const std::vector<int32_t> tokens = prompt_tokens(num_prompts / 2);
+  for (auto _ : state) {
+    std::vector<Block> blocks = cache.match(tokens);
+    benchmark::DoNotOptimize(blocks.data());
+  }
+  // release the blocks before the allocator
+  cache.evict(num_prompts * kBlocksPerPrompt);
+}
+
+// insert a prompt sharing the first block with a cached one
+static void BM_prefix_cache_insert(benchmark::State& state) {
+  const int64_t num_prompts = state.range(0);
+  BlockAllocator allocator(num_prompts * kBlocksPerPrompt + 1, kBlockSize);
+  PrefixCache cache(kBlockSize);
+  for (int64_t i = 0; i < num_prompts; ++i) {
+    const std::vector<Block> blocks = allocator.allocate(kBlocksPerPrompt);
+    cache.insert(prompt_tokens(i), blocks);
+  }
+
+  const std::vector<int32_t> tokens = prompt_tokens(num_prompts / 2);
+  std::vector<Block> blocks = cache.match(tokens);
+  for (auto _ : state) {
+    // no new tokens, only walks the tree
+    const size_t num_inserted = cache.insert(tokens, blocks);
+    benchmark::DoNotOptimize(num_inserted);
+  }
+  blocks.clear();
+  cache.evict(num_prompts * kBlocksPerPrompt);
+}
+
+BENCHMARK(BM_prefix_cache_match)->Arg(16)->Arg(1024)->Arg(16384);
+BENCHMARK(BM_prefix_cache_insert)->Arg(16)->Arg(1024)->Arg(16384);
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <absl/time/clock.h>
+#include <absl/time/time.h>
+
+#include <atomic>
+#include <cstdint>
+
+namespace llm {
+
+// A source of the current time. Components that make time based decisions,
+// i.e. the scheduler, read the time from a clock so that they can be driven
+// by a simulated clock in offline simulations and tests.
+class Clock {
+ public:
+  virtual ~Clock() = default;
+
+  virtual absl::Time now() const = 0;
+};
+
+// the wall clock
+class SystemClock final : public Clock {
+ public:
+  absl::Time now() const override { return absl::Now(); }
+
+  static SystemClock* instance() {
+    static SystemClock clock;
+    return &clock;
+  }
+};
+
+// a manually advanced clock, thread safe.
+class SimulatedClock final : public Clock {
+ public:
+  explicit SimulatedClock(absl::Time start = absl::UnixEpoch())
+      : now_ns_(absl::ToUnixNanos(start)) {}
+
+  absl::Time now() const override {
+    return absl::FromUnixNanos(now_ns_.load(std::memory_order_relaxed));
+  }
+
+  void advance(absl::Duration duration) {
+    now_ns_.fetch_add(absl::ToInt64Nanoseconds(duration),
+                      std::memory_order_relaxed);
+  }
+
+  // move the clock forward to the given time, no-op if it is in the past.
+  void advance_to(absl::Time time) {
+    const int64_t time_ns = absl::ToUnixNanos(time);
+    int64_t now_ns = now_ns_.load(std::memory_order_relaxed);
+    while (now_ns < time_ns &&
+           !now_ns_.compare_exchange_weak(
+               now_ns, time_ns, std::memory_order_relaxed)) {
+      // now_ns is reloaded on failure
+    }
+  }
+
+ private:
+  std::atomic<int64_t> now_ns_;
+};
+
+}  // namespace llm
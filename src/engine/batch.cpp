@@ -53,6 +53,7 @@ void Batch::add(const std::vector<Sequence*>& sequences) {
 }
 
 void Batch::set_engine_type(EngineType engine_type) {
+  engine_type_ = engine_type;
   // set engine type for all sequences in the batch
   for (auto* sequence : sequences_) {
     sequence->set_engine_type(engine_type);
@@ -61,10 +62,17 @@ void Batch::set_engine_type(EngineType engine_type) {
   std::fill(budget_used_.begin(), budget_used_.end(), 0);
 }
 
+void Batch::add_block_swaps(const std::vector<BlockSwap>& block_swaps) {
+  block_swaps_.insert(
+      block_swaps_.end(), block_swaps.begin(), block_swaps.end());
+}
+
 void Batch::clear() {
   sequences_.clear();
   token_budgets_.clear();
   budget_used_.clear();
+  block_swaps_.clear();
+  std::fill(block_swaps_prepared_.begin(), block_swaps_prepared_.end(), false);
 }
 
 // prepare inputs for the batch
@@ -128,10 +136,16 @@ ModelInput Batch::prepare_model_input() {
     // update budget used
     budget_used_[i] += q_seq_len;
 
+    // blocks behind the sliding window are released, keys start from the
+    // first block kept.
+    const size_t n_released_blocks = sequence->num_released_blocks();
+    const uint32_t kv_seq_len =
+        seq_len - n_released_blocks * sequence->blocks().back().size();
+
     // update sequence length
-    max_seq_len = std::max(max_seq_len, seq_len);
+    max_seq_len = std::max(max_seq_len, kv_seq_len);
     q_max_seq_len = std::max(q_max_seq_len, q_seq_len);
-    cu_seq_lens.push_back(cu_seq_lens.back() + seq_len);
+    cu_seq_lens.push_back(cu_seq_lens.back() + kv_seq_len);
     q_cu_seq_lens.push_back(q_cu_seq_lens.back() + q_seq_len);
 
     // pack the token ids and positions into one-dimensional tensors
@@ -200,9 +214,9 @@ ModelInput Batch::prepare_model_input() {
 
     // construct block ids for each sequence
     std::vector<int32_t> block_ids;
-    block_ids.reserve(blocks.size());
-    for (const auto& block : blocks) {
-      block_ids.push_back(block.id());
+    block_ids.reserve(blocks.size() - n_released_blocks);
+    for (size_t j = n_released_blocks; j < blocks.size(); ++j) {
+      block_ids.push_back(blocks[j].id());
     }
     block_tables_vec.push_back(block_ids);
   }
@@ -240,6 +254,12 @@ ModelInput Batch::prepare_model_input() {
                                       unique_token_lens_vec);
   }
 
+  // hand block swaps to the engine only once
+  const auto engine_idx = static_cast<size_t>(engine_type_);
+  if (!block_swaps_prepared_[engine_idx]) {
+    model_inputs.block_swaps = block_swaps_;
+    block_swaps_prepared_[engine_idx] = true;
+  }
   return model_inputs;
 }
 
@@ -259,6 +279,11 @@ void Batch::process_sample_output(const SampleOutput& sample_output) {
       // add the next token to sequence
       const int32_t next_token_id =
           static_cast<int32_t>(next_tokens[output_idx++].item<int64_t>());
+      // the sequence is still recomputing its released kv cache, the sampled
+      // token is already known.
+      if (seq->num_kv_cache_tokens() < seq->num_tokens()) {
+        continue;
+      }
       seq->append_new_token_id(next_token_id);
     }
     CHECK_EQ(output_idx, num_seqs);
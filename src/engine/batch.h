@@ -56,6 +56,9 @@ class Batch {
   // set the engine type for the batch
   void set_engine_type(EngineType engine_type);
 
+  // add cache block swaps to apply before running the model
+  void add_block_swaps(const std::vector<BlockSwap>& block_swaps);
+
  private:
   // sequences in the batch
   std::vector<Sequence*> sequences_;
@@ -66,6 +69,17 @@ class Batch {
 
   // number of used budget for each sequence
   std::vector<uint32_t> budget_used_;
+
+  // cache block swaps to apply before running the model
+  std::vector<BlockSwap> block_swaps_;
+
+  // whether block swaps have been handed to each engine type. the swaps
+  // should only be applied once for each engine.
+  std::vector<bool> block_swaps_prepared_ =
+      std::vector<bool>(static_cast<size_t>(EngineType::COUNT), false);
+
+  // current engine type of the batch
+  EngineType engine_type_ = EngineType::LLM;
 };
 
 }  // namespace llm
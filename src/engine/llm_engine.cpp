@@ -1,13 +1,14 @@
 #include "llm_engine.h"
 
 #include <ATen/cuda/CUDAContext.h>
-#include <gflags/gflags_declare.h>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 
 #include <boost/algorithm/string.hpp>
 #include <memory>
 
 #include "common/pretty_print.h"
+#include "memory/numa.h"
 #include "model_loader/model_loader.h"
 #include "model_parallel/parallel_args.h"
 #include "models/model_args.h"
@@ -17,7 +18,12 @@
 static constexpr int64_t GB = int64_t(1024) * 1024 * 1024;
 
 DEFINE_int32(block_size, 16, "slots per block, value must be multiple of 16");
-DEFINE_int64(max_cache_size, 10 * GB, "max cache size in bytes, default 10GB");
+DEFINE_int64(max_cache_size,
+             10 * GB,
+             "max kv cache size in bytes, caps the size profiled from the "
+             "available memory under max_memory_utilization. 0 for no cap. "
+             "the default 10GB cap only applies to cuda devices, cpu devices "
+             "are capped only when the flag is set explicitly");
 DEFINE_double(max_memory_utilization,
               0.9,
               "maximum memory utilization allowed, default 0.9");
@@ -34,10 +40,40 @@ DEFINE_int64(max_num_seqs_per_batch,
              32,
              "Maximum number of sequences per batch for profiling.");
 
+DEFINE_string(kv_cache_dtype,
+              "auto",
+              "data type of kv cache, auto to use the model dtype, or int8 to "
+              "quantize kv cache with per-block scales, only for cpu");
+
+DEFINE_int64(max_swap_space,
+             0,
+             "max host memory in bytes to hold kv cache of preempted "
+             "sequences, 0 to disable swapping");
+
+DEFINE_int32(numa_node,
+             -1,
+             "numa node to bind the threads, weights and kv cache of the cpu "
+             "worker to, -1 to leave placement to the os. only one cpu device "
+             "is supported per process, run one process per socket to use "
+             "several nodes");
+
 DECLARE_bool(disable_custom_kernels);
 
 namespace llm {
 namespace {
+// returns the numa node to bind the worker to, -1 if not bound
+int numa_node_for(const std::vector<torch::Device>& devices) {
+  if (FLAGS_numa_node < 0) {
+    return -1;
+  }
+  // process groups are only created for cuda devices
+  CHECK(devices.size() == 1 && devices[0].is_cpu())
+      << "Numa binding is only supported for a single cpu device";
+  CHECK(FLAGS_numa_node < memory::num_numa_nodes())
+      << "Invalid numa node: " << FLAGS_numa_node;
+  return FLAGS_numa_node;
+}
+
 torch::ScalarType parse_dtype(const std::string& dtype_str,
                               const torch::Device& device) {
   if (device.is_cpu()) {
@@ -61,6 +97,19 @@ torch::ScalarType parse_dtype(const std::string& dtype_str,
   }
   CHECK(false) << "Unsupported dtype: " << dtype_str << " on device " << device;
 }
+
+torch::ScalarType parse_kv_cache_dtype(const std::string& dtype_str,
+                                       const torch::Device& device,
+                                       torch::ScalarType dtype) {
+  if (dtype_str.empty() || dtype_str == "auto") {
+    return dtype;
+  }
+  if (dtype_str == "int8") {
+    CHECK(device.is_cpu()) << "int8 kv cache is only supported on cpu";
+    return torch::kChar;
+  }
+  CHECK(false) << "Unsupported kv cache dtype: " << dtype_str;
+}
 }  // namespace
 
 LLMEngine::LLMEngine(const std::vector<torch::Device>& devices)
@@ -90,11 +139,13 @@ LLMEngine::LLMEngine(const std::vector<torch::Device>& devices)
   }
 
   // create a worker for each device
+  const int numa_node = numa_node_for(devices);
   for (size_t i = 0; i < devices.size(); ++i) {
     const int32_t rank = static_cast<int32_t>(i);
     ProcessGroup* pg = world_size > 1 ? process_groups_[i].get() : nullptr;
     ParallelArgs parallel_args(rank, world_size, pg);
-    workers_.emplace_back(std::make_unique<Worker>(parallel_args, devices[i]));
+    workers_.emplace_back(
+        std::make_unique<Worker>(parallel_args, devices[i], numa_node));
   }
 
   if (FLAGS_disable_custom_kernels) {
@@ -115,7 +166,7 @@ bool LLMEngine::init(const std::string& model_weights_path) {
   LOG(INFO) << "Initializing kv cache with size: "
             << readable_size(cache_size_in_bytes);
   const int64_t n_blocks = calculate_kv_cache_blocks(cache_size_in_bytes);
-  if (!init_kv_cache(n_blocks)) {
+  if (!init_kv_cache(n_blocks, calculate_host_kv_cache_blocks())) {
     LOG(ERROR) << "Failed to initialize kv cache";
     return false;
   }
@@ -144,12 +195,14 @@ bool LLMEngine::init_model(const std::string& model_weights_path) {
   n_local_kv_heads_ = n_kv_heads / world_size;
   head_dim_ = args_.hidden_size() / n_heads;
   dtype_ = parse_dtype(args_.dtype(), devices_[0]);
+  kv_cache_dtype_ =
+      parse_kv_cache_dtype(FLAGS_kv_cache_dtype, devices_[0], dtype_);
 
   // key + value for all layers
   LOG(INFO) << "Block info, block_size: " << FLAGS_block_size
             << ", n_local_kv_heads: " << n_local_kv_heads_
             << ", head_dim: " << head_dim_ << ", n_layers: " << args_.n_layers()
-            << ", dtype: " << dtype_;
+            << ", dtype: " << dtype_ << ", kv_cache_dtype: " << kv_cache_dtype_;
 
   if (tokenizer_->vocab_size() != args_.vocab_size()) {
     // use tokenizer vocab size if model vocab size is not set
@@ -246,14 +299,8 @@ bool LLMEngine::warmup_model() {
 int64_t LLMEngine::profile_memory_for_kv_cache() {
   // use first device to profile memory usage
   const auto& device = workers_[0]->device();
-  if (device.is_cpu()) {
-    // use max memory cache size for CPU
-    LOG(INFO) << "Initializing CPU cache with max cache size: "
-              << readable_size(FLAGS_max_cache_size);
-    // TODO: add CPU memory profiling
-    return FLAGS_max_cache_size;
-  }
-  CHECK(device.is_cuda()) << "Only support CPU and CUDA device for now.";
+  CHECK(device.is_cpu() || device.is_cuda())
+      << "Only support CPU and CUDA device for now.";
 
   // Prepare dummy inputs for memory profiling
   torch::Tensor flatten_token_ids;
@@ -299,7 +346,13 @@ int64_t LLMEngine::profile_memory_for_kv_cache() {
           total_memory * (1.0 - FLAGS_max_memory_utilization);
       available_memory -= buffer_memory;
     }
-    if (FLAGS_max_cache_size > 0) {
+    LOG(INFO) << device << ": kv cache budget from profiling: "
+              << readable_size(std::max(available_memory, int64_t(0)));
+    // host memory is usually far larger than the default cap
+    const bool use_cap =
+        device.is_cuda() ||
+        !gflags::GetCommandLineFlagInfoOrDie("max_cache_size").is_default;
+    if (use_cap && FLAGS_max_cache_size > 0) {
       available_memory = std::min(available_memory, FLAGS_max_cache_size);
     }
     smallest_available_memory =
@@ -308,7 +361,7 @@ int64_t LLMEngine::profile_memory_for_kv_cache() {
   return std::max(smallest_available_memory, int64_t(0));
 }
 
-bool LLMEngine::init_kv_cache(int64_t n_blocks) {
+bool LLMEngine::init_kv_cache(int64_t n_blocks, int64_t n_host_blocks) {
   CHECK_GT(n_blocks, 0) << "no memory for kv cache";
 
   // init kv cache for each worker
@@ -316,19 +369,30 @@ bool LLMEngine::init_kv_cache(int64_t n_blocks) {
       n_blocks, FLAGS_block_size, n_local_kv_heads_, head_dim_};
   LOG(INFO) << "Initializing kv cache with shape: [" << kv_cache_shape << "]";
 
+  if (n_host_blocks > 0) {
+    LOG(INFO) << "Initializing host kv cache with " << n_host_blocks
+              << " blocks for swapping";
+  }
+
   // initialize block manager
-  block_manager_ = std::make_unique<BlockManager>(n_blocks, FLAGS_block_size);
+  block_manager_ = std::make_unique<BlockManager>(
+      n_blocks,
+      FLAGS_block_size,
+      n_host_blocks,
+      FLAGS_block_size * kv_cache_slot_size_in_bytes());
+  block_manager_->set_sliding_window(args_.sliding_window());
 
   // init kv cache for each worker in parallel
   if (workers_.size() == 1) {
     // only one worker, call init_kv_cache in current thread
-    return workers_[0]->init_kv_cache(kv_cache_shape);
+    return workers_[0]->init_kv_cache(kv_cache_shape, n_host_blocks);
   }
 
   std::vector<folly::SemiFuture<bool>> futures;
   futures.reserve(workers_.size());
   for (auto& worker : workers_) {
-    futures.push_back(worker->init_kv_cache_async(kv_cache_shape));
+    futures.push_back(
+        worker->init_kv_cache_async(kv_cache_shape, n_host_blocks));
   }
   // wait for all futures to complete
   auto results = folly::collectAll(futures).get();
@@ -370,10 +434,18 @@ ModelOutput LLMEngine::execute_model(Batch& batch) {
 }
 
 int64_t LLMEngine::kv_cache_slot_size_in_bytes() const {
-  const auto dtype_size = torch::scalarTypeToTypeMeta(dtype_).itemsize();
+  const auto dtype_size =
+      torch::scalarTypeToTypeMeta(kv_cache_dtype_).itemsize();
   // key + value for all layers
-  const int64_t slot_size_in_bytes =
+  int64_t slot_size_in_bytes =
       2 * n_local_kv_heads_ * head_dim_ * args_.n_layers() * dtype_size;
+  if (kv_cache_dtype_ == torch::kChar) {
+    // a float scale for each head in each block, shared by its slots
+    const int64_t scales_size_in_bytes =
+        2 * n_local_kv_heads_ * args_.n_layers() * sizeof(float);
+    slot_size_in_bytes +=
+        (scales_size_in_bytes + FLAGS_block_size - 1) / FLAGS_block_size;
+  }
   return slot_size_in_bytes;
 }
 
@@ -384,4 +456,12 @@ int64_t LLMEngine::calculate_kv_cache_blocks(
   return cache_size_in_bytes / block_size_in_bytes;
 }
 
+int64_t LLMEngine::calculate_host_kv_cache_blocks() const {
+  // swapping only pays off when kv cache lives on gpu
+  if (FLAGS_max_swap_space <= 0 || !devices_[0].is_cuda()) {
+    return 0;
+  }
+  return calculate_kv_cache_blocks(FLAGS_max_swap_space);
+}
+
 }  // namespace llm
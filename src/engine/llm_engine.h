@@ -55,7 +55,11 @@ class LLMEngine : public Engine {
 
   bool init_model(const std::string& model_weights_path);
 
-  bool init_kv_cache(int64_t n_blocks);
+  // n_host_blocks: number of host blocks to hold swapped out kv cache
+  bool init_kv_cache(int64_t n_blocks, int64_t n_host_blocks = 0);
+
+  // returns the number of host blocks for swapping out kv cache
+  int64_t calculate_host_kv_cache_blocks() const;
 
   // returns the memory size for the kv cache
   int64_t profile_memory_for_kv_cache();
@@ -75,6 +79,9 @@ class LLMEngine : public Engine {
   // dtype
   torch::ScalarType dtype_;
 
+  // dtype of kv cache, int8 if kv cache is quantized
+  torch::ScalarType kv_cache_dtype_;
+
   // model args
   ModelArgs args_;
 
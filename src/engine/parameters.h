@@ -2,6 +2,9 @@
 
 #include <torch/torch.h>
 
+#include <vector>
+
+#include "memory/block.h"
 #include "models/parameters.h"
 #include "sampling/parameters.h"
 
@@ -18,6 +21,8 @@ struct ModelInput {
   InputParameters input_params;
   // sampling parameters, mainly for sampling
   SamplingParameters sampling_params;
+  // cache block swaps to apply in order before running the model
+  std::vector<BlockSwap> block_swaps;
 };
 
 // output for the model that encapsulates all the necessary
@@ -1,25 +1,37 @@
 #include "worker.h"
 
+#include <ATen/Parallel.h>
 #include <ATen/cuda/CUDAGraph.h>
+#include <absl/strings/str_cat.h>
 #include <c10/core/Device.h>
 #include <c10/cuda/CUDAGuard.h>
 #include <folly/Unit.h>
 #include <folly/futures/Future.h>
+#include <gflags/gflags_declare.h>
 #include <glog/logging.h>
 #include <torch/torch.h>
 
+#include <algorithm>
 #include <memory>
+#include <unordered_map>
 #include <utility>
 
+#include "common/pretty_print.h"
 #include "common/threadpool.h"
 #include "engine/utils.h"
+#include "memory/host_memory.h"
 #include "memory/kv_cache.h"
+#include "memory/mapped_file.h"
 #include "memory/memory.h"
+#include "memory/numa.h"
 #include "model_loader/state_dict.h"
 #include "models/parameters.h"
 #include "sampling/logits_processor.h"
 #include "sampling/sampler.h"
 
+DECLARE_string(host_kv_cache_file);
+DECLARE_string(kv_cache_dtype);
+
 namespace llm {
 
 const static std::vector<int> BatchSizeForCudaGraph = {
@@ -90,36 +102,195 @@ class CudaGraphRunner {
   torch::Tensor hidden_states_buffer_;
 };
 
-Worker::Worker(const ParallelArgs& parallel_args, const torch::Device& device)
-    : parallel_args_(parallel_args), device_(device) {}
+Worker::Worker(const ParallelArgs& parallel_args,
+               const torch::Device& device,
+               int numa_node)
+    : device_(device), numa_node_(numa_node), parallel_args_(parallel_args) {
+  CHECK(numa_node_ < 0 || device_.is_cpu())
+      << "Numa binding is only supported on cpu";
+}
 
 bool Worker::init_model(torch::ScalarType dtype,
                         const ModelArgs& args,
                         const QuantArgs& quant_args) {
+  bind_thread_to_numa_node();
   // initialize model
   args_ = args;
   dtype_ = dtype;
   const auto options = torch::dtype(dtype_).device(device_);
   model_ = CausalLM::create(args, quant_args, parallel_args_, options);
   CHECK(model_ != nullptr) << "Failed to create model.";
+
+  // bind the weights before they are loaded, so that pages are allocated on
+  // the node no matter which threads copy the weights in.
+  if (numa_node_ >= 0) {
+    for (const auto& parameter : model_->parameters()) {
+      bind_tensor_to_numa_node(parameter);
+    }
+    for (const auto& buffer : model_->buffers()) {
+      bind_tensor_to_numa_node(buffer);
+    }
+  }
   return true;
 }
 
-bool Worker::init_kv_cache(const std::vector<int64_t>& kv_cache_shape) {
+void Worker::bind_thread_to_numa_node() const {
+  if (numa_node_ < 0) {
+    return;
+  }
+  // the intra-op threads of torch created by the thread inherit the binding
+  thread_local int bound_numa_node = -1;
+  if (bound_numa_node == numa_node_) {
+    return;
+  }
+  bound_numa_node = numa_node_;
+  if (memory::bind_thread_to_numa_node(numa_node_)) {
+    const auto cpus = memory::numa_node_cpus(numa_node_);
+    // the size of the intra-op thread pool is process wide, not per worker
+    at::set_num_threads(static_cast<int>(cpus.size()));
+    LOG(INFO) << "Bound worker thread to numa node " << numa_node_ << " with "
+              << cpus.size() << " cpus";
+  }
+}
+
+void Worker::bind_tensor_to_numa_node(const torch::Tensor& tensor) const {
+  if (numa_node_ < 0 || !tensor.defined() || tensor.numel() == 0) {
+    return;
+  }
+  memory::bind_memory_to_numa_node(
+      tensor.data_ptr(), tensor.nbytes(), numa_node_);
+}
+
+bool Worker::init_kv_cache(const std::vector<int64_t>& kv_cache_shape,
+                           int64_t n_host_blocks) {
   CHECK(model_ != nullptr) << "Model is not initialized.";
+  bind_thread_to_numa_node();
   // create a KVCache for each layer
   const int64_t num_layers = args_.n_layers();
   kv_caches_.reserve(num_layers);
+  if (FLAGS_kv_cache_dtype == "int8") {
+    CHECK(device_.is_cpu()) << "int8 kv cache is only supported on cpu";
+    // [num_blocks, num_kv_heads]
+    const std::vector<int64_t> scales_shape = {kv_cache_shape[0],
+                                               kv_cache_shape[2]};
+    const auto options = torch::dtype(torch::kChar).device(device_);
+    const auto scales_options = torch::dtype(torch::kFloat).device(device_);
+    for (int64_t i = 0; i < num_layers; ++i) {
+      auto key_cache = torch::empty(kv_cache_shape, options);
+      auto value_cache = torch::empty(kv_cache_shape, options);
+      auto key_scales = torch::zeros(scales_shape, scales_options);
+      auto value_scales = torch::zeros(scales_shape, scales_options);
+      kv_caches_.emplace_back(key_cache, value_cache, key_scales, value_scales);
+    }
+  } else {
+    for (int64_t i = 0; i < num_layers; ++i) {
+      auto key_cache =
+          torch::empty(kv_cache_shape, torch::dtype(dtype_).device(device_));
+      auto value_cache =
+          torch::empty(kv_cache_shape, torch::dtype(dtype_).device(device_));
+      kv_caches_.emplace_back(key_cache, value_cache);
+    }
+  }
+  // keep the kv cache local to the threads reading it
+  for (const auto& kv_cache : kv_caches_) {
+    const auto [key_cache, value_cache] = kv_cache.get_kv_cache();
+    bind_tensor_to_numa_node(key_cache);
+    bind_tensor_to_numa_node(value_cache);
+  }
+
+  if (n_host_blocks > 0) {
+    // same layout as device kv cache, use pinned memory for faster copy
+    std::vector<int64_t> host_kv_cache_shape = kv_cache_shape;
+    host_kv_cache_shape[0] = n_host_blocks;
+    if (!FLAGS_host_kv_cache_file.empty()) {
+      return init_mapped_host_kv_cache(host_kv_cache_shape);
+    }
+    const auto options = torch::dtype(dtype_).device(torch::kCPU).pinned_memory(
+        device_.is_cuda());
+    host_kv_caches_.reserve(num_layers);
+    for (int64_t i = 0; i < num_layers; ++i) {
+      auto key_cache = torch::empty(host_kv_cache_shape, options);
+      auto value_cache = torch::empty(host_kv_cache_shape, options);
+      host_kv_caches_.emplace_back(key_cache, value_cache);
+    }
+  }
+  return true;
+}
+
+bool Worker::init_mapped_host_kv_cache(
+    const std::vector<int64_t>& host_kv_cache_shape) {
+  const int64_t num_layers = args_.n_layers();
+  int64_t cache_size = torch::elementSize(dtype_);
+  for (const int64_t dim : host_kv_cache_shape) {
+    cache_size *= dim;
+  }
+  // one file per worker, each holds its own shard of kv heads
+  const std::string path =
+      absl::StrCat(FLAGS_host_kv_cache_file, ".", parallel_args_.rank());
+  auto file = MappedFile::open(path, 2 * num_layers * cache_size);
+  if (file == nullptr) {
+    return false;
+  }
+
+  // the tensors keep the file mapped
+  const auto deleter = [file](void* /*data*/) {};
+  const auto options = torch::dtype(dtype_).device(torch::kCPU);
+  host_kv_caches_.reserve(num_layers);
   for (int64_t i = 0; i < num_layers; ++i) {
+    char* data = file->data() + 2 * i * cache_size;
     auto key_cache =
-        torch::empty(kv_cache_shape, torch::dtype(dtype_).device(device_));
-    auto value_cache =
-        torch::empty(kv_cache_shape, torch::dtype(dtype_).device(device_));
-    kv_caches_.emplace_back(key_cache, value_cache);
+        torch::from_blob(data, host_kv_cache_shape, deleter, options);
+    auto value_cache = torch::from_blob(
+        data + cache_size, host_kv_cache_shape, deleter, options);
+    host_kv_caches_.emplace_back(key_cache, value_cache);
   }
   return true;
 }
 
+void Worker::swap_blocks(const std::vector<BlockSwap>& block_swaps) {
+  // group consecutive swaps in the same direction to copy them in one go
+  size_t start = 0;
+  while (start < block_swaps.size()) {
+    const bool swap_out = block_swaps[start].swap_out;
+    const bool on_device = block_swaps[start].on_device;
+    CHECK(on_device || !host_kv_caches_.empty())
+        << "Host kv cache is not initialized.";
+    std::vector<int32_t> src_block_ids;
+    std::vector<int32_t> dst_block_ids;
+    // a freed block may be reused within the group, the last copy wins
+    std::unordered_map<int32_t, size_t> dst_index;
+    size_t end = start;
+    // all blocks of a group are read before any is written, so a copy out
+    // of a block written earlier in the group starts a new group.
+    for (; end < block_swaps.size() &&
+           block_swaps[end].swap_out == swap_out &&
+           block_swaps[end].on_device == on_device &&
+           !(on_device && dst_index.count(block_swaps[end].src_block_id) > 0);
+         ++end) {
+      const auto [it, inserted] = dst_index.emplace(
+          block_swaps[end].dst_block_id, dst_block_ids.size());
+      if (!inserted) {
+        src_block_ids[it->second] = block_swaps[end].src_block_id;
+        continue;
+      }
+      src_block_ids.push_back(block_swaps[end].src_block_id);
+      dst_block_ids.push_back(block_swaps[end].dst_block_id);
+    }
+    const auto src_ids = torch::tensor(src_block_ids, torch::kInt);
+    const auto dst_ids = torch::tensor(dst_block_ids, torch::kInt);
+    for (size_t i = 0; i < kv_caches_.size(); ++i) {
+      if (on_device) {
+        kv_caches_[i].copy_blocks_from(kv_caches_[i], src_ids, dst_ids);
+      } else if (swap_out) {
+        host_kv_caches_[i].copy_blocks_from(kv_caches_[i], src_ids, dst_ids);
+      } else {
+        kv_caches_[i].copy_blocks_from(host_kv_caches_[i], src_ids, dst_ids);
+      }
+    }
+    start = end;
+  }
+}
+
 bool Worker::warmup_model(bool enable_cudagraph) {
   if (enable_cudagraph) {
     LOG(INFO) << "CUDAGraph is enabled.";
@@ -143,13 +314,19 @@ std::tuple<int64_t, int64_t> Worker::profile_device_memory(
     torch::Tensor flatten_positions,  // [num_tokens]
     const InputParameters& params) {
   CHECK(model_ != nullptr) << "Model is not initialized.";
-  CHECK(device_.is_cuda()) << "Memory profiling is only supported on GPU.";
+  bind_thread_to_numa_node();
 
   torch::DeviceGuard device_guard(device_);
 
   // initialize dummy kv caches for profiling
   std::vector<KVCache> dummy_kv_caches(args_.n_layers());
 
+  if (device_.is_cpu()) {
+    return profile_host_memory(
+        flatten_tokens, flatten_positions, params, dummy_kv_caches);
+  }
+  CHECK(device_.is_cuda()) << "Only support CPU and CUDA device for now.";
+
   // release all unocupied cached memory
   // torch::cuda::empty_cache();
   c10::cuda::CUDACachingAllocator::emptyCache();
@@ -169,7 +346,45 @@ std::tuple<int64_t, int64_t> Worker::profile_device_memory(
   return {available_memory, total_memory};
 }
 
+std::tuple<int64_t, int64_t> Worker::profile_host_memory(
+    torch::Tensor flatten_tokens,
+    torch::Tensor flatten_positions,
+    const InputParameters& params,
+    std::vector<KVCache>& dummy_kv_caches) {
+  if (!memory::reset_host_peak_rss()) {
+    LOG(WARNING) << "Failed to reset peak rss, activation memory is "
+                    "measured since the beginning of the program";
+  }
+
+  // call model forward and discard the result
+  model_->forward(flatten_tokens, flatten_positions, dummy_kv_caches, params);
+
+  // activations are freed after the forward but the kv cache has to leave
+  // room for them on every step. memory freed back to the allocator is
+  // counted in rss and already missing from the available memory.
+  const int64_t rss_after = memory::host_rss();
+  const int64_t peak_rss = memory::host_peak_rss();
+  const int64_t activation_memory = std::max<int64_t>(peak_rss - rss_after, 0);
+  LOG(INFO) << "Peak rss: " << readable_size(peak_rss)
+            << ", activation memory: " << readable_size(activation_memory);
+
+  auto available_memory = memory::available_memory(device_);
+  auto total_memory = memory::total_memory(device_);
+  // the kv cache is bound to the numa node, only its memory counts
+  if (numa_node_ >= 0) {
+    const int64_t node_free_memory = memory::numa_node_free_memory(numa_node_);
+    const int64_t node_total_memory =
+        memory::numa_node_total_memory(numa_node_);
+    if (node_free_memory >= 0 && node_total_memory > 0) {
+      available_memory = std::min(available_memory, node_free_memory);
+      total_memory = std::min(total_memory, node_total_memory);
+    }
+  }
+  return {available_memory - activation_memory, total_memory};
+}
+
 ModelOutput Worker::execute_model(const ModelInput& inputs) {
+  bind_thread_to_numa_node();
   torch::DeviceGuard device_guard(device_);
 
   // all tensors should be on the same device as model
@@ -177,6 +392,13 @@ ModelOutput Worker::execute_model(const ModelInput& inputs) {
   auto flatten_positions = inputs.positions.to(device_);
   InputParameters params = inputs.input_params.to(device_);
 
+  // swap cache blocks before the model overwrites them. the copies are
+  // queued on the compute stream, so the forward waits for all of them,
+  // including prefix cache blocks restored from the host tier.
+  if (!inputs.block_swaps.empty()) {
+    swap_blocks(inputs.block_swaps);
+  }
+
   // call model forward to get hidden states
   auto hidden_states =
       model_->forward(flatten_tokens, flatten_positions, kv_caches_, params);
@@ -267,14 +489,17 @@ folly::SemiFuture<bool> Worker::init_model_async(torch::ScalarType dtype,
 }
 
 folly::SemiFuture<bool> Worker::init_kv_cache_async(
-    const std::vector<int64_t>& kv_cache_shape) {
+    const std::vector<int64_t>& kv_cache_shape,
+    int64_t n_host_blocks) {
   folly::Promise<bool> promise;
   auto future = promise.getSemiFuture();
-  threadpool_.schedule(
-      [this, &kv_cache_shape, promise = std::move(promise)]() mutable {
-        const bool success = this->init_kv_cache(kv_cache_shape);
-        promise.setValue(success);
-      });
+  threadpool_.schedule([this,
+                        &kv_cache_shape,
+                        n_host_blocks,
+                        promise = std::move(promise)]() mutable {
+    const bool success = this->init_kv_cache(kv_cache_shape, n_host_blocks);
+    promise.setValue(success);
+  });
   return future;
 }
 
@@ -17,7 +17,11 @@ namespace llm {
 class CudaGraphRunner;
 class Worker final {
  public:
-  Worker(const ParallelArgs& parallel_args, const torch::Device& device);
+  // numa_node: the numa node to bind the threads, weights and kv cache of a
+  // cpu worker to, -1 to leave them to the os.
+  Worker(const ParallelArgs& parallel_args,
+         const torch::Device& device,
+         int numa_node = -1);
 
   ~Worker() = default;
 
@@ -40,7 +44,9 @@ class Worker final {
       const InputParameters& params);
 
   // initialize kv cache. blocking call
-  bool init_kv_cache(const std::vector<int64_t>& kv_cache_shape);
+  // n_host_blocks: number of blocks in host memory to hold swapped kv cache
+  bool init_kv_cache(const std::vector<int64_t>& kv_cache_shape,
+                     int64_t n_host_blocks = 0);
 
   // Run the model on the given input. blocking call
   ModelOutput execute_model(const ModelInput& inputs);
@@ -64,7 +70,8 @@ class Worker final {
 
   // initialize kv cache. async call
   folly::SemiFuture<bool> init_kv_cache_async(
-      const std::vector<int64_t>& kv_cache_shape);
+      const std::vector<int64_t>& kv_cache_shape,
+      int64_t n_host_blocks = 0);
 
   // Run the model on the given input. async call
   // the future returns a successfull status with no meaningful value
@@ -78,6 +85,28 @@ class Worker final {
   // capture cuda graph
   void capture_graph();
 
+  // returns available host memory and total host memory, the available memory
+  // leaves room for the peak activation memory of the forward.
+  std::tuple<int64_t, int64_t> profile_host_memory(
+      torch::Tensor flatten_tokens,
+      torch::Tensor flatten_positions,
+      const InputParameters& params,
+      std::vector<KVCache>& dummy_kv_caches);
+
+  // copy cache blocks between device and host memory, or between device
+  // blocks for copy-on-write, in order
+  void swap_blocks(const std::vector<BlockSwap>& block_swaps);
+
+  // bind the calling thread to the numa node of the worker, once per thread
+  void bind_thread_to_numa_node() const;
+
+  // bind the memory of the tensor to the numa node of the worker
+  void bind_tensor_to_numa_node(const torch::Tensor& tensor) const;
+
+  // back the host kv cache with a memory mapped file
+  bool init_mapped_host_kv_cache(
+      const std::vector<int64_t>& host_kv_cache_shape);
+
   // working thread
   ThreadPool threadpool_;
 
@@ -87,6 +116,9 @@ class Worker final {
   // device to run the model on
   torch::Device device_;
 
+  // numa node to bind to, -1 if not bound
+  int numa_node_ = -1;
+
   // parallel args
   ParallelArgs parallel_args_;
 
@@ -96,6 +128,9 @@ class Worker final {
   // kv caches
   std::vector<llm::KVCache> kv_caches_;
 
+  // kv caches in host memory to hold swapped out blocks
+  std::vector<llm::KVCache> host_kv_caches_;
+
   // model
   std::unique_ptr<CausalLM> model_;
 
@@ -88,6 +88,11 @@ class StreamCallData : public CallData {
     return rpc_ok_.load(std::memory_order_relaxed);
   }
 
+  // add trailing metadata sent with the status, call before finish
+  void add_trailing_metadata(const std::string& key, const std::string& value) {
+    ctx_.AddTrailingMetadata(key, value);
+  }
+
   // returns false if the rpc channel has been closed/cancelled.
   bool finish_with_error(const grpc::StatusCode& code,
                          const std::string& error_message) {
@@ -1,5 +1,7 @@
 #include "chat_handler.h"
 
+#include <absl/time/clock.h>
+#include <absl/time/time.h>
 #include <glog/logging.h>
 #include <grpcpp/grpcpp.h>
 #include <torch/torch.h>
@@ -274,6 +276,11 @@ std::unique_ptr<Request> grpc_request_to_request(ChatCallData* call_data,
   if (grpc_request.has_priority()) {
     request->priority = grpc_priority_to_priority(grpc_request.priority());
   }
+  request->user = grpc_request.user();
+  if (grpc_request.has_deadline_ms()) {
+    request->deadline =
+        absl::Now() + absl::Milliseconds(grpc_request.deadline_ms());
+  }
   // disable echo for chat completion
   request->echo = false;
 
@@ -352,7 +359,14 @@ void ChatHandler::chat_async(ChatCallData* call_data) {
     }
 
     // schedule the request
-    if (!scheduler_->schedule(request)) {
+    absl::Duration retry_after = absl::ZeroDuration();
+    if (!scheduler_->schedule(request, &retry_after)) {
+      if (retry_after > absl::ZeroDuration()) {
+        // let the client retry later or on another replica
+        call_data->add_trailing_metadata(
+            "grpc-retry-pushback-ms",
+            std::to_string(absl::ToInt64Milliseconds(retry_after)));
+      }
       call_data->finish_with_error(grpc::StatusCode::RESOURCE_EXHAUSTED,
                                    "Out of capacity");
     }
@@ -35,6 +35,8 @@ std::string finish_reason_to_string(FinishReason reason) {
       return "length";
     case FinishReason::FUNCTION_CALL:
       return "function_call";
+    case FinishReason::DEADLINE_EXCEEDED:
+      return "deadline_exceeded";
     default:
       LOG(WARNING) << "Unknown finish reason: " << static_cast<int>(reason);
   }
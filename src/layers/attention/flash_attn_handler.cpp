@@ -61,6 +61,7 @@ void FlashAttnHandler::batch_prefill(
     const InputParameters& input_params,  // input paras used for attention
     torch::Tensor& output) {
   // don't use kv cache in prefill stage
+  // window_size_left is -1 to attend to all tokens without sliding window
   mha_varlen_fwd(output,
                  query,
                  key,
@@ -73,7 +74,7 @@ void FlashAttnHandler::batch_prefill(
                  input_params.kv_max_seq_len,
                  /*softmax_scale=*/scale_,
                  /*is_causal=*/true,
-                 /*window_size_left=*/-1,
+                 /*window_size_left=*/sliding_window_ - 1,
                  /*window_size_right=*/-1,
                  /*num_splits=*/0);
 }
@@ -103,7 +104,7 @@ void FlashAttnHandler::batch_decode(
                  input_params.kv_max_seq_len,
                  scale_,
                  /*is_causal=*/true,
-                 /*window_size_left=*/-1,
+                 /*window_size_left=*/sliding_window_ - 1,
                  /*window_size_right=*/-1,
                  /*num_splits=*/0);
 }
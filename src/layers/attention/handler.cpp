@@ -17,9 +17,10 @@ DEFINE_string(attention_handler,
               "attention handler, e.g. auto, pytorch, flash_attn, flash_infer");
 
 namespace llm {
+namespace {
 
 // create an attention handler with alibi slopes
-std::unique_ptr<AttentionHandler> AttentionHandler::create_handler_with_alibi(
+std::unique_ptr<AttentionHandler> create_alibi_handler(
     const ModelArgs& args,
     torch::optional<torch::Tensor> alibi_slopes,
     const torch::TensorOptions& options) {
@@ -57,7 +58,7 @@ std::unique_ptr<AttentionHandler> AttentionHandler::create_handler_with_alibi(
 }
 
 // create an attention handler with ROPE
-std::unique_ptr<AttentionHandler> AttentionHandler::create_handler_with_rope(
+std::unique_ptr<AttentionHandler> create_rope_handler(
     const ModelArgs& args,
     bool interleaved,
     const torch::TensorOptions& options) {
@@ -124,4 +125,24 @@ std::unique_ptr<AttentionHandler> AttentionHandler::create_handler_with_rope(
                                       options);
 }
 
+}  // namespace
+
+std::unique_ptr<AttentionHandler> AttentionHandler::create_handler_with_alibi(
+    const ModelArgs& args,
+    torch::optional<torch::Tensor> alibi_slopes,
+    const torch::TensorOptions& options) {
+  auto handler = create_alibi_handler(args, alibi_slopes, options);
+  handler->set_sliding_window(args.sliding_window());
+  return handler;
+}
+
+std::unique_ptr<AttentionHandler> AttentionHandler::create_handler_with_rope(
+    const ModelArgs& args,
+    bool interleaved,
+    const torch::TensorOptions& options) {
+  auto handler = create_rope_handler(args, interleaved, options);
+  handler->set_sliding_window(args.sliding_window());
+  return handler;
+}
+
 }  // namespace llm
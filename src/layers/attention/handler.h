@@ -23,6 +23,11 @@ class AttentionHandler {
   // set workspace for temporary storage before calling any attention operations
   virtual void set_workspace(const torch::Tensor& workspace) {}
 
+  // only attend to the last sliding_window tokens, 0 to attend to all tokens
+  void set_sliding_window(int64_t sliding_window) {
+    sliding_window_ = sliding_window;
+  }
+
   // apply positional embedding to query and key if needed
   virtual std::tuple<torch::Tensor, torch::Tensor> apply_pos_emb(
       const torch::Tensor& query,
@@ -71,6 +76,10 @@ class AttentionHandler {
       const ModelArgs& args,
       bool interleaved,
       const torch::TensorOptions& options);
+
+ protected:
+  // number of most recent tokens to attend to, 0 to attend to all tokens
+  int64_t sliding_window_ = 0;
 };
 
 }  // namespace llm
@@ -49,6 +49,7 @@ void varlen_masked_self_attention(
     const torch::Tensor& kv_cu_seq_lens,  // [n_seqs + 1]
     const torch::optional<torch::Tensor> alibi_slopes,  // [n_heads]
     float scale,
+    int64_t sliding_window,
     torch::Tensor& output) {
   // same length for key and value
   DCHECK(key.size(0) == value.size(0));
@@ -94,7 +95,13 @@ void varlen_masked_self_attention(
     // [1, q_len, kv_len]
     torch::Tensor mask = torch::ones({1, q_len, kv_len}, torch::kBool);
     // returns the lower triangular part of a matrix
-    mask = torch::tril(mask, /*diagonal=*/kv_len - q_len).to(query);
+    mask = torch::tril(mask, /*diagonal=*/kv_len - q_len);
+    if (sliding_window > 0) {
+      // only attend to the last sliding_window tokens
+      mask = torch::triu(mask,
+                         /*diagonal=*/kv_len - q_len - sliding_window + 1);
+    }
+    mask = mask.to(query);
 
     torch::Tensor bias;
     if (alibi_slopes) {
@@ -158,6 +165,7 @@ void RefHandler::batch_prefill(
                                input_params.kv_cu_seq_lens,
                                alibi_slopes_,
                                scale_,
+                               sliding_window_,
                                output);
 }
 
@@ -179,6 +187,7 @@ void RefHandler::batch_decode(
                                input_params.kv_cu_seq_lens,
                                alibi_slopes_,
                                scale_,
+                               sliding_window_,
                                output);
 }
 
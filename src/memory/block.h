@@ -9,26 +9,64 @@ class BlockAllocator;
 
 // Memory block represents a contiguous memory region.
 // It is used to track memory usage. the block will be released when the
-// reference count drops to zero.
+// reference count drops to zero. the reference count lives in a dense array
+// owned by the allocator, so copying a block never touches the heap.
 class Block final {
  public:
-  ~Block();
+  ~Block() { dec_ref_count(); }
 
   // add default constructor to allow resizing with std::vector
   Block() = default;
 
-  // used for testing
+  // used for testing, the reference count is kept on the heap
   Block(int32_t id);
 
   Block(int32_t id, BlockAllocator* allocator);
 
   // copy constructor and assignment operator
-  Block(const Block& other);
-  Block& operator=(const Block& other);
+  Block(const Block& other)
+      : id_(other.id_),
+        ref_count_(other.ref_count_),
+        allocator_(other.allocator_) {
+    inc_ref_count();
+  }
+
+  Block& operator=(const Block& other) {
+    if (this != &other) {
+      // increase first in case both refer to the same block
+      other.inc_ref_count();
+      dec_ref_count();
+      id_ = other.id_;
+      ref_count_ = other.ref_count_;
+      allocator_ = other.allocator_;
+    }
+    return *this;
+  }
 
   // move related operations
-  Block(Block&& other) noexcept;
-  Block& operator=(Block&& other) noexcept;
+  Block(Block&& other) noexcept
+      : id_(other.id_),
+        ref_count_(other.ref_count_),
+        allocator_(other.allocator_) {
+    // reset other without adjusting the reference count
+    other.id_ = -1;
+    other.ref_count_ = nullptr;
+    other.allocator_ = nullptr;
+  }
+
+  Block& operator=(Block&& other) noexcept {
+    if (this != &other) {
+      dec_ref_count();
+      id_ = other.id_;
+      ref_count_ = other.ref_count_;
+      allocator_ = other.allocator_;
+
+      other.id_ = -1;
+      other.ref_count_ = nullptr;
+      other.allocator_ = nullptr;
+    }
+    return *this;
+  }
 
   // get the block id
   int32_t id() const { return id_; }
@@ -47,19 +85,44 @@ class Block final {
 
  private:
   // increase reference count
-  void inc_ref_count();
-
-  // decrease reference count
-  void dec_ref_count();
+  void inc_ref_count() const {
+    if (ref_count_ != nullptr) {
+      ++(*ref_count_);
+    }
+  }
+
+  // decrease reference count, the block is released when it drops to zero
+  void dec_ref_count() {
+    if (ref_count_ != nullptr && --(*ref_count_) == 0) {
+      release();
+    }
+  }
+
+  // return the block to the allocator
+  void release();
 
   // block id
   int32_t id_ = -1;
-  // reference count
+  // reference count, an entry in the allocator's ref count array
   uint32_t* ref_count_ = nullptr;
   // allocator that manages this block
   BlockAllocator* allocator_ = nullptr;
 };
 
+// copy the kv cache of a block between device and host memory. it is used to
+// swap out preempted sequences instead of recomputing them later. it also
+// copies a shared device block before a sequence writes into it.
+struct BlockSwap {
+  // source block id
+  int32_t src_block_id = -1;
+  // destination block id
+  int32_t dst_block_id = -1;
+  // true: copy from device to host, false: copy from host to device
+  bool swap_out = true;
+  // true: copy between device blocks, swap_out is ignored
+  bool on_device = false;
+};
+
 // equeal operator, mainly used for testing
 inline bool operator==(const Block& lhs, const Block& rhs) {
   return lhs.id() == rhs.id();
@@ -2,18 +2,30 @@
 
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <cstdint>
+#include <iterator>
+#include <map>
 #include <vector>
 
 #include "block.h"
 
 namespace llm {
 
-BlockAllocator::BlockAllocator(uint32_t total_blocks, uint32_t block_size)
-    : free_block_count_(total_blocks), block_size_(block_size) {
+BlockAllocator::BlockAllocator(uint32_t total_blocks,
+                               uint32_t block_size,
+                               bool contiguous)
+    : free_block_count_(total_blocks),
+      block_size_(block_size),
+      contiguous_(contiguous),
+      ref_counts_(total_blocks, 0) {
   CHECK(total_blocks > 0) << "No blocks to allocate";
   CHECK(block_size > 0) << "Block size must be positive";
 
+  if (contiguous_) {
+    add_free_run(/*start=*/0, total_blocks);
+    return;
+  }
   free_blocks_.reserve(free_block_count_);
   for (int32_t i = 0; i < free_block_count_; ++i) {
     // push smaller block ids to the back of the vector
@@ -22,7 +34,7 @@ BlockAllocator::BlockAllocator(uint32_t total_blocks, uint32_t block_size)
 }
 
 BlockAllocator::~BlockAllocator() {
-  CHECK(free_block_count_ == free_blocks_.size())
+  CHECK(free_block_count_ == ref_counts_.size())
       << "Not all blocks have been freed";
 }
 
@@ -31,6 +43,13 @@ std::vector<Block> BlockAllocator::allocate(uint32_t n_blocks) {
   CHECK(n_blocks <= free_block_count_) << "Not enough blocks available";
   std::vector<Block> blocks;
   blocks.reserve(n_blocks);
+  if (contiguous_) {
+    // the rest of the longest run is left for the blocks to grow into
+    while (blocks.size() < n_blocks) {
+      take_longest_free_run(n_blocks - blocks.size(), &blocks);
+    }
+    return blocks;
+  }
   for (uint32_t i = 0; i < n_blocks; ++i) {
     const int32_t block_id = free_blocks_[--free_block_count_];
     blocks.emplace_back(block_id, this);
@@ -41,14 +60,157 @@ std::vector<Block> BlockAllocator::allocate(uint32_t n_blocks) {
 // allocate a block id
 Block BlockAllocator::allocate() {
   CHECK(free_block_count_ > 0) << "No more blocks available";
+  if (contiguous_) {
+    std::vector<Block> blocks;
+    take_longest_free_run(/*n_blocks=*/1, &blocks);
+    return std::move(blocks.front());
+  }
   const int32_t block_id = free_blocks_[--free_block_count_];
   return {block_id, this};
 }
 
+std::vector<Block> BlockAllocator::allocate_after(int32_t block_id,
+                                                  uint32_t n_blocks) {
+  CHECK(n_blocks <= free_block_count_) << "Not enough blocks available";
+  std::vector<Block> blocks;
+  blocks.reserve(n_blocks);
+  int32_t next_id = block_id + 1;
+  while (contiguous_ && blocks.size() < n_blocks && next_id >= 0 &&
+         static_cast<size_t>(next_id) < ref_counts_.size() &&
+         ref_counts_[next_id] == 0) {
+    take_free_block(next_id);
+    blocks.emplace_back(next_id++, this);
+  }
+  if (blocks.size() < n_blocks) {
+    auto rest = allocate(n_blocks - blocks.size());
+    std::move(rest.begin(), rest.end(), std::back_inserter(blocks));
+  }
+  return blocks;
+}
+
+std::vector<Block> BlockAllocator::allocate_contiguous(uint32_t n_blocks) {
+  if (!contiguous_ || free_runs_by_length_.empty() ||
+      free_runs_by_length_.rbegin()->first < n_blocks) {
+    return {};
+  }
+  std::vector<Block> blocks;
+  blocks.reserve(n_blocks);
+  take_longest_free_run(n_blocks, &blocks);
+  return blocks;
+}
+
+std::vector<Block> BlockAllocator::allocate_block_ids(
+    const std::vector<int32_t>& block_ids) {
+  std::vector<bool> wanted(ref_counts_.size(), false);
+  for (const int32_t block_id : block_ids) {
+    if (block_id < 0 || static_cast<size_t>(block_id) >= wanted.size() ||
+        ref_counts_[block_id] != 0 || wanted[block_id]) {
+      return {};
+    }
+    wanted[block_id] = true;
+  }
+
+  if (contiguous_) {
+    for (const int32_t block_id : block_ids) {
+      take_free_block(block_id);
+    }
+    std::vector<Block> blocks;
+    blocks.reserve(block_ids.size());
+    for (const int32_t block_id : block_ids) {
+      blocks.emplace_back(block_id, this);
+    }
+    return blocks;
+  }
+
+  // remove the blocks from the free list in one pass
+  size_t n_left = 0;
+  for (size_t i = 0; i < free_block_count_; ++i) {
+    const int32_t block_id = free_blocks_[i];
+    if (!wanted[block_id]) {
+      free_blocks_[n_left++] = block_id;
+    }
+  }
+  CHECK(free_block_count_ - n_left == block_ids.size());
+  free_block_count_ = n_left;
+
+  std::vector<Block> blocks;
+  blocks.reserve(block_ids.size());
+  for (const int32_t block_id : block_ids) {
+    blocks.emplace_back(block_id, this);
+  }
+  return blocks;
+}
+
 // caller should make sure the block_id is valid
 void BlockAllocator::free(int32_t block_id) {
-  CHECK(free_block_count_ < free_blocks_.size());
-  free_blocks_[free_block_count_++] = block_id;
+  CHECK(free_block_count_ < ref_counts_.size());
+  if (!contiguous_) {
+    free_blocks_[free_block_count_++] = block_id;
+    return;
+  }
+
+  ++free_block_count_;
+  // merge with the free runs right before and after the block
+  int32_t start = block_id;
+  uint32_t length = 1;
+  auto next = free_runs_.upper_bound(block_id);
+  if (next != free_runs_.begin()) {
+    auto prev = std::prev(next);
+    if (prev->first + static_cast<int32_t>(prev->second) == block_id) {
+      start = prev->first;
+      length += prev->second;
+      remove_free_run(prev);
+    }
+  }
+  if (next != free_runs_.end() && next->first == block_id + 1) {
+    length += next->second;
+    remove_free_run(next);
+  }
+  add_free_run(start, length);
+}
+
+void BlockAllocator::take_free_block(int32_t block_id) {
+  auto it = free_runs_.upper_bound(block_id);
+  CHECK(it != free_runs_.begin()) << "block " << block_id << " is not free";
+  --it;
+  const int32_t start = it->first;
+  const uint32_t length = it->second;
+  CHECK(block_id < start + static_cast<int32_t>(length))
+      << "block " << block_id << " is not free";
+  remove_free_run(it);
+  if (block_id > start) {
+    add_free_run(start, block_id - start);
+  }
+  const int32_t end = start + static_cast<int32_t>(length);
+  if (block_id + 1 < end) {
+    add_free_run(block_id + 1, end - block_id - 1);
+  }
+  --free_block_count_;
+}
+
+void BlockAllocator::take_longest_free_run(uint32_t n_blocks,
+                                           std::vector<Block>* blocks) {
+  CHECK(!free_runs_by_length_.empty()) << "No more blocks available";
+  const auto [length, start] = *free_runs_by_length_.rbegin();
+  const uint32_t n_taken = std::min(n_blocks, length);
+  remove_free_run(free_runs_.find(start));
+  if (n_taken < length) {
+    add_free_run(start + static_cast<int32_t>(n_taken), length - n_taken);
+  }
+  free_block_count_ -= n_taken;
+  for (uint32_t i = 0; i < n_taken; ++i) {
+    blocks->emplace_back(start + static_cast<int32_t>(i), this);
+  }
+}
+
+void BlockAllocator::add_free_run(int32_t start, uint32_t length) {
+  free_runs_.emplace(start, length);
+  free_runs_by_length_.emplace(length, start);
+}
+
+void BlockAllocator::remove_free_run(std::map<int32_t, uint32_t>::iterator it) {
+  free_runs_by_length_.erase({it->second, it->first});
+  free_runs_.erase(it);
 }
 
 }  // namespace llm
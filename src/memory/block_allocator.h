@@ -2,6 +2,9 @@
 #include <glog/logging.h>
 
 #include <cstdint>
+#include <map>
+#include <set>
+#include <utility>
 #include <vector>
 
 #include "block.h"
@@ -11,10 +14,16 @@ namespace llm {
 // BlockAllocator is used to track memory blocks. It is not thread safe.
 // Please note: The actual memory has been allocated outside of this class.
 // This class only manages the allocation and deallocation of block ids.
+// By default freed blocks are reused first. In contiguous mode blocks are
+// taken from free runs of consecutive ids instead, so that the blocks of a
+// sequence stay next to each other in the kv cache.
 class BlockAllocator final {
  public:
   // block_size: number of slots per block
-  BlockAllocator(uint32_t total_blocks, uint32_t block_size);
+  // contiguous: whether to allocate blocks from runs of consecutive ids
+  BlockAllocator(uint32_t total_blocks,
+                 uint32_t block_size,
+                 bool contiguous = false);
 
   ~BlockAllocator();
 
@@ -30,24 +39,74 @@ class BlockAllocator final {
   // allocate a block
   Block allocate();
 
+  // allocate a list of blocks to follow the given block. in contiguous mode
+  // the free blocks right after it are taken first.
+  std::vector<Block> allocate_after(int32_t block_id, uint32_t n_blocks);
+
+  // allocate a run of blocks with consecutive ids. returns an empty list if
+  // not in contiguous mode or there is no free run long enough.
+  std::vector<Block> allocate_contiguous(uint32_t n_blocks);
+
+  // allocate the given blocks, i.e. to restore blocks recorded before a
+  // restart. returns an empty list if any of them is not free.
+  std::vector<Block> allocate_block_ids(const std::vector<int32_t>& block_ids);
+
   // get number of slots per block
   size_t block_size() const { return block_size_; }
 
   // get number of free blocks
   size_t free_block_count() const { return free_block_count_; }
 
+  // get number of total blocks
+  size_t total_block_count() const { return ref_counts_.size(); }
+
+  // whether blocks are allocated from runs of consecutive ids
+  bool contiguous() const { return contiguous_; }
+
+  // get number of free runs of consecutive ids in contiguous mode
+  size_t free_run_count() const { return free_runs_.size(); }
+
  private:
   friend class Block;
   void free(int32_t block_id);
 
+  // get the reference count of the block
+  uint32_t* ref_count_of(int32_t block_id) {
+    DCHECK(block_id >= 0 &&
+           static_cast<size_t>(block_id) < ref_counts_.size());
+    return &ref_counts_[block_id];
+  }
+
+  // take a free block out of the free runs
+  void take_free_block(int32_t block_id);
+
+  // take n_blocks free blocks from the start of the longest free run
+  void take_longest_free_run(uint32_t n_blocks, std::vector<Block>* blocks);
+
+  void add_free_run(int32_t start, uint32_t length);
+
+  void remove_free_run(std::map<int32_t, uint32_t>::iterator it);
+
   // free block count
   size_t free_block_count_ = 0;
 
   // number of slots per block
   size_t block_size_ = 0;
 
-  // free block list
+  // whether blocks are allocated from runs of consecutive ids
+  bool contiguous_ = false;
+
+  // free block list, not used in contiguous mode
   std::vector<int32_t> free_blocks_;
+
+  // free runs of consecutive ids in contiguous mode, start -> length
+  std::map<int32_t, uint32_t> free_runs_;
+
+  // free runs ordered by (length, start) to find the longest one
+  std::set<std::pair<uint32_t, int32_t>> free_runs_by_length_;
+
+  // reference counts indexed by block id, 0 for free blocks
+  std::vector<uint32_t> ref_counts_;
 };
 
 }  // namespace llm
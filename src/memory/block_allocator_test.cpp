@@ -2,6 +2,9 @@
 
 #include <gtest/gtest.h>
 
+#include <cstdint>
+#include <vector>
+
 namespace llm {
 
 TEST(BlockAllocatorTest, Basic) {
@@ -101,4 +104,64 @@ TEST(BlockAllocatorTest, Basic) {
   }
 }
 
-}  // namespace llm
\ No newline at end of file
+TEST(BlockAllocatorTest, Contiguous) {
+  const uint32_t n_blocks = 8;
+  const uint32_t block_size = 2;
+  BlockAllocator allocator(n_blocks, block_size, /*contiguous=*/true);
+  EXPECT_TRUE(allocator.contiguous());
+  EXPECT_EQ(allocator.free_run_count(), 1);
+
+  auto ids_of = [](const std::vector<Block>& blocks) {
+    std::vector<int32_t> ids;
+    for (const auto& block : blocks) {
+      ids.push_back(block.id());
+    }
+    return ids;
+  };
+
+  {
+    const auto blocks = allocator.allocate(2);
+    EXPECT_EQ(ids_of(blocks), std::vector<int32_t>({0, 1}));
+    {
+      const Block block = allocator.allocate();
+      EXPECT_EQ(block.id(), 2);
+
+      // the block after 1 is taken, continue from the longest free run
+      const auto next_blocks = allocator.allocate_after(1, 2);
+      EXPECT_EQ(ids_of(next_blocks), std::vector<int32_t>({3, 4}));
+      EXPECT_EQ(allocator.free_run_count(), 1);
+    }
+    // freed blocks are merged back into runs
+    EXPECT_EQ(allocator.free_block_count(), 6);
+    EXPECT_EQ(allocator.free_run_count(), 1);
+
+    const Block block = allocator.allocate();
+    EXPECT_EQ(block.id(), 2);
+    const auto run = allocator.allocate(1);
+    EXPECT_EQ(run[0].id(), 3);
+    EXPECT_EQ(allocator.free_run_count(), 1);
+    EXPECT_TRUE(allocator.allocate_contiguous(5).empty());
+    {
+      const auto long_run = allocator.allocate_contiguous(4);
+      EXPECT_EQ(ids_of(long_run), std::vector<int32_t>({4, 5, 6, 7}));
+      EXPECT_EQ(allocator.free_block_count(), 0);
+      EXPECT_EQ(allocator.free_run_count(), 0);
+    }
+  }
+  EXPECT_EQ(allocator.free_block_count(), n_blocks);
+  EXPECT_EQ(allocator.free_run_count(), 1);
+
+  {
+    const auto blocks = allocator.allocate_block_ids({4, 6});
+    EXPECT_EQ(ids_of(blocks), std::vector<int32_t>({4, 6}));
+    EXPECT_EQ(allocator.free_run_count(), 3);
+    // the free block right after 4 is taken first
+    const auto next_blocks = allocator.allocate_after(4, 2);
+    EXPECT_EQ(ids_of(next_blocks), std::vector<int32_t>({5, 0}));
+    EXPECT_TRUE(allocator.allocate_block_ids({5}).empty());
+  }
+  EXPECT_EQ(allocator.free_block_count(), n_blocks);
+  EXPECT_EQ(allocator.free_run_count(), 1);
+}
+
+}  // namespace llm
@@ -2,23 +2,95 @@
 
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <cstdint>
+#include <cstdio>
+#include <fstream>
 #include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "block_allocator.h"
+#include "eviction_policy.h"
 #include "request/request.h"
 
 DEFINE_bool(enable_prefix_cache,
             true,
             "enable the prefix cache for the block manager");
 
+DEFINE_string(prefix_cache_eviction_policy,
+              "lru",
+              "the order to evict prefix cache nodes: lru, lfu (least "
+              "frequently used with decay) or cost (lfu weighted by the cost "
+              "to recompute the tokens)");
+
+DEFINE_double(prefix_cache_half_life,
+              600,
+              "seconds after which a prefix cache hit counts half for the "
+              "lfu and cost eviction policies");
+
+DEFINE_bool(enable_prefix_cache_host_tier,
+            false,
+            "spill blocks evicted from the prefix cache into the host kv "
+            "cache sized by --max_swap_space instead of dropping them. "
+            "restored blocks are copied back on the compute stream before "
+            "the forward of the step that uses them, the step waits for "
+            "the whole copy");
+
+DEFINE_string(host_kv_cache_file,
+              "",
+              "back the host kv cache with memory mapped files at this path, "
+              "one per worker, to keep it on local disk. the prefix cache "
+              "spilled there is reloaded on restart, do not share the files "
+              "between different models.");
+
+DEFINE_bool(enable_contiguous_block_allocation,
+            false,
+            "allocate kv cache blocks from runs of consecutive block ids, so "
+            "that sequences grow in place instead of picking up the most "
+            "recently freed blocks");
+
 namespace llm {
 
-BlockManager::BlockManager(uint32_t num_blocks, int32_t block_size)
+BlockManager::BlockManager(uint32_t num_blocks,
+                           int32_t block_size,
+                           const Clock* clock)
+    : BlockManager(num_blocks,
+                   block_size,
+                   /*num_host_blocks=*/0,
+                   /*block_size_in_bytes=*/0,
+                   clock) {}
+
+BlockManager::BlockManager(uint32_t num_blocks,
+                           int32_t block_size,
+                           uint32_t num_host_blocks,
+                           int64_t block_size_in_bytes,
+                           const Clock* clock)
     : block_size_(block_size),
-      block_allocator_(num_blocks, block_size),
-      prefix_cache_(block_size) {}
+      block_allocator_(num_blocks,
+                       block_size,
+                       FLAGS_enable_contiguous_block_allocation),
+      block_size_in_bytes_(block_size_in_bytes),
+      prefix_cache_(
+          block_size,
+          EvictionPolicyFactory::create(FLAGS_prefix_cache_eviction_policy,
+                                        FLAGS_prefix_cache_half_life),
+          clock) {
+  if (num_host_blocks > 0) {
+    host_block_allocator_ =
+        std::make_unique<BlockAllocator>(num_host_blocks, block_size);
+    if (FLAGS_enable_prefix_cache && FLAGS_enable_prefix_cache_host_tier) {
+      prefix_cache_.enable_host_tier(&block_allocator_,
+                                     host_block_allocator_.get(),
+                                     &pending_block_swaps_);
+      load_host_tier();
+    }
+  }
+}
+
+BlockManager::~BlockManager() { save_host_tier(); }
 
 bool BlockManager::allocate_blocks_for(Sequence* sequence) {
   DCHECK(sequence != nullptr);
@@ -27,11 +99,40 @@ bool BlockManager::allocate_blocks_for(Sequence* sequence) {
 
 bool BlockManager::allocate_blocks_for(Sequence* sequence, size_t num_tokens) {
   DCHECK(sequence != nullptr);
+  // bring back the swapped out kv cache first
+  if (sequence->is_swapped() && !swap_in_blocks_for(sequence)) {
+    return false;
+  }
+
   // first try to allocate shared blocks
   if (sequence->num_blocks() == 0) {
     allocate_shared_blocks_for(sequence);
   }
 
+  // recycle the blocks behind the sliding window before allocating new ones
+  sequence->release_blocks_out_of_window(sliding_window_);
+
+  if (!copy_on_write_blocks_for(sequence, num_tokens) ||
+      !append_blocks_for(sequence, num_tokens)) {
+    return false;
+  }
+
+  // a prompt may be matched again after a failed allocation released its
+  // blocks, it is only counted once its blocks are kept.
+  if (FLAGS_enable_prefix_cache && !sequence->is_prefix_cache_counted()) {
+    sequence->set_prefix_cache_counted();
+    const size_t num_prompt_tokens = sequence->num_prompt_tokens();
+    // the last token of a full match is recomputed, round it back up
+    const size_t num_hit_blocks =
+        (sequence->num_kv_cache_tokens() + block_size_ - 1) / block_size_;
+    prefix_cache_.record_query(
+        num_prompt_tokens,
+        std::min(num_hit_blocks * block_size_, num_prompt_tokens));
+  }
+  return true;
+}
+
+bool BlockManager::append_blocks_for(Sequence* sequence, size_t num_tokens) {
   const size_t num_blocks = sequence->num_blocks();
   // round up to the nearest block number
   const size_t num_blocks_needed = (num_tokens + block_size_ - 1) / block_size_;
@@ -45,6 +146,13 @@ bool BlockManager::allocate_blocks_for(Sequence* sequence, size_t num_tokens) {
     return false;
   }
 
+  if (num_blocks > 0) {
+    // grow in place right after the last block if possible
+    const int32_t last_block_id = sequence->blocks().back().id();
+    sequence->append_blocks(
+        block_allocator_.allocate_after(last_block_id, num_additional_blocks));
+    return true;
+  }
   const auto block_ids = block_allocator_.allocate(num_additional_blocks);
   sequence->append_blocks(block_ids);
   return true;
@@ -79,7 +187,18 @@ void BlockManager::release_blocks_for(Sequence* sequence) {
   DCHECK(sequence != nullptr);
   cache_blocks_for(sequence);
   // release the blocks after prefix cache insertion
+  const bool swapped = sequence->is_swapped();
   sequence->release_blocks();
+  if (swapped) {
+    // other sequences may have been waiting for the same host blocks
+    release_stale_swapped_in_blocks();
+  }
+}
+
+void BlockManager::release_tail_blocks_for(Sequence* sequence,
+                                           size_t num_blocks) {
+  DCHECK(sequence != nullptr);
+  sequence->release_tail_blocks(num_blocks);
 }
 
 bool BlockManager::has_enough_blocks(uint32_t num_blocks) {
@@ -111,16 +230,26 @@ bool BlockManager::has_enough_blocks(uint32_t num_blocks) {
   return false;
 }
 
-void BlockManager::allocate_shared_blocks_for(Sequence* sequence) {
+void BlockManager::allocate_shared_blocks_for(Sequence* sequence,
+                                              size_t num_kept_blocks) {
+  // swapped out sequence keeps its own kv cache
+  if (sequence->is_swapped()) {
+    return;
+  }
   // only allocate shared blocks for prefill sequences
   if (FLAGS_enable_prefix_cache) {
     const auto tokens_ids = sequence->token_ids();
-    std::vector<Block> shared_blocks = prefix_cache_.match(tokens_ids);
+    std::vector<Block> shared_blocks =
+        prefix_cache_.match(tokens_ids, num_kept_blocks);
     sequence->append_shared_blocks(shared_blocks);
   }
 }
 
 void BlockManager::cache_blocks_for(Sequence* sequence) {
+  // the leading blocks are gone, nothing to match a prefix with
+  if (sequence->num_released_blocks() > 0) {
+    return;
+  }
   if (FLAGS_enable_prefix_cache) {
     // only insert tokens in kv cache to the prefix cache
     const auto tokens_ids = sequence->tokens_in_kv_cache();
@@ -130,4 +259,342 @@ void BlockManager::cache_blocks_for(Sequence* sequence) {
   }
 }
 
+void BlockManager::fork_blocks_for(Request* request) {
+  DCHECK(request != nullptr);
+  const Sequence& parent = request->sequences[0];
+  if (parent.is_swapped()) {
+    return;
+  }
+  for (size_t i = 1; i < request->sequences.size(); ++i) {
+    Sequence& sequence = request->sequences[i];
+    if (sequence.num_blocks() == 0 && !sequence.is_swapped()) {
+      sequence.fork_blocks_from(parent);
+      // the prompt is counted with the parent
+      sequence.set_prefix_cache_counted();
+    }
+  }
+}
+
+bool BlockManager::copy_on_write_blocks_for(Sequence* sequence,
+                                            size_t num_tokens) {
+  // prompt tokens are the same in all sequences sharing a block, rewriting
+  // them is safe. any other token is only written into a private block.
+  const size_t start = std::max(sequence->num_kv_cache_tokens(),
+                                sequence->num_prompt_tokens());
+  const size_t end = std::min(num_tokens, sequence->kv_cache_capacity());
+  if (start >= end) {
+    return true;
+  }
+
+  std::vector<size_t> shared_block_indices;
+  const auto blocks = sequence->blocks();
+  for (size_t i = start / block_size_; i <= (end - 1) / block_size_; ++i) {
+    if (blocks[i].is_shared()) {
+      shared_block_indices.push_back(i);
+    }
+  }
+  if (shared_block_indices.empty()) {
+    return true;
+  }
+  if (!has_enough_blocks(shared_block_indices.size())) {
+    return false;
+  }
+
+  const auto new_blocks =
+      block_allocator_.allocate(shared_block_indices.size());
+  for (size_t i = 0; i < shared_block_indices.size(); ++i) {
+    const size_t index = shared_block_indices[i];
+    pending_block_swaps_.push_back({sequence->blocks()[index].id(),
+                                    new_blocks[i].id(),
+                                    /*swap_out=*/false,
+                                    /*on_device=*/true});
+    sequence->replace_block(index, new_blocks[i]);
+  }
+  return true;
+}
+
+size_t BlockManager::compact_blocks_for(
+    const std::vector<Sequence*>& sequences,
+    size_t max_blocks) {
+  if (!block_allocator_.contiguous() || max_blocks == 0) {
+    return 0;
+  }
+
+  // blocks waiting for a copy in this step stay in place, moving them would
+  // copy their contents before the pending copy lands.
+  std::unordered_set<int32_t> pending_block_ids;
+  for (const auto& block_swap : pending_block_swaps_) {
+    if (!block_swap.swap_out) {
+      pending_block_ids.insert(block_swap.dst_block_id);
+    }
+  }
+
+  // only the private blocks after the shared prefix and after any block with a
+  // pending copy can be moved
+  struct Candidate {
+    Sequence* sequence;
+    size_t first_index;
+  };
+  std::vector<Candidate> candidates;
+  for (Sequence* sequence : sequences) {
+    if (sequence->is_swapped()) {
+      continue;
+    }
+    const auto blocks = sequence->blocks();
+    size_t first_index = blocks.size();
+    while (first_index > 0 && blocks[first_index - 1].is_valid() &&
+           !blocks[first_index - 1].is_shared() &&
+           pending_block_ids.count(blocks[first_index - 1].id()) == 0) {
+      --first_index;
+    }
+    bool fragmented = false;
+    for (size_t i = first_index + 1; i < blocks.size(); ++i) {
+      if (blocks[i].id() != blocks[i - 1].id() + 1) {
+        fragmented = true;
+        break;
+      }
+    }
+    if (fragmented) {
+      candidates.push_back({sequence, first_index});
+    }
+  }
+  // longer sequences read more blocks per step and gain the most
+  std::sort(candidates.begin(),
+            candidates.end(),
+            [](const Candidate& a, const Candidate& b) {
+              return a.sequence->num_blocks() - a.first_index >
+                     b.sequence->num_blocks() - b.first_index;
+            });
+
+  size_t num_copied_blocks = 0;
+  for (const auto& [sequence, first_index] : candidates) {
+    // blocks allocated ahead of the kv cache don't need to be copied
+    const size_t num_tokens = sequence->num_kv_cache_tokens(EngineType::LLM);
+    const size_t num_used_blocks = std::max(
+        std::min((num_tokens + block_size_ - 1) / block_size_,
+                 sequence->num_blocks()),
+        first_index);
+    const size_t num_copies = num_used_blocks - first_index;
+    if (num_copied_blocks + num_copies > max_blocks) {
+      continue;
+    }
+    auto new_blocks = block_allocator_.allocate_contiguous(
+        sequence->num_blocks() - first_index);
+    if (new_blocks.empty()) {
+      continue;
+    }
+    // the old blocks are freed right away, the copies are applied in order
+    // before any later writes into them.
+    for (size_t i = 0; i < new_blocks.size(); ++i) {
+      const size_t index = first_index + i;
+      if (index < num_used_blocks) {
+        pending_block_swaps_.push_back({sequence->blocks()[index].id(),
+                                        new_blocks[i].id(),
+                                        /*swap_out=*/false,
+                                        /*on_device=*/true});
+      }
+      sequence->replace_block(index, new_blocks[i]);
+    }
+    num_copied_blocks += num_copies;
+  }
+  return num_copied_blocks;
+}
+
+bool BlockManager::evict_for_free_blocks(size_t num_blocks) {
+  return has_enough_blocks(num_blocks);
+}
+
+size_t BlockManager::num_cached_prompt_tokens(const Sequence* sequence) const {
+  if (!FLAGS_enable_prefix_cache) {
+    return 0;
+  }
+  const auto prompt_tokens =
+      sequence->token_ids().slice(0, sequence->num_prompt_tokens());
+  return prefix_cache_.num_matched_tokens(prompt_tokens);
+}
+
+std::vector<Block> BlockManager::cached_prompt_blocks(
+    const Sequence* sequence) const {
+  if (!FLAGS_enable_prefix_cache) {
+    return {};
+  }
+  const auto prompt_tokens =
+      sequence->token_ids().slice(0, sequence->num_prompt_tokens());
+  return prefix_cache_.matched_blocks(prompt_tokens);
+}
+
+bool BlockManager::swap_out_blocks_for(Request* request) {
+  DCHECK(request != nullptr);
+  // blocks shared by sequences forked from the same prompt are copied once
+  std::unordered_set<int32_t> block_ids;
+  for (const auto& sequence : request->sequences) {
+    if (sequence.is_swapped()) {
+      continue;
+    }
+    const auto blocks = sequence.blocks();
+    const size_t num_blocks = num_blocks_in_kv_cache(&sequence);
+    for (size_t i = 0; i < num_blocks; ++i) {
+      block_ids.insert(blocks[i].id());
+    }
+  }
+  const size_t num_host_blocks_needed = block_ids.size();
+  if (num_host_blocks_needed > num_free_host_blocks()) {
+    // running requests take precedence over the spilled prefix cache
+    prefix_cache_.evict_host_blocks(num_host_blocks_needed -
+                                    num_free_host_blocks());
+    if (num_host_blocks_needed > num_free_host_blocks()) {
+      return false;
+    }
+  }
+
+  // the sequences share the host copies of their shared blocks
+  std::unordered_map<int32_t, Block> host_blocks;
+  for (auto& sequence : request->sequences) {
+    swap_out_blocks_for(&sequence, &host_blocks);
+  }
+  return true;
+}
+
+std::vector<BlockSwap> BlockManager::take_pending_block_swaps() {
+  std::vector<BlockSwap> block_swaps;
+  block_swaps.swap(pending_block_swaps_);
+  return block_swaps;
+}
+
+size_t BlockManager::num_blocks_in_kv_cache(const Sequence* sequence) const {
+  // the sequence is recomputed from the start without its leading blocks
+  if (sequence->num_released_blocks() > 0) {
+    return 0;
+  }
+  // the llm engine is always ahead of the ssm engine
+  const size_t num_tokens = sequence->num_kv_cache_tokens(EngineType::LLM);
+  return std::min((num_tokens + block_size_ - 1) / block_size_,
+                  sequence->num_blocks());
+}
+
+void BlockManager::swap_out_blocks_for(
+    Sequence* sequence,
+    std::unordered_map<int32_t, Block>* host_blocks_by_id) {
+  if (sequence->is_swapped()) {
+    return;
+  }
+  const size_t num_blocks = num_blocks_in_kv_cache(sequence);
+  if (num_blocks == 0) {
+    // nothing worth keeping
+    sequence->release_blocks();
+    return;
+  }
+
+  // the device blocks can be reused right away since block swaps are applied
+  // in order before the next model execution.
+  const auto blocks = sequence->blocks();
+  std::vector<Block> host_blocks;
+  host_blocks.reserve(num_blocks);
+  for (size_t i = 0; i < num_blocks; ++i) {
+    auto [it, inserted] = host_blocks_by_id->try_emplace(blocks[i].id());
+    if (inserted) {
+      it->second = host_block_allocator_->allocate();
+      pending_block_swaps_.push_back(
+          {blocks[i].id(), it->second.id(), /*swap_out=*/true});
+    }
+    host_blocks.push_back(it->second);
+  }
+  sequence->swap_out_blocks(host_blocks);
+}
+
+bool BlockManager::swap_in_blocks_for(Sequence* sequence) {
+  release_stale_swapped_in_blocks();
+  const auto host_blocks = sequence->host_blocks();
+  size_t num_new_blocks = 0;
+  for (const Block& host_block : host_blocks) {
+    if (swapped_in_blocks_.count(host_block.id()) == 0) {
+      ++num_new_blocks;
+    }
+  }
+  if (!has_enough_blocks(num_new_blocks)) {
+    return false;
+  }
+
+  std::vector<Block> blocks;
+  blocks.reserve(host_blocks.size());
+  for (const Block& host_block : host_blocks) {
+    // already swapped in by another sequence sharing the host block
+    auto it = swapped_in_blocks_.find(host_block.id());
+    if (it != swapped_in_blocks_.end()) {
+      blocks.push_back(it->second.block);
+      continue;
+    }
+    Block block = block_allocator_.allocate();
+    pending_block_swaps_.push_back(
+        {host_block.id(), block.id(), /*swap_out=*/false});
+    if (host_block.is_shared()) {
+      // keep it for the other sequences still swapped out
+      swapped_in_blocks_.emplace(host_block.id(),
+                                 SwappedInBlock{host_block, block});
+    }
+    blocks.push_back(std::move(block));
+  }
+  sequence->swap_in_blocks(blocks);
+  // the last sequence sharing a host block is back
+  release_stale_swapped_in_blocks();
+  return true;
+}
+
+void BlockManager::release_stale_swapped_in_blocks() {
+  for (auto it = swapped_in_blocks_.begin(); it != swapped_in_blocks_.end();) {
+    // only held here, no sequence is waiting for the block anymore
+    if (it->second.host_block.ref_count() <= 1) {
+      it = swapped_in_blocks_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void BlockManager::load_host_tier() {
+  if (FLAGS_host_kv_cache_file.empty()) {
+    return;
+  }
+  const std::string path = FLAGS_host_kv_cache_file + ".index";
+  std::ifstream file(path, std::ios::binary);
+  if (!file.is_open()) {
+    return;
+  }
+  int64_t block_size_in_bytes = 0;
+  file.read(reinterpret_cast<char*>(&block_size_in_bytes),
+            sizeof(block_size_in_bytes));
+  if (file && block_size_in_bytes == block_size_in_bytes_ &&
+      prefix_cache_.load_host_tier(file)) {
+    LOG(INFO) << "Loaded " << prefix_cache_.num_host_blocks()
+              << " host blocks into the prefix cache from " << path;
+  }
+  // the kv cache changes from now on, the index is only valid on exit
+  file.close();
+  std::remove(path.c_str());
+}
+
+void BlockManager::save_host_tier() const {
+  if (FLAGS_host_kv_cache_file.empty() ||
+      prefix_cache_.num_host_blocks() == 0) {
+    return;
+  }
+  // blocks with pending swaps are not copied into the host kv cache yet
+  std::unordered_set<int32_t> pending_block_ids;
+  for (const auto& block_swap : pending_block_swaps_) {
+    if (block_swap.swap_out) {
+      pending_block_ids.insert(block_swap.dst_block_id);
+    }
+  }
+
+  const std::string path = FLAGS_host_kv_cache_file + ".index";
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  if (!file.is_open()) {
+    LOG(ERROR) << "Failed to save the host tier of the prefix cache: " << path;
+    return;
+  }
+  file.write(reinterpret_cast<const char*>(&block_size_in_bytes_),
+             sizeof(block_size_in_bytes_));
+  prefix_cache_.save_host_tier(file, pending_block_ids);
+}
+
 }  // namespace llm
@@ -1,9 +1,12 @@
 #pragma once
 
 #include <cstdint>
+#include <memory>
+#include <unordered_map>
 #include <vector>
 
 #include "block_allocator.h"
+#include "common/clock.h"
 #include "prefix_cache.h"
 #include "request/request.h"
 #include "request/sequence.h"
@@ -12,7 +15,22 @@ namespace llm {
 
 class BlockManager final {
  public:
-  BlockManager(uint32_t num_blocks, int32_t block_size);
+  // clock is used for the access times of the prefix cache, defaults to the
+  // wall clock.
+  BlockManager(uint32_t num_blocks,
+               int32_t block_size,
+               const Clock* clock = nullptr);
+
+  // create a block manager with a host block pool to swap out preempted
+  // sequences. block_size_in_bytes is used to estimate the swap cost.
+  BlockManager(uint32_t num_blocks,
+               int32_t block_size,
+               uint32_t num_host_blocks,
+               int64_t block_size_in_bytes,
+               const Clock* clock = nullptr);
+
+  // saves the host tier of the prefix cache if --host_kv_cache_file is set
+  ~BlockManager();
 
   bool allocate_blocks_for(Sequence* sequence);
 
@@ -24,26 +42,148 @@ class BlockManager final {
 
   void release_blocks_for(Sequence* sequence);
 
+  // release the last num_blocks blocks of the sequence without caching them,
+  // the dropped tokens are recomputed the next time the sequence is scheduled.
+  void release_tail_blocks_for(Sequence* sequence, size_t num_blocks);
+
   // try to allocate blloks for sequence with num_tokens
   bool allocate_blocks_for(Sequence* sequence, size_t num_tokens);
 
   // try to share blocks among sequences with the same prefix
-  void allocate_shared_blocks_for(Sequence* sequence);
+  // blocks spilled to the host tier are restored only while num_kept_blocks
+  // free blocks are left.
+  void allocate_shared_blocks_for(Sequence* sequence,
+                                  size_t num_kept_blocks = 0);
 
   // cache the blocks for the sequence
   void cache_blocks_for(Sequence* sequence);
 
+  // share the prompt blocks of the first sequence with the sequences expanded
+  // from it, including the last partial block. shared blocks are copied on
+  // write when the sequences generate different tokens.
+  void fork_blocks_for(Request* request);
+
+  // move the private blocks of fragmented sequences into runs of consecutive
+  // ids, copying at most max_blocks blocks. the copies are queued as block
+  // swaps. only works with contiguous block allocation, returns the number of
+  // blocks copied.
+  size_t compact_blocks_for(const std::vector<Sequence*>& sequences,
+                            size_t max_blocks);
+
+  // evict blocks from the prefix cache until there are at least num_blocks
+  // free blocks, returns false if not enough blocks can be evicted.
+  bool evict_for_free_blocks(size_t num_blocks);
+
+  // get the number of prompt tokens of the sequence that are in the prefix
+  // cache, without changing the state of the prefix cache.
+  size_t num_cached_prompt_tokens(const Sequence* sequence) const;
+
+  // get the blocks in device memory holding the prompt of the sequence in the
+  // prefix cache, without changing the state of the prefix cache. the blocks
+  // are not evicted while they are held.
+  std::vector<Block> cached_prompt_blocks(const Sequence* sequence) const;
+
+  // release blocks of sequences behind the sliding window of attention, so
+  // that long sequences hold a constant number of blocks. 0 to keep all.
+  void set_sliding_window(size_t sliding_window) {
+    sliding_window_ = sliding_window;
+  }
+
+  // get the prefix cache, i.e. to report its hit rate
+  const PrefixCache& prefix_cache() const { return prefix_cache_; }
+
+  // swap out blocks of all sequences in the request to host memory
+  // returns false if there are not enough host blocks, nothing is changed.
+  bool swap_out_blocks_for(Request* request);
+
+  // returns and clears block swaps that have not been handed to the engine
+  std::vector<BlockSwap> take_pending_block_swaps();
+
+  // get the number of free blocks in the host block pool
+  size_t num_free_host_blocks() const {
+    return host_block_allocator_ == nullptr
+               ? 0
+               : host_block_allocator_->free_block_count();
+  }
+
+  // get the size of a block in bytes, 0 if unknown
+  int64_t block_size_in_bytes() const { return block_size_in_bytes_; }
+
+  // get the number of free blocks in the block allocator
+  size_t num_free_blocks() const {
+    return block_allocator_.free_block_count();
+  }
+
+  // get the number of total blocks in the block allocator
+  size_t num_total_blocks() const {
+    return block_allocator_.total_block_count();
+  }
+
+  // get the number of slots per block
+  int32_t block_size() const { return block_size_; }
+
  private:
   // check if block allocator has enough slots, if not, try to evict some blocks
   // from the prefix cache
   bool has_enough_blocks(uint32_t num_blocks);
 
+  // copy the shared blocks that the sequence writes new tokens into when
+  // growing to num_tokens, returns false if no enough blocks
+  bool copy_on_write_blocks_for(Sequence* sequence, size_t num_tokens);
+
+  // append new blocks to hold num_tokens, returns false if no enough blocks
+  bool append_blocks_for(Sequence* sequence, size_t num_tokens);
+
+  // number of blocks needed to hold the kv cache of the sequence
+  size_t num_blocks_in_kv_cache(const Sequence* sequence) const;
+
+  // swap out blocks of the sequence to host memory. blocks already copied for
+  // another sequence of the same request are looked up in host_blocks_by_id,
+  // keyed by the device block id.
+  void swap_out_blocks_for(
+      Sequence* sequence,
+      std::unordered_map<int32_t, Block>* host_blocks_by_id);
+
+  // swap in host blocks of the sequence, returns false if no enough blocks.
+  // host blocks shared with other swapped out sequences are swapped in once.
+  bool swap_in_blocks_for(Sequence* sequence);
+
+  // drop swapped in blocks that no swapped out sequence shares anymore
+  void release_stale_swapped_in_blocks();
+
+  // load the host tier of the prefix cache saved by a previous process
+  void load_host_tier();
+
+  // save the host tier of the prefix cache for the next process
+  void save_host_tier() const;
+
   // number of slots per block
   int32_t block_size_ = 0;
 
   // the block allocator that manages the memory blocks
   BlockAllocator block_allocator_;
 
+  // size of a block in bytes, used to estimate the swap cost
+  int64_t block_size_in_bytes_ = 0;
+
+  // number of most recent tokens attended to, 0 to attend to all tokens
+  size_t sliding_window_ = 0;
+
+  // the block allocator for host memory, null if swapping is disabled
+  std::unique_ptr<BlockAllocator> host_block_allocator_;
+
+  // block swaps in order, waiting to be applied by the engine
+  std::vector<BlockSwap> pending_block_swaps_;
+
+  // a host block swapped in while other swapped out sequences still share it
+  struct SwappedInBlock {
+    Block host_block;
+    Block block;
+  };
+  // keyed by the host block id, the sequences sharing the host block pick up
+  // the same device block when they are swapped in.
+  std::unordered_map<int32_t, SwappedInBlock> swapped_in_blocks_;
+
   // prefix cache
   PrefixCache prefix_cache_;
 };
@@ -1,7 +1,19 @@
 #include "block_manager.h"
 
+#include <gflags/gflags.h>
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+DECLARE_bool(enable_contiguous_block_allocation);
+DECLARE_bool(enable_prefix_cache_host_tier);
+DECLARE_string(host_kv_cache_file);
+
 namespace llm {
 
 TEST(BlockManagerTest, Basic) {
@@ -11,4 +23,521 @@ TEST(BlockManagerTest, Basic) {
   // TODO: add more tests
 }
 
-}  // namespace llm
\ No newline at end of file
+TEST(BlockManagerTest, SwapOutAndSwapIn) {
+  const uint32_t n_blocks = 8;
+  const uint32_t n_host_blocks = 4;
+  const uint32_t block_size = 2;
+  BlockManager manager(n_blocks,
+                       block_size,
+                       n_host_blocks,
+                       /*block_size_in_bytes=*/1024);
+  EXPECT_EQ(manager.num_free_host_blocks(), n_host_blocks);
+
+  Request request("1", /*prompt_tokens=*/{1, 2, 3, 4, 5});
+  request.add_sequence();
+  Sequence* sequence = &request.sequences[0];
+
+  EXPECT_TRUE(manager.allocate_blocks_for(sequence));
+  EXPECT_EQ(sequence->num_blocks(), 3);
+  sequence->commit_kv_cache(/*size=*/5);
+  std::vector<int32_t> block_ids;
+  for (const auto& block : sequence->blocks()) {
+    block_ids.push_back(block.id());
+  }
+
+  // swap out all blocks to host memory
+  EXPECT_TRUE(manager.swap_out_blocks_for(&request));
+  EXPECT_TRUE(sequence->is_swapped());
+  EXPECT_EQ(sequence->num_blocks(), 0);
+  EXPECT_EQ(sequence->num_kv_cache_tokens(), 5);
+  EXPECT_EQ(manager.num_free_blocks(), n_blocks);
+  EXPECT_EQ(manager.num_free_host_blocks(), n_host_blocks - 3);
+
+  auto swaps = manager.take_pending_block_swaps();
+  ASSERT_EQ(swaps.size(), 3);
+  for (size_t i = 0; i < swaps.size(); ++i) {
+    EXPECT_TRUE(swaps[i].swap_out);
+    EXPECT_EQ(swaps[i].src_block_id, block_ids[i]);
+    EXPECT_EQ(swaps[i].dst_block_id, sequence->host_blocks()[i].id());
+  }
+  EXPECT_TRUE(manager.take_pending_block_swaps().empty());
+
+  // not enough host blocks for another swap out
+  Request request2("2", /*prompt_tokens=*/{1, 2, 3, 4, 5, 6});
+  request2.add_sequence();
+  EXPECT_TRUE(manager.allocate_blocks_for(&request2.sequences[0]));
+  request2.sequences[0].commit_kv_cache(/*size=*/6);
+  EXPECT_FALSE(manager.swap_out_blocks_for(&request2));
+  EXPECT_FALSE(request2.sequences[0].is_swapped());
+  manager.release_blocks_for(&request2);
+
+  // swap in blocks when the sequence is scheduled again
+  std::vector<int32_t> host_block_ids;
+  for (const auto& block : sequence->host_blocks()) {
+    host_block_ids.push_back(block.id());
+  }
+  EXPECT_TRUE(manager.allocate_blocks_for(sequence, /*num_tokens=*/6));
+  EXPECT_FALSE(sequence->is_swapped());
+  EXPECT_EQ(sequence->num_blocks(), 3);
+  EXPECT_EQ(sequence->num_kv_cache_tokens(), 5);
+  EXPECT_EQ(manager.num_free_host_blocks(), n_host_blocks);
+
+  swaps = manager.take_pending_block_swaps();
+  ASSERT_EQ(swaps.size(), 3);
+  for (size_t i = 0; i < swaps.size(); ++i) {
+    EXPECT_FALSE(swaps[i].swap_out);
+    EXPECT_EQ(swaps[i].src_block_id, host_block_ids[i]);
+    EXPECT_EQ(swaps[i].dst_block_id, sequence->blocks()[i].id());
+  }
+
+  manager.release_blocks_for(&request);
+}
+
+TEST(BlockManagerTest, ReleaseTailBlocks) {
+  const uint32_t n_blocks = 8;
+  const uint32_t block_size = 2;
+  BlockManager manager(n_blocks, block_size);
+
+  Request request("1", /*prompt_tokens=*/{1, 2, 3, 4});
+  request.stopping_criteria.max_tokens = 10;
+  request.stopping_criteria.ignore_eos_token = true;
+  request.add_sequence();
+  Sequence* sequence = &request.sequences[0];
+  EXPECT_TRUE(manager.allocate_blocks_for(sequence));
+  sequence->commit_kv_cache(/*size=*/4);
+  sequence->append_new_token_id(5);
+  EXPECT_TRUE(manager.allocate_blocks_for(sequence));
+  sequence->commit_kv_cache(/*size=*/1);
+  sequence->append_new_token_id(6);
+  EXPECT_EQ(sequence->num_blocks(), 3);
+  EXPECT_EQ(manager.num_free_blocks(), n_blocks - 3);
+
+  // the released tokens are recomputed, generated tokens are kept
+  manager.release_tail_blocks_for(sequence, /*num_blocks=*/1);
+  EXPECT_EQ(sequence->num_blocks(), 2);
+  EXPECT_EQ(sequence->num_kv_cache_tokens(), 4);
+  EXPECT_EQ(sequence->num_tokens(), 6);
+  EXPECT_FALSE(sequence->is_prefill_stage());
+  EXPECT_EQ(manager.num_free_blocks(), n_blocks - 2);
+
+  // nothing to release
+  manager.release_tail_blocks_for(sequence, /*num_blocks=*/0);
+  EXPECT_EQ(sequence->num_blocks(), 2);
+  EXPECT_EQ(sequence->num_kv_cache_tokens(), 4);
+
+  manager.release_blocks_for(&request);
+  EXPECT_EQ(sequence->num_kv_cache_tokens(), 0);
+}
+
+TEST(BlockManagerTest, PrefixCacheQueries) {
+  const uint32_t n_blocks = 4;
+  const uint32_t block_size = 2;
+  BlockManager manager(n_blocks, block_size);
+  const PrefixCache& prefix_cache = manager.prefix_cache();
+
+  Request request1("1", /*prompt_tokens=*/{1, 2, 3, 4});
+  request1.add_sequence();
+  EXPECT_TRUE(manager.allocate_blocks_for(&request1.sequences[0]));
+  request1.sequences[0].commit_kv_cache(/*size=*/4);
+  manager.release_blocks_for(&request1);
+
+  // takes the free blocks, the prefix cache keeps the first prompt
+  Request blocker("2", /*prompt_tokens=*/{7, 8, 9, 10});
+  blocker.add_sequence();
+  EXPECT_TRUE(manager.allocate_blocks_for(&blocker.sequences[0]));
+  blocker.sequences[0].commit_kv_cache(/*size=*/4);
+  EXPECT_EQ(prefix_cache.num_query_tokens(), 8);
+  EXPECT_EQ(prefix_cache.num_hit_tokens(), 0);
+
+  // the prefix is matched, but there is no block left for the rest
+  Request request2("3", /*prompt_tokens=*/{1, 2, 3, 4, 5, 6});
+  request2.add_sequence();
+  Sequence* sequence = &request2.sequences[0];
+  EXPECT_FALSE(manager.allocate_blocks_for(sequence));
+  manager.release_blocks_for(sequence);
+  EXPECT_EQ(prefix_cache.num_query_tokens(), 8);
+
+  // matched again once the blocker is done, the prompt is counted once
+  manager.release_blocks_for(&blocker);
+  EXPECT_TRUE(manager.allocate_blocks_for(sequence));
+  EXPECT_EQ(sequence->num_kv_cache_tokens(), 4);
+  EXPECT_EQ(prefix_cache.num_query_tokens(), 14);
+  EXPECT_EQ(prefix_cache.num_hit_tokens(), 4);
+
+  // preempted and scheduled again
+  manager.release_blocks_for(sequence);
+  EXPECT_TRUE(manager.allocate_blocks_for(sequence));
+  EXPECT_EQ(prefix_cache.num_query_tokens(), 14);
+  EXPECT_EQ(prefix_cache.num_hit_tokens(), 4);
+  EXPECT_DOUBLE_EQ(prefix_cache.hit_rate(), 4.0 / 14);
+}
+
+TEST(BlockManagerTest, ForkBlocks) {
+  const uint32_t n_blocks = 8;
+  const uint32_t block_size = 4;
+  BlockManager manager(n_blocks, block_size);
+
+  Request request("1", "", /*n=*/3, /*prompt_tokens=*/{1, 2, 3, 4, 5, 6});
+  request.stopping_criteria.max_tokens = 10;
+  request.stopping_criteria.ignore_eos_token = true;
+  request.add_sequence();
+  Sequence* parent = &request.sequences[0];
+  EXPECT_TRUE(manager.allocate_blocks_for(parent));
+  parent->commit_kv_cache(/*size=*/6);
+  parent->append_new_token_id(7);
+  const int32_t partial_block_id = parent->blocks()[1].id();
+
+  // children share all prompt blocks, including the partial one
+  ASSERT_TRUE(request.should_expand_sequences());
+  request.expand_sequences();
+  manager.fork_blocks_for(&request);
+  Sequence* child1 = &request.sequences[1];
+  Sequence* child2 = &request.sequences[2];
+  for (const Sequence* child : {child1, child2}) {
+    ASSERT_EQ(child->num_blocks(), parent->num_blocks());
+    EXPECT_TRUE(std::equal(child->blocks().begin(),
+                           child->blocks().end(),
+                           parent->blocks().begin()));
+    EXPECT_EQ(child->num_kv_cache_tokens(), 5);
+  }
+  EXPECT_EQ(manager.num_free_blocks(), n_blocks - 2);
+
+  // recomputing the last prompt token doesn't copy the block
+  EXPECT_TRUE(manager.allocate_blocks_for(child1));
+  EXPECT_TRUE(manager.take_pending_block_swaps().empty());
+  child1->commit_kv_cache(/*size=*/1);
+  child1->append_new_token_id(8);
+
+  // the block is copied when a generated token is written into it
+  EXPECT_TRUE(manager.allocate_blocks_for(parent));
+  auto swaps = manager.take_pending_block_swaps();
+  ASSERT_EQ(swaps.size(), 1);
+  EXPECT_TRUE(swaps[0].on_device);
+  EXPECT_EQ(swaps[0].src_block_id, partial_block_id);
+  EXPECT_EQ(swaps[0].dst_block_id, parent->blocks()[1].id());
+  EXPECT_NE(parent->blocks()[1].id(), partial_block_id);
+  EXPECT_EQ(parent->blocks()[0], child1->blocks()[0]);
+
+  EXPECT_TRUE(manager.allocate_blocks_for(child1));
+  swaps = manager.take_pending_block_swaps();
+  ASSERT_EQ(swaps.size(), 1);
+  EXPECT_EQ(swaps[0].src_block_id, partial_block_id);
+  EXPECT_NE(child1->blocks()[1].id(), partial_block_id);
+  EXPECT_EQ(manager.num_free_blocks(), n_blocks - 4);
+
+  // the last sequence holding the block writes into it in place
+  EXPECT_TRUE(manager.allocate_blocks_for(child2));
+  child2->commit_kv_cache(/*size=*/1);
+  child2->append_new_token_id(9);
+  EXPECT_TRUE(manager.allocate_blocks_for(child2));
+  EXPECT_TRUE(manager.take_pending_block_swaps().empty());
+  EXPECT_EQ(child2->blocks()[1].id(), partial_block_id);
+  EXPECT_EQ(manager.num_free_blocks(), n_blocks - 4);
+
+  manager.release_blocks_for(&request);
+  EXPECT_EQ(manager.num_free_blocks() + manager.prefix_cache().num_blocks(),
+            n_blocks);
+}
+
+TEST(BlockManagerTest, SwapForkedSequences) {
+  const uint32_t n_blocks = 8;
+  // not enough to copy the shared prompt blocks for each sequence
+  const uint32_t n_host_blocks = 4;
+  const uint32_t block_size = 4;
+  BlockManager manager(n_blocks,
+                       block_size,
+                       n_host_blocks,
+                       /*block_size_in_bytes=*/1024);
+
+  Request request("1", "", /*n=*/3, /*prompt_tokens=*/{1, 2, 3, 4, 5, 6});
+  request.stopping_criteria.max_tokens = 10;
+  request.stopping_criteria.ignore_eos_token = true;
+  request.add_sequence();
+  Sequence* parent = &request.sequences[0];
+  EXPECT_TRUE(manager.allocate_blocks_for(parent));
+  parent->commit_kv_cache(/*size=*/6);
+  parent->append_new_token_id(7);
+  request.expand_sequences();
+  manager.fork_blocks_for(&request);
+  Sequence* child1 = &request.sequences[1];
+  Sequence* child2 = &request.sequences[2];
+  EXPECT_EQ(manager.num_free_blocks(), n_blocks - 2);
+
+  // the shared blocks are copied into host memory once
+  EXPECT_TRUE(manager.swap_out_blocks_for(&request));
+  EXPECT_EQ(manager.num_free_blocks(), n_blocks);
+  EXPECT_EQ(manager.num_free_host_blocks(), n_host_blocks - 2);
+  EXPECT_EQ(manager.take_pending_block_swaps().size(), 2);
+  for (const Sequence* child : {child1, child2}) {
+    ASSERT_TRUE(child->is_swapped());
+    EXPECT_TRUE(std::equal(child->host_blocks().begin(),
+                           child->host_blocks().end(),
+                           parent->host_blocks().begin()));
+  }
+
+  // and copied back once, the sequences share them again
+  EXPECT_TRUE(manager.allocate_blocks_for(child1));
+  EXPECT_EQ(manager.take_pending_block_swaps().size(), 2);
+  EXPECT_EQ(manager.num_free_blocks(), n_blocks - 2);
+  EXPECT_TRUE(manager.allocate_blocks_for(child2));
+  EXPECT_TRUE(manager.take_pending_block_swaps().empty());
+  EXPECT_TRUE(std::equal(child2->blocks().begin(),
+                         child2->blocks().end(),
+                         child1->blocks().begin()));
+  EXPECT_EQ(child2->num_kv_cache_tokens(), 5);
+
+  // the parent writes a generated token into the partial prompt block
+  EXPECT_TRUE(manager.allocate_blocks_for(parent));
+  const auto swaps = manager.take_pending_block_swaps();
+  ASSERT_EQ(swaps.size(), 1);
+  EXPECT_TRUE(swaps[0].on_device);
+  EXPECT_EQ(swaps[0].src_block_id, child1->blocks()[1].id());
+  EXPECT_EQ(parent->blocks()[0], child1->blocks()[0]);
+  EXPECT_EQ(parent->num_kv_cache_tokens(), 6);
+  EXPECT_EQ(manager.num_free_blocks(), n_blocks - 3);
+  EXPECT_EQ(manager.num_free_host_blocks(), n_host_blocks);
+
+  manager.release_blocks_for(&request);
+  EXPECT_EQ(manager.num_free_blocks() + manager.prefix_cache().num_blocks(),
+            n_blocks);
+}
+
+TEST(BlockManagerTest, SlidingWindow) {
+  const uint32_t n_blocks = 6;
+  const uint32_t block_size = 2;
+  const size_t sliding_window = 4;
+  BlockManager manager(n_blocks, block_size);
+  manager.set_sliding_window(sliding_window);
+
+  Request request("1", /*prompt_tokens=*/{1, 2, 3, 4, 5, 6});
+  request.stopping_criteria.max_tokens = 100;
+  request.stopping_criteria.ignore_eos_token = true;
+  request.add_sequence();
+  Sequence* sequence = &request.sequences[0];
+  EXPECT_TRUE(manager.allocate_blocks_for(sequence));
+  sequence->commit_kv_cache(/*size=*/6);
+
+  // generate far more tokens than the blocks can hold without the window
+  for (int32_t token_id = 7; token_id < 50; ++token_id) {
+    sequence->append_new_token_id(token_id);
+    ASSERT_TRUE(manager.allocate_blocks_for(sequence));
+    const size_t num_tokens = sequence->num_kv_cache_tokens();
+    // the window of the next token and the token recomputed after a fork
+    const size_t first_token = num_tokens - sliding_window;
+    EXPECT_EQ(sequence->num_released_blocks(), first_token / block_size);
+    for (size_t i = 0; i < sequence->num_blocks(); ++i) {
+      EXPECT_EQ(sequence->blocks()[i].is_valid(),
+                i >= sequence->num_released_blocks());
+    }
+    EXPECT_GE(manager.num_free_blocks(), n_blocks - 4);
+    sequence->commit_kv_cache(/*size=*/1);
+  }
+
+  // nothing is cached without the leading blocks
+  manager.release_blocks_for(&request);
+  EXPECT_EQ(sequence->num_released_blocks(), 0);
+  EXPECT_EQ(manager.num_free_blocks(), n_blocks);
+}
+
+TEST(BlockManagerTest, CompactBlocks) {
+  const uint32_t n_blocks = 16;
+  const uint32_t block_size = 2;
+  FLAGS_enable_contiguous_block_allocation = true;
+  BlockManager manager(n_blocks, block_size);
+  FLAGS_enable_contiguous_block_allocation = false;
+
+  // two sequences growing in turn interleave their blocks
+  std::vector<std::unique_ptr<Request>> requests;
+  std::vector<Sequence*> sequences;
+  for (int32_t i = 0; i < 2; ++i) {
+    auto request = std::make_unique<Request>(
+        std::to_string(i), std::vector<int32_t>{10 * i + 1, 10 * i + 2});
+    request->stopping_criteria.max_tokens = 100;
+    request->stopping_criteria.ignore_eos_token = true;
+    request->add_sequence();
+    sequences.push_back(&request->sequences[0]);
+    requests.push_back(std::move(request));
+  }
+  for (int32_t token_id = 3; token_id <= 6; ++token_id) {
+    for (Sequence* sequence : sequences) {
+      ASSERT_TRUE(manager.allocate_blocks_for(sequence));
+      sequence->commit_kv_cache(sequence->num_tokens() -
+                                sequence->num_kv_cache_tokens());
+      sequence->append_new_token_id(token_id);
+    }
+  }
+  auto block_ids_of = [](const Sequence* sequence) {
+    std::vector<int32_t> ids;
+    for (const auto& block : sequence->blocks()) {
+      ids.push_back(block.id());
+    }
+    return ids;
+  };
+  EXPECT_EQ(block_ids_of(sequences[0]), std::vector<int32_t>({0, 2, 4}));
+  EXPECT_EQ(block_ids_of(sequences[1]), std::vector<int32_t>({1, 3, 5}));
+
+  // not enough budget to move all blocks of a sequence
+  EXPECT_EQ(manager.compact_blocks_for(sequences, /*max_blocks=*/2), 0);
+  EXPECT_TRUE(manager.take_pending_block_swaps().empty());
+
+  EXPECT_EQ(manager.compact_blocks_for(sequences, /*max_blocks=*/6), 6);
+  const auto swaps = manager.take_pending_block_swaps();
+  ASSERT_EQ(swaps.size(), 6);
+  for (const auto& swap : swaps) {
+    EXPECT_TRUE(swap.on_device);
+    EXPECT_GE(swap.dst_block_id, 6);
+  }
+  for (const Sequence* sequence : sequences) {
+    const auto ids = block_ids_of(sequence);
+    for (size_t i = 1; i < ids.size(); ++i) {
+      EXPECT_EQ(ids[i], ids[i - 1] + 1);
+    }
+  }
+  EXPECT_EQ(manager.num_free_blocks(), n_blocks - 6);
+
+  // nothing left to move
+  EXPECT_EQ(manager.compact_blocks_for(sequences, /*max_blocks=*/6), 0);
+
+  for (auto& request : requests) {
+    manager.release_blocks_for(request.get());
+  }
+  EXPECT_EQ(manager.num_free_blocks() + manager.prefix_cache().num_blocks(),
+            n_blocks);
+}
+
+TEST(BlockManagerTest, CompactBlocksAfterCopyOnWrite) {
+  const uint32_t n_blocks = 16;
+  const uint32_t block_size = 2;
+  FLAGS_enable_contiguous_block_allocation = true;
+  BlockManager manager(n_blocks, block_size);
+  FLAGS_enable_contiguous_block_allocation = false;
+
+  Request request("1", "", /*n=*/2, /*prompt_tokens=*/{1, 2, 3});
+  request.stopping_criteria.max_tokens = 10;
+  request.stopping_criteria.ignore_eos_token = true;
+  request.add_sequence();
+  Request other("2", /*prompt_tokens=*/{20, 21, 22});
+  other.stopping_criteria.max_tokens = 10;
+  other.stopping_criteria.ignore_eos_token = true;
+  other.add_sequence();
+  Sequence* parent = &request.sequences[0];
+  Sequence* sequence = &other.sequences[0];
+  for (Sequence* seq : {parent, sequence}) {
+    ASSERT_TRUE(manager.allocate_blocks_for(seq));
+    seq->commit_kv_cache(/*size=*/3);
+  }
+  parent->append_new_token_id(4);
+  sequence->append_new_token_id(23);
+  const int32_t partial_block_id = parent->blocks()[1].id();
+  ASSERT_TRUE(request.should_expand_sequences());
+  request.expand_sequences();
+  manager.fork_blocks_for(&request);
+  Sequence* child = &request.sequences[1];
+
+  // the parent copies the shared partial block and grows around the other
+  // sequence within the same step
+  ASSERT_TRUE(manager.allocate_blocks_for(parent));
+  ASSERT_TRUE(manager.allocate_blocks_for(sequence, /*num_tokens=*/5));
+  ASSERT_TRUE(manager.allocate_blocks_for(parent, /*num_tokens=*/5));
+  const std::vector<Sequence*> sequences = {parent, child, sequence};
+  std::vector<std::vector<int32_t>> contents_before;
+  for (const Sequence* seq : sequences) {
+    std::vector<int32_t> ids;
+    for (const auto& block : seq->blocks()) {
+      ids.push_back(block.id());
+    }
+    contents_before.push_back(ids);
+  }
+  // the parent reads the copy of the partial block
+  contents_before[0][1] = partial_block_id;
+
+  // the block waiting for its copy is not moved
+  EXPECT_EQ(manager.compact_blocks_for(sequences, /*max_blocks=*/8), 2);
+
+  // apply the copies in order, each block holds the id it was written from
+  std::vector<int32_t> contents(n_blocks);
+  for (int32_t i = 0; i < static_cast<int32_t>(n_blocks); ++i) {
+    contents[i] = i;
+  }
+  for (const auto& swap : manager.take_pending_block_swaps()) {
+    ASSERT_TRUE(swap.on_device);
+    contents[swap.dst_block_id] = contents[swap.src_block_id];
+  }
+  for (size_t i = 0; i < sequences.size(); ++i) {
+    // only the blocks holding kv cache are copied
+    const size_t num_used_blocks =
+        (sequences[i]->num_kv_cache_tokens() + block_size - 1) / block_size;
+    for (size_t j = 0; j < num_used_blocks; ++j) {
+      EXPECT_EQ(contents[sequences[i]->blocks()[j].id()],
+                contents_before[i][j]);
+    }
+  }
+
+  manager.release_blocks_for(&request);
+  manager.release_blocks_for(&other);
+  EXPECT_EQ(manager.num_free_blocks() + manager.prefix_cache().num_blocks(),
+            n_blocks);
+}
+
+TEST(BlockManagerTest, ReloadHostTier) {
+  const uint32_t n_blocks = 8;
+  const uint32_t n_host_blocks = 4;
+  const uint32_t block_size = 2;
+  FLAGS_enable_prefix_cache_host_tier = true;
+  FLAGS_host_kv_cache_file = ::testing::TempDir() + "host_kv_cache";
+  const std::string index_path = FLAGS_host_kv_cache_file + ".index";
+
+  // cache a prompt and spill it into host blocks before exiting
+  auto run_and_spill = [&](int64_t block_size_in_bytes) {
+    BlockManager manager(
+        n_blocks, block_size, n_host_blocks, block_size_in_bytes);
+    Request request("1", /*prompt_tokens=*/{1, 2, 3, 4, 5});
+    request.add_sequence();
+    EXPECT_TRUE(manager.allocate_blocks_for(&request.sequences[0]));
+    request.sequences[0].commit_kv_cache(/*size=*/5);
+    manager.release_blocks_for(&request);
+    EXPECT_TRUE(manager.evict_for_free_blocks(n_blocks));
+    EXPECT_EQ(manager.num_free_host_blocks(), n_host_blocks - 2);
+    EXPECT_EQ(manager.take_pending_block_swaps().size(), 2);
+  };
+
+  run_and_spill(/*block_size_in_bytes=*/1024);
+  EXPECT_TRUE(std::ifstream(index_path).good());
+  {
+    BlockManager manager(n_blocks,
+                         block_size,
+                         n_host_blocks,
+                         /*block_size_in_bytes=*/1024);
+    // the index is consumed on load
+    EXPECT_FALSE(std::ifstream(index_path).good());
+    EXPECT_EQ(manager.num_free_host_blocks(), n_host_blocks - 2);
+
+    Request request("2", /*prompt_tokens=*/{1, 2, 3, 4, 6});
+    request.add_sequence();
+    Sequence* sequence = &request.sequences[0];
+    EXPECT_EQ(manager.num_cached_prompt_tokens(sequence), 4);
+    EXPECT_TRUE(manager.allocate_blocks_for(sequence));
+    EXPECT_EQ(sequence->num_kv_cache_tokens(), 4);
+    const auto swaps = manager.take_pending_block_swaps();
+    ASSERT_EQ(swaps.size(), 2);
+    EXPECT_FALSE(swaps[0].swap_out || swaps[1].swap_out);
+    EXPECT_EQ(manager.num_free_host_blocks(), n_host_blocks);
+    manager.release_blocks_for(&request);
+  }
+
+  // a different layout ignores the index
+  run_and_spill(/*block_size_in_bytes=*/1024);
+  {
+    BlockManager manager(n_blocks,
+                         block_size,
+                         n_host_blocks,
+                         /*block_size_in_bytes=*/2048);
+    EXPECT_EQ(manager.num_free_host_blocks(), n_host_blocks);
+  }
+
+  std::remove(index_path.c_str());
+  FLAGS_enable_prefix_cache_host_tier = false;
+  FLAGS_host_kv_cache_file = "";
+}
+
+}  // namespace llm
@@ -0,0 +1,71 @@
+#include "eviction_policy.h"
+
+#include <glog/logging.h>
+
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace llm {
+namespace {
+// number of tokens before a token at which its attention costs as much as
+// the dense layers, roughly 6 * hidden_size for llama-like models.
+constexpr double kAttentionCostContext = 16384;
+}  // namespace
+
+double LRUEvictionPolicy::rank(const PrefixCacheNodeStats& stats) const {
+  return static_cast<double>(stats.last_access_time);
+}
+
+LFUEvictionPolicy::LFUEvictionPolicy(double half_life_s)
+    : half_life_us_(half_life_s * 1e6) {
+  CHECK(half_life_s > 0) << "half life should be greater than 0";
+}
+
+double LFUEvictionPolicy::rank(const PrefixCacheNodeStats& stats) const {
+  // the decay scales all frequencies by the same factor, in log space the
+  // elapsed time since the epoch shifts all keys by the same amount.
+  return std::log2(stats.frequency) +
+         static_cast<double>(stats.last_access_time) / half_life_us_;
+}
+
+double LFUEvictionPolicy::decay(double frequency, int64_t elapsed_us) const {
+  if (elapsed_us <= 0) {
+    return frequency;
+  }
+  return frequency *
+         std::exp2(-static_cast<double>(elapsed_us) / half_life_us_);
+}
+
+CostAwareEvictionPolicy::CostAwareEvictionPolicy(double half_life_s)
+    : LFUEvictionPolicy(half_life_s) {}
+
+double CostAwareEvictionPolicy::rank(const PrefixCacheNodeStats& stats) const {
+  // average cost of the tokens in the node, the same for each of its blocks
+  const double context = static_cast<double>(stats.num_prefix_tokens) +
+                         static_cast<double>(stats.num_tokens) / 2;
+  return LFUEvictionPolicy::rank(stats) + std::log2(recompute_cost(context));
+}
+
+double CostAwareEvictionPolicy::recompute_cost(double num_prefix_tokens) {
+  return 1.0 + num_prefix_tokens / kAttentionCostContext;
+}
+
+std::unique_ptr<EvictionPolicy> EvictionPolicyFactory::create(
+    const std::string& type,
+    double half_life_s) {
+  if (type == "lru") {
+    return std::make_unique<LRUEvictionPolicy>();
+  }
+  if (type == "lfu") {
+    return std::make_unique<LFUEvictionPolicy>(half_life_s);
+  }
+  if (type == "cost") {
+    return std::make_unique<CostAwareEvictionPolicy>(half_life_s);
+  }
+  LOG(FATAL) << "Unknown prefix cache eviction policy: " << type;
+  return nullptr;
+}
+
+}  // namespace llm
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace llm {
+
+// statistics of a prefix cache node
+struct PrefixCacheNodeStats {
+  // number of tokens in the node
+  size_t num_tokens = 0;
+  // number of tokens before the node, i.e. in its ancestors
+  size_t num_prefix_tokens = 0;
+  // whether the blocks are in the host tier
+  bool on_host = false;
+  // the last access time in microseconds
+  int64_t last_access_time = 0;
+  // number of matches that hit the node
+  size_t hit_count = 0;
+  // access frequency at the last access time, decayed by the policy
+  double frequency = 0;
+};
+
+// An eviction policy decides the order in which the prefix cache evicts nodes.
+// Nodes with lower ranks are evicted first, ties are broken by the last access
+// time.
+class EvictionPolicy {
+ public:
+  virtual ~EvictionPolicy() = default;
+
+  // returns the rank to keep the node. it only changes when the node is
+  // accessed, the relative order of nodes stays the same as time passes. the
+  // prefix cache keeps evictable nodes sorted by it instead of ranking all
+  // nodes on every eviction.
+  virtual double rank(const PrefixCacheNodeStats& stats) const = 0;
+
+  // decays the access frequency over the elapsed time
+  virtual double decay(double frequency, int64_t /*elapsed_us*/) const {
+    return frequency;
+  }
+
+  // returns true if nodes are evicted in LRU order, the prefix cache then
+  // walks its LRU list instead of ranking all nodes.
+  virtual bool is_lru() const { return false; }
+};
+
+// Least-Recently-Used (LRU): evict the node accessed longest ago.
+class LRUEvictionPolicy final : public EvictionPolicy {
+ public:
+  double rank(const PrefixCacheNodeStats& stats) const override;
+
+  bool is_lru() const override { return true; }
+};
+
+// Least-Frequently-Used with decay (LFU): evict the node with the lowest hit
+// frequency, where each hit counts half after every half life. a burst of
+// one-off prompts can't flush prompts that are reused all the time, and
+// prompts that were popular long ago still age out.
+class LFUEvictionPolicy : public EvictionPolicy {
+ public:
+  explicit LFUEvictionPolicy(double half_life_s);
+
+  // log2 of the frequency decayed back to the unix epoch
+  double rank(const PrefixCacheNodeStats& stats) const override;
+
+  double decay(double frequency, int64_t elapsed_us) const override;
+
+ private:
+  double half_life_us_;
+};
+
+// Cost-aware LFU: weight the decayed hit frequency by the cost to recompute
+// the tokens of a block. recomputing a token costs the same in the dense
+// layers but its attention grows with the number of tokens before it, so
+// blocks deep in long prompts are kept over blocks of short ones.
+class CostAwareEvictionPolicy final : public LFUEvictionPolicy {
+ public:
+  explicit CostAwareEvictionPolicy(double half_life_s);
+
+  // the LFU rank plus log2 of the average recompute cost of the tokens
+  double rank(const PrefixCacheNodeStats& stats) const override;
+
+  // returns the relative cost to recompute a token after num_prefix_tokens
+  static double recompute_cost(double num_prefix_tokens);
+};
+
+class EvictionPolicyFactory {
+ public:
+  // create the policy by name: lru, lfu or cost
+  static std::unique_ptr<EvictionPolicy> create(const std::string& type,
+                                                double half_life_s);
+};
+
+}  // namespace llm
@@ -0,0 +1,52 @@
+#include "eviction_policy.h"
+
+#include <gtest/gtest.h>
+
+namespace llm {
+
+TEST(EvictionPolicyTest, LFU) {
+  LFUEvictionPolicy policy(/*half_life_s=*/1);
+  PrefixCacheNodeStats stats;
+  stats.last_access_time = 1000000;
+  stats.frequency = 4;
+  // a hit counts half after each half life
+  EXPECT_DOUBLE_EQ(policy.decay(4, /*elapsed_us=*/1000000), 2);
+  EXPECT_DOUBLE_EQ(policy.decay(4, /*elapsed_us=*/2000000), 1);
+  PrefixCacheNodeStats later = stats;
+  later.last_access_time = 2000000;
+  later.frequency = 2;
+  EXPECT_DOUBLE_EQ(policy.rank(later), policy.rank(stats));
+
+  // at 3s, the recent node has frequency 1 * 2^-0.5 against 4 * 2^-2
+  PrefixCacheNodeStats recent;
+  recent.last_access_time = 2500000;
+  recent.frequency = 1;
+  EXPECT_LT(policy.rank(recent), policy.rank(stats));
+  recent.frequency = 3;
+  EXPECT_GT(policy.rank(recent), policy.rank(stats));
+}
+
+TEST(EvictionPolicyTest, CostAware) {
+  CostAwareEvictionPolicy policy(/*half_life_s=*/1);
+  PrefixCacheNodeStats shallow;
+  shallow.num_tokens = 32;
+  shallow.frequency = 1;
+  PrefixCacheNodeStats deep = shallow;
+  deep.num_prefix_tokens = 4096;
+
+  // blocks after a long prefix cost more to recompute
+  EXPECT_GT(policy.rank(deep), policy.rank(shallow));
+  EXPECT_GT(CostAwareEvictionPolicy::recompute_cost(4096),
+            CostAwareEvictionPolicy::recompute_cost(0));
+  // but frequency still dominates
+  shallow.frequency = 2;
+  EXPECT_GT(policy.rank(shallow), policy.rank(deep));
+}
+
+TEST(EvictionPolicyTest, Factory) {
+  EXPECT_TRUE(EvictionPolicyFactory::create("lru", 1)->is_lru());
+  EXPECT_FALSE(EvictionPolicyFactory::create("lfu", 1)->is_lru());
+  EXPECT_FALSE(EvictionPolicyFactory::create("cost", 1)->is_lru());
+}
+
+}  // namespace llm
@@ -0,0 +1,166 @@
+#include "host_memory.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+namespace llm::memory {
+namespace {
+constexpr char kCgroupRoot[] = "/sys/fs/cgroup";
+
+// returns the content of the file, or an empty string if it can't be read
+std::string read_file(const std::string& path) {
+  std::ifstream file(path);
+  if (!file.is_open()) {
+    return "";
+  }
+  std::stringstream buffer;
+  buffer << file.rdbuf();
+  return buffer.str();
+}
+
+// returns the cgroup v2 directory of the process, or empty if not found
+std::string cgroup_dir() {
+  std::istringstream content(read_file("/proc/self/cgroup"));
+  std::string line;
+  while (std::getline(content, line)) {
+    // the cgroup v2 entry is "0::<path>"
+    if (line.compare(0, 3, "0::") == 0) {
+      std::string path = line.substr(3);
+      while (!path.empty() && path.back() == '/') {
+        path.pop_back();
+      }
+      return kCgroupRoot + path;
+    }
+  }
+  return "";
+}
+
+struct CgroupMemory {
+  // the smallest limit of the cgroup and its ancestors, -1 for no limit
+  int64_t limit = -1;
+  // the smallest memory left under the limits, -1 for no limit
+  int64_t available = -1;
+};
+
+// limits of ancestors apply to the process too, so walk up to the root
+CgroupMemory cgroup_memory() {
+  CgroupMemory result;
+  std::string dir = cgroup_dir();
+  const std::string root = kCgroupRoot;
+  while (dir.size() >= root.size()) {
+    const int64_t limit =
+        parse_cgroup_memory_limit(read_file(dir + "/memory.max"));
+    if (limit >= 0) {
+      const int64_t current =
+          parse_memory_field(read_file(dir + "/memory.current"), "");
+      const int64_t inactive_file =
+          parse_memory_field(read_file(dir + "/memory.stat"), "inactive_file");
+      int64_t used = std::max<int64_t>(current, 0);
+      // inactive page cache is reclaimed before hitting the limit
+      used -= std::min(std::max<int64_t>(inactive_file, 0), used);
+      const int64_t available = std::max<int64_t>(limit - used, 0);
+      if (result.limit < 0 || limit < result.limit) {
+        result.limit = limit;
+      }
+      if (result.available < 0 || available < result.available) {
+        result.available = available;
+      }
+    }
+    if (dir == root) {
+      break;
+    }
+    dir = dir.substr(0, dir.rfind('/'));
+  }
+  return result;
+}
+
+}  // namespace
+
+int64_t parse_memory_field(const std::string& content,
+                           const std::string& field) {
+  std::istringstream lines(content);
+  std::string line;
+  while (std::getline(lines, line)) {
+    if (line.compare(0, field.size(), field) != 0) {
+      continue;
+    }
+    // the field should be followed by its value
+    const char* value = line.c_str() + field.size();
+    if (!field.empty() && !std::isspace(static_cast<unsigned char>(*value))) {
+      continue;
+    }
+    char* end = nullptr;
+    const int64_t number = std::strtoll(value, &end, /*base=*/10);
+    if (end == value) {
+      continue;
+    }
+    while (std::isspace(static_cast<unsigned char>(*end))) {
+      ++end;
+    }
+    return std::string(end) == "kB" ? number * 1024 : number;
+  }
+  return -1;
+}
+
+int64_t parse_cgroup_memory_limit(const std::string& content) {
+  if (content.compare(0, 3, "max") == 0) {
+    return -1;
+  }
+  return parse_memory_field(content, "");
+}
+
+int64_t host_total_memory() {
+  const int64_t total =
+      parse_memory_field(read_file("/proc/meminfo"), "MemTotal:");
+  CHECK(total > 0) << "Failed to read MemTotal from /proc/meminfo";
+  const auto cgroup = cgroup_memory();
+  if (cgroup.limit >= 0) {
+    return std::min(total, cgroup.limit);
+  }
+  return total;
+}
+
+int64_t host_available_memory() {
+  const int64_t available =
+      parse_memory_field(read_file("/proc/meminfo"), "MemAvailable:");
+  CHECK(available >= 0) << "Failed to read MemAvailable from /proc/meminfo";
+  const auto cgroup = cgroup_memory();
+  if (cgroup.available >= 0) {
+    return std::min(available, cgroup.available);
+  }
+  return available;
+}
+
+int64_t host_rss() {
+  const int64_t rss = parse_memory_field(read_file("/proc/self/status"),
+                                         "VmRSS:");
+  CHECK(rss >= 0) << "Failed to read VmRSS from /proc/self/status";
+  return rss;
+}
+
+int64_t host_peak_rss() {
+  const int64_t peak = parse_memory_field(read_file("/proc/self/status"),
+                                          "VmHWM:");
+  CHECK(peak >= 0) << "Failed to read VmHWM from /proc/self/status";
+  return peak;
+}
+
+bool reset_host_peak_rss() {
+  // writing 5 to clear_refs resets VmHWM to VmRSS since linux 4.0
+  std::ofstream file("/proc/self/clear_refs");
+  if (!file.is_open()) {
+    return false;
+  }
+  file << "5";
+  file.flush();
+  return file.good();
+}
+
+}  // namespace llm::memory
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace llm::memory {
+
+// returns the value of the field in a /proc or cgroup file, e.g. "MemTotal:"
+// in /proc/meminfo or "inactive_file" in memory.stat, in bytes. values in kB
+// are converted to bytes. returns -1 if the field is not found.
+int64_t parse_memory_field(const std::string& content,
+                           const std::string& field);
+
+// returns the limit in a cgroup v2 memory.max file in bytes, or -1 if there is
+// no limit.
+int64_t parse_cgroup_memory_limit(const std::string& content);
+
+// returns the total host memory in bytes that the process can use, the
+// smaller one of the physical memory and the cgroup v2 memory limit.
+int64_t host_total_memory();
+
+// returns the available host memory in bytes, the smaller one of the
+// MemAvailable in /proc/meminfo and the memory left under the cgroup v2 limit,
+// without counting reclaimable page cache as used.
+int64_t host_available_memory();
+
+// returns the resident set size of the process in bytes
+int64_t host_rss();
+
+// returns the peak resident set size of the process in bytes
+int64_t host_peak_rss();
+
+// resets the peak resident set size to the current one. returns false if not
+// supported, then the peak is since the beginning of the program.
+bool reset_host_peak_rss();
+
+}  // namespace llm::memory
@@ -0,0 +1,58 @@
+#include "host_memory.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+namespace llm::memory {
+
+TEST(HostMemoryTest, ParseMemoryField) {
+  const std::string meminfo =
+      "MemTotal:       16318412 kB\n"
+      "MemFree:         1048576 kB\n"
+      "MemAvailable:    8159206 kB\n";
+  EXPECT_EQ(parse_memory_field(meminfo, "MemTotal:"), 16318412LL * 1024);
+  EXPECT_EQ(parse_memory_field(meminfo, "MemAvailable:"), 8159206LL * 1024);
+  EXPECT_EQ(parse_memory_field(meminfo, "SwapTotal:"), -1);
+
+  // values in memory.stat are in bytes, fields should match as a whole
+  const std::string stat =
+      "anon 4096\n"
+      "inactive_file_extra 1\n"
+      "inactive_file 8192\n";
+  EXPECT_EQ(parse_memory_field(stat, "inactive_file"), 8192);
+  EXPECT_EQ(parse_memory_field(stat, "inactive"), -1);
+
+  // single value files
+  EXPECT_EQ(parse_memory_field("123456\n", ""), 123456);
+  EXPECT_EQ(parse_memory_field("", ""), -1);
+}
+
+TEST(HostMemoryTest, ParseCgroupMemoryLimit) {
+  EXPECT_EQ(parse_cgroup_memory_limit("max\n"), -1);
+  EXPECT_EQ(parse_cgroup_memory_limit("1073741824\n"), 1073741824);
+  // no cgroup v2 file
+  EXPECT_EQ(parse_cgroup_memory_limit(""), -1);
+}
+
+TEST(HostMemoryTest, ProcessMemory) {
+  const int64_t total = host_total_memory();
+  const int64_t available = host_available_memory();
+  EXPECT_GT(total, 0);
+  EXPECT_GE(available, 0);
+
+  reset_host_peak_rss();
+  const int64_t rss = host_rss();
+  EXPECT_GT(rss, 0);
+
+  // touch 64MB to grow the peak rss
+  const size_t size = 64 * 1024 * 1024;
+  {
+    std::vector<char> buffer(size, 1);
+    EXPECT_GE(host_rss(), rss + static_cast<int64_t>(size) / 2);
+  }
+  EXPECT_GE(host_peak_rss(), rss + static_cast<int64_t>(size) / 2);
+}
+
+}  // namespace llm::memory
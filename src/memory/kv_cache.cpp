@@ -5,6 +5,8 @@
 #include <glog/logging.h>
 #include <torch/torch.h>
 
+#include <algorithm>
+#include <cmath>
 #include <cstdint>
 #include <vector>
 
@@ -13,6 +15,65 @@
 namespace llm {
 using ISlice = torch::indexing::Slice;
 
+namespace {
+constexpr float kInt8Max = 127.0f;
+
+// quantize one token into a block of int8 cache.
+// token: [num_heads, head_dim], block: [block_size, num_heads, head_dim]
+// scales: [num_heads]
+// the first token of a block resets the scales. a later token with larger
+// values grows the scale of its head, and the entries already in the block
+// are requantized to the new scale, so that one scale covers the whole block.
+void quantize_token(const float* token,
+                    int64_t block_offset,
+                    int64_t num_heads,
+                    int64_t head_dim,
+                    int8_t* block,
+                    float* scales) {
+  for (int64_t h = 0; h < num_heads; ++h) {
+    const float* src = token + h * head_dim;
+    float amax = 0.0f;
+    for (int64_t d = 0; d < head_dim; ++d) {
+      amax = std::max(amax, std::abs(src[d]));
+    }
+    const float scale = amax / kInt8Max;
+    if (block_offset == 0) {
+      scales[h] = scale;
+    } else if (scale > scales[h]) {
+      const float ratio = scales[h] / scale;
+      for (int64_t i = 0; i < block_offset; ++i) {
+        int8_t* dst = block + (i * num_heads + h) * head_dim;
+        for (int64_t d = 0; d < head_dim; ++d) {
+          dst[d] = static_cast<int8_t>(std::nearbyint(dst[d] * ratio));
+        }
+      }
+      scales[h] = scale;
+    }
+
+    const float inv_scale = scales[h] > 0.0f ? 1.0f / scales[h] : 0.0f;
+    int8_t* dst = block + (block_offset * num_heads + h) * head_dim;
+    for (int64_t d = 0; d < head_dim; ++d) {
+      const float q = std::nearbyint(src[d] * inv_scale);
+      dst[d] = static_cast<int8_t>(std::clamp(q, -kInt8Max, kInt8Max));
+    }
+  }
+}
+
+// gather slots from int8 cache and dequantize them with the block scales
+// cache: [num_blocks, block_size, num_heads, head_dim]
+// scales: [num_blocks, num_heads]
+// returns: [num_slots, num_heads, head_dim]
+torch::Tensor dequantize(const torch::Tensor& cache,
+                         const torch::Tensor& scales,
+                         const torch::Tensor& slot_ids,
+                         const torch::Tensor& block_ids) {
+  const auto slots = cache.view({-1, cache.size(-2), cache.size(-1)})
+                         .index_select(/*dim=*/0, slot_ids);
+  return slots.to(scales.scalar_type()) *
+         scales.index_select(/*dim=*/0, block_ids).unsqueeze(-1);
+}
+}  // namespace
+
 // [num_blocks, block_size, num_kv_heads, head_dim]
 KVCache::KVCache(torch::Tensor key_cache, torch::Tensor value_cache)
     : num_kv_heads_(value_cache.size(-2)),
@@ -21,6 +82,26 @@ KVCache::KVCache(torch::Tensor key_cache, torch::Tensor value_cache)
       key_cache_(std::move(key_cache)),
       value_cache_(std::move(value_cache)) {}
 
+KVCache::KVCache(torch::Tensor key_cache,
+                 torch::Tensor value_cache,
+                 torch::Tensor key_scales,
+                 torch::Tensor value_scales)
+    : KVCache(std::move(key_cache), std::move(value_cache)) {
+  CHECK(key_cache_.scalar_type() == torch::kChar &&
+        value_cache_.scalar_type() == torch::kChar)
+      << "quantized kv cache should be int8";
+  CHECK(key_scales.scalar_type() == torch::kFloat &&
+        value_scales.scalar_type() == torch::kFloat)
+      << "kv cache scales should be float";
+  CHECK(key_cache_.is_contiguous() && value_cache_.is_contiguous());
+  CHECK_EQ(key_scales.size(0), key_cache_.size(0));
+  CHECK_EQ(key_scales.size(1), num_kv_heads_);
+  CHECK_EQ(value_scales.size(0), value_cache_.size(0));
+  CHECK_EQ(value_scales.size(1), num_kv_heads_);
+  key_scales_ = std::move(key_scales);
+  value_scales_ = std::move(value_scales);
+}
+
 void KVCache::set_kv_cache(const torch::Tensor& slot_ids,
                            const torch::Tensor& keys,
                            const torch::Tensor& values,
@@ -30,6 +111,10 @@ void KVCache::set_kv_cache(const torch::Tensor& slot_ids,
   DCHECK_EQ(slot_ids.device(), keys.device());
   DCHECK_EQ(slot_ids.device(), values.device());
 
+  if (quantized()) {
+    CHECK(!keys.is_cuda()) << "quantized kv cache is only supported on cpu";
+    return set_kv_cache_quantized(slot_ids, keys, values);
+  }
   if (keys.is_cuda()) {
     // use cuda kernel
     return set_kv_cache_cuda(slot_ids, keys, values, stream);
@@ -57,6 +142,44 @@ void KVCache::set_kv_cache_slow(const torch::Tensor& slot_ids,
   }
 }
 
+void KVCache::set_kv_cache_quantized(const torch::Tensor& slot_ids,
+                                     const torch::Tensor& keys,
+                                     const torch::Tensor& values) {
+  auto slot_ids_cpu = slot_ids.cpu();
+  const int32_t* ids = slot_ids_cpu.data_ptr<int32_t>();
+  const auto num_tokens = keys.size(0);
+
+  const auto keys_fp32 = keys.to(torch::kFloat).contiguous();
+  const auto values_fp32 = values.to(torch::kFloat).contiguous();
+  const float* key_data = keys_fp32.data_ptr<float>();
+  const float* value_data = values_fp32.data_ptr<float>();
+  int8_t* key_cache = key_cache_.data_ptr<int8_t>();
+  int8_t* value_cache = value_cache_.data_ptr<int8_t>();
+  float* key_scales = key_scales_.data_ptr<float>();
+  float* value_scales = value_scales_.data_ptr<float>();
+
+  const int64_t slot_size = num_kv_heads_ * head_size_;
+  const int64_t block_stride = block_size_ * slot_size;
+  for (int64_t i = 0; i < num_tokens; ++i) {
+    const int32_t slot_id = ids[i];
+    const auto block_id = slot_id / block_size_;
+    const auto block_offset = slot_id % block_size_;
+
+    quantize_token(key_data + i * slot_size,
+                   block_offset,
+                   num_kv_heads_,
+                   head_size_,
+                   key_cache + block_id * block_stride,
+                   key_scales + block_id * num_kv_heads_);
+    quantize_token(value_data + i * slot_size,
+                   block_offset,
+                   num_kv_heads_,
+                   head_size_,
+                   value_cache + block_id * block_stride,
+                   value_scales + block_id * num_kv_heads_);
+  }
+}
+
 void KVCache::set_kv_cache_cuda(const torch::Tensor& slot_ids,
                                 const torch::Tensor& keys,
                                 const torch::Tensor& values,
@@ -65,6 +188,33 @@ void KVCache::set_kv_cache_cuda(const torch::Tensor& slot_ids,
       slot_ids, keys, values, key_cache_, value_cache_, stream);
 }
 
+void KVCache::copy_blocks_from(const KVCache& src,
+                               const torch::Tensor& src_block_ids,
+                               const torch::Tensor& dst_block_ids) {
+  DCHECK_EQ(src_block_ids.numel(), dst_block_ids.numel());
+  CHECK_EQ(quantized(), src.quantized())
+      << "can't copy blocks between quantized and unquantized kv cache";
+  const auto src_device = src.key_cache_.device();
+  const auto dst_device = key_cache_.device();
+  const auto src_ids = src_block_ids.to(src_device, torch::kLong);
+  const auto dst_ids = dst_block_ids.to(dst_device, torch::kLong);
+
+  // gather blocks from src then scatter them into dst
+  const auto keys = src.key_cache_.index_select(/*dim=*/0, src_ids);
+  key_cache_.index_copy_(/*dim=*/0, dst_ids, keys.to(dst_device));
+  const auto values = src.value_cache_.index_select(/*dim=*/0, src_ids);
+  value_cache_.index_copy_(/*dim=*/0, dst_ids, values.to(dst_device));
+
+  if (quantized()) {
+    const auto key_scales = src.key_scales_.index_select(/*dim=*/0, src_ids);
+    key_scales_.index_copy_(/*dim=*/0, dst_ids, key_scales.to(dst_device));
+    const auto value_scales =
+        src.value_scales_.index_select(/*dim=*/0, src_ids);
+    value_scales_.index_copy_(
+        /*dim=*/0, dst_ids, value_scales.to(dst_device));
+  }
+}
+
 std::tuple<torch::Tensor, torch::Tensor> KVCache::get_kv_cache(
     const torch::Tensor& slot_ids) const {
   DCHECK_EQ(slot_ids.dtype(), torch::kInt);
@@ -83,24 +233,37 @@ std::tuple<torch::Tensor, torch::Tensor> KVCache::get_kv_cache(
 
 std::tuple<torch::Tensor, torch::Tensor> KVCache::get_kv_cache(
     const std::vector<int>& slot_ids) const {
+  if (quantized()) {
+    // dequantize all slots at once instead of slot by slot
+    const auto ids = torch::tensor(slot_ids, torch::kLong);
+    const auto block_ids =
+        torch::div(ids, block_size_, /*rounding_mode=*/"floor");
+    return std::make_tuple(
+        dequantize(key_cache_, key_scales_, ids, block_ids),
+        dequantize(value_cache_, value_scales_, ids, block_ids));
+  }
+
+  // [num_blocks * block_size, num_kv_heads, head_dim]
+  const auto key_slots = key_cache_.view({-1, num_kv_heads_, head_size_});
+  const auto value_slots = value_cache_.view({-1, num_kv_heads_, head_size_});
+
+  // copy runs of consecutive slots in one go, a sequence with contiguous
+  // blocks is read as a few long runs instead of slot by slot.
   std::vector<torch::Tensor> keys;
-  keys.reserve(slot_ids.size());
   std::vector<torch::Tensor> values;
-  values.reserve(slot_ids.size());
-
-  for (int slot_id : slot_ids) {
-    const int64_t block_id = slot_id / block_size_;
-    const int64_t block_offset = slot_id % block_size_;
-    // key = key_cache_[block_id, block_offset, :, :]
-    const auto key =
-        key_cache_.index({block_id, block_offset, ISlice(), ISlice()});
-    keys.push_back(key.reshape({num_kv_heads_, head_size_}));
-    // value = value_cache_[block_id, block_offset, :, :]
-    const auto value =
-        value_cache_.index({block_id, block_offset, ISlice(), ISlice()});
-    values.push_back(value);
+  size_t start = 0;
+  while (start < slot_ids.size()) {
+    size_t end = start + 1;
+    while (end < slot_ids.size() && slot_ids[end] == slot_ids[end - 1] + 1) {
+      ++end;
+    }
+    const int64_t first_slot = slot_ids[start];
+    const int64_t last_slot = first_slot + static_cast<int64_t>(end - start);
+    keys.push_back(key_slots.slice(/*dim=*/0, first_slot, last_slot));
+    values.push_back(value_slots.slice(/*dim=*/0, first_slot, last_slot));
+    start = end;
   }
-  return std::make_tuple(torch::stack(keys), torch::stack(values));
+  return std::make_tuple(torch::cat(keys), torch::cat(values));
 }
 
 std::tuple<torch::Tensor, torch::Tensor> KVCache::get_kv_cache(
@@ -129,30 +292,19 @@ std::tuple<torch::Tensor, torch::Tensor> KVCache::get_kv_cache(
   const torch::Tensor block_tables_cpu = block_tables.cpu();
   const torch::Tensor kv_cu_seq_lens_cpu = kv_cu_seq_lens.cpu();
 
-  std::vector<torch::Tensor> keys;
-  keys.reserve(n_seqs);
-  std::vector<torch::Tensor> values;
-  values.reserve(n_seqs);
-
+  std::vector<int32_t> slot_ids;
   const int32_t* kv_cu_lens = kv_cu_seq_lens_cpu.data_ptr<int32_t>();
+  slot_ids.reserve(kv_cu_lens[n_seqs]);
   for (int64_t i = 0; i < n_seqs; ++i) {
     const int32_t seq_len = kv_cu_lens[i + 1] - kv_cu_lens[i];
     const int32_t* block_ids = block_tables_cpu[i].data_ptr<int32_t>();
     for (int64_t j = 0; j < seq_len; ++j) {
-      const int64_t block_id = block_ids[j / block_size_];
-      const int64_t block_offset = j % block_size_;
-
-      // key = key_cache_[block_id, block_offset, :, :]
-      const auto key =
-          key_cache_.index({block_id, block_offset, ISlice(), ISlice()});
-      keys.push_back(key.reshape({num_kv_heads_, head_size_}));
-      // value = value_cache_[block_id, block_offset, :, :]
-      const auto value =
-          value_cache_.index({block_id, block_offset, ISlice(), ISlice()});
-      values.push_back(value);
+      const int32_t block_id = block_ids[j / block_size_];
+      const int32_t block_offset = j % block_size_;
+      slot_ids.push_back(block_id * block_size_ + block_offset);
     }
   }
-  return std::make_tuple(torch::stack(keys), torch::stack(values));
+  return get_kv_cache(slot_ids);
 }
 
 }  // namespace llm
@@ -15,11 +15,21 @@ class KVCache final {
   // TODO: pass in kv_shape and options instead
   KVCache(torch::Tensor key_cache, torch::Tensor value_cache);
 
+  // int8 quantized kv cache with a scale for each head in each block
+  // key_scales/value_scales: [num_blocks, num_heads] FloatTensor
+  KVCache(torch::Tensor key_cache,
+          torch::Tensor value_cache,
+          torch::Tensor key_scales,
+          torch::Tensor value_scales);
+
   // check if the key and value cache is empty
   bool empty() const {
     return !key_cache_.defined() || !value_cache_.defined();
   }
 
+  // check if the key and value cache is quantized into int8
+  bool quantized() const { return key_scales_.defined(); }
+
   // get key and value cache tensors
   std::tuple<torch::Tensor, torch::Tensor> get_kv_cache() const {
     return {key_cache_, value_cache_};
@@ -41,6 +51,13 @@ class KVCache final {
       const torch::Tensor& block_table,
       int64_t context_len) const;
 
+  // copy blocks from the src cache into this cache, the two caches may live
+  // on different devices, for example, swapping between gpu and host memory.
+  // src_block_ids/dst_block_ids: [num_blocks] IntTensor
+  void copy_blocks_from(const KVCache& src,
+                        const torch::Tensor& src_block_ids,
+                        const torch::Tensor& dst_block_ids);
+
   // put following functions as public for testing/benchmarking
   void set_kv_cache_slow(const torch::Tensor& slot_ids,
                          const torch::Tensor& keys,
@@ -62,6 +79,11 @@ class KVCache final {
   std::tuple<torch::Tensor, torch::Tensor> get_kv_cache(
       const std::vector<int>& slot_ids) const;
 
+  // quantize keys/values into int8 and write them into the cache
+  void set_kv_cache_quantized(const torch::Tensor& slot_ids,
+                              const torch::Tensor& keys,
+                              const torch::Tensor& values);
+
   int64_t num_kv_heads_ = 0;
   int64_t head_size_ = 0;
   int64_t block_size_ = 0;
@@ -73,6 +95,12 @@ class KVCache final {
   torch::Tensor key_cache_;
   // [num_blocks, block_size, num_heads, head_dim]
   torch::Tensor value_cache_;
+
+  // scales to dequantize the int8 cache, undefined if not quantized
+  // [num_blocks, num_heads]
+  torch::Tensor key_scales_;
+  // [num_blocks, num_heads]
+  torch::Tensor value_scales_;
 };
 
 }  // namespace llm
@@ -102,4 +102,72 @@ TEST(KVCacheTest, Random) {
   }
 }
 
+TEST(KVCacheTest, Int8) {
+  const int num_kv_heads = 4;
+  const int head_dim = 64;
+  const int block_size = 8;
+  const int num_blocks = 6;
+  const int num_slots = num_blocks * block_size;
+
+  torch::manual_seed(10);
+  const auto options = torch::dtype(torch::kChar);
+  const auto scales_options = torch::dtype(torch::kFloat);
+  KVCache kv_cache(
+      torch::empty({num_blocks, block_size, num_kv_heads, head_dim}, options),
+      torch::empty({num_blocks, block_size, num_kv_heads, head_dim}, options),
+      torch::zeros({num_blocks, num_kv_heads}, scales_options),
+      torch::zeros({num_blocks, num_kv_heads}, scales_options));
+  EXPECT_TRUE(kv_cache.quantized());
+
+  // values grow within each block to requantize the earlier tokens
+  const auto growth =
+      torch::arange(1, num_slots + 1, scales_options).view({-1, 1, 1}) /
+      num_slots;
+  torch::Tensor keys =
+      torch::randn({num_slots, num_kv_heads, head_dim}, scales_options) *
+      growth;
+  torch::Tensor values =
+      torch::randn({num_slots, num_kv_heads, head_dim}, scales_options);
+  // write the tokens one by one in the order of a sequence
+  for (int32_t i = 0; i < num_slots; ++i) {
+    using ISlice = torch::indexing::Slice;
+    torch::Tensor slot_ids = torch::tensor({i}, torch::kInt);
+    kv_cache.set_kv_cache(slot_ids,
+                          keys.index({ISlice(i, i + 1)}),
+                          values.index({ISlice(i, i + 1)}));
+  }
+
+  // blocks are in reverse order in the block table
+  const auto block_table =
+      torch::arange(num_blocks - 1, -1, -1, torch::kInt).view({1, -1});
+  const auto cu_seq_lens = torch::tensor({0, num_slots}, torch::kInt);
+  auto [keys_out, values_out] = kv_cache.get_kv_cache(block_table, cu_seq_lens);
+  const auto slot_ids = torch::arange(num_slots, torch::kLong)
+                            .view({num_blocks, block_size})
+                            .flip(0)
+                            .flatten();
+  const auto desired_keys = keys.index_select(0, slot_ids);
+  const auto desired_values = values.index_select(0, slot_ids);
+  EXPECT_EQ(keys_out.scalar_type(), torch::kFloat);
+  EXPECT_EQ(keys_out.sizes(), desired_keys.sizes());
+  // rounding errs by half a step of the block scale, requantizing the earlier
+  // tokens of a block to a grown scale adds up to another step.
+  const double key_step = 2 * keys.abs().max().item<double>() / 127;
+  const double value_step = 2 * values.abs().max().item<double>() / 127;
+  EXPECT_TRUE(torch::allclose(keys_out, desired_keys, 0, key_step));
+  EXPECT_TRUE(torch::allclose(values_out, desired_values, 0, value_step));
+
+  // copy blocks together with their scales
+  KVCache dst(
+      torch::zeros({num_blocks, block_size, num_kv_heads, head_dim}, options),
+      torch::zeros({num_blocks, block_size, num_kv_heads, head_dim}, options),
+      torch::zeros({num_blocks, num_kv_heads}, scales_options),
+      torch::zeros({num_blocks, num_kv_heads}, scales_options));
+  const auto block_ids = torch::arange(num_blocks, torch::kInt);
+  dst.copy_blocks_from(kv_cache, block_ids, block_ids);
+  auto [dst_keys, dst_values] = dst.get_kv_cache(block_table, cu_seq_lens);
+  EXPECT_TRUE(torch::equal(dst_keys, keys_out));
+  EXPECT_TRUE(torch::equal(dst_values, values_out));
+}
+
 }  // namespace llm
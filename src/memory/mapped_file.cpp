@@ -0,0 +1,47 @@
+#include "mapped_file.h"
+
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <string>
+
+namespace llm {
+
+std::shared_ptr<MappedFile> MappedFile::open(const std::string& path,
+                                             size_t size) {
+  CHECK(size > 0) << "Mapped file should not be empty";
+  const int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    LOG(ERROR) << "Failed to open " << path << ": " << std::strerror(errno);
+    return nullptr;
+  }
+  // keeps the content if the size is unchanged
+  if (::ftruncate(fd, static_cast<off_t>(size)) != 0) {
+    LOG(ERROR) << "Failed to resize " << path << ": " << std::strerror(errno);
+    ::close(fd);
+    return nullptr;
+  }
+  void* data =
+      ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  // the mapping holds its own reference to the file
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    LOG(ERROR) << "Failed to map " << path << ": " << std::strerror(errno);
+    return nullptr;
+  }
+  return std::shared_ptr<MappedFile>(
+      new MappedFile(static_cast<char*>(data), size));
+}
+
+MappedFile::~MappedFile() {
+  if (data_ != nullptr) {
+    ::munmap(data_, size_);
+  }
+}
+
+}  // namespace llm
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+namespace llm {
+
+// A file shared mapped into memory. pages are loaded and written back by the
+// kernel on demand, so the mapping can be larger than the free host memory
+// and the content is kept in the file across restarts.
+class MappedFile final {
+ public:
+  // open or create the file, resize it to size bytes and map it into memory.
+  // returns nullptr on failure.
+  static std::shared_ptr<MappedFile> open(const std::string& path,
+                                          size_t size);
+
+  ~MappedFile();
+
+  // disable copy, move and assign
+  MappedFile(const MappedFile&) = delete;
+  MappedFile(MappedFile&&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  MappedFile& operator=(MappedFile&&) = delete;
+
+  char* data() const { return data_; }
+
+  size_t size() const { return size_; }
+
+ private:
+  MappedFile(char* data, size_t size) : data_(data), size_(size) {}
+
+  char* data_ = nullptr;
+
+  size_t size_ = 0;
+};
+
+}  // namespace llm
@@ -0,0 +1,33 @@
+#include "mapped_file.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+namespace llm {
+
+TEST(MappedFileTest, KeepsContent) {
+  const std::string path = ::testing::TempDir() + "mapped_file_test";
+  std::remove(path.c_str());
+  {
+    auto file = MappedFile::open(path, /*size=*/4096);
+    ASSERT_NE(file, nullptr);
+    EXPECT_EQ(file->size(), 4096);
+    // a new file is zero filled
+    EXPECT_EQ(file->data()[4095], 0);
+    std::memcpy(file->data() + 100, "kv cache", 8);
+  }
+
+  // reopen with the same size
+  auto file = MappedFile::open(path, /*size=*/4096);
+  ASSERT_NE(file, nullptr);
+  EXPECT_EQ(std::memcmp(file->data() + 100, "kv cache", 8), 0);
+  file.reset();
+
+  EXPECT_EQ(MappedFile::open("/nonexistent/mapped_file_test", 4096), nullptr);
+  std::remove(path.c_str());
+}
+
+}  // namespace llm
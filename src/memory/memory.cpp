@@ -4,6 +4,8 @@
 #include <glog/logging.h>
 #include <torch/torch.h>
 
+#include "host_memory.h"
+
 namespace llm::memory {
 
 // returns the maximum memory allocated in bytes on the device
@@ -23,9 +25,11 @@ int64_t max_memory_allocated(const torch::Device& device) {
 }
 
 // returns the total memory in bytes of the device.
-// Only support CUDA device for now.
 int64_t total_memory(const torch::Device& device) {
-  CHECK(device.is_cuda()) << "Only support CUDA device for now.";
+  if (device.is_cpu()) {
+    return host_total_memory();
+  }
+  CHECK(device.is_cuda()) << "Only support CPU and CUDA device for now.";
 
   const auto device_index =
       device.has_index() ? device.index() : c10::cuda::current_device();
@@ -37,7 +41,10 @@ int64_t total_memory(const torch::Device& device) {
 }
 
 int64_t available_memory(const torch::Device& device) {
-  CHECK(device.is_cuda()) << "Only support CUDA device for now.";
+  if (device.is_cpu()) {
+    return host_available_memory();
+  }
+  CHECK(device.is_cuda()) << "Only support CPU and CUDA device for now.";
   const auto device_index =
       device.has_index() ? device.index() : c10::cuda::current_device();
   CHECK(cudaSetDevice(device_index) == cudaSuccess)
@@ -9,11 +9,12 @@ namespace llm::memory {
 // Only support CUDA device for now.
 int64_t max_memory_allocated(const torch::Device& device);
 
-// returns the total memory in bytes of the device.
-// Only support CUDA device for now.
+// returns the total memory in bytes of the device, for cpu it is capped by
+// the cgroup memory limit.
 int64_t total_memory(const torch::Device& device);
 
-// returns the available memory in bytes of the device.
+// returns the available memory in bytes of the device, for cpu it is capped
+// by the memory left under the cgroup memory limit.
 int64_t available_memory(const torch::Device& device);
 
 } // namespace llm::memory
@@ -0,0 +1,179 @@
+#include "numa.h"
+
+#include <glog/logging.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "host_memory.h"
+
+namespace llm::memory {
+namespace {
+// from linux/mempolicy.h, not every toolchain ships numaif.h
+constexpr int kMpolPreferred = 1;
+constexpr int kMpolBind = 2;
+constexpr unsigned kMpolMfMove = 1 << 1;
+
+constexpr size_t kBitsPerMask = sizeof(unsigned long) * 8;
+
+std::string node_dir(int node) {
+  return "/sys/devices/system/node/node" + std::to_string(node);
+}
+
+std::string read_file(const std::string& path) {
+  std::ifstream file(path);
+  if (!file.is_open()) {
+    return "";
+  }
+  std::stringstream buffer;
+  buffer << file.rdbuf();
+  return buffer.str();
+}
+
+// returns the field in the meminfo of the numa node in bytes, -1 if unknown
+int64_t numa_node_memory_field(int node, const std::string& name) {
+  if (node < 0) {
+    return -1;
+  }
+  // i.e. "Node 0 MemTotal:       16318412 kB"
+  return parse_memory_field(
+      read_file(node_dir(node) + "/meminfo"),
+      "Node " + std::to_string(node) + " " + name + ":");
+}
+
+// the node mask with only the node set, the kernel reads maxnode - 1 bits
+std::vector<unsigned long> node_mask_of(int node) {
+  std::vector<unsigned long> mask(node / kBitsPerMask + 1, 0);
+  mask[node / kBitsPerMask] = 1UL << (node % kBitsPerMask);
+  return mask;
+}
+
+}  // namespace
+
+std::vector<int> parse_cpu_list(const std::string& cpu_list) {
+  std::vector<int> ids;
+  std::istringstream ranges(cpu_list);
+  std::string range;
+  while (std::getline(ranges, range, ',')) {
+    // strip the trailing newline of sysfs files
+    range.erase(std::remove_if(range.begin(), range.end(), ::isspace),
+                range.end());
+    if (range.empty()) {
+      continue;
+    }
+    char* end = nullptr;
+    const long first = std::strtol(range.c_str(), &end, /*base=*/10);
+    long last = first;
+    if (end == range.c_str() || first < 0) {
+      return {};
+    }
+    if (*end == '-') {
+      const char* start = end + 1;
+      last = std::strtol(start, &end, /*base=*/10);
+      if (end == start || last < first) {
+        return {};
+      }
+    }
+    if (*end != '\0') {
+      return {};
+    }
+    for (long id = first; id <= last; ++id) {
+      ids.push_back(static_cast<int>(id));
+    }
+  }
+  return ids;
+}
+
+int num_numa_nodes() {
+  const auto nodes =
+      parse_cpu_list(read_file("/sys/devices/system/node/online"));
+  return nodes.empty() ? 0 : nodes.back() + 1;
+}
+
+std::vector<int> numa_node_cpus(int node) {
+  if (node < 0) {
+    return {};
+  }
+  return parse_cpu_list(read_file(node_dir(node) + "/cpulist"));
+}
+
+int64_t numa_node_total_memory(int node) {
+  return numa_node_memory_field(node, "MemTotal");
+}
+
+int64_t numa_node_free_memory(int node) {
+  return numa_node_memory_field(node, "MemFree");
+}
+
+bool bind_thread_to_numa_node(int node) {
+  const auto cpus = numa_node_cpus(node);
+  if (cpus.empty()) {
+    LOG(ERROR) << "No cpus found for numa node " << node;
+    return false;
+  }
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  for (const int cpu : cpus) {
+    CPU_SET(cpu, &cpu_set);
+  }
+  if (::pthread_setaffinity_np(::pthread_self(), sizeof(cpu_set), &cpu_set) !=
+      0) {
+    LOG(ERROR) << "Failed to bind thread to cpus of numa node " << node;
+    return false;
+  }
+
+  const auto mask = node_mask_of(node);
+  if (::syscall(SYS_set_mempolicy,
+                kMpolPreferred,
+                mask.data(),
+                mask.size() * kBitsPerMask + 1) != 0) {
+    const int error = errno;
+    LOG(ERROR) << "Failed to set memory policy for numa node " << node << ": "
+               << std::strerror(error);
+    errno = error;
+    return false;
+  }
+  return true;
+}
+
+bool bind_memory_to_numa_node(void* data, size_t size, int node) {
+  CHECK(node >= 0) << "Invalid numa node " << node;
+  const auto page_size = static_cast<uintptr_t>(::sysconf(_SC_PAGESIZE));
+  const auto begin = reinterpret_cast<uintptr_t>(data);
+  const uintptr_t first_page = (begin + page_size - 1) / page_size * page_size;
+  const uintptr_t last_page = (begin + size) / page_size * page_size;
+  if (first_page >= last_page) {
+    // nothing to bind in a range smaller than a page
+    return true;
+  }
+
+  const auto mask = node_mask_of(node);
+  // NOLINTNEXTLINE(performance-no-int-to-ptr)
+  if (::syscall(SYS_mbind,
+                reinterpret_cast<void*>(first_page),
+                last_page - first_page,
+                kMpolBind,
+                mask.data(),
+                mask.size() * kBitsPerMask + 1,
+                kMpolMfMove) != 0) {
+    const int error = errno;
+    LOG(ERROR) << "Failed to bind memory to numa node " << node << ": "
+               << std::strerror(error);
+    errno = error;
+    return false;
+  }
+  return true;
+}
+
+}  // namespace llm::memory
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace llm::memory {
+
+// returns the ids in a sysfs list like "0-3,8,10-11", or empty if malformed
+std::vector<int> parse_cpu_list(const std::string& cpu_list);
+
+// returns the number of numa nodes, 0 if unknown
+int num_numa_nodes();
+
+// returns the cpus of the numa node, empty if the node doesn't exist
+std::vector<int> numa_node_cpus(int node);
+
+// returns the total memory of the numa node in bytes, -1 if unknown
+int64_t numa_node_total_memory(int node);
+
+// returns the free memory of the numa node in bytes, -1 if unknown
+int64_t numa_node_free_memory(int node);
+
+// binds the calling thread to the cpus of the numa node and prefers the node
+// for its memory allocations. threads created by it later, i.e. the intra-op
+// threads of torch, inherit both. returns false and sets errno on failure.
+bool bind_thread_to_numa_node(int node);
+
+// binds the memory in [data, data + size) to the numa node, pages already
+// touched are moved and later page faults are served from the node. only the
+// pages entirely inside the range are bound. returns false and sets errno on
+// failure, i.e. EPERM where seccomp denies mbind in containers.
+bool bind_memory_to_numa_node(void* data, size_t size, int node);
+
+}  // namespace llm::memory
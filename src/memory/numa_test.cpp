@@ -0,0 +1,44 @@
+#include "numa.h"
+
+#include <gtest/gtest.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <vector>
+
+namespace llm::memory {
+
+TEST(NumaTest, ParseCpuList) {
+  EXPECT_EQ(parse_cpu_list("0\n"), std::vector<int>({0}));
+  EXPECT_EQ(parse_cpu_list("0-3,8,10-11\n"),
+            std::vector<int>({0, 1, 2, 3, 8, 10, 11}));
+  EXPECT_TRUE(parse_cpu_list("").empty());
+  // malformed lists
+  EXPECT_TRUE(parse_cpu_list("3-1").empty());
+  EXPECT_TRUE(parse_cpu_list("0-").empty());
+  EXPECT_TRUE(parse_cpu_list("a,1").empty());
+}
+
+TEST(NumaTest, BindToNode) {
+  if (num_numa_nodes() == 0) {
+    GTEST_SKIP() << "no numa information";
+  }
+  EXPECT_FALSE(numa_node_cpus(0).empty());
+  EXPECT_GT(numa_node_total_memory(0), 0);
+  EXPECT_GE(numa_node_free_memory(0), 0);
+  EXPECT_TRUE(numa_node_cpus(num_numa_nodes()).empty());
+
+  const size_t size = 4 * 1024 * 1024;
+  void* data = std::malloc(size);
+  ASSERT_NE(data, nullptr);
+  if (!bind_memory_to_numa_node(data, size, /*node=*/0) && errno == EPERM) {
+    std::free(data);
+    GTEST_SKIP() << "mbind is not permitted, i.e. by the container seccomp";
+  }
+  EXPECT_TRUE(bind_memory_to_numa_node(data, size, /*node=*/0));
+  // ranges within a page are left alone
+  EXPECT_TRUE(bind_memory_to_numa_node(data, /*size=*/16, /*node=*/0));
+  std::free(data);
+}
+
+}  // namespace llm::memory
@@ -1,10 +1,15 @@
 #include "prefix_cache.h"
 
-#include <absl/time/clock.h>
 #include <absl/time/time.h>
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <cstdint>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <tuple>
+#include <unordered_set>
 #include <vector>
 
 #include "common/slice.h"
@@ -27,10 +32,65 @@ size_t round_down(size_t n, size_t multiple) {
   return (n / multiple) * multiple;
 }
 
+// chain the hash of previous blocks with the tokens of the next block. stable
+// across processes: fnv-1a over tokens followed by the murmur3 finalizer.
+// the offset basis keeps a block of zero tokens from hashing to its parent's
+// hash, both fnv and the finalizer map zero to zero.
+uint64_t hash_block(uint64_t hash, const Slice<int32_t>& tokens) {
+  hash ^= 0xcbf29ce484222325ULL;
+  for (const int32_t token : tokens) {
+    hash = (hash ^ static_cast<uint32_t>(token)) * 0x100000001b3ULL;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb1fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+// version the host tier index, bump on any layout change
+constexpr uint64_t kHostTierMagic = 0x746569742d6d6c6cULL;
+constexpr uint32_t kHostTierVersion = 1;
+
+template <typename T>
+void write_value(std::ostream& os, const T& value) {
+  os.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+void write_values(std::ostream& os, const std::vector<T>& values) {
+  os.write(reinterpret_cast<const char*>(values.data()),
+           static_cast<std::streamsize>(values.size() * sizeof(T)));
+}
+
+template <typename T>
+bool read_value(std::istream& is, T* value) {
+  return static_cast<bool>(
+      is.read(reinterpret_cast<char*>(value), sizeof(T)));
+}
+
+template <typename T>
+bool read_values(std::istream& is, size_t n, std::vector<T>* values) {
+  values->resize(n);
+  return static_cast<bool>(
+      is.read(reinterpret_cast<char*>(values->data()),
+              static_cast<std::streamsize>(n * sizeof(T))));
+}
+
 }  // namespace
 
-PrefixCache::PrefixCache(uint32_t block_size) : block_size_(block_size) {
+PrefixCache::PrefixCache(uint32_t block_size)
+    : PrefixCache(block_size, std::make_unique<LRUEvictionPolicy>()) {}
+
+PrefixCache::PrefixCache(uint32_t block_size,
+                         std::unique_ptr<EvictionPolicy> policy,
+                         const Clock* clock)
+    : block_size_(block_size),
+      policy_(std::move(policy)),
+      clock_(clock != nullptr ? clock : SystemClock::instance()) {
   CHECK(block_size_ > 0) << "Block size should be greater than 0";
+  CHECK(policy_ != nullptr) << "Eviction policy should not be null";
 
   // initialize the lru list
   lru_front_.next = &lru_back_;
@@ -50,62 +110,128 @@ PrefixCache::~PrefixCache() {
   CHECK(num_nodes_ == num_nodes) << "detected memory leak";
 }
 
+void PrefixCache::enable_host_tier(BlockAllocator* device_allocator,
+                                   BlockAllocator* host_allocator,
+                                   std::vector<BlockSwap>* block_swaps) {
+  CHECK(device_allocator != nullptr && host_allocator != nullptr &&
+        block_swaps != nullptr);
+  CHECK(num_nodes_ == 0) << "Host tier should be enabled on an empty cache";
+  device_allocator_ = device_allocator;
+  host_allocator_ = host_allocator;
+  block_swaps_ = block_swaps;
+}
+
 // match the token ids with the prefix tree
 // return matched blocks
-std::vector<Block> PrefixCache::match(const Slice<int32_t>& token_ids) {
-  const int64_t now = absl::ToUnixMicros(absl::Now());
+std::vector<Block> PrefixCache::match(const Slice<int32_t>& token_ids,
+                                      size_t num_kept_blocks) {
+  const int64_t now = absl::ToUnixMicros(clock_->now());
   std::vector<Block> blocks;
 
   // allign tokens to block boundary
   const size_t n_tokens = round_down(token_ids.size(), block_size_);
   auto tokens_slice = token_ids.slice(0, n_tokens);
 
-  size_t matched_tokens = 0;
   // start from the root node
   Node* next_node = &root_;
   while (next_node != nullptr && !tokens_slice.empty()) {
-    Node* curr = next_node;
+    Node* child = find_child(next_node, tokens_slice);
     next_node = nullptr;
+    if (child == nullptr) {
+      break;
+    }
+    // truncate the prefix length at block boundary, at least one block
+    const size_t prefix_length = round_down(
+        common_prefix_length(tokens_slice, child->token_ids), block_size_);
 
-    // match with children
-    for (Node* child : curr->children) {
-      size_t prefix_length =
-          common_prefix_length(tokens_slice, child->token_ids);
-      // truncate the prefix length at block boundary
-      prefix_length = round_down(prefix_length, block_size_);
-
-      // find a match
-      if (prefix_length > 0) {
-        // update the last access time and move the node to the back of the LRU
-        child->last_access_time = now;
-        move_node_to_lru_back(child);
-
-        matched_tokens += prefix_length;
-
-        // append the blocks to the result
-        const size_t n_blocks = prefix_length / block_size_;
-        blocks.insert(blocks.end(),
-                      child->blocks.begin(),
-                      child->blocks.begin() + n_blocks);
-        tokens_slice = tokens_slice.slice(prefix_length);
-
-        if (prefix_length == child->token_ids.size()) {
-          // full match, continue to grand children
-          next_node = child;
-        }
+    // update the access statistics and move the node to the back of the LRU
+    touch_node(child, now, /*hit=*/true);
+
+    if (child->on_host) {
+      // only bring back the matched blocks
+      if (prefix_length < child->token_ids.size()) {
+        split_node(child, prefix_length);
+      }
+      if (!restore_node(child, num_kept_blocks)) {
         break;
       }
     }
+
+    // append the blocks to the result
+    const size_t n_blocks = prefix_length / block_size_;
+    blocks.insert(
+        blocks.end(), child->blocks.begin(), child->blocks.begin() + n_blocks);
+    tokens_slice = tokens_slice.slice(prefix_length);
+
+    if (prefix_length == child->token_ids.size()) {
+      // full match, continue to grand children
+      next_node = child;
+    }
   }
 
   return blocks;
 }
 
+size_t PrefixCache::num_matched_tokens(const Slice<int32_t>& token_ids) const {
+  // allign tokens to block boundary
+  const size_t n_tokens = round_down(token_ids.size(), block_size_);
+  auto tokens_slice = token_ids.slice(0, n_tokens);
+
+  size_t matched_tokens = 0;
+  const Node* next_node = &root_;
+  while (next_node != nullptr && !tokens_slice.empty()) {
+    const Node* child = find_child(next_node, tokens_slice);
+    next_node = nullptr;
+    if (child == nullptr) {
+      break;
+    }
+    // truncate the prefix length at block boundary
+    const size_t prefix_length = round_down(
+        common_prefix_length(tokens_slice, child->token_ids), block_size_);
+    matched_tokens += prefix_length;
+    tokens_slice = tokens_slice.slice(prefix_length);
+    if (prefix_length == child->token_ids.size()) {
+      // full match, continue to grand children
+      next_node = child;
+    }
+  }
+  return matched_tokens;
+}
+
+std::vector<Block> PrefixCache::matched_blocks(
+    const Slice<int32_t>& token_ids) const {
+  // allign tokens to block boundary
+  const size_t n_tokens = round_down(token_ids.size(), block_size_);
+  auto tokens_slice = token_ids.slice(0, n_tokens);
+
+  std::vector<Block> blocks;
+  const Node* next_node = &root_;
+  while (next_node != nullptr && !tokens_slice.empty()) {
+    const Node* child = find_child(next_node, tokens_slice);
+    next_node = nullptr;
+    if (child == nullptr || child->on_host) {
+      break;
+    }
+    // truncate the prefix length at block boundary
+    const size_t prefix_length = round_down(
+        common_prefix_length(tokens_slice, child->token_ids), block_size_);
+    const size_t n_blocks = prefix_length / block_size_;
+    blocks.insert(
+        blocks.end(), child->blocks.begin(), child->blocks.begin() + n_blocks);
+    tokens_slice = tokens_slice.slice(prefix_length);
+    if (prefix_length == child->token_ids.size()) {
+      // full match, continue to grand children
+      next_node = child;
+    }
+  }
+  return blocks;
+}
+
 // insert the token ids and blocks into the prefix tree
 // return the length of new inserted tokens
 size_t PrefixCache::insert(const Slice<int32_t>& token_ids,
                            const Slice<Block>& blocks) {
-  const int64_t now = absl::ToUnixMicros(absl::Now());
+  const int64_t now = absl::ToUnixMicros(clock_->now());
   // allign tokens to block boundary
   const size_t n_blocks =
       std::min(token_ids.size() / block_size_, blocks.size());
@@ -120,42 +246,43 @@ size_t PrefixCache::insert(const Slice<int32_t>& token_ids,
   Node* next_node = &root_;
   while (next_node != nullptr && !tokens_slice.empty()) {
     Node* curr = next_node;
-    next_node = nullptr;
+    next_node = find_child(curr, tokens_slice);
 
-    // match with children
-    for (Node* child : curr->children) {
-      size_t prefix_length =
-          common_prefix_length(tokens_slice, child->token_ids);
-      // we only cache a whole block, truncate the prefix length
-      prefix_length = round_down(prefix_length, block_size_);
-
-      // find a match
-      if (prefix_length > 0) {
-        // update the last access time and move the node to the back of the LRU
-        child->last_access_time = now;
-        move_node_to_lru_back(child);
-
-        CHECK(prefix_length % block_size_ == 0)
-            << "The prefix length should be multiple of block size";
-        const size_t n_blocks = prefix_length / block_size_;
-        // advance the token and block slices
-        tokens_slice = tokens_slice.slice(prefix_length);
-        blocks_slice = blocks_slice.slice(n_blocks);
-
-        if (prefix_length < child->token_ids.size()) {
-          // partial match, split the child node on the common prefix
-          split_node(child, prefix_length);
-        }
-        next_node = child;
-        break;
+    // no child match, create a new child node
+    if (next_node == nullptr) {
+      if (create_child(curr, tokens_slice, blocks_slice, now) != nullptr) {
+        new_inserted_tokens += tokens_slice.size();
       }
+      break;
     }
 
-    // no child match, create a new child node
-    if (next_node == nullptr) {
-      create_child(curr, tokens_slice, blocks_slice, now);
-      new_inserted_tokens += tokens_slice.size();
+    Node* child = next_node;
+    // we only cache a whole block, truncate the prefix length
+    const size_t prefix_length = round_down(
+        common_prefix_length(tokens_slice, child->token_ids), block_size_);
+
+    // update the access time and move the node to the back of the LRU
+    touch_node(child, now, /*hit=*/false);
+
+    const size_t n_blocks = prefix_length / block_size_;
+    if (prefix_length < child->token_ids.size()) {
+      // partial match, split the child node on the common prefix
+      split_node(child, prefix_length);
+    }
+
+    if (child->on_host) {
+      // the sequence has the same kv cache in device blocks, take them over
+      child->blocks = blocks_slice.slice(0, n_blocks).to_vector();
+      child->on_host = false;
+      num_host_blocks_ -= n_blocks;
+      num_blocks_ += n_blocks;
+      rank_node(child);
+      rank_node(curr);
     }
+
+    // advance the token and block slices
+    tokens_slice = tokens_slice.slice(prefix_length);
+    blocks_slice = blocks_slice.slice(n_blocks);
   }
   return new_inserted_tokens;
 }
@@ -180,42 +307,39 @@ size_t PrefixCache::evict_helper(size_t n_blocks_to_evict) {
   size_t total_evicted = 0;
   // evict nodes at the end to avoid invaliding iterator
   std::vector<Node*> nodes_to_evict;
-  int64_t pre_access_time = 0;
-  for (Node* node = lru_front_.next;
-       total_evicted < n_blocks_to_evict && node != &lru_back_;
-       node = node->next) {
-    CHECK(pre_access_time <= node->last_access_time)
-        << "The last access time should be in ascending order";
-    pre_access_time = node->last_access_time;
-
-    // skip non-leaf nodes
-    if (!node->children.empty()) {
-      continue;
+  // spill nodes at the end as well, making room in the host tier drops nodes
+  std::vector<Node*> nodes_to_spill;
+  if (policy_->is_lru()) {
+    int64_t pre_access_time = 0;
+    for (Node* node = lru_front_.next;
+         total_evicted < n_blocks_to_evict && node != &lru_back_;
+         node = node->next) {
+      CHECK(pre_access_time <= node->last_access_time)
+          << "The last access time should be in ascending order";
+      pre_access_time = node->last_access_time;
+      total_evicted += evict_node(node,
+                                  n_blocks_to_evict - total_evicted,
+                                  &nodes_to_evict,
+                                  &nodes_to_spill);
     }
-
-    // find first non-shared block to evict
-    const auto& blocks = node->blocks;
-    const size_t n_blocks = blocks.size();
-    size_t non_shared_start = 0;
-    for (; non_shared_start < n_blocks; ++non_shared_start) {
-      if (!blocks[non_shared_start].is_shared()) {
-        break;
+  } else {
+    // nodes are only re-ranked after the scan
+    Node* partially_evicted = nullptr;
+    for (auto it = ranked_device_nodes_.begin();
+         total_evicted < n_blocks_to_evict && it != ranked_device_nodes_.end();
+         ++it) {
+      Node* node = std::get<Node*>(*it);
+      const size_t n_blocks = node->blocks.size();
+      total_evicted += evict_node(node,
+                                  n_blocks_to_evict - total_evicted,
+                                  &nodes_to_evict,
+                                  &nodes_to_spill);
+      if (node->blocks.size() < n_blocks) {
+        partially_evicted = node;
       }
     }
-
-    // try to only evict minimal number of blocks
-    const size_t n_to_evict = std::min(n_blocks_to_evict - total_evicted,
-                                       n_blocks - non_shared_start);
-    total_evicted += n_to_evict;
-    if (n_to_evict == n_blocks) {
-      // mark the node as to be evicted
-      nodes_to_evict.push_back(node);
-    } else if (n_to_evict > 0) {
-      // partially evict non-shared blocks
-      const size_t n_blocks_left = n_blocks - n_to_evict;
-      DCHECK(n_blocks_left >= non_shared_start);
-      node->token_ids.resize(n_blocks_left * block_size_);
-      node->blocks.resize(n_blocks_left);
+    if (partially_evicted != nullptr) {
+      rank_node(partially_evicted);
     }
   }
 
@@ -223,12 +347,345 @@ size_t PrefixCache::evict_helper(size_t n_blocks_to_evict) {
   for (Node* node : nodes_to_evict) {
     release_node(node);
   }
+  for (Node* node : nodes_to_spill) {
+    if (!spill_node(node)) {
+      // no room in the host tier, drop the node with its spilled children
+      release_subtree(node);
+    }
+  }
 
   // update the number of blocks
   num_blocks_ -= total_evicted;
   return total_evicted;
 }
 
+size_t PrefixCache::evict_node(Node* node,
+                               size_t n_blocks_to_evict,
+                               std::vector<Node*>* nodes_to_evict,
+                               std::vector<Node*>* nodes_to_spill) {
+  // skip spilled nodes and nodes with children in device memory
+  if (node->on_host || has_device_child(node)) {
+    return 0;
+  }
+
+  // find first non-shared block to evict
+  const auto& blocks = node->blocks;
+  const size_t n_blocks = blocks.size();
+  size_t non_shared_start = 0;
+  for (; non_shared_start < n_blocks; ++non_shared_start) {
+    if (!blocks[non_shared_start].is_shared()) {
+      break;
+    }
+  }
+
+  // spill the whole node into host blocks if none of them is shared
+  if (host_allocator_ != nullptr && non_shared_start == 0) {
+    nodes_to_spill->push_back(node);
+    return n_blocks;
+  }
+
+  // spilled children need the node, only leaf nodes can be dropped
+  if (!node->children.empty()) {
+    return 0;
+  }
+
+  // try to only evict minimal number of blocks
+  const size_t n_to_evict =
+      std::min(n_blocks_to_evict, n_blocks - non_shared_start);
+  if (n_to_evict == n_blocks) {
+    // mark the node as to be evicted
+    nodes_to_evict->push_back(node);
+  } else if (n_to_evict > 0) {
+    // partially evict non-shared blocks
+    const size_t n_blocks_left = n_blocks - n_to_evict;
+    DCHECK(n_blocks_left >= non_shared_start);
+    node->token_ids.resize(n_blocks_left * block_size_);
+    node->blocks.resize(n_blocks_left);
+    node->hash = hash_blocks(node->parent->hash, node->token_ids);
+  }
+  return n_to_evict;
+}
+
+void PrefixCache::rank_node(Node* node) {
+  if (policy_->is_lru() || node == &root_) {
+    return;
+  }
+  unrank_node(node);
+  RankedNodes* ranked_nodes = nullptr;
+  if (node->on_host) {
+    if (node->children.empty()) {
+      ranked_nodes = &ranked_host_nodes_;
+    }
+  } else if (!has_device_child(node)) {
+    ranked_nodes = &ranked_device_nodes_;
+  }
+  if (ranked_nodes != nullptr) {
+    node->rank_it =
+        ranked_nodes->emplace(policy_->rank(stats(node)), node->lru_seq, node)
+            .first;
+    node->ranked_nodes = ranked_nodes;
+  }
+}
+
+void PrefixCache::unrank_node(Node* node) {
+  if (node->ranked_nodes != nullptr) {
+    node->ranked_nodes->erase(node->rank_it);
+    node->ranked_nodes = nullptr;
+  }
+}
+
+PrefixCacheNodeStats PrefixCache::stats(const Node* node) const {
+  PrefixCacheNodeStats stats;
+  stats.num_tokens = node->token_ids.size();
+  stats.num_prefix_tokens = node->num_prefix_tokens;
+  stats.on_host = node->on_host;
+  stats.last_access_time = node->last_access_time;
+  stats.hit_count = node->hit_count;
+  stats.frequency = node->frequency;
+  return stats;
+}
+
+std::vector<PrefixCacheNodeStats> PrefixCache::node_stats() const {
+  std::vector<PrefixCacheNodeStats> node_stats;
+  node_stats.reserve(num_nodes_);
+  std::vector<const Node*> stack = {&root_};
+  while (!stack.empty()) {
+    const Node* node = stack.back();
+    stack.pop_back();
+    for (const Node* child : node->children) {
+      node_stats.push_back(stats(child));
+      stack.push_back(child);
+    }
+  }
+  return node_stats;
+}
+
+void PrefixCache::touch_node(Node* node, int64_t now, bool hit) {
+  node->frequency =
+      policy_->decay(node->frequency, now - node->last_access_time) +
+      (hit ? 1.0 : 0.0);
+  if (hit) {
+    ++node->hit_count;
+  }
+  node->last_access_time = now;
+  move_node_to_lru_back(node);
+  rank_node(node);
+}
+
+size_t PrefixCache::evict_host_blocks(size_t n_blocks_to_evict) {
+  size_t total_evicted = 0;
+  // drop spilled leaf nodes in the policy order, loop until no blocks to evict
+  while (total_evicted < n_blocks_to_evict) {
+    size_t evicted = 0;
+    if (policy_->is_lru()) {
+      Node* node = lru_front_.next;
+      while (total_evicted + evicted < n_blocks_to_evict &&
+             node != &lru_back_) {
+        Node* next = node->next;
+        if (node->on_host && node->children.empty()) {
+          evicted += node->blocks.size();
+          release_node(node);
+        }
+        node = next;
+      }
+    } else {
+      // dropping a node may make its parent the next one to drop
+      while (total_evicted + evicted < n_blocks_to_evict &&
+             !ranked_host_nodes_.empty()) {
+        Node* node = std::get<Node*>(*ranked_host_nodes_.begin());
+        evicted += node->blocks.size();
+        release_node(node);
+      }
+    }
+    if (evicted == 0) {
+      break;
+    }
+    total_evicted += evicted;
+  }
+  num_host_blocks_ -= total_evicted;
+  return total_evicted;
+}
+
+bool PrefixCache::spill_node(Node* node) {
+  DCHECK(!node->on_host);
+  const size_t n_blocks = node->blocks.size();
+  if (n_blocks > host_allocator_->total_block_count()) {
+    return false;
+  }
+  const size_t n_free_blocks = host_allocator_->free_block_count();
+  if (n_blocks > n_free_blocks) {
+    // make room by dropping least recently used spilled nodes
+    evict_host_blocks(n_blocks - n_free_blocks);
+    if (n_blocks > host_allocator_->free_block_count()) {
+      return false;
+    }
+  }
+
+  // the device blocks can be reused right away since block swaps are applied
+  // in order before the next model execution.
+  std::vector<Block> host_blocks = host_allocator_->allocate(n_blocks);
+  for (size_t i = 0; i < n_blocks; ++i) {
+    block_swaps_->push_back(
+        {node->blocks[i].id(), host_blocks[i].id(), /*swap_out=*/true});
+  }
+  node->blocks = std::move(host_blocks);
+  node->on_host = true;
+  num_host_blocks_ += n_blocks;
+  rank_node(node);
+  rank_node(node->parent);
+  return true;
+}
+
+bool PrefixCache::restore_node(Node* node, size_t num_kept_blocks) {
+  DCHECK(node->on_host);
+  DCHECK(node->parent == &root_ || !node->parent->on_host);
+  const size_t n_blocks = node->blocks.size();
+  if (n_blocks + num_kept_blocks > device_allocator_->free_block_count()) {
+    return false;
+  }
+
+  std::vector<Block> blocks = device_allocator_->allocate(n_blocks);
+  for (size_t i = 0; i < n_blocks; ++i) {
+    block_swaps_->push_back(
+        {node->blocks[i].id(), blocks[i].id(), /*swap_out=*/false});
+  }
+  node->blocks = std::move(blocks);
+  node->on_host = false;
+  num_host_blocks_ -= n_blocks;
+  num_blocks_ += n_blocks;
+  rank_node(node);
+  rank_node(node->parent);
+  return true;
+}
+
+bool PrefixCache::has_device_child(const Node* node) {
+  for (const Node* child : node->children) {
+    if (!child->on_host) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void PrefixCache::save_host_tier(
+    std::ostream& os,
+    const std::unordered_set<int32_t>& pending_block_ids) const {
+  // collect spilled subtrees under the root, parents before children
+  std::vector<const Node*> nodes;
+  std::unordered_map<const Node*, uint64_t> node_index;
+  std::vector<const Node*> stack = {&root_};
+  while (!stack.empty()) {
+    const Node* node = stack.back();
+    stack.pop_back();
+    for (const Node* child : node->children) {
+      if (!child->on_host) {
+        continue;
+      }
+      bool pending = false;
+      for (const Block& block : child->blocks) {
+        pending = pending || pending_block_ids.count(block.id()) > 0;
+      }
+      if (pending) {
+        continue;
+      }
+      nodes.push_back(child);
+      node_index[child] = nodes.size();
+      stack.push_back(child);
+    }
+  }
+
+  write_value(os, kHostTierMagic);
+  write_value(os, kHostTierVersion);
+  write_value(os, block_size_);
+  write_value(os, static_cast<uint64_t>(host_allocator_->total_block_count()));
+  write_value(os, static_cast<uint64_t>(nodes.size()));
+  for (const Node* node : nodes) {
+    // 0 for the root
+    const auto it = node_index.find(node->parent);
+    write_value(os, it == node_index.end() ? uint64_t{0} : it->second);
+    write_value(os, static_cast<uint64_t>(node->blocks.size()));
+    write_values(os, node->token_ids);
+    std::vector<int32_t> block_ids;
+    block_ids.reserve(node->blocks.size());
+    for (const Block& block : node->blocks) {
+      block_ids.push_back(block.id());
+    }
+    write_values(os, block_ids);
+  }
+}
+
+bool PrefixCache::load_host_tier(std::istream& is) {
+  CHECK(host_allocator_ != nullptr) << "Host tier is not enabled";
+  uint64_t magic = 0;
+  uint32_t version = 0;
+  uint32_t block_size = 0;
+  uint64_t n_host_blocks = 0;
+  uint64_t n_nodes = 0;
+  if (!read_value(is, &magic) || !read_value(is, &version) ||
+      !read_value(is, &block_size) || !read_value(is, &n_host_blocks) ||
+      !read_value(is, &n_nodes)) {
+    return false;
+  }
+  if (magic != kHostTierMagic || version != kHostTierVersion ||
+      block_size != block_size_ ||
+      n_host_blocks != host_allocator_->total_block_count()) {
+    LOG(WARNING) << "Ignoring host tier index with a different layout";
+    return false;
+  }
+
+  // read all nodes first to allocate host blocks in one go
+  std::vector<uint64_t> parents(n_nodes);
+  std::vector<std::vector<int32_t>> token_ids(n_nodes);
+  std::vector<size_t> n_blocks(n_nodes);
+  std::vector<int32_t> block_ids;
+  for (uint64_t i = 0; i < n_nodes; ++i) {
+    uint64_t n = 0;
+    std::vector<int32_t> ids;
+    if (!read_value(is, &parents[i]) || parents[i] > i ||
+        !read_value(is, &n) || n == 0 || n > n_host_blocks ||
+        !read_values(is, n * block_size_, &token_ids[i]) ||
+        !read_values(is, n, &ids)) {
+      LOG(WARNING) << "Corrupted host tier index";
+      return false;
+    }
+    n_blocks[i] = n;
+    block_ids.insert(block_ids.end(), ids.begin(), ids.end());
+  }
+  std::vector<Block> blocks = host_allocator_->allocate_block_ids(block_ids);
+  if (blocks.size() != block_ids.size()) {
+    LOG(WARNING) << "Host blocks in the index are not free";
+    return false;
+  }
+
+  const int64_t now = absl::ToUnixMicros(clock_->now());
+  std::vector<Node*> nodes(n_nodes, nullptr);
+  auto blocks_slice = Slice<Block>(blocks);
+  for (uint64_t i = 0; i < n_nodes; ++i) {
+    const auto node_blocks = blocks_slice.slice(0, n_blocks[i]);
+    blocks_slice = blocks_slice.slice(n_blocks[i]);
+    // children of skipped nodes are skipped as well
+    Node* parent = parents[i] == 0 ? &root_ : nodes[parents[i] - 1];
+    if (parent == nullptr || find_child(parent, token_ids[i]) != nullptr) {
+      continue;
+    }
+    nodes[i] = create_child(
+        parent, token_ids[i], node_blocks, now, /*on_host=*/true);
+  }
+  return true;
+}
+
+void PrefixCache::release_subtree(Node* node) {
+  while (!node->children.empty()) {
+    Node* child = *node->children.begin();
+    DCHECK(child->on_host) << "should only release spilled children";
+    release_subtree(child);
+  }
+  if (node->on_host) {
+    num_host_blocks_ -= node->blocks.size();
+  }
+  release_node(node);
+}
+
 void PrefixCache::release_node(Node* node) {
   DCHECK(node != &root_);
   DCHECK(node->children.empty()) << "should only release leaf node";
@@ -236,11 +693,19 @@ void PrefixCache::release_node(Node* node) {
   auto* parent = node->parent;
   DCHECK(parent->children.count(node) > 0);
   parent->children.erase(node);
+  // a node that lost a hash collision is not in the index
+  auto it = nodes_.find(node->first_block_hash);
+  if (it != nodes_.end() && it->second == node) {
+    nodes_.erase(it);
+  }
 
   // delete the node
+  unrank_node(node);
   remove_node_from_lru(node);
   delete node;
   --num_nodes_;
+  // the parent may have become evictable
+  rank_node(parent);
 }
 
 void PrefixCache::split_node(Node* node, size_t common_prefix_length) {
@@ -262,8 +727,21 @@ void PrefixCache::split_node(Node* node, size_t common_prefix_length) {
   child->token_ids = token_ids.slice(common_prefix_length).to_vector();
   child->blocks = blocks.slice(n_blocks).to_vector();
   child->last_access_time = node->last_access_time;
+  child->hit_count = node->hit_count;
+  child->frequency = node->frequency;
+  child->on_host = node->on_host;
   // point to parent
   child->parent = node;
+  child->num_prefix_tokens = node->num_prefix_tokens + common_prefix_length;
+  // the hash up to the end stays with the child
+  child->hash = node->hash;
+  node->hash = hash_blocks(node->parent->hash,
+                           token_ids.slice(0, common_prefix_length));
+  child->first_block_hash = hash_blocks(
+      node->hash, Slice<int32_t>(child->token_ids).slice(0, block_size_));
+  // on a hash collision with another node, the child is left out of the index
+  // and can't be matched, like the tokens left uncached by create_child()
+  nodes_.emplace(child->first_block_hash, child);
   // take over children
   child->children = std::move(node->children);
   for (Node* grand_child : child->children) {
@@ -275,31 +753,83 @@ void PrefixCache::split_node(Node* node, size_t common_prefix_length) {
   node->blocks.resize(n_blocks);
   // put the new child into the children set
   node->children.insert(child);
+  rank_node(child);
+  rank_node(node);
 }
 
-void PrefixCache::create_child(Node* node,
-                               const Slice<int32_t>& tokens,
-                               const Slice<Block>& blocks,
-                               int64_t now) {
+PrefixCache::Node* PrefixCache::create_child(Node* node,
+                                             const Slice<int32_t>& tokens,
+                                             const Slice<Block>& blocks,
+                                             int64_t now,
+                                             bool on_host) {
   CHECK(!tokens.empty() && tokens.size() == blocks.size() * block_size_)
       << "The number of tokens "
          "should be equal to the number of blocks times block size";
 
+  const uint64_t first_block_hash =
+      hash_blocks(node->hash, tokens.slice(0, block_size_));
+  // a hash collision with another node, leave the tokens uncached
+  if (nodes_.count(first_block_hash) > 0) {
+    return nullptr;
+  }
+
   Node* child = new Node();
   add_node_to_lru_back(child);
   ++num_nodes_;
 
-  num_blocks_ += blocks.size();
+  if (on_host) {
+    num_host_blocks_ += blocks.size();
+  } else {
+    num_blocks_ += blocks.size();
+  }
 
   child->token_ids = tokens.to_vector();
   child->blocks = blocks.to_vector();
+  child->on_host = on_host;
   child->last_access_time = now;
+  child->frequency = 1.0;
   child->parent = node;
+  child->num_prefix_tokens = node->num_prefix_tokens + node->token_ids.size();
+  child->first_block_hash = first_block_hash;
+  child->hash = hash_blocks(node->hash, tokens);
   node->children.insert(child);
+  nodes_.emplace(first_block_hash, child);
+  rank_node(child);
+  rank_node(node);
+  return child;
+}
+
+PrefixCache::Node* PrefixCache::find_child(const Node* node,
+                                           const Slice<int32_t>& tokens) const {
+  if (tokens.size() < block_size_) {
+    return nullptr;
+  }
+  const auto first_block = tokens.slice(0, block_size_);
+  auto it = nodes_.find(hash_blocks(node->hash, first_block));
+  if (it == nodes_.end()) {
+    return nullptr;
+  }
+  // guard against hash collisions
+  Node* child = it->second;
+  if (child->parent != node ||
+      common_prefix_length(first_block, child->token_ids) < block_size_) {
+    return nullptr;
+  }
+  return child;
+}
+
+uint64_t PrefixCache::hash_blocks(uint64_t hash,
+                                  const Slice<int32_t>& tokens) const {
+  for (size_t start = 0; start + block_size_ <= tokens.size();
+       start += block_size_) {
+    hash = hash_block(hash, tokens.slice(start, start + block_size_));
+  }
+  return hash;
 }
 
 // add a new node to the back of the LRU list
 void PrefixCache::add_node_to_lru_back(Node* node) {
+  node->lru_seq = ++lru_seq_;
   node->prev = lru_back_.prev;
   node->next = &lru_back_;
   lru_back_.prev->next = node;
@@ -1,18 +1,42 @@
 #pragma once
 
 #include <cstdint>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <set>
+#include <tuple>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
 #include "block.h"
+#include "block_allocator.h"
+#include "common/clock.h"
 #include "common/slice.h"
+#include "eviction_policy.h"
 
 namespace llm {
 
+// A radix tree of cached blocks. nodes are also indexed by the hash of their
+// first block chained with the hashes of all blocks before it, so that
+// walking down the tree takes one hash probe per node instead of scanning all
+// children.
+//
+// with the host tier enabled, evicted nodes are spilled into host blocks and
+// stay in the tree. a match on a spilled node swaps its blocks back into
+// device memory instead of recomputing them.
+//
+// nodes are evicted in the order of the eviction policy, LRU by default.
 class PrefixCache final {
  public:
   explicit PrefixCache(uint32_t block_size);
 
+  // clock is used for access times, defaults to the wall clock.
+  PrefixCache(uint32_t block_size,
+              std::unique_ptr<EvictionPolicy> policy,
+              const Clock* clock = nullptr);
+
   ~PrefixCache();
 
   // disable copy, move and assign
@@ -21,12 +45,32 @@ class PrefixCache final {
   PrefixCache& operator=(const PrefixCache&) = delete;
   PrefixCache& operator=(PrefixCache&&) = delete;
 
+  // spill evicted blocks into the host block pool instead of dropping them.
+  // blocks are copied by the block swaps appended to block_swaps, which are
+  // shared with the block manager to keep all swaps in order.
+  void enable_host_tier(BlockAllocator* device_allocator,
+                        BlockAllocator* host_allocator,
+                        std::vector<BlockSwap>* block_swaps);
+
   // match the token ids with the prefix tree
   // return matched blocks
-  std::vector<Block> match(const std::vector<int32_t>& token_ids) {
-    return match(Slice<int32_t>(token_ids));
+  // spilled blocks are only brought back while num_kept_blocks free device
+  // blocks are left, the match stops at the first node that doesn't fit.
+  std::vector<Block> match(const std::vector<int32_t>& token_ids,
+                           size_t num_kept_blocks = 0) {
+    return match(Slice<int32_t>(token_ids), num_kept_blocks);
   }
-  std::vector<Block> match(const Slice<int32_t>& token_ids);
+  std::vector<Block> match(const Slice<int32_t>& token_ids,
+                           size_t num_kept_blocks = 0);
+
+  // get the number of matched tokens without touching the LRU list
+  // used to probe the prefix cache for scheduling decisions
+  size_t num_matched_tokens(const Slice<int32_t>& token_ids) const;
+
+  // get the matched blocks in device memory without touching the LRU list,
+  // the match stops at the first spilled node. holding the blocks keeps them
+  // from being evicted.
+  std::vector<Block> matched_blocks(const Slice<int32_t>& token_ids) const;
 
   // insert the token ids and blocks into the prefix tree
   // return the length of new inserted tokens
@@ -40,47 +84,155 @@ class PrefixCache final {
   // return the actual number of evicted blocks
   size_t evict(size_t n_blocks);
 
+  // drop host blocks held by the prefix cache
+  // return the actual number of dropped host blocks
+  size_t evict_host_blocks(size_t n_blocks);
+
+  // write the nodes in the host tier to the stream, skipping nodes with any
+  // block in pending_block_ids, i.e. blocks not copied to the host yet.
+  void save_host_tier(
+      std::ostream& os,
+      const std::unordered_set<int32_t>& pending_block_ids) const;
+
+  // load the nodes written by save_host_tier into the same host blocks
+  // return false if the stream is invalid or the blocks are in use
+  bool load_host_tier(std::istream& is);
+
   // get the number of blocks in the prefix cache
   size_t num_blocks() const { return num_blocks_; }
 
+  // get the number of host blocks in the prefix cache
+  size_t num_host_blocks() const { return num_host_blocks_; }
+
   // get the total number of nodes in the prefix tree
   size_t num_nodes() const { return num_nodes_; }
 
+  // count a prompt looked up by match. match() doesn't count lookups itself
+  // since a prompt may be matched again after its blocks were released.
+  void record_query(size_t num_query_tokens, size_t num_hit_tokens) {
+    num_query_tokens_ += num_query_tokens;
+    num_hit_tokens_ += num_hit_tokens;
+  }
+
+  // get the number of recorded prompt tokens
+  size_t num_query_tokens() const { return num_query_tokens_; }
+
+  // get the number of recorded prompt tokens found in the prefix cache
+  size_t num_hit_tokens() const { return num_hit_tokens_; }
+
+  // get the ratio of matched tokens to looked up tokens
+  double hit_rate() const {
+    return num_query_tokens_ == 0 ? 0.0
+                                  : static_cast<double>(num_hit_tokens_) /
+                                        static_cast<double>(num_query_tokens_);
+  }
+
+  // get the statistics of all nodes, parents before children
+  std::vector<PrefixCacheNodeStats> node_stats() const;
+
  private:
+  struct Node;
+
+  // evictable nodes keyed by the rank of the eviction policy, ties are broken
+  // by the position in the LRU list.
+  using RankedNodes = std::set<std::tuple<double, uint64_t, Node*>>;
+
   struct Node {
     // the token ids that the node represents
     // assert(token_ids.size() == blocks.size() * block_size)
     std::vector<int32_t> token_ids;
     // the block ids that the node represents
     std::vector<Block> blocks;
+    // blocks are in the host block pool, all children are in it as well
+    bool on_host = false;
 
     // the children nodes, used to traverse down the tree
     std::unordered_set<Node*> children;
     // the parent node, used to traverse up the tree
     Node* parent = nullptr;
+    // number of tokens in all ancestors
+    size_t num_prefix_tokens = 0;
+
+    // hash of the first block chained from the root, the key in nodes_
+    uint64_t first_block_hash = 0;
+    // hash of all blocks up to the end of the node chained from the root
+    uint64_t hash = 0;
 
     // the last access time of the node, used to evict blocks
     int64_t last_access_time = 0;
+    // number of matches that hit the node
+    size_t hit_count = 0;
+    // access frequency at the last access time, decayed by the policy
+    double frequency = 0;
 
     // the previous and next nodes, used to maintain the LRU list
     Node* prev = nullptr;
     Node* next = nullptr;
+    // increases each time the node moves to the back of the LRU list
+    uint64_t lru_seq = 0;
+
+    // the ranked nodes holding the node, null if it can't be evicted
+    RankedNodes* ranked_nodes = nullptr;
+    RankedNodes::iterator rank_it;
   };
 
+  // find the child of the node starting with the first block of tokens
+  Node* find_child(const Node* node, const Slice<int32_t>& tokens) const;
+
+  // chain the hash with each block of the tokens
+  uint64_t hash_blocks(uint64_t hash, const Slice<int32_t>& tokens) const;
+
   // release the node and update leaf_nodes_
   void release_node(Node* node);
 
+  // release the node together with all its spilled descendants
+  void release_subtree(Node* node);
+
   // split the node on the common prefix
   void split_node(Node* node, size_t common_prefix_length);
 
-  // create a new child node under the node
-  void create_child(Node* node,
-                    const Slice<int32_t>& tokens,
-                    const Slice<Block>& blocks,
-                    int64_t now);
+  // create a new child node under the node, returns nullptr if the first
+  // block hash collides with another node.
+  Node* create_child(Node* node,
+                     const Slice<int32_t>& tokens,
+                     const Slice<Block>& blocks,
+                     int64_t now,
+                     bool on_host = false);
 
   size_t evict_helper(size_t n_blocks);
 
+  // evict the blocks of the node that are not shared, spilled nodes are added
+  // to nodes_to_spill and dropped nodes to nodes_to_evict.
+  // return the number of evicted blocks
+  size_t evict_node(Node* node,
+                    size_t n_blocks,
+                    std::vector<Node*>* nodes_to_evict,
+                    std::vector<Node*>* nodes_to_spill);
+
+  // re-rank the node after its evictability or access statistics changed.
+  // no-op for the LRU policy, which walks the LRU list instead.
+  void rank_node(Node* node);
+
+  // remove the node from the ranked nodes
+  static void unrank_node(Node* node);
+
+  // get the statistics of the node
+  PrefixCacheNodeStats stats(const Node* node) const;
+
+  // update the access time and frequency of the node
+  void touch_node(Node* node, int64_t now, bool hit);
+
+  // copy the blocks of the node into host blocks and release device blocks
+  // return false if there are not enough host blocks
+  bool spill_node(Node* node);
+
+  // copy the blocks of the node back into device blocks
+  // return false if less than num_kept_blocks free device blocks would be left
+  bool restore_node(Node* node, size_t num_kept_blocks);
+
+  // check if any child of the node is in device memory
+  static bool has_device_child(const Node* node);
+
   // remove the node from the LRU list
   static void remove_node_from_lru(Node* node);
 
@@ -93,6 +245,9 @@ class PrefixCache final {
   // the root node of the prefix tree
   Node root_;
 
+  // nodes indexed by their first block hash
+  std::unordered_map<uint64_t, Node*> nodes_;
+
   // the front and back nodes of the LRU list
   // the front node is the least recently used node
   // sorted by the last access time in ascending order
@@ -102,11 +257,37 @@ class PrefixCache final {
   // the block size of the memory blocks
   uint32_t block_size_;
 
+  // the order to evict nodes
+  std::unique_ptr<EvictionPolicy> policy_;
+
+  // the source of access times
+  const Clock* clock_;
+
+  // nodes that can be evicted from device memory, i.e. with no children in
+  // device memory, and spilled leaf nodes that can be dropped
+  RankedNodes ranked_device_nodes_;
+  RankedNodes ranked_host_nodes_;
+
+  // the last sequence number given to a node moved to the back of the LRU
+  uint64_t lru_seq_ = 0;
+
   // the total number of blocks in the prefix cache
   size_t num_blocks_ = 0;
 
+  // allocators and block swaps for the host tier, null if it is disabled
+  BlockAllocator* device_allocator_ = nullptr;
+  BlockAllocator* host_allocator_ = nullptr;
+  std::vector<BlockSwap>* block_swaps_ = nullptr;
+
+  // the total number of host blocks in the prefix cache
+  size_t num_host_blocks_ = 0;
+
   // the total number of nodes in the prefix tree
   size_t num_nodes_ = 0;
+
+  // the number of recorded prompt tokens and hits among them
+  size_t num_query_tokens_ = 0;
+  size_t num_hit_tokens_ = 0;
 };
 
 }  // namespace llm
\ No newline at end of file
@@ -3,7 +3,10 @@
 #include <absl/random/random.h>
 #include <gtest/gtest.h>
 
+#include <string>
+
 #include "block_allocator.h"
+#include "common/clock.h"
 
 namespace llm {
 
@@ -144,19 +147,286 @@ std::vector<T> sub_vector(const std::vector<T>& data, size_t size) {
   return {data.begin(), data.begin() + size};
 }
 
+TEST(PrefixCacheTest, NumMatchedTokens) {
+  const uint32_t block_size = 2;
+  PrefixCache cache(block_size);
+
+  std::vector<int32_t> token_ids = {1, 2, 3, 4, 5, 6, 7};
+  EXPECT_EQ(cache.num_matched_tokens(token_ids), 0);
+
+  std::vector<Block> blocks = {0, 1, 2};
+  cache.insert(token_ids, blocks);
+
+  // probe should agree with match, truncated at block boundary
+  EXPECT_EQ(cache.num_matched_tokens(token_ids), 6);
+  std::vector<int32_t> partial = {1, 2, 3, 5};
+  EXPECT_EQ(cache.num_matched_tokens(partial), 2);
+  EXPECT_EQ(cache.match(partial).size(), 1);
+  std::vector<int32_t> miss = {2, 1, 3, 4};
+  EXPECT_EQ(cache.num_matched_tokens(miss), 0);
+
+  // probing doesn't change the cache
+  EXPECT_EQ(cache.num_blocks(), 3);
+  EXPECT_EQ(cache.num_nodes(), 1);
+}
+
+TEST(PrefixCacheTest, MatchedBlocks) {
+  const uint32_t block_size = 2;
+  PrefixCache cache(block_size);
+
+  const std::vector<int32_t> token_ids = {1, 2, 3, 4, 5, 6, 7};
+  cache.insert(token_ids, {0, 1, 2});
+  const std::vector<int32_t> other = {7, 8};
+  cache.insert(other, {3});
+
+  // probing the blocks doesn't count as a lookup
+  const std::vector<int32_t> partial = {1, 2, 3, 4, 9, 9};
+  const std::vector<Block> blocks = cache.matched_blocks(partial);
+  EXPECT_EQ(blocks, std::vector<Block>({0, 1}));
+  EXPECT_EQ(cache.num_query_tokens(), 0);
+
+  // the held blocks are not evicted
+  EXPECT_EQ(cache.evict(4), 2);
+  EXPECT_EQ(cache.num_matched_tokens(token_ids), 4);
+  EXPECT_EQ(cache.num_matched_tokens(other), 0);
+}
+
+TEST(PrefixCacheTest, ManySiblings) {
+  const uint32_t block_size = 4;
+  PrefixCache cache(block_size);
+
+  // prompts with distinct first blocks under the root
+  const int32_t num_prompts = 1000;
+  auto prompt = [&](int32_t i) {
+    return std::vector<int32_t>{i, i, i, i, 1, 2, 3, 4, i, i};
+  };
+  for (int32_t i = 0; i < num_prompts; ++i) {
+    std::vector<Block> blocks = {2 * i, 2 * i + 1};
+    EXPECT_EQ(cache.insert(prompt(i), blocks), 8);
+  }
+  EXPECT_EQ(cache.num_nodes(), num_prompts);
+  EXPECT_EQ(cache.num_blocks(), 2 * num_prompts);
+
+  for (int32_t i = 0; i < num_prompts; ++i) {
+    std::vector<Block> desired_blocks = {2 * i, 2 * i + 1};
+    EXPECT_EQ(cache.match(prompt(i)), desired_blocks);
+  }
+
+  // split a node and match both parts
+  std::vector<int32_t> token_ids = {7, 7, 7, 7, 5, 6, 7, 8};
+  std::vector<Block> blocks = {14, 10000};
+  EXPECT_EQ(cache.insert(token_ids, blocks), 4);
+  EXPECT_EQ(cache.num_nodes(), num_prompts + 2);
+  std::vector<Block> desired_blocks = {14, 10000};
+  EXPECT_EQ(cache.match(token_ids), desired_blocks);
+  desired_blocks = {14, 15};
+  EXPECT_EQ(cache.match(prompt(7)), desired_blocks);
+
+  // evicted nodes are gone from the index
+  blocks.clear();
+  desired_blocks.clear();
+  EXPECT_EQ(cache.evict(2 * num_prompts + 1), 2 * num_prompts + 1);
+  EXPECT_EQ(cache.num_nodes(), 0);
+  EXPECT_TRUE(cache.match(prompt(7)).empty());
+  EXPECT_EQ(cache.insert(prompt(7), {14, 15}), 8);
+  EXPECT_EQ(cache.match(prompt(7)).size(), 2);
+}
+
+TEST(PrefixCacheTest, ZeroTokens) {
+  const uint32_t block_size = 1;
+  PrefixCache cache(block_size);
+
+  // a block of zero tokens should not share the hash of its parent
+  const std::vector<int32_t> prompt1 = {0, 1};
+  const std::vector<int32_t> prompt2 = {1};
+  const std::vector<int32_t> prompt3 = {0, 2};
+  std::vector<Block> blocks1 = {1, 2};
+  std::vector<Block> blocks2 = {3};
+  std::vector<Block> blocks3 = {1, 4};
+  EXPECT_EQ(cache.insert(prompt1, blocks1), 2);
+  EXPECT_EQ(cache.insert(prompt2, blocks2), 1);
+  // split the first node into [0] and [1]
+  EXPECT_EQ(cache.insert(prompt3, blocks3), 1);
+  EXPECT_EQ(cache.num_nodes(), 4);
+
+  EXPECT_EQ(cache.match(prompt1), blocks1);
+  EXPECT_EQ(cache.match(prompt2), blocks2);
+  EXPECT_EQ(cache.match(prompt3), blocks3);
+}
+
+TEST(PrefixCacheTest, LFUEviction) {
+  const uint32_t block_size = 2;
+  PrefixCache cache(block_size,
+                    std::make_unique<LFUEvictionPolicy>(/*half_life_s=*/3600));
+
+  // a system prompt reused by a few requests
+  const std::vector<int32_t> system_prompt = {1, 2, 3, 4};
+  EXPECT_EQ(cache.insert(system_prompt, {1, 2}), 4);
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(cache.match(system_prompt).size(), 2);
+  }
+
+  // followed by a burst of one-off prompts
+  for (int32_t i = 0; i < 3; ++i) {
+    const std::vector<int32_t> prompt = {10 + i, 10, 10, 10};
+    EXPECT_TRUE(cache.match(prompt).empty());
+    EXPECT_EQ(cache.insert(prompt, {10 + 2 * i, 11 + 2 * i}), 4);
+  }
+
+  // LRU would evict the system prompt first, one-off prompts go in LRU order
+  EXPECT_EQ(cache.evict(4), 4);
+  EXPECT_EQ(cache.num_matched_tokens(system_prompt), 4);
+  const std::vector<int32_t> first_prompt = {10, 10, 10, 10};
+  const std::vector<int32_t> last_prompt = {12, 10, 10, 10};
+  EXPECT_EQ(cache.num_matched_tokens(first_prompt), 0);
+  EXPECT_EQ(cache.num_matched_tokens(last_prompt), 4);
+
+  const auto node_stats = cache.node_stats();
+  ASSERT_EQ(node_stats.size(), 2);
+  size_t total_hits = 0;
+  for (const auto& stats : node_stats) {
+    total_hits += stats.hit_count;
+  }
+  EXPECT_EQ(total_hits, 3);
+}
+
+TEST(PrefixCacheTest, LFUEvictionDecay) {
+  const uint32_t block_size = 2;
+  SimulatedClock clock;
+  PrefixCache cache(block_size,
+                    std::make_unique<LFUEvictionPolicy>(/*half_life_s=*/1),
+                    &clock);
+
+  // popular a long time ago
+  const std::vector<int32_t> old_prompt = {1, 2, 3, 4};
+  EXPECT_EQ(cache.insert(old_prompt, {1, 2}), 4);
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(cache.match(old_prompt).size(), 2);
+  }
+
+  // a prompt seen once, ten half lives later
+  clock.advance(absl::Seconds(10));
+  const std::vector<int32_t> new_prompt = {5, 6, 7, 8};
+  EXPECT_EQ(cache.insert(new_prompt, {3, 4}), 4);
+
+  // the hits of the old prompt have decayed below a single recent access
+  EXPECT_EQ(cache.evict(2), 2);
+  EXPECT_EQ(cache.num_matched_tokens(old_prompt), 0);
+  EXPECT_EQ(cache.num_matched_tokens(new_prompt), 4);
+
+  // the new prompt is popular now
+  clock.advance(absl::Seconds(1));
+  EXPECT_EQ(cache.match(new_prompt).size(), 2);
+  EXPECT_EQ(cache.insert(old_prompt, {1, 2}), 4);
+  EXPECT_EQ(cache.evict(2), 2);
+  EXPECT_EQ(cache.num_matched_tokens(old_prompt), 0);
+  EXPECT_EQ(cache.num_matched_tokens(new_prompt), 4);
+}
+
+TEST(PrefixCacheTest, HostTier) {
+  const uint32_t block_size = 2;
+  BlockAllocator device_allocator(/*total_blocks=*/4, block_size);
+  BlockAllocator host_allocator(/*total_blocks=*/3, block_size);
+  std::vector<BlockSwap> swaps;
+  PrefixCache cache(block_size);
+  cache.enable_host_tier(&device_allocator, &host_allocator, &swaps);
+
+  const std::vector<int32_t> prompt1 = {1, 2, 3, 4};
+  const std::vector<int32_t> prompt2 = {5, 6, 7, 8};
+  EXPECT_EQ(cache.insert(prompt1, device_allocator.allocate(2)), 4);
+
+  // evicted blocks are spilled into host blocks
+  EXPECT_EQ(cache.evict(1), 2);
+  EXPECT_EQ(cache.num_blocks(), 0);
+  EXPECT_EQ(cache.num_host_blocks(), 2);
+  EXPECT_EQ(device_allocator.free_block_count(), 4);
+  ASSERT_EQ(swaps.size(), 2);
+  EXPECT_TRUE(swaps[0].swap_out && swaps[1].swap_out);
+  EXPECT_EQ(cache.num_matched_tokens(prompt1), 4);
+  swaps.clear();
+
+  // a hit swaps the matched blocks back into device blocks
+  std::vector<int32_t> partial = {1, 2, 5, 6};
+  std::vector<Block> blocks = cache.match(partial);
+  ASSERT_EQ(blocks.size(), 1);
+  ASSERT_EQ(swaps.size(), 1);
+  EXPECT_FALSE(swaps[0].swap_out);
+  EXPECT_EQ(swaps[0].dst_block_id, blocks[0].id());
+  EXPECT_EQ(cache.num_blocks(), 1);
+  EXPECT_EQ(cache.num_host_blocks(), 1);
+  EXPECT_EQ(cache.num_nodes(), 2);
+  swaps.clear();
+
+  // the sequence's own blocks replace the spilled ones on insert
+  blocks.push_back(device_allocator.allocate());
+  EXPECT_EQ(cache.insert(prompt1, blocks), 0);
+  EXPECT_EQ(cache.num_blocks(), 2);
+  EXPECT_EQ(cache.num_host_blocks(), 0);
+  EXPECT_EQ(cache.match(prompt1), blocks);
+  EXPECT_TRUE(swaps.empty());
+  blocks.clear();
+
+  // the least recently used spilled node is dropped to make room, prompt1 was
+  // split into two nodes by the partial match.
+  EXPECT_EQ(cache.insert(prompt2, device_allocator.allocate(2)), 4);
+  EXPECT_EQ(cache.evict(4), 4);
+  EXPECT_EQ(cache.num_blocks(), 0);
+  EXPECT_EQ(cache.num_host_blocks(), 3);
+  EXPECT_EQ(cache.num_matched_tokens(prompt1), 2);
+  EXPECT_EQ(cache.num_matched_tokens(prompt2), 4);
+
+  // nothing left to spill or drop
+  EXPECT_EQ(cache.evict(1), 0);
+  EXPECT_EQ(cache.evict_host_blocks(4), 3);
+  EXPECT_EQ(cache.num_nodes(), 0);
+}
+
+TEST(PrefixCacheTest, HostTierKeptBlocks) {
+  const uint32_t block_size = 2;
+  BlockAllocator device_allocator(/*total_blocks=*/4, block_size);
+  BlockAllocator host_allocator(/*total_blocks=*/4, block_size);
+  std::vector<BlockSwap> swaps;
+  PrefixCache cache(block_size);
+  cache.enable_host_tier(&device_allocator, &host_allocator, &swaps);
+
+  const std::vector<int32_t> prompt = {1, 2, 3, 4};
+  EXPECT_EQ(cache.insert(prompt, device_allocator.allocate(2)), 4);
+  EXPECT_EQ(cache.evict(2), 2);
+  EXPECT_EQ(cache.num_host_blocks(), 2);
+  swaps.clear();
+
+  // restoring would eat into the kept free blocks
+  std::vector<Block> held = device_allocator.allocate(1);
+  EXPECT_TRUE(cache.match(prompt, /*num_kept_blocks=*/2).empty());
+  EXPECT_TRUE(swaps.empty());
+  EXPECT_EQ(cache.num_host_blocks(), 2);
+  EXPECT_EQ(device_allocator.free_block_count(), 3);
+
+  // enough free blocks above the kept ones
+  held.clear();
+  std::vector<Block> blocks = cache.match(prompt, /*num_kept_blocks=*/2);
+  EXPECT_EQ(blocks.size(), 2);
+  EXPECT_EQ(swaps.size(), 2);
+  EXPECT_EQ(cache.num_host_blocks(), 0);
+  EXPECT_EQ(device_allocator.free_block_count(), 2);
+}
+
 class PrefixCacheRandomTest
     : public ::testing::TestWithParam<std::tuple<int32_t /*block_size*/,
                                                  int32_t /*max_seq_len*/,
-                                                 int32_t /*num_seqs*/>> {};
+                                                 int32_t /*num_seqs*/,
+                                                 std::string /*policy*/>> {
+};
 
 TEST_P(PrefixCacheRandomTest, Random) {
-  const auto& [block_size, max_seq_len, num_seqs] = GetParam();
+  const auto& [block_size, max_seq_len, num_seqs, policy] = GetParam();
 
   const int32_t vocab_size = 2000;
   const int32_t total_blocks = (max_seq_len * num_seqs) / block_size + 10;
 
   BlockAllocator allocator(total_blocks, block_size);
-  PrefixCache cache(block_size);
+  PrefixCache cache(block_size,
+                    EvictionPolicyFactory::create(policy, /*half_life_s=*/1));
 
   absl::BitGen gen;
   // construct sequences and insert into prefix cache
@@ -257,7 +527,8 @@ INSTANTIATE_TEST_SUITE_P(
     PrefixCacheRandomTest,
     ::testing::Combine(::testing::Values(1, 4, 8, 32, 128, 256),  // block_size
                        ::testing::Values(1000),                   // max_seq_len
-                       ::testing::Values(1000)                    // num_seqs
+                       ::testing::Values(1000),                   // num_seqs
+                       ::testing::Values("lru", "lfu", "cost")    // policy
                        ));
 
 }  // namespace llm
\ No newline at end of file
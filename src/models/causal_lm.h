@@ -49,7 +49,10 @@ class CausalLM : public torch::nn::Module {
 template <typename Model>
 class CausalLMImpl : public CausalLM {
  public:
-  CausalLMImpl(Model model) : model_(std::move(model)) {}
+  CausalLMImpl(Model model) : model_(std::move(model)) {
+    // expose the weights through parameters(), i.e. to place them in memory
+    register_module("model", model_);
+  }
 
   torch::Tensor forward(const torch::Tensor& tokens,     // [num_tokens]
                         const torch::Tensor& positions,  // [num_tokens]
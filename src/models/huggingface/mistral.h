@@ -414,6 +414,7 @@ REGISTER_MODEL_ARGS(mistral, [&] {
   LOAD_ARG_OR(bos_token_id, "bos_token_id", 1);
   LOAD_ARG_OR(eos_token_id, "eos_token_id", 2);
   LOAD_ARG_OR(rope_theta, "rope_theta", 10000.0f);
+  LOAD_ARG_OR(sliding_window, "sliding_window", 0);
 });
 
 }  // namespace llm::hf
@@ -58,6 +58,9 @@ struct ModelArgs {
   // the maximum sequence length to use for rotary position embeddings.
   DEFINE_ARG(int64_t, max_position_embeddings) = 0;
 
+  // number of most recent tokens a token attends to, 0 to attend to all.
+  DEFINE_ARG(int64_t, sliding_window) = 0;
+
   // token id for beginning of sentence.
   DEFINE_ARG(int32_t, bos_token_id) = 0;
 
@@ -119,6 +122,7 @@ inline std::ostream& operator<<(std::ostream& os, const ModelArgs& args) {
   os << ", rope_scaling: " << args.rope_scaling();
   os << ", rotary_pct: " << args.rotary_pct();
   os << ", max_position_embeddings: " << args.max_position_embeddings();
+  os << ", sliding_window: " << args.sliding_window();
   os << ", bos_token_id: " << args.bos_token_id();
   os << ", eos_token_id: " << args.eos_token_id();
   os << ", use_parallel_residual: " << args.use_parallel_residual();
@@ -87,4 +87,14 @@ void Request::expand_sequences() {
   }
 }
 
+void Request::finish(FinishReason reason) {
+  // make sure all sequences are created to report the finish reason
+  expand_sequences();
+  for (Sequence& seq : sequences) {
+    if (!seq.is_finished()) {
+      seq.finish(reason);
+    }
+  }
+}
+
 }  // namespace llm
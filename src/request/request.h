@@ -1,5 +1,7 @@
 #pragma once
 
+#include <absl/time/time.h>
+
 #include <cstdint>
 #include <deque>
 #include <string>
@@ -99,6 +101,12 @@ struct Request final {
 
   void expand_sequences();
 
+  // check if the request has a deadline
+  bool has_deadline() const { return deadline != absl::InfiniteFuture(); }
+
+  // finish all unfinished sequences with the given reason
+  void finish(FinishReason reason);
+
   // The unique id of the request.
   // NOLINTNEXTLINE
   const std::string id;
@@ -134,6 +142,23 @@ struct Request final {
   // the priority of the request.
   RequestPriority priority = RequestPriority::MEDIUM;
 
+  // the deadline of the request, no deadline by default.
+  absl::Time deadline = absl::InfiniteFuture();
+
+  // the end user who sent the request, used as the tenant id.
+  std::string user;
+
+  // the number of times the request was moved back by the scheduler to favor
+  // prefix cache hits, used to bound the reordering.
+  size_t num_bypassed = 0;
+
+  // the time the request arrived at the scheduler, on the scheduler clock.
+  absl::Time arrival_time;
+
+  // the priority used by the scheduler, raised from priority by aging. set by
+  // the scheduler on arrival.
+  RequestPriority effective_priority = RequestPriority::MEDIUM;
+
   // list of sequences to generate completions for the prompt
   // use deque instead of vector to avoid no-copy move for Sequence
   std::deque<Sequence> sequences;
@@ -162,15 +187,4 @@ struct RequestPtrLess {
   }
 };
 
-// Compare two request contexts based on priority then scheduled time.
-// if a > b then a should be processed after b.
-struct RequestPtrGreater {
-  bool operator()(const Request* a, const Request* b) const {
-    if (a->priority == b->priority) {
-      return a->created_time > b->created_time;
-    }
-    return a->priority > b->priority;
-  }
-};
-
 }  // namespace llm
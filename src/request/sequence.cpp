@@ -2,6 +2,7 @@
 
 #include <absl/strings/match.h>
 
+#include <algorithm>
 #include <atomic>
 #include <cstdint>
 #include <string>
@@ -198,14 +199,100 @@ void Sequence::release_blocks() {
   // reset the kv cache position to 0
   std::fill(num_kv_cache_tokens_.begin(), num_kv_cache_tokens_.end(), 0);
   blocks_.clear();
+  num_released_blocks_ = 0;
+  host_blocks_.clear();
+}
+
+void Sequence::fork_blocks_from(const Sequence& parent) {
+  CHECK(blocks_.empty()) << "forked blocks should be the only blocks";
+  CHECK_EQ(num_prompt_tokens_, parent.num_prompt_tokens_);
+  if (parent.blocks_.empty() || num_prompt_tokens_ == 0) {
+    return;
+  }
+  const size_t block_size = parent.blocks_.back().size();
+  const size_t num_blocks = (num_prompt_tokens_ + block_size - 1) / block_size;
+  CHECK_LE(num_blocks, parent.blocks_.size());
+  CHECK_LT(parent.num_released_blocks_, num_blocks);
+  blocks_.assign(parent.blocks_.begin(), parent.blocks_.begin() + num_blocks);
+  num_released_blocks_ = parent.num_released_blocks_;
+
+  // recompute the last prompt token, the same as a full prefix cache match
+  for (size_t i = 0; i < num_kv_cache_tokens_.size(); ++i) {
+    num_kv_cache_tokens_[i] =
+        std::min(parent.num_kv_cache_tokens_[i], num_prompt_tokens_ - 1);
+  }
+}
+
+void Sequence::replace_block(size_t index, const Block& block) {
+  CHECK_LT(index, blocks_.size());
+  blocks_[index] = block;
+}
+
+void Sequence::release_blocks_out_of_window(size_t sliding_window) {
+  if (sliding_window == 0 || blocks_.empty()) {
+    return;
+  }
+  // the next token to process, minus rejected speculative tokens that are
+  // processed again and the last token recomputed by forked sequences.
+  const size_t num_tokens = num_kv_cache_tokens(EngineType::LLM);
+  const size_t num_tokens_to_redo = FLAGS_num_speculative_tokens + 1;
+  if (num_tokens < sliding_window + num_tokens_to_redo) {
+    return;
+  }
+  // the first token in the sliding window of the next token to process
+  const size_t first_token =
+      num_tokens - num_tokens_to_redo - sliding_window + 1;
+  const size_t block_size = blocks_.back().size();
+  // always keep the last block
+  const size_t num_blocks =
+      std::min(first_token / block_size, blocks_.size() - 1);
+  for (size_t i = num_released_blocks_; i < num_blocks; ++i) {
+    blocks_[i] = Block();
+  }
+  num_released_blocks_ = std::max(num_released_blocks_, num_blocks);
+}
+
+void Sequence::release_tail_blocks(size_t num_blocks) {
+  CHECK_LE(num_blocks, blocks_.size());
+  // recomputing the dropped tokens needs the tokens in the released blocks,
+  // recompute the whole sequence instead.
+  if (num_released_blocks_ > 0 && num_blocks > 0) {
+    num_blocks = blocks_.size();
+    num_released_blocks_ = 0;
+  }
+  blocks_.resize(blocks_.size() - num_blocks);
+  // kv cache beyond the remaining blocks is lost
+  const size_t capacity = kv_cache_capacity();
+  for (auto& num_kv_cache_tokens : num_kv_cache_tokens_) {
+    num_kv_cache_tokens = std::min(num_kv_cache_tokens, capacity);
+  }
+}
+
+void Sequence::swap_out_blocks(const std::vector<Block>& host_blocks) {
+  CHECK(host_blocks_.empty()) << "sequence is already swapped out";
+  CHECK(!host_blocks.empty()) << "no host blocks to swap out";
+  CHECK_EQ(num_released_blocks_, 0) << "released blocks can't be swapped";
+  // all kv cache should be covered by the host blocks
+  const size_t block_size = host_blocks[0].size();
+  CHECK_GE(host_blocks.size() * block_size,
+           num_kv_cache_tokens(EngineType::LLM));
+  host_blocks_ = host_blocks;
+  blocks_.clear();
+}
+
+void Sequence::swap_in_blocks(const std::vector<Block>& blocks) {
+  CHECK(blocks_.empty()) << "swap in blocks before any other blocks";
+  CHECK_EQ(blocks.size(), host_blocks_.size());
+  blocks_ = blocks;
+  host_blocks_.clear();
 }
 
 size_t Sequence::kv_cache_capacity() const {
   if (blocks_.empty()) {
     return 0;
   }
-  // all blocks have the same size
-  const size_t block_size = blocks_[0].size();
+  // all blocks have the same size, the leading ones may be released
+  const size_t block_size = blocks_.back().size();
   return blocks_.size() * block_size;
 }
 
@@ -216,7 +303,7 @@ std::vector<int32_t> Sequence::kv_cache_slots(int32_t pos_start,
   std::vector<int32_t> slots;
   slots.reserve(pos_end - pos_start);
 
-  const size_t block_size = blocks_[0].size();
+  const size_t block_size = blocks_.back().size();
   for (int32_t i = pos_start; i < pos_end; ++i) {
     const int32_t block_id = blocks_[i / block_size].id();
     const int32_t block_offset = i % block_size;
@@ -238,6 +325,13 @@ bool Sequence::is_cancelled() const {
   return is_cancelled_.load(std::memory_order_relaxed);
 }
 
+void Sequence::finish(FinishReason reason) {
+  CHECK(reason != FinishReason::NONE);
+  finish_reason_ = reason;
+  is_finished_ = true;
+  finish_status_invalidated_ = false;
+}
+
 bool Sequence::is_finished() const {
   // return the cached finish status
   if (!finish_status_invalidated_) {
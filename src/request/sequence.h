@@ -127,9 +127,47 @@ class Sequence final {
   // append shared cache blocks from prefix cache
   void append_shared_blocks(const std::vector<Block>& shared_blocks);
 
-  // release all cache blocks
+  // share the blocks holding the prompt with the parent sequence, which has
+  // the same prompt in kv cache. the last prompt token is recomputed to sample
+  // from, shared blocks are copied before any other token is written to them.
+  void fork_blocks_from(const Sequence& parent);
+
+  // replace the block at index, i.e. with a copy of a shared block
+  void replace_block(size_t index, const Block& block);
+
+  // release the leading blocks that are out of the sliding window of the next
+  // token to process. they are kept as invalid blocks in place so that a block
+  // index still maps to the same tokens.
+  void release_blocks_out_of_window(size_t sliding_window);
+
+  // get the number of leading blocks released out of the sliding window
+  size_t num_released_blocks() const { return num_released_blocks_; }
+
+  // release all cache blocks, including swapped out host blocks
   void release_blocks();
 
+  // release the last num_blocks cache blocks, the kv cache position is moved
+  // back to the end of the remaining blocks to recompute the dropped tokens.
+  void release_tail_blocks(size_t num_blocks);
+
+  // replace cache blocks with host blocks that hold a copy of the kv cache,
+  // the kv cache position is kept.
+  void swap_out_blocks(const std::vector<Block>& host_blocks);
+
+  // replace host blocks with cache blocks that the kv cache is copied into
+  void swap_in_blocks(const std::vector<Block>& blocks);
+
+  // returns host blocks that hold the swapped out kv cache
+  Slice<Block> host_blocks() const { return host_blocks_; }
+
+  // check if the kv cache is swapped out to host memory
+  bool is_swapped() const { return !host_blocks_.empty(); }
+
+  // check if the prompt is counted in the prefix cache statistics, each
+  // prompt is counted once even if it is matched again after preemption.
+  bool is_prefix_cache_counted() const { return prefix_cache_counted_; }
+  void set_prefix_cache_counted() { prefix_cache_counted_ = true; }
+
   // returns allocated cache blocks
   Slice<Block> blocks() const { return blocks_; }
 
@@ -162,6 +200,9 @@ class Sequence final {
   // check finish status, use cached value if not invalidated
   bool is_finished() const;
 
+  // finish the sequence early with the given reason
+  void finish(FinishReason reason);
+
   // set engine type this sequence is used for
   void set_engine_type(EngineType engine_type) {
     CHECK(engine_type < EngineType::COUNT) << "Invalid engine type.";
@@ -216,6 +257,15 @@ class Sequence final {
   // physical blocks that hold the kv cache.
   std::vector<Block> blocks_;
 
+  // number of leading blocks released out of the sliding window
+  size_t num_released_blocks_ = 0;
+
+  // host blocks that hold the kv cache when the sequence is swapped out.
+  std::vector<Block> host_blocks_;
+
+  // is the prompt counted in the prefix cache statistics
+  bool prefix_cache_counted_ = false;
+
   // is the sequence cancelled
   std::atomic_bool is_cancelled_{false};
 
@@ -212,4 +212,26 @@ TEST(SequenceTest, DiscardTokenIds) {
   EXPECT_EQ(sequence.token_ids().to_vector(), desired_tokens);
 }
 
+TEST(SequenceTest, FinishEarly) {
+  std::vector<int32_t> prompt_tokens = {1, 2, 4};
+  StoppingCriteria stopping_criteria;
+  stopping_criteria.max_tokens = 100;
+  stopping_criteria.ignore_eos_token = true;
+  SamplingParameter sampling_param;
+
+  Sequence sequence(prompt_tokens,
+                    sampling_param,
+                    stopping_criteria,
+                    /*echo=*/false,
+                    /*on_stream=*/nullptr);
+  EXPECT_FALSE(sequence.is_finished());
+  EXPECT_EQ(sequence.finish_reason(), FinishReason::NONE);
+
+  // finish the sequence before prefill, i.e. deadline exceeded
+  sequence.finish(FinishReason::DEADLINE_EXCEEDED);
+  EXPECT_TRUE(sequence.is_finished());
+  EXPECT_EQ(sequence.finish_reason(), FinishReason::DEADLINE_EXCEEDED);
+  EXPECT_EQ(sequence.num_generated_tokens(), 0);
+}
+
 }  // namespace llm
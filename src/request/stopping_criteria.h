@@ -11,11 +11,13 @@ namespace llm {
 // "stop" - the model hit a natural stop point or a provided stop sequence.
 // "length" - the maximum number of tokens specified in the request was reached.
 // "function_call" - the model called a function.
+// "deadline_exceeded" - the request can't be finished before its deadline.
 enum class FinishReason {
   NONE = 0,
   STOP = 1,
   LENGTH,
   FUNCTION_CALL,
+  DEADLINE_EXCEEDED,
 };
 
 // StoppingCriteria is used to specify stopping criterias for a
@@ -3,27 +3,177 @@
 #include <absl/time/clock.h>
 #include <absl/time/time.h>
 #include <folly/MPMCQueue.h>
+#include <folly/futures/Future.h>
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <cstdint>
+#include <iterator>
+#include <limits>
+#include <map>
 #include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
+#include "common/metrics.h"
 #include "engine/engine.h"
 #include "request/request.h"
 #include "request/sequence.h"
 
 DEFINE_int32(max_tokens_per_batch, 256, "max number of tokens per batch");
 DEFINE_int32(max_seqs_per_batch, 64, "max number of sequences per batch");
+DEFINE_bool(enable_schedule_overlap,
+            false,
+            "overlap the host side scheduling work with model execution. "
+            "waiting requests are matched against the prefix cache and get "
+            "blocks for their first chunk while the model runs, the batch "
+            "itself is still built between steps");
+DEFINE_double(prefill_cost_per_token_us,
+              50,
+              "initial estimate of the cost in microseconds to prefill one "
+              "token, replaced by the step latency measured per batched "
+              "token. used to decide between swapping and recomputation, "
+              "and to drop requests that can't finish prefill before their "
+              "deadline");
+DEFINE_string(scheduling_policy,
+              "fcfs",
+              "policy to order requests within the same priority level, "
+              "fcfs: first come first served, edf: earliest deadline first, "
+              "psa: shortest predicted remaining work first, fair_share: "
+              "weighted fair share across tenants");
+DEFINE_int32(max_queue_wait_ms,
+             0,
+             "reject new requests with RESOURCE_EXHAUSTED when the predicted "
+             "wait for kv cache exceeds this bound. the wait is predicted from "
+             "the max_tokens of admitted requests beyond the kv cache size, "
+             "requests that fit into the free blocks left by the waiting "
+             "requests are always admitted. before any request finishes, "
+             "the excess is assumed to wait 100ms per kv cache turnover. "
+             "0 to disable");
+DEFINE_int32(priority_aging_ms,
+             0,
+             "raise the priority of a waiting request by one level for every "
+             "period of this many milliseconds it waits, 0 to disable");
+DEFINE_double(low_priority_token_share,
+              0,
+              "fraction of the batch token budget in [0, 1) kept for LOW "
+              "priority requests while there are any, 0 to disable");
+DEFINE_int32(prefix_aware_reorder_window,
+             0,
+             "max number of queued requests in the same priority level to "
+             "reorder in favor of prefix cache hits, 0 to disable");
+DEFINE_int32(max_prefill_tokens_per_batch,
+             0,
+             "max number of prefill tokens per batch. when set, prefill and "
+             "decode sequences use separate token budgets, 0 to disable");
+DEFINE_int32(max_decode_tokens_per_batch,
+             0,
+             "max number of decode tokens per batch when prefill and decode "
+             "budgets are separated, 0 to use max_tokens_per_batch");
+DEFINE_int32(max_prefill_seqs_per_batch,
+             0,
+             "max number of sequences in prefill stage per batch, 0 for no "
+             "limit");
+DEFINE_double(target_tpot_ms,
+              0,
+              "target time per output token in milliseconds. the prefill "
+              "token budget adapts to measured step latency to meet it, 0 to "
+              "disable");
+DEFINE_int32(num_lookahead_decode_steps,
+             0,
+             "reserve blocks for this many future decode steps whenever a "
+             "decode sequence needs a new block, 0 to allocate on demand");
+DEFINE_double(kv_cache_watermark,
+              0,
+              "fraction of kv cache blocks in [0, 1) kept free at batch "
+              "formation for running sequences to grow. prefix cache blocks "
+              "are evicted to restore it and waiting requests are only "
+              "admitted above it, 0 to disable");
+DEFINE_double(prefix_cache_reclaim_target,
+              0,
+              "fraction of kv cache blocks in [0, 1) kept free by evicting "
+              "cold prefix cache blocks between steps, overlapped with the "
+              "model execution if --enable_schedule_overlap is set. batch "
+              "formation only evicts when the free blocks run out, 0 to "
+              "disable");
+DEFINE_double(swap_bandwidth_gbps,
+              16,
+              "estimated bandwidth in GB/s between device and host memory");
+DEFINE_int32(max_compaction_blocks_per_step,
+             0,
+             "max number of kv cache blocks copied per step to move the "
+             "blocks of scheduled sequences into runs of consecutive ids, "
+             "needs --enable_contiguous_block_allocation, 0 to disable");
 
-DECLARE_bool(enable_prefix_cache);
 DECLARE_int32(num_speculative_tokens);
 
 namespace llm {
 
+DEFINE_COUNTER(num_preemptions_total,
+               "Total number of requests preempted to free up cache blocks");
+DEFINE_COUNTER(num_priority_promotions_total,
+               "Total number of waiting requests promoted to a higher "
+               "priority by aging");
+DEFINE_COUNTER(num_released_tail_blocks_total,
+               "Total number of tail blocks released from preemptable "
+               "sequences to free up cache blocks");
+DEFINE_COUNTER(num_reclaimed_blocks_total,
+               "Total number of prefix cache blocks evicted between steps to "
+               "keep free blocks available");
+DEFINE_COUNTER(num_compacted_blocks_total,
+               "Total number of kv cache blocks copied to keep the blocks of "
+               "sequences contiguous");
+DEFINE_COUNTER(prefix_cache_query_tokens_total,
+               "Total number of prompt tokens looked up in the prefix cache");
+DEFINE_COUNTER(prefix_cache_hit_tokens_total,
+               "Total number of prompt tokens found in the prefix cache");
+
+namespace {
+
+// the request queue is drained every step, so it frees up quickly
+constexpr int64_t kQueueFullRetryAfterMs = 100;
+
+// number of tokens in the kv cache stored in the block at the index
+size_t num_kv_cache_tokens_in_block(const Sequence& sequence, size_t index) {
+  const auto blocks = sequence.blocks();
+  const size_t block_size = blocks[index].size();
+  const size_t start = index * block_size;
+  const size_t num_tokens = sequence.num_kv_cache_tokens(EngineType::LLM);
+  return start < num_tokens ? std::min(num_tokens - start, block_size) : 0;
+}
+
+// number of references to each block held by the sequences of the request,
+// sequences forked from the same prompt share blocks.
+std::unordered_map<int32_t, uint32_t> count_block_refs(const Request& request) {
+  std::unordered_map<int32_t, uint32_t> block_refs;
+  for (const auto& seq : request.sequences) {
+    for (const Block& block : seq.blocks()) {
+      if (block.is_valid()) {
+        ++block_refs[block.id()];
+      }
+    }
+  }
+  return block_refs;
+}
+
+// check if the block is kept after the request releases it, i.e. by the
+// prefix cache or another request.
+bool is_held_outside(const Block& block,
+                     const std::unordered_map<int32_t, uint32_t>& block_refs) {
+  const auto it = block_refs.find(block.id());
+  return it == block_refs.end() || block.ref_count() > it->second;
+}
+
+}  // namespace
+
 constexpr size_t kRequestQueueSize = 100000;
 
-ContinuousScheduler::ContinuousScheduler(Engine* engine)
-    : engine_(engine), request_queue_(kRequestQueueSize) {
+ContinuousScheduler::ContinuousScheduler(Engine* engine, const Clock* clock)
+    : engine_(engine),
+      clock_(clock != nullptr ? clock : SystemClock::instance()),
+      request_queue_(kRequestQueueSize) {
   CHECK(engine_ != nullptr);
   block_manager_ = engine_->block_manager();
   tokenizer_ = engine_->tokenizer();
@@ -32,6 +182,39 @@ ContinuousScheduler::ContinuousScheduler(Engine* engine)
 
   response_handler_ =
       std::make_unique<ResponseHandler>(block_manager_, tokenizer_.get());
+  policy_ = SchedulerPolicyFactory::create(
+      SchedulerPolicyType(FLAGS_scheduling_policy));
+
+  if (FLAGS_enable_schedule_overlap) {
+    engine_threadpool_ = std::make_unique<ThreadPool>();
+  }
+
+  CHECK(FLAGS_low_priority_token_share >= 0 &&
+        FLAGS_low_priority_token_share < 1)
+      << "low_priority_token_share must be in [0, 1)";
+  CHECK(FLAGS_kv_cache_watermark >= 0 && FLAGS_kv_cache_watermark < 1)
+      << "kv_cache_watermark must be in [0, 1)";
+  CHECK_GE(FLAGS_num_lookahead_decode_steps, 0);
+  watermark_blocks_ = static_cast<size_t>(
+      FLAGS_kv_cache_watermark *
+      static_cast<double>(block_manager_->num_total_blocks()));
+  CHECK(FLAGS_prefix_cache_reclaim_target >= 0 &&
+        FLAGS_prefix_cache_reclaim_target < 1)
+      << "prefix_cache_reclaim_target must be in [0, 1)";
+  reclaim_target_blocks_ = static_cast<size_t>(
+      FLAGS_prefix_cache_reclaim_target *
+      static_cast<double>(block_manager_->num_total_blocks()));
+
+  if (FLAGS_max_prefill_tokens_per_batch > 0) {
+    split_token_budget_ = true;
+    max_prefill_token_budget_ = FLAGS_max_prefill_tokens_per_batch;
+    prefill_token_budget_ = max_prefill_token_budget_;
+  }
+  prefill_cost_per_token_us_ = FLAGS_prefill_cost_per_token_us;
+  last_release_rate_update_ = clock_->now();
+  num_free_blocks_.store(
+      static_cast<int64_t>(block_manager_->num_free_blocks()),
+      std::memory_order_relaxed);
 }
 
 ContinuousScheduler::~ContinuousScheduler() {
@@ -42,11 +225,13 @@ ContinuousScheduler::~ContinuousScheduler() {
     std::unique_ptr<Request> request_ptr(request);
   }
 
-  // release all requests in the priority queue
-  while (!priority_queue_.empty()) {
-    Request* request = priority_queue_.top();
-    priority_queue_.pop();
-    std::unique_ptr<Request> request_ptr(request);
+  // release all requests in the priority queues
+  for (MinHeap* queue : {&priority_queue_, &low_priority_queue_}) {
+    while (!queue->empty()) {
+      Request* request = queue->top().request;
+      queue->pop();
+      std::unique_ptr<Request> request_ptr(request);
+    }
   }
 
   // release all running requests
@@ -56,20 +241,126 @@ ContinuousScheduler::~ContinuousScheduler() {
   running_requests_.clear();
 }
 
-bool ContinuousScheduler::schedule(std::unique_ptr<Request>& request) {
+bool ContinuousScheduler::schedule(std::unique_ptr<Request>& request,
+                                   absl::Duration* retry_after) {
   CHECK(request != nullptr);
   CHECK(!request->sequences.empty());
 
+  // reject early if the request would wait too long for kv cache
+  const int64_t demand_blocks = estimate_kv_cache_demand(request.get());
+  if (FLAGS_max_queue_wait_ms > 0) {
+    const auto max_queue_wait = absl::Milliseconds(FLAGS_max_queue_wait_ms);
+    const auto queue_wait = predict_queue_wait(demand_blocks);
+    if (queue_wait > max_queue_wait) {
+      if (retry_after != nullptr) {
+        *retry_after = queue_wait - max_queue_wait;
+      }
+      return false;
+    }
+  }
+
   if (request_queue_.write(request.get())) {
+    admitted_demand_blocks_.fetch_add(demand_blocks,
+                                      std::memory_order_relaxed);
     // take over the ownership of the request
     request.release();
+    // wake up the scheduler thread if it is waiting for new requests
+    absl::MutexLock lock(&request_mutex_);
+    has_new_requests_ = true;
     return true;
   }
   // queue is full
+  if (retry_after != nullptr) {
+    *retry_after = absl::Milliseconds(kQueueFullRetryAfterMs);
+  }
   return false;
 }
 
-Batch ContinuousScheduler::build_sequence_batch() {
+void ContinuousScheduler::enqueue(Request* request) {
+  // catch up on aging for requests coming back to the queue
+  age_request(request, clock_->now());
+  // evaluate the key once to keep the heap consistent
+  auto& queue = request->effective_priority == RequestPriority::LOW
+                    ? low_priority_queue_
+                    : priority_queue_;
+  queue.push({request, policy_->key(request)});
+}
+
+void ContinuousScheduler::age_requests(absl::Time now) {
+  if (FLAGS_priority_aging_ms <= 0 || now < next_aging_time_) {
+    return;
+  }
+  next_aging_time_ = absl::InfiniteFuture();
+  bool promoted = false;
+  for (QueuedRequest& queued : priority_queue_.container()) {
+    promoted |= age_request(queued.request, now);
+  }
+  // promoted LOW priority requests move to the priority queue
+  auto& low_priority_requests = low_priority_queue_.container();
+  size_t num_low_priority_requests = 0;
+  for (QueuedRequest& queued : low_priority_requests) {
+    if (age_request(queued.request, now)) {
+      priority_queue_.container().push_back(queued);
+      promoted = true;
+    } else {
+      low_priority_requests[num_low_priority_requests++] = queued;
+    }
+  }
+  if (num_low_priority_requests < low_priority_requests.size()) {
+    low_priority_requests.resize(num_low_priority_requests);
+    low_priority_queue_.rebuild();
+  }
+  if (promoted) {
+    priority_queue_.rebuild();
+  }
+
+  // running requests can starve too when they can't get blocks to grow
+  promoted = false;
+  for (Request* request : running_requests_) {
+    promoted |= age_request(request, now);
+  }
+  if (promoted) {
+    std::stable_sort(running_requests_.begin(),
+                     running_requests_.end(),
+                     [](const Request* a, const Request* b) {
+                       return a->effective_priority < b->effective_priority;
+                     });
+  }
+}
+
+bool ContinuousScheduler::age_request(Request* request, absl::Time now) {
+  if (FLAGS_priority_aging_ms <= 0 ||
+      request->effective_priority == RequestPriority::HIGH) {
+    return false;
+  }
+
+  // one level up for every aging period since the arrival
+  const auto aging_period = absl::Milliseconds(FLAGS_priority_aging_ms);
+  const int64_t num_periods =
+      std::max(now - request->arrival_time, absl::ZeroDuration()) /
+      aging_period;
+  const int64_t aged_priority = std::max<int64_t>(
+      static_cast<int64_t>(request->priority) - num_periods,
+      static_cast<int64_t>(RequestPriority::HIGH));
+
+  bool promoted = false;
+  if (aged_priority < static_cast<int64_t>(request->effective_priority)) {
+    if (request->effective_priority == RequestPriority::LOW) {
+      --num_low_priority_requests_;
+    }
+    request->effective_priority = static_cast<RequestPriority>(aged_priority);
+    num_priority_promotions_total.Increment();
+    promoted = true;
+  }
+  if (request->effective_priority != RequestPriority::HIGH) {
+    next_aging_time_ =
+        std::min(next_aging_time_,
+                 request->arrival_time + aging_period * (num_periods + 1));
+  }
+  return promoted;
+}
+
+void ContinuousScheduler::drain_request_queue() {
   // propogate new requests to priority_queue_
   while (!request_queue_.isEmpty()) {
     Request* request = nullptr;
@@ -77,40 +368,71 @@ Batch ContinuousScheduler::build_sequence_batch() {
     request_queue_.read(request);
     CHECK(request != nullptr);
 
-    // expand sequences to the target number if prefix cache is disabled.
-    if (!FLAGS_enable_prefix_cache) {
-      // expand sequences to the target number
-      request->expand_sequences();
+    request->arrival_time = clock_->now();
+    request->effective_priority = request->priority;
+    if (request->effective_priority == RequestPriority::LOW) {
+      ++num_low_priority_requests_;
     }
-
-    priority_queue_.push(request);
+    policy_->on_request_arrival(request);
+    enqueue(request);
   }
+}
 
-  // insert running requests back to the priority queue, iterating from the
-  // lowest priority to the highest
-  for (auto it = running_requests_.rbegin(); it != running_requests_.rend();
-       ++it) {
-    Request* request = *it;
+Batch ContinuousScheduler::build_sequence_batch() {
+  drain_request_queue();
+  age_requests(clock_->now());
+
+  // running requests stay in place across steps, only finished and expired
+  // ones are removed.
+  const auto now = clock_->now();
+  size_t num_running_requests = 0;
+  for (Request* request : running_requests_) {
     if (request->is_finished() || request->is_cancelled()) {
-      // release the ownership of the request
-      response_handler_->on_request_finish(std::unique_ptr<Request>(request));
+      finish_request(request);
+      continue;
+    }
+    if (is_deadline_unreachable(request, now)) {
+      finish_expired_request(request);
       continue;
     }
 
+    // cache the prompt blocks right after prefill so that queued requests
+    // sharing the prefix can reuse them.
+    if (FLAGS_prefix_aware_reorder_window > 0) {
+      Sequence& sequence = request->sequences[0];
+      if (sequence.num_kv_cache_tokens() == sequence.num_prompt_tokens() &&
+          !request->should_expand_sequences()) {
+        block_manager_->cache_blocks_for(&sequence);
+      }
+    }
+
     // check if the request can be expanded
     if (request->should_expand_sequences()) {
-      // cache the blocks to share among the sequences
+      // cache the blocks to share with other requests
       block_manager_->cache_blocks_for(&request->sequences[0]);
-      // expand sequences to the target number
+      // expand sequences to the target number, they share the prompt blocks
+      // of the first sequence instead of prefilling the prompt again.
       request->expand_sequences();
+      block_manager_->fork_blocks_for(request);
     }
 
-    // put it to the front of the preemptable queue as it has higher priority
-    preemptable_requests_.push_front(request);
-    // push the request back to the priority queue
-    priority_queue_.push(request);
+    running_requests_[num_running_requests++] = request;
+  }
+  running_requests_.resize(num_running_requests);
+
+  // restore the free blocks above the watermark before scheduling, so that
+  // running sequences rarely have to evict or preempt to grow.
+  if (watermark_blocks_ > 0 &&
+      block_manager_->num_free_blocks() < watermark_blocks_) {
+    block_manager_->evict_for_free_blocks(watermark_blocks_);
+  }
+
+  // requests in the same priority level are reordered for prefix cache hits,
+  // requests waiting for a shared prefix are put back after scheduling.
+  std::vector<Request*> prefix_deferred_requests;
+  if (FLAGS_prefix_aware_reorder_window > 0) {
+    prefix_deferred_requests = reorder_for_prefix_cache();
   }
-  running_requests_.clear();
 
   struct SequenceData {
     Sequence* sequence = nullptr;
@@ -134,19 +456,113 @@ Batch ContinuousScheduler::build_sequence_batch() {
                        max_seqs_per_batch * avg_sequence_token_budget);
   size_t remaining_seq_budget = max_seqs_per_batch;
 
-  // schedule the requests in the priority queue until budgets are exhausted
-  while (!priority_queue_.empty() &&
+  // separate budgets for prefill and decode sequences, only used when
+  // split_token_budget_ is enabled.
+  const size_t decode_token_budget = FLAGS_max_decode_tokens_per_batch > 0
+                                         ? FLAGS_max_decode_tokens_per_batch
+                                         : FLAGS_max_tokens_per_batch;
+  // tokens needed for one decode step
+  const size_t decode_step_tokens = 1 + FLAGS_num_speculative_tokens;
+  size_t remaining_prefill_budget = prefill_token_budget_;
+  size_t remaining_decode_budget =
+      std::max(decode_token_budget, decode_step_tokens);
+  size_t remaining_prefill_seqs = FLAGS_max_prefill_seqs_per_batch > 0
+                                      ? FLAGS_max_prefill_seqs_per_batch
+                                      : max_seqs_per_batch;
+  if (split_token_budget_) {
+    remaining_token_budget = remaining_prefill_budget + remaining_decode_budget;
+  }
+  // requests skipped due to the prefill budget, put back after scheduling
+  std::vector<Request*> deferred_requests;
+  // waiting requests scheduled in this step, which join the running requests
+  std::vector<Request*> admitted_requests;
+  num_decode_seqs_in_batch_ = 0;
+
+  // tokens kept for LOW priority requests, higher priority requests don't
+  // use them.
+  size_t reserved_token_budget = 0;
+  if (num_low_priority_requests_ > 0) {
+    reserved_token_budget = static_cast<size_t>(
+        FLAGS_low_priority_token_share *
+        static_cast<double>(remaining_token_budget));
+  }
+  // set when pending requests run out of their budget, the remaining running
+  // requests can still use the reserved tokens.
+  bool pending_exhausted = false;
+  // set when pending requests above LOW priority run out of their budget, the
+  // LOW priority requests waiting behind them can still use the reserved
+  // tokens.
+  bool low_priority_only = false;
+  auto has_pending = [&]() {
+    return !pending_exhausted && has_pending_requests(low_priority_only);
+  };
+
+  // running requests go before pending requests with the same priority
+  next_running_request_ = 0;
+  auto next_is_running = [&]() {
+    if (next_running_request_ >= running_requests_.size()) {
+      return false;
+    }
+    return !has_pending() ||
+           running_requests_[next_running_request_]->effective_priority <=
+               top_pending_request(low_priority_only)->effective_priority;
+  };
+  // move the request past the scheduling cursor
+  auto take_request = [&](Request* request, bool is_running) {
+    if (is_running) {
+      ++next_running_request_;
+    } else {
+      pop_pending_request(low_priority_only);
+      admitted_requests.push_back(request);
+      remove_prepared_request(request);
+    }
+  };
+
+  // schedule running and pending requests until budgets are exhausted
+  while ((next_running_request_ < running_requests_.size() || has_pending()) &&
          remaining_token_budget > FLAGS_num_speculative_tokens &&
          remaining_seq_budget > 0) {
-    Request* request = priority_queue_.top();
-    // TODO: check if request is timeout
+    const bool is_running = next_is_running();
+    Request* request = is_running ? running_requests_[next_running_request_]
+                                  : top_pending_request(low_priority_only);
+    // drop the request before burning compute if it can't meet its deadline
+    if (!is_running && is_deadline_unreachable(request, now)) {
+      pop_pending_request(low_priority_only);
+      finish_expired_request(request);
+      continue;
+    }
+
+    // requests above LOW priority leave the reserved tokens
+    size_t request_token_budget = remaining_token_budget;
+    if (request->effective_priority != RequestPriority::LOW) {
+      request_token_budget -=
+          std::min(reserved_token_budget, remaining_token_budget);
+    }
+    if (request_token_budget <= FLAGS_num_speculative_tokens) {
+      if (is_running) {
+        ++next_running_request_;
+      } else if (reserved_token_budget > 0 &&
+                 request->effective_priority != RequestPriority::LOW) {
+        // only the reserved tokens are left, skip to the LOW priority
+        // requests waiting behind.
+        low_priority_only = true;
+      } else {
+        pending_exhausted = true;
+      }
+      continue;
+    }
 
     std::vector<SequenceData> candidates;
     candidates.reserve(request->sequences.size());
 
     bool has_enough_blocks = true;
+    // blocks short of to schedule the sequence that failed to allocate
+    size_t num_missing_blocks = 0;
     size_t allocated_tokens = 0;
     size_t allocated_seqs = 0;
+    size_t allocated_prefill_tokens = 0;
+    size_t allocated_prefill_seqs = 0;
+    size_t allocated_decode_tokens = 0;
     for (Sequence& sequence : request->sequences) {
       // skip finished sequence.
       if (sequence.is_finished()) {
@@ -154,78 +570,149 @@ Batch ContinuousScheduler::build_sequence_batch() {
       }
       // no budget left
       if (allocated_tokens + FLAGS_num_speculative_tokens >=
-              remaining_token_budget ||
+              request_token_budget ||
           allocated_seqs >= remaining_seq_budget) {
         break;
       }
 
-      const size_t token_budget = std::min(
-          avg_sequence_token_budget, remaining_token_budget - allocated_tokens);
+      size_t token_budget = std::min(avg_sequence_token_budget,
+                                     request_token_budget - allocated_tokens);
+      const bool is_prefill = sequence.is_prefill_stage();
+      if (split_token_budget_) {
+        if (is_prefill) {
+          // prefill chunk is bounded by the adaptive prefill budget
+          if (allocated_prefill_seqs >= remaining_prefill_seqs ||
+              allocated_prefill_tokens + FLAGS_num_speculative_tokens >=
+                  remaining_prefill_budget) {
+            continue;
+          }
+          token_budget = std::min(
+              remaining_prefill_budget - allocated_prefill_tokens,
+              request_token_budget - allocated_tokens);
+        } else {
+          // decode sequence only needs tokens for one step
+          if (allocated_decode_tokens + decode_step_tokens >
+              remaining_decode_budget) {
+            continue;
+          }
+          token_budget = decode_step_tokens;
+        }
+      }
       size_t actual_tokens = 0;
+      // waiting requests are admitted only above the watermark
+      const size_t num_kept_blocks = is_running ? 0 : watermark_blocks_;
       // no blocks left
-      if (!allocate_blocks_for(&sequence, token_budget, &actual_tokens)) {
+      if (!allocate_blocks_for(
+              &sequence, token_budget, &actual_tokens, num_kept_blocks)) {
         has_enough_blocks = false;
+        const size_t block_size = block_manager_->block_size();
+        const size_t num_blocks_needed =
+            (sequence.num_kv_cache_tokens() + actual_tokens + block_size - 1) /
+            block_size;
+        const size_t num_free_blocks = block_manager_->num_free_blocks();
+        const size_t num_blocks_available =
+            sequence.num_blocks() + num_free_blocks -
+            std::min(num_free_blocks, num_kept_blocks);
+        num_missing_blocks = num_blocks_needed -
+                             std::min(num_blocks_needed, num_blocks_available);
         break;
       }
 
       // update the allocated tokens for the sequence
       allocated_tokens += actual_tokens;
       allocated_seqs += 1;
+      if (is_prefill) {
+        allocated_prefill_tokens += actual_tokens;
+        allocated_prefill_seqs += 1;
+      } else {
+        allocated_decode_tokens += actual_tokens;
+      }
       candidates.push_back({&sequence, actual_tokens});
     }
     CHECK(allocated_tokens <= remaining_token_budget);
     CHECK(allocated_seqs <= remaining_seq_budget);
 
+    // nothing fits into the separated budgets, try the next request
+    if (split_token_budget_ && has_enough_blocks && candidates.empty()) {
+      if (is_running) {
+        ++next_running_request_;
+      } else {
+        pop_pending_request(low_priority_only);
+        deferred_requests.push_back(request);
+      }
+      continue;
+    }
+
     // schedule candidates in the request if there are enough blocks
     if (has_enough_blocks) {
-      // remove the request from the priority queue
-      priority_queue_.pop();
+      take_request(request, is_running);
       // add the request to the batch
-      running_requests_.push_back(request);
       new_batch.insert(new_batch.end(), candidates.begin(), candidates.end());
+      policy_->on_request_scheduled(request, allocated_tokens);
       remaining_token_budget -= allocated_tokens;
       remaining_seq_budget -= allocated_seqs;
-
-      // the request has been scheduled and can't be preempted
-      if (!preemptable_requests_.empty() &&
-          request == preemptable_requests_.front()) {
-        preemptable_requests_.pop_front();
-      }
+      remaining_prefill_budget -=
+          std::min(remaining_prefill_budget, allocated_prefill_tokens);
+      remaining_prefill_seqs -=
+          std::min(remaining_prefill_seqs, allocated_prefill_seqs);
+      remaining_decode_budget -=
+          std::min(remaining_decode_budget, allocated_decode_tokens);
+      num_decode_seqs_in_batch_ += allocated_seqs - allocated_prefill_seqs;
       continue;
     }
 
-    // otherwise, preempt lowest priority request and retry
-    if (!preemptable_requests_.empty()) {
-      Request* request_to_preempt = preemptable_requests_.back();
-      preemptable_requests_.pop_back();
-
-      // avoid preempting the candidate itself
-      if (request_to_preempt != request) {
-        block_manager_->release_blocks_for(request_to_preempt);
-      }
+    // otherwise, reclaim blocks from lower priority requests and retry
+    if (reclaim_blocks_for(request, std::max<size_t>(num_missing_blocks, 1))) {
       continue;
     }
 
-    // no requests left to preempt, partially schedule the request
+    // no blocks left to reclaim, partially schedule the request
     if (!candidates.empty()) {
-      priority_queue_.pop();
-      running_requests_.push_back(request);
+      take_request(request, is_running);
       new_batch.insert(new_batch.end(), candidates.begin(), candidates.end());
+      policy_->on_request_scheduled(request, allocated_tokens);
       remaining_token_budget -= allocated_tokens;
       remaining_seq_budget -= allocated_seqs;
+      num_decode_seqs_in_batch_ += allocated_seqs - allocated_prefill_seqs;
     }
     break;
   }
 
-  // adjust the token number for each sequence if still have token budget left
-  if (remaining_token_budget > 0) {
+  // put back requests that were skipped for their budgets
+  for (Request* request : deferred_requests) {
+    enqueue(request);
+  }
+
+  // admitted requests join the running requests, sorted by priority
+  if (!admitted_requests.empty()) {
+    auto by_priority = [](const Request* a, const Request* b) {
+      return a->effective_priority < b->effective_priority;
+    };
+    std::stable_sort(
+        admitted_requests.begin(), admitted_requests.end(), by_priority);
+    const size_t num_running = running_requests_.size();
+    running_requests_.insert(running_requests_.end(),
+                             admitted_requests.begin(),
+                             admitted_requests.end());
+    std::inplace_merge(running_requests_.begin(),
+                       running_requests_.begin() + num_running,
+                       running_requests_.end(),
+                       by_priority);
+  }
+
+  // adjust the token number for each sequence if still have token budget left.
+  // skipped for separated budgets, where the prefill budget is already sized
+  // to meet the latency target.
+  if (!split_token_budget_ && remaining_token_budget > 0) {
     for (SequenceData& seq_data : new_batch) {
       // add previous allocated tokens back
       remaining_token_budget += seq_data.token_budget;
       size_t actual_tokens = 0;
-      // no memory left
-      if (!allocate_blocks_for(
-              seq_data.sequence, remaining_token_budget, &actual_tokens)) {
+      // no memory left above the watermark
+      if (!allocate_blocks_for(seq_data.sequence,
+                               remaining_token_budget,
+                               &actual_tokens,
+                               watermark_blocks_)) {
         break;
       }
       // update the allocated tokens for the sequence
@@ -240,20 +727,80 @@ Batch ContinuousScheduler::build_sequence_batch() {
     }
   }
 
-  if (new_batch.empty() && !priority_queue_.empty()) {
+  if (new_batch.empty() && (next_running_request_ < running_requests_.size() ||
+                            has_pending_requests())) {
     LOG(ERROR) << "No enough memory to schedule single sequence";
     // no enough memory to schedule single sequence, just finish the request
-    Request* request = priority_queue_.top();
-    priority_queue_.pop();
-    // release the ownership of the request
-    response_handler_->on_request_finish(std::unique_ptr<Request>(request));
+    Request* request = nullptr;
+    if (next_is_running()) {
+      request = running_requests_[next_running_request_];
+      running_requests_.erase(running_requests_.begin() +
+                              next_running_request_);
+    } else {
+      request = top_pending_request();
+      pop_pending_request();
+    }
+    finish_request(request);
+  }
+
+  // put back reordered requests that were not scheduled
+  for (Request* request : reordered_requests_) {
+    enqueue(request);
+  }
+  reordered_requests_.clear();
+  for (Request* request : prefix_deferred_requests) {
+    enqueue(request);
+  }
+
+  // defragment the blocks of scheduled sequences before their block tables
+  // are read by the batch
+  if (FLAGS_max_compaction_blocks_per_step > 0 && !new_batch.empty()) {
+    std::vector<Sequence*> sequences;
+    sequences.reserve(new_batch.size());
+    for (const SequenceData& seq_data : new_batch) {
+      sequences.push_back(seq_data.sequence);
+    }
+    const size_t num_compacted_blocks = block_manager_->compact_blocks_for(
+        sequences, FLAGS_max_compaction_blocks_per_step);
+    num_compacted_blocks_total.Increment(
+        static_cast<double>(num_compacted_blocks));
   }
 
   // update the batch
   Batch batch;
+  num_tokens_in_batch_ = 0;
+  num_prefill_tokens_in_batch_ = 0;
   for (const SequenceData& seq_data : new_batch) {
     batch.add(seq_data.sequence, seq_data.token_budget);
+    num_tokens_in_batch_ += seq_data.token_budget;
+    if (seq_data.sequence->is_prefill_stage()) {
+      num_prefill_tokens_in_batch_ += seq_data.token_budget;
+    }
+  }
+  // swaps have to be applied before the blocks are reused by this batch
+  if (!batch.empty()) {
+    batch.add_block_swaps(block_manager_->take_pending_block_swaps());
   }
+
+  // the prefix cache is only looked up while building batches
+  const PrefixCache& prefix_cache = block_manager_->prefix_cache();
+  prefix_cache_query_tokens_total.Increment(static_cast<double>(
+      prefix_cache.num_query_tokens() - num_prefix_cache_query_tokens_));
+  prefix_cache_hit_tokens_total.Increment(static_cast<double>(
+      prefix_cache.num_hit_tokens() - num_prefix_cache_hit_tokens_));
+  num_prefix_cache_query_tokens_ = prefix_cache.num_query_tokens();
+  num_prefix_cache_hit_tokens_ = prefix_cache.num_hit_tokens();
+
+  // published for admission control on other threads
+  int64_t running_demand_blocks = 0;
+  for (const Request* request : running_requests_) {
+    running_demand_blocks += estimate_kv_cache_demand(request);
+  }
+  running_demand_blocks_.store(running_demand_blocks,
+                               std::memory_order_relaxed);
+  num_free_blocks_.store(
+      static_cast<int64_t>(block_manager_->num_free_blocks()),
+      std::memory_order_relaxed);
   return batch;
 }
 
@@ -261,27 +808,49 @@ Batch ContinuousScheduler::build_sequence_batch() {
 // may get blocked if there are no requests to process
 void ContinuousScheduler::step(const absl::Duration& timeout) {
   // get a new batch of requests
-  const auto deadline = absl::Now() + timeout;
+  const auto deadline = clock_->now() + timeout;
   Batch batch;
   while (true) {
+    {
+      // requests arrived from now on would wake up the wait below
+      absl::MutexLock lock(&request_mutex_);
+      has_new_requests_ = false;
+    }
     batch = build_sequence_batch();
     if (!batch.empty()) {
       // find one batch of requests to process
       break;
     }
-    const auto now = absl::Now();
-    if (now > deadline) {
+    const auto now = clock_->now();
+    if (now >= deadline) {
       // no requests to process
       return;
     }
-    // wait for new requests to arrive
-    constexpr uint64_t kStepSleepTimeMs = 10;
-    const auto time_to_sleep =
-        std::min(absl::Milliseconds(kStepSleepTimeMs), deadline - now);
-    absl::SleepFor(time_to_sleep);
+
+    // wait for new requests to arrive. if there are pending requests that
+    // can't be scheduled, i.e. no enough memory, retry after a short while.
+    // the wait is bounded by a timeout since the clock may be simulated.
+    auto wait_timeout = deadline - now;
+    if (has_pending_requests() || !running_requests_.empty()) {
+      constexpr uint64_t kStepRetryTimeMs = 10;
+      wait_timeout =
+          std::min(wait_timeout, absl::Milliseconds(kStepRetryTimeMs));
+    }
+    absl::MutexLock lock(&request_mutex_);
+    request_mutex_.AwaitWithTimeout(absl::Condition(&has_new_requests_),
+                                    wait_timeout);
   }
 
-  engine_->execute_model(batch);
+  const auto step_start = clock_->now();
+  if (engine_threadpool_ != nullptr) {
+    execute_with_overlap(batch);
+  } else {
+    engine_->execute_model(batch);
+  }
+  const auto step_latency = clock_->now() - step_start;
+  update_prefill_token_budget(step_latency);
+  update_prefill_cost(step_latency);
+  update_demand_release_rate();
 
   // process sequence in batch
   for (int64_t i = 0; i < batch.size(); ++i) {
@@ -291,17 +860,693 @@ void ContinuousScheduler::step(const absl::Duration& timeout) {
       response_handler_->on_sequence_stream(seq);
     }
   }
+
+  // already done while the model was running with schedule overlap
+  if (engine_threadpool_ == nullptr) {
+    reclaim_free_blocks();
+  }
+}
+
+void ContinuousScheduler::reclaim_free_blocks() {
+  const size_t num_free_blocks = block_manager_->num_free_blocks();
+  if (num_free_blocks >= reclaim_target_blocks_) {
+    return;
+  }
+  // hold the prefixes that the requests at the head of the queues are about
+  // to hit, evicting them would only cost those requests a recomputation.
+  std::vector<Block> pinned_blocks;
+  const size_t max_seqs_per_batch = std::max(FLAGS_max_seqs_per_batch, 1);
+  for (const Request* request : head_pending_requests(max_seqs_per_batch)) {
+    for (const Sequence& sequence : request->sequences) {
+      if (sequence.is_finished() || sequence.num_blocks() > 0 ||
+          sequence.is_swapped()) {
+        continue;
+      }
+      auto blocks = block_manager_->cached_prompt_blocks(&sequence);
+      pinned_blocks.insert(pinned_blocks.end(),
+                           std::make_move_iterator(blocks.begin()),
+                           std::make_move_iterator(blocks.end()));
+      // the other sequences share the same prompt
+      break;
+    }
+  }
+  // evicted blocks are only held by the prefix cache, never by the batch in
+  // flight. blocks spilled to the host tier are copied with the next batch.
+  block_manager_->evict_for_free_blocks(reclaim_target_blocks_);
+  const size_t num_reclaimed_blocks =
+      block_manager_->num_free_blocks() - num_free_blocks;
+  num_reclaimed_blocks_total.Increment(
+      static_cast<double>(num_reclaimed_blocks));
+}
+
+std::vector<Request*> ContinuousScheduler::head_pending_requests(
+    size_t max_requests) const {
+  // requests above LOW priority go first, see top_pending_request()
+  auto in_order = [](const QueuedRequest& a, const QueuedRequest& b) {
+    return QueuedRequestGreater()(b, a);
+  };
+  std::vector<Request*> requests;
+  for (const MinHeap* queue : {&priority_queue_, &low_priority_queue_}) {
+    const auto& queued = queue->container();
+    const size_t num_requests =
+        std::min(queued.size(), max_requests - requests.size());
+    std::vector<QueuedRequest> head(num_requests);
+    std::partial_sort_copy(
+        queued.begin(), queued.end(), head.begin(), head.end(), in_order);
+    for (const QueuedRequest& entry : head) {
+      requests.push_back(entry.request);
+    }
+  }
+  return requests;
+}
+
+void ContinuousScheduler::update_prefill_token_budget(
+    const absl::Duration& step_latency) {
+  if (!split_token_budget_ || FLAGS_target_tpot_ms <= 0) {
+    return;
+  }
+
+  // no decode sequences in the batch, let prefill soak up the budget
+  double scale = 1.25;
+  const double latency_ms = absl::ToDoubleMilliseconds(step_latency);
+  if (num_decode_seqs_in_batch_ > 0 && latency_ms > 0) {
+    // shrink quickly when over the target, grow slowly when under it
+    scale = std::clamp(FLAGS_target_tpot_ms / latency_ms, 0.5, 1.1);
+  }
+
+  // keep at least one block worth of tokens for prefill to make progress
+  const size_t min_budget = std::min<size_t>(
+      max_prefill_token_budget_,
+      std::max<size_t>(block_manager_->block_size(),
+                       FLAGS_num_speculative_tokens + 1));
+  const auto budget =
+      static_cast<size_t>(static_cast<double>(prefill_token_budget_) * scale);
+  prefill_token_budget_ =
+      std::clamp(budget, min_budget, max_prefill_token_budget_);
+}
+
+void ContinuousScheduler::update_prefill_cost(
+    const absl::Duration& step_latency) {
+  // decode only steps are dominated by memory reads, not by prefill
+  if (num_prefill_tokens_in_batch_ == 0 || num_tokens_in_batch_ == 0) {
+    return;
+  }
+  // the step overhead and decode tokens are spread over all batched tokens,
+  // so the cost errs on the high side for small batches.
+  const double cost_us = absl::ToDoubleMicroseconds(step_latency) /
+                         static_cast<double>(num_tokens_in_batch_);
+  constexpr double kAlpha = 0.2;
+  prefill_cost_per_token_us_ =
+      kAlpha * cost_us + (1 - kAlpha) * prefill_cost_per_token_us_;
+}
+
+void ContinuousScheduler::execute_with_overlap(Batch& batch) {
+  folly::Promise<folly::Unit> promise;
+  auto future = promise.getSemiFuture();
+  engine_threadpool_->schedule(
+      [this, &batch, promise = std::move(promise)]() mutable {
+        // run the model in the engine thread
+        engine_->execute_model(batch);
+        promise.setValue();
+      });
+
+  // the sequences in the batch are owned by the engine thread until the
+  // execution finishes, only prepare requests waiting in the priority queue.
+  prepare_next_batch(batch.size());
+  // after the prepared requests took their prefix cache hits
+  reclaim_free_blocks();
+
+  // wait for the model execution to finish
+  std::move(future).get();
+}
+
+void ContinuousScheduler::prepare_next_batch(size_t num_inflight_seqs) {
+  drain_request_queue();
+
+  const size_t max_seqs_per_batch = std::max(FLAGS_max_seqs_per_batch, 1);
+  // in-flight sequences would most likely continue in the next step
+  if (num_inflight_seqs >= max_seqs_per_batch) {
+    return;
+  }
+  const size_t tokens_per_inflight_seq = 1 + FLAGS_num_speculative_tokens;
+  const size_t inflight_tokens = num_inflight_seqs * tokens_per_inflight_seq;
+  if (inflight_tokens >= FLAGS_max_tokens_per_batch) {
+    return;
+  }
+  size_t remaining_seq_budget = max_seqs_per_batch - num_inflight_seqs;
+  size_t remaining_token_budget = FLAGS_max_tokens_per_batch - inflight_tokens;
+  const size_t avg_sequence_token_budget =
+      std::max<size_t>(FLAGS_max_tokens_per_batch / max_seqs_per_batch,
+                       tokens_per_inflight_seq);
+
+  // keep one block for each in-flight sequence to grow, the allocation here
+  // should never cause preemption or eviction for running sequences.
+  const size_t block_size = block_manager_->block_size();
+  const size_t reserved_blocks = num_inflight_seqs + watermark_blocks_;
+
+  std::vector<Request*> visited;
+  bool has_enough_blocks = true;
+  while (has_pending_requests() && has_enough_blocks &&
+         remaining_seq_budget > 0 && remaining_token_budget > 0) {
+    Request* request = top_pending_request();
+    pop_pending_request();
+    visited.push_back(request);
+
+    for (Sequence& sequence : request->sequences) {
+      if (remaining_seq_budget == 0 || remaining_token_budget == 0) {
+        break;
+      }
+      // skip finished sequence and sequence already has blocks. swapped out
+      // sequences are brought back when they are scheduled.
+      if (sequence.is_finished() || sequence.num_blocks() > 0 ||
+          sequence.is_swapped()) {
+        continue;
+      }
+
+      // share blocks with the prefix cache first, restoring spilled blocks
+      // must leave the reserved blocks alone as well.
+      block_manager_->allocate_shared_blocks_for(&sequence, reserved_blocks);
+
+      // allocate blocks for the first prefill chunk
+      const size_t num_kv_cache_tokens = sequence.num_kv_cache_tokens();
+      const size_t token_budget =
+          std::min(avg_sequence_token_budget, remaining_token_budget);
+      const size_t num_tokens = std::min(num_kv_cache_tokens + token_budget,
+                                         sequence.num_tokens());
+      const size_t num_blocks_needed =
+          (num_tokens + block_size - 1) / block_size;
+      const size_t num_additional_blocks =
+          num_blocks_needed > sequence.num_blocks()
+              ? num_blocks_needed - sequence.num_blocks()
+              : 0;
+      if (num_additional_blocks + reserved_blocks >
+          block_manager_->num_free_blocks()) {
+        has_enough_blocks = false;
+        break;
+      }
+      if (num_additional_blocks > 0 &&
+          !block_manager_->allocate_blocks_for(&sequence, num_tokens)) {
+        has_enough_blocks = false;
+        break;
+      }
+      remaining_token_budget -= num_tokens - num_kv_cache_tokens;
+      --remaining_seq_budget;
+    }
+  }
+
+  // put the requests back, build_sequence_batch() will pick them up. the ones
+  // holding blocks can give them up again until they are scheduled.
+  for (Request* request : visited) {
+    const bool has_blocks =
+        std::any_of(request->sequences.begin(),
+                    request->sequences.end(),
+                    [](const Sequence& seq) { return seq.num_blocks() > 0; });
+    if (has_blocks && std::find(prepared_requests_.begin(),
+                                prepared_requests_.end(),
+                                request) == prepared_requests_.end()) {
+      prepared_requests_.push_back(request);
+    }
+    enqueue(request);
+  }
+}
+
+void ContinuousScheduler::remove_prepared_request(Request* request) {
+  auto it = std::find(
+      prepared_requests_.begin(), prepared_requests_.end(), request);
+  if (it != prepared_requests_.end()) {
+    prepared_requests_.erase(it);
+  }
+}
+
+bool ContinuousScheduler::has_pending_requests(bool low_priority_only) const {
+  if (low_priority_only) {
+    // reordered requests all have the same priority
+    return !low_priority_queue_.empty() ||
+           (!reordered_requests_.empty() &&
+            reordered_requests_.front()->effective_priority ==
+                RequestPriority::LOW);
+  }
+  return !reordered_requests_.empty() || !priority_queue_.empty() ||
+         !low_priority_queue_.empty();
+}
+
+Request* ContinuousScheduler::top_pending_request(
+    bool low_priority_only) const {
+  if (!reordered_requests_.empty() &&
+      (!low_priority_only ||
+       reordered_requests_.front()->effective_priority ==
+           RequestPriority::LOW)) {
+    return reordered_requests_.front();
+  }
+  if (!low_priority_only && !priority_queue_.empty()) {
+    return priority_queue_.top().request;
+  }
+  return low_priority_queue_.top().request;
+}
+
+void ContinuousScheduler::pop_pending_request(bool low_priority_only) {
+  if (!reordered_requests_.empty() &&
+      (!low_priority_only ||
+       reordered_requests_.front()->effective_priority ==
+           RequestPriority::LOW)) {
+    reordered_requests_.pop_front();
+    return;
+  }
+  if (!low_priority_only && !priority_queue_.empty()) {
+    priority_queue_.pop();
+    return;
+  }
+  low_priority_queue_.pop();
+}
+
+std::vector<Request*> ContinuousScheduler::reorder_for_prefix_cache() {
+  CHECK(reordered_requests_.empty());
+  MinHeap& queue =
+      priority_queue_.empty() ? low_priority_queue_ : priority_queue_;
+  if (queue.empty()) {
+    return {};
+  }
+
+  // take a window of requests with the same priority from the queue
+  const auto priority = queue.top().request->effective_priority;
+  std::vector<Request*> window;
+  const size_t window_size = FLAGS_prefix_aware_reorder_window;
+  while (!queue.empty() && window.size() < window_size &&
+         queue.top().request->effective_priority == priority) {
+    window.push_back(queue.top().request);
+    queue.pop();
+  }
+
+  const size_t block_size = block_manager_->block_size();
+  // requests that have been moved back too many times keep their position
+  const size_t max_bypass = window_size;
+
+  struct Candidate {
+    Request* request = nullptr;
+    // number of prompt tokens in the prefix cache
+    size_t num_cached_tokens = 0;
+    // position in the window before reordering
+    size_t position = 0;
+  };
+  // requests that can be moved around, in the original order
+  std::vector<Candidate> movable;
+  std::vector<size_t> movable_slots;
+  // groups of requests sharing the first uncached block, keyed by the number
+  // of cached tokens and the tokens in the first uncached block
+  std::map<std::pair<size_t, std::vector<int32_t>>, Request*> prefix_groups;
+  std::vector<Request*> deferred;
+  std::vector<Request*> reordered(window.size(), nullptr);
+  for (size_t i = 0; i < window.size(); ++i) {
+    Request* request = window[i];
+    const Sequence& sequence = request->sequences[0];
+    if (!sequence.is_prefill_stage() || sequence.is_swapped()) {
+      // only prefill requests can benefit from the prefix cache
+      reordered[i] = request;
+      continue;
+    }
+
+    const size_t num_cached_tokens =
+        block_manager_->num_cached_prompt_tokens(&sequence);
+    const bool started =
+        sequence.num_blocks() > 0 || sequence.num_kv_cache_tokens() > 0;
+    // group requests sharing an uncached prefix, the first one is the leader
+    const size_t num_prompt_tokens = sequence.num_prompt_tokens();
+    if (num_cached_tokens + block_size <= num_prompt_tokens) {
+      const auto prompt_tokens = sequence.token_ids();
+      std::vector<int32_t> first_uncached_block(
+          prompt_tokens.begin() + num_cached_tokens,
+          prompt_tokens.begin() + num_cached_tokens + block_size);
+      auto [it, inserted] = prefix_groups.try_emplace(
+          {num_cached_tokens, std::move(first_uncached_block)}, request);
+      if (!inserted && !started && request->num_bypassed < max_bypass) {
+        // wait for the leader to prefill the shared prefix
+        request->num_bypassed += 1;
+        deferred.push_back(request);
+        continue;
+      }
+    }
+
+    if (started || request->num_bypassed >= max_bypass) {
+      // keep the position for running or starving requests
+      reordered[i] = request;
+      continue;
+    }
+    movable.push_back({request, num_cached_tokens, i});
+    movable_slots.push_back(i);
+  }
+
+  // prefer requests with more cached prompt tokens
+  std::stable_sort(movable.begin(),
+                   movable.end(),
+                   [](const Candidate& a, const Candidate& b) {
+                     return a.num_cached_tokens > b.num_cached_tokens;
+                   });
+  for (size_t i = 0; i < movable.size(); ++i) {
+    const size_t slot = movable_slots[i];
+    if (slot > movable[i].position) {
+      movable[i].request->num_bypassed += 1;
+    }
+    reordered[slot] = movable[i].request;
+  }
+
+  for (Request* request : reordered) {
+    if (request != nullptr) {
+      reordered_requests_.push_back(request);
+    }
+  }
+  return deferred;
+}
+
+bool ContinuousScheduler::is_deadline_unreachable(const Request* request,
+                                                  absl::Time now) const {
+  if (!request->has_deadline()) {
+    return false;
+  }
+  if (now >= request->deadline) {
+    return true;
+  }
+
+  // estimate the time to finish the remaining prefill
+  size_t num_prefill_tokens = 0;
+  for (const auto& seq : request->sequences) {
+    if (!seq.is_finished() && seq.is_prefill_stage()) {
+      num_prefill_tokens += seq.num_prompt_tokens() - seq.num_kv_cache_tokens();
+    }
+  }
+  const auto prefill_time =
+      absl::Microseconds(static_cast<double>(num_prefill_tokens) *
+                         prefill_cost_per_token_us_);
+  return now + prefill_time > request->deadline;
+}
+
+void ContinuousScheduler::finish_expired_request(Request* request) {
+  request->finish(FinishReason::DEADLINE_EXCEEDED);
+
+  // stream the finish reason to the client
+  if (request->stream) {
+    for (Sequence& seq : request->sequences) {
+      response_handler_->on_sequence_stream(&seq);
+    }
+  }
+  finish_request(request);
+}
+
+void ContinuousScheduler::finish_request(Request* request) {
+  policy_->on_request_finish(request);
+  remove_prepared_request(request);
+  if (request->effective_priority == RequestPriority::LOW) {
+    --num_low_priority_requests_;
+  }
+
+  // the kv cache demand of the request is released
+  const int64_t demand_blocks = estimate_kv_cache_demand(request);
+  admitted_demand_blocks_.fetch_sub(demand_blocks, std::memory_order_relaxed);
+  released_demand_blocks_ += demand_blocks;
+
+  // release the ownership of the request
+  response_handler_->on_request_finish(std::unique_ptr<Request>(request));
+}
+
+int64_t ContinuousScheduler::estimate_kv_cache_demand(
+    const Request* request) const {
+  const size_t num_prompt_tokens = request->num_prompt_tokens();
+  const auto& stopping_criteria = request->stopping_criteria;
+  size_t max_tokens = stopping_criteria.max_tokens;
+  if (stopping_criteria.max_context_length > 0) {
+    // the sequence can't grow beyond the max context length
+    const size_t max_context_length = stopping_criteria.max_context_length;
+    const size_t max_output_tokens =
+        max_context_length > num_prompt_tokens
+            ? max_context_length - num_prompt_tokens
+            : 0;
+    max_tokens = max_tokens > 0 ? std::min(max_tokens, max_output_tokens)
+                                : max_output_tokens;
+  }
+  // prompt is shared among sequences
+  const size_t num_tokens = num_prompt_tokens + request->num_seqs * max_tokens;
+  const size_t block_size = block_manager_->block_size();
+  return static_cast<int64_t>((num_tokens + block_size - 1) / block_size);
+}
+
+absl::Duration ContinuousScheduler::predict_queue_wait(
+    int64_t demand_blocks) const {
+  const int64_t admitted_demand_blocks =
+      admitted_demand_blocks_.load(std::memory_order_relaxed);
+  // requests admitted since the last batch and the ones left in the queue
+  // take the free blocks first
+  const int64_t waiting_demand_blocks = std::max<int64_t>(
+      admitted_demand_blocks -
+          running_demand_blocks_.load(std::memory_order_relaxed),
+      0);
+  // the request can start right away
+  if (waiting_demand_blocks + demand_blocks <=
+      num_free_blocks_.load(std::memory_order_relaxed)) {
+    return absl::ZeroDuration();
+  }
+  const int64_t total_demand_blocks = admitted_demand_blocks + demand_blocks;
+  // free blocks and reclaimable prefix cache blocks are covered by the total
+  const int64_t num_total_blocks =
+      static_cast<int64_t>(block_manager_->num_total_blocks());
+  const int64_t excess_blocks = total_demand_blocks - num_total_blocks;
+  if (excess_blocks <= 0) {
+    return absl::ZeroDuration();
+  }
+  const double release_rate =
+      demand_release_rate_.load(std::memory_order_relaxed);
+  if (release_rate <= 0) {
+    // no request has finished yet, assume the excess waits for the kv cache
+    // to turn over at least once per retry period.
+    const int64_t num_turnovers =
+        (excess_blocks + num_total_blocks - 1) / num_total_blocks;
+    return absl::Milliseconds(kQueueFullRetryAfterMs) * num_turnovers;
+  }
+  return absl::Seconds(static_cast<double>(excess_blocks) / release_rate);
+}
+
+void ContinuousScheduler::update_demand_release_rate() {
+  const auto now = clock_->now();
+  const auto elapsed = now - last_release_rate_update_;
+  constexpr int64_t kReleaseRateWindowMs = 1000;
+  if (elapsed < absl::Milliseconds(kReleaseRateWindowMs)) {
+    return;
+  }
+  // idle periods don't count toward the release rate, but a window with
+  // running requests and no releases decays it.
+  if (released_demand_blocks_ > 0 || !running_requests_.empty()) {
+    const double rate = static_cast<double>(released_demand_blocks_) /
+                        absl::ToDoubleSeconds(elapsed);
+    const double prev_rate =
+        demand_release_rate_.load(std::memory_order_relaxed);
+    // exponential moving average to smooth out bursts
+    demand_release_rate_.store(prev_rate > 0 ? 0.5 * prev_rate + 0.5 * rate
+                                             : rate,
+                               std::memory_order_relaxed);
+  }
+  released_demand_blocks_ = 0;
+  last_release_rate_update_ = now;
+}
+
+bool ContinuousScheduler::reclaim_blocks_for(const Request* request,
+                                             size_t num_blocks) {
+  // waiting requests prepared under schedule overlap hold no kv cache beyond
+  // their prefix cache hits, they give up their blocks before any running
+  // request loses work. the lowest priority goes first, ties go to the last
+  // prepared. prepared requests with a higher priority keep their blocks.
+  size_t prepared_victim_idx = prepared_requests_.size();
+  for (size_t i = 0; i < prepared_requests_.size(); ++i) {
+    const Request* victim = prepared_requests_[i];
+    if (victim == request ||
+        victim->effective_priority < request->effective_priority) {
+      continue;
+    }
+    if (prepared_victim_idx == prepared_requests_.size() ||
+        victim->effective_priority >=
+            prepared_requests_[prepared_victim_idx]->effective_priority) {
+      prepared_victim_idx = i;
+    }
+  }
+  if (prepared_victim_idx < prepared_requests_.size()) {
+    Request* victim = prepared_requests_[prepared_victim_idx];
+    prepared_requests_.erase(prepared_requests_.begin() + prepared_victim_idx);
+    block_manager_->release_blocks_for(victim);
+    return true;
+  }
+
+  // running requests not scheduled in this step yet can be preempted, the
+  // candidate itself is never preempted. victims with the lowest priority go
+  // first, then the cheapest way to reclaim blocks, measured by the cost of
+  // lost work per reclaimed block. blocks beyond num_blocks are not worth
+  // anything.
+  size_t best_victim_idx = 0;
+  Request* best_victim = nullptr;
+  // the sequence to release tail blocks from, nullptr to preempt the request
+  Sequence* best_sequence = nullptr;
+  size_t best_num_tail_blocks = 0;
+  size_t best_num_reclaimed_blocks = 0;
+  double best_cost_per_block = std::numeric_limits<double>::infinity();
+  auto consider = [&](size_t victim_idx,
+                      Sequence* sequence,
+                      size_t num_reclaimed_blocks,
+                      double cost_us) {
+    num_reclaimed_blocks = std::min(num_reclaimed_blocks, num_blocks);
+    if (num_reclaimed_blocks == 0) {
+      return;
+    }
+    const Request* victim = running_requests_[victim_idx];
+    const double cost_per_block =
+        cost_us / static_cast<double>(num_reclaimed_blocks);
+    bool is_better = best_victim == nullptr;
+    if (!is_better &&
+        victim->effective_priority != best_victim->effective_priority) {
+      is_better = victim->effective_priority > best_victim->effective_priority;
+    } else if (!is_better) {
+      is_better = cost_per_block < best_cost_per_block ||
+                  (cost_per_block == best_cost_per_block &&
+                   num_reclaimed_blocks > best_num_reclaimed_blocks);
+    }
+    if (is_better) {
+      best_victim_idx = victim_idx;
+      best_victim = running_requests_[victim_idx];
+      best_sequence = sequence;
+      best_num_tail_blocks = sequence != nullptr ? num_reclaimed_blocks : 0;
+      best_num_reclaimed_blocks = num_reclaimed_blocks;
+      best_cost_per_block = cost_per_block;
+    }
+  };
+
+  // from the last admitted to the first, ties go to the last admitted
+  for (size_t i = running_requests_.size(); i-- > next_running_request_;) {
+    Request* victim = running_requests_[i];
+    if (victim == request) {
+      continue;
+    }
+
+    // release the exclusive tail blocks of a sequence, only the tokens in
+    // the released blocks are recomputed. considered first to win ties since
+    // the victim keeps running. speculative decoding expects the kv cache of
+    // decode sequences to be up to date, so no partial releases.
+    if (FLAGS_num_speculative_tokens == 0) {
+      for (auto& seq : victim->sequences) {
+        const auto blocks = seq.blocks();
+        size_t num_tail_blocks = 0;
+        size_t num_lost_tokens = 0;
+        while (num_tail_blocks < std::min(blocks.size(), num_blocks)) {
+          const size_t index = blocks.size() - num_tail_blocks - 1;
+          if (blocks[index].is_shared() || !blocks[index].is_valid()) {
+            break;
+          }
+          num_lost_tokens += num_kv_cache_tokens_in_block(seq, index);
+          ++num_tail_blocks;
+        }
+        // nothing to recompute for finished sequences
+        const double cost_us = seq.is_finished()
+                                   ? 0
+                                   : static_cast<double>(num_lost_tokens) *
+                                         prefill_cost_per_token_us_;
+        consider(i, &seq, num_tail_blocks, cost_us);
+      }
+    }
+
+    // preempt the whole request, blocks held outside of the request, i.e. by
+    // the prefix cache, are not reclaimed. blocks shared only between its
+    // sequences are freed once.
+    const auto block_refs = count_block_refs(*victim);
+    std::unordered_set<int32_t> exclusive_block_ids;
+    for (const auto& seq : victim->sequences) {
+      for (const Block& block : seq.blocks()) {
+        if (block.is_valid() && !is_held_outside(block, block_refs)) {
+          exclusive_block_ids.insert(block.id());
+        }
+      }
+    }
+    const size_t num_exclusive_blocks = exclusive_block_ids.size();
+    consider(i,
+             /*sequence=*/nullptr,
+             num_exclusive_blocks,
+             std::min(recompute_cost_us(victim), swap_cost_us(victim)));
+  }
+
+  if (best_victim == nullptr) {
+    return false;
+  }
+  if (best_sequence != nullptr) {
+    // the victim keeps running with a shorter kv cache
+    num_released_tail_blocks_total.Increment(
+        static_cast<double>(best_num_tail_blocks));
+    block_manager_->release_tail_blocks_for(best_sequence,
+                                            best_num_tail_blocks);
+  } else {
+    // the victim waits in the priority queue to be scheduled again
+    running_requests_.erase(running_requests_.begin() + best_victim_idx);
+    preempt(best_victim);
+    enqueue(best_victim);
+  }
+  return true;
+}
+
+void ContinuousScheduler::preempt(Request* request) {
+  num_preemptions_total.Increment();
+  if (should_swap_out(request) &&
+      block_manager_->swap_out_blocks_for(request)) {
+    return;
+  }
+  // fall back to recomputation
+  block_manager_->release_blocks_for(request);
+}
+
+bool ContinuousScheduler::should_swap_out(const Request* request) const {
+  // compare the cost of recomputing kv cache with copying blocks back and forth
+  return swap_cost_us(request) < recompute_cost_us(request);
+}
+
+double ContinuousScheduler::recompute_cost_us(const Request* request) const {
+  // blocks held outside of the request are kept after the release, i.e. by
+  // the prefix cache. blocks shared only between its sequences are lost, and
+  // their tokens are recomputed once.
+  const auto block_refs = count_block_refs(*request);
+  std::unordered_set<int32_t> lost_block_ids;
+  size_t num_lost_tokens = 0;
+  for (const auto& seq : request->sequences) {
+    // finished sequences are not scheduled again
+    if (seq.is_finished()) {
+      continue;
+    }
+    const auto blocks = seq.blocks();
+    for (size_t i = 0; i < blocks.size(); ++i) {
+      if (!blocks[i].is_valid() || is_held_outside(blocks[i], block_refs) ||
+          !lost_block_ids.insert(blocks[i].id()).second) {
+        continue;
+      }
+      num_lost_tokens += num_kv_cache_tokens_in_block(seq, i);
+    }
+  }
+  return static_cast<double>(num_lost_tokens) * prefill_cost_per_token_us_;
+}
+
+double ContinuousScheduler::swap_cost_us(const Request* request) const {
+  // blocks shared between the sequences are copied once each way
+  const size_t num_blocks = count_block_refs(*request).size();
+  if (num_blocks == 0 || num_blocks > block_manager_->num_free_host_blocks()) {
+    return std::numeric_limits<double>::infinity();
+  }
+
+  const int64_t block_size_in_bytes = block_manager_->block_size_in_bytes();
+  const double swap_bytes = 2.0 * static_cast<double>(num_blocks) *
+                            static_cast<double>(block_size_in_bytes);
+  // GB/s => bytes/us
+  return swap_bytes / (FLAGS_swap_bandwidth_gbps * 1e3);
 }
 
 bool ContinuousScheduler::allocate_blocks_for(Sequence* sequence,
                                               size_t token_budget,
-                                              size_t* actual_tokens) {
+                                              size_t* actual_tokens,
+                                              size_t num_kept_blocks) {
   // token budget should be large enough for one speculative decoding step
   CHECK_GT(token_budget, FLAGS_num_speculative_tokens);
 
   if (sequence->num_blocks() == 0) {
     // need to allocate shared blocks explicitly to avoid kv_cache_pos change
-    block_manager_->allocate_shared_blocks_for(sequence);
+    block_manager_->allocate_shared_blocks_for(sequence, num_kept_blocks);
   }
 
   // number of tokens in the kv cache, which are already processed
@@ -332,6 +1577,42 @@ bool ContinuousScheduler::allocate_blocks_for(Sequence* sequence,
   // the actual allocated tokens is the difference between the total
   // number of tokens and the number of tokens already processed
   *actual_tokens = num_tokens - num_kv_cache_tokens;
+
+  const size_t block_size = block_manager_->block_size();
+  const size_t num_blocks = sequence->num_blocks();
+  const size_t num_blocks_needed = (num_tokens + block_size - 1) / block_size;
+  if (num_blocks_needed <= num_blocks) {
+    // fits into the blocks allocated or reserved before
+    return block_manager_->allocate_blocks_for(sequence, num_tokens);
+  }
+  const size_t num_additional_blocks = num_blocks_needed - num_blocks;
+  if (num_kept_blocks > 0 &&
+      !block_manager_->evict_for_free_blocks(num_additional_blocks +
+                                             num_kept_blocks)) {
+    return false;
+  }
+
+  // reserve blocks for the next decode steps from the free blocks above the
+  // watermark, the following steps fill them without allocating.
+  if (FLAGS_num_lookahead_decode_steps > 0 && num_tokens >= num_prompt_tokens &&
+      !sequence->is_swapped()) {
+    const size_t max_tokens = sequence->stopping_criteria()->max_tokens;
+    size_t num_lookahead_tokens =
+        num_tokens + static_cast<size_t>(FLAGS_num_lookahead_decode_steps) *
+                         (1 + FLAGS_num_speculative_tokens);
+    if (max_tokens > 0) {
+      num_lookahead_tokens = std::min(
+          num_lookahead_tokens,
+          num_prompt_tokens + max_tokens + FLAGS_num_speculative_tokens);
+    }
+    const size_t num_lookahead_blocks =
+        (num_lookahead_tokens + block_size - 1) / block_size - num_blocks;
+    if (num_lookahead_blocks > num_additional_blocks &&
+        num_lookahead_blocks + std::max(num_kept_blocks, watermark_blocks_) <=
+            block_manager_->num_free_blocks()) {
+      num_tokens = std::max(num_tokens, num_lookahead_tokens);
+    }
+  }
   // allocate blocks for the sequence
   return block_manager_->allocate_blocks_for(sequence, num_tokens);
 }
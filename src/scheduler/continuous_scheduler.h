@@ -1,16 +1,25 @@
 #pragma once
 
+#include <absl/base/thread_annotations.h>
+#include <absl/synchronization/mutex.h>
 #include <absl/time/time.h>
 #include <folly/MPMCQueue.h>
 
+#include <algorithm>
+#include <atomic>
+#include <deque>
 #include <memory>
 #include <queue>
+#include <vector>
 
+#include "common/clock.h"
+#include "common/threadpool.h"
 #include "engine/batch.h"
 #include "memory/block_manager.h"
 #include "request/request.h"
 #include "response_handler.h"
 #include "scheduler.h"
+#include "scheduler_policy.h"
 
 namespace llm {
 class Engine;
@@ -19,13 +28,17 @@ class Engine;
 // number of seqs per batch and the time out value.
 class ContinuousScheduler final : public Scheduler {
  public:
-  ContinuousScheduler(Engine* engine);
+  // clock is used for time based decisions, i.e. deadlines and latency
+  // feedback, defaults to the wall clock.
+  explicit ContinuousScheduler(Engine* engine, const Clock* clock = nullptr);
 
   ~ContinuousScheduler();
 
   // schedule a request, thread safe and non-blocking
   // may return false if the queue is full
-  bool schedule(std::unique_ptr<Request>& request) override;
+  bool schedule(std::unique_ptr<Request>& request,
+                absl::Duration* retry_after) override;
+  using Scheduler::schedule;
 
   // step the scheduler forward by one step
   // may get blocked if there are no requests to process
@@ -35,19 +48,123 @@ class ContinuousScheduler final : public Scheduler {
   // get a batch of requests from the priority queue
   Batch build_sequence_batch();
 
+  // move new requests from the request queue to the priority queue
+  void drain_request_queue();
+
+  // push the request into the priority queue with the key from the policy
+  void enqueue(Request* request);
+
+  // raise the effective priority of unfinished requests by one level for
+  // every --priority_aging_ms since their arrival. the priority queue and the
+  // running requests are only reordered when a request is promoted.
+  void age_requests(absl::Time now);
+
+  // raise the effective priority of the request by its waiting time, returns
+  // true if it is promoted.
+  bool age_request(Request* request, absl::Time now);
+
+  // pending requests are taken from reordered_requests_ first, then from the
+  // priority queue and the LOW priority queue. low_priority_only skips the
+  // requests above LOW priority.
+  bool has_pending_requests(bool low_priority_only = false) const;
+  Request* top_pending_request(bool low_priority_only = false) const;
+  void pop_pending_request(bool low_priority_only = false);
+
+  // reorder a bounded window of requests with the top priority in favor of
+  // prefix cache hits into reordered_requests_. returns requests deferred to
+  // reuse the prefix from another request in the window.
+  std::vector<Request*> reorder_for_prefix_cache();
+
+  // run the batch on the engine thread and overlap the host side work for the
+  // next step with the model execution.
+  void execute_with_overlap(Batch& batch);
+
+  // prepare waiting requests for the next step while the current batch is
+  // being executed, including prefix matching and block allocation.
+  // only touches requests that are not in flight. requests holding blocks
+  // are tracked in prepared_requests_ until they are scheduled.
+  void prepare_next_batch(size_t num_inflight_seqs);
+
+  // stop tracking the request as prepared, i.e. once it is scheduled
+  void remove_prepared_request(Request* request);
+
+  // evict cold prefix cache blocks between steps until reclaim_target_blocks_
+  // blocks are free, so that batch formation rarely has to evict. prefixes of
+  // the requests at the head of the queues are kept.
+  void reclaim_free_blocks();
+
+  // get up to max_requests waiting requests in the order they are scheduled,
+  // without taking them out of the queues.
+  std::vector<Request*> head_pending_requests(size_t max_requests) const;
+
+  // adapt the prefill token budget to the measured step latency so that
+  // decode sequences stay within the target time per output token.
+  void update_prefill_token_budget(const absl::Duration& step_latency);
+
+  // track the cost of one prefill token from the measured step latency
+  void update_prefill_cost(const absl::Duration& step_latency);
+
+  // check if the request can't be finished before its deadline, taking the
+  // estimated time of the remaining prefill into account.
+  bool is_deadline_unreachable(const Request* request, absl::Time now) const;
+
+  // finish the request with DEADLINE_EXCEEDED and release it
+  void finish_expired_request(Request* request);
+
+  // release the request and hand it over to the response handler
+  void finish_request(Request* request);
+
+  // estimate the kv cache blocks needed by the request, including the prompt
+  // and max_tokens for each sequence. thread safe.
+  int64_t estimate_kv_cache_demand(const Request* request) const;
+
+  // predict how long a new request with the given kv cache demand would wait
+  // for kv cache blocks. thread safe.
+  absl::Duration predict_queue_wait(int64_t demand_blocks) const;
+
+  // update the rate that kv cache demand is released by finished requests
+  void update_demand_release_rate();
+
+  // free up num_blocks cache blocks for the request, from the prepared waiting
+  // requests first and then from the running requests not scheduled yet at
+  // the lowest priority level. picks the victim that loses the least work per
+  // reclaimed block, either releasing the tail blocks of a sequence or
+  // preempting a whole request. returns false if no blocks can be reclaimed.
+  bool reclaim_blocks_for(const Request* request, size_t num_blocks);
+
+  // preempt the request to free up cache blocks, either by swapping its kv
+  // cache out to host memory or by releasing it for recomputation.
+  void preempt(Request* request);
+
+  // returns true if swapping the request out is cheaper than recomputing it.
+  bool should_swap_out(const Request* request) const;
+
+  // estimated cost in microseconds to recompute the kv cache lost by
+  // releasing the request, kv cache kept by the prefix cache is not counted.
+  double recompute_cost_us(const Request* request) const;
+
+  // estimated cost in microseconds to swap the request out and back in,
+  // infinite if the request can't be swapped out.
+  double swap_cost_us(const Request* request) const;
+
   // allocate blocks for a sequence, honoring the tokens budget.
   // * for prefill sequence, the allocated_tokens will be within
   // [1, num_prompt_tokens - num_tokens_in_kv_cache].
   // * for decode sequence, the actual_tokens usually would be 1 or K for
   // speculative decoding.
+  // num_kept_blocks free blocks are left untouched by the allocation.
   // returns false if no blocks can be allocated.
   bool allocate_blocks_for(Sequence* sequence,
                            size_t token_budget,
-                           size_t* actual_tokens);
+                           size_t* actual_tokens,
+                           size_t num_kept_blocks = 0);
 
   // the engine to run the batch
   Engine* engine_;
 
+  // the source of the current time
+  const Clock* clock_;
+
   // the block manager to manage the cache blocks
   BlockManager* block_manager_;
 
@@ -58,21 +175,133 @@ class ContinuousScheduler final : public Scheduler {
   // the schedule owns the requests and manages their lifetimes.
   folly::MPMCQueue<Request*> request_queue_;
 
+  // used to wake up the scheduler thread when new requests arrive
+  absl::Mutex request_mutex_;
+  bool has_new_requests_ ABSL_GUARDED_BY(request_mutex_) = false;
+
+  // a request in the priority queue with the key from the scheduler policy
+  struct QueuedRequest {
+    Request* request = nullptr;
+    double key = 0;
+  };
+
+  // if a > b then a should be processed after b.
+  struct QueuedRequestGreater {
+    bool operator()(const QueuedRequest& a, const QueuedRequest& b) const {
+      if (a.request->effective_priority != b.request->effective_priority) {
+        return a.request->effective_priority > b.request->effective_priority;
+      }
+      if (a.key != b.key) {
+        return a.key > b.key;
+      }
+      if (a.request->arrival_time != b.request->arrival_time) {
+        return a.request->arrival_time > b.request->arrival_time;
+      }
+      return a.request->created_time > b.request->created_time;
+    }
+  };
+
   // Requests with HIGH priority are processed first, followed by MEDIUM
   // priority requests, and finally LOW priority requests. Within each priority
-  // level, requests are handled on First-Come-First-Served (FCFS) basis.
-  using MinHeap =
-      std::priority_queue<Request*, std::vector<Request*>, RequestPtrGreater>;
+  // level, requests are ordered by the scheduler policy, i.e. FCFS, EDF or
+  // shortest predicted remaining work first.
+  class MinHeap : public std::priority_queue<QueuedRequest,
+                                             std::vector<QueuedRequest>,
+                                             QueuedRequestGreater> {
+   public:
+    // queued requests in heap order
+    std::vector<QueuedRequest>& container() { return c; }
+    const std::vector<QueuedRequest>& container() const { return c; }
+
+    // restore the heap order after requests in the container are changed
+    void rebuild() { std::make_heap(c.begin(), c.end(), comp); }
+  };
   MinHeap priority_queue_;
 
-  // a batch of requests in running state, sorted by priority from high to low.
+  // requests waiting with LOW effective priority, kept apart so that the
+  // tokens reserved for them are reached without popping the requests above.
+  MinHeap low_priority_queue_;
+
+  // the earliest time a queued request is due for promotion by aging
+  absl::Time next_aging_time_ = absl::InfiniteFuture();
+
+  // number of unfinished requests with LOW effective priority
+  size_t num_low_priority_requests_ = 0;
+
+  // the policy to order requests within the same priority level
+  std::unique_ptr<SchedulerPolicy> policy_;
+
+  // requests taken from the priority queue in prefix cache aware order,
+  // only used while building a batch.
+  std::deque<Request*> reordered_requests_;
+
+  // admitted requests that hold cache blocks, sorted by effective priority from
+  // high to low and then by admission order. they stay across steps until
+  // finished or preempted, only waiting requests are kept in the priority
+  // queue.
   std::vector<Request*> running_requests_;
 
-  // preemptable requests that hold cache slots, sorted by priority from high to
-  // low.
-  std::deque<Request*> preemptable_requests_;
+  // index of the first running request not scheduled in the current step,
+  // the ones from it on can be preempted.
+  size_t next_running_request_ = 0;
+
+  // waiting requests holding blocks allocated by prepare_next_batch(), in the
+  // order they were prepared. reclaim_blocks_for() can release them.
+  std::vector<Request*> prepared_requests_;
 
   std::unique_ptr<ResponseHandler> response_handler_;
+
+  // a dedicated thread to run the model when schedule overlap is enabled
+  std::unique_ptr<ThreadPool> engine_threadpool_;
+
+  // use separate token budgets for prefill and decode sequences
+  bool split_token_budget_ = false;
+
+  // the upper bound of the prefill token budget
+  size_t max_prefill_token_budget_ = 0;
+
+  // the current prefill token budget, adapted from measured step latency
+  size_t prefill_token_budget_ = 0;
+
+  // free blocks kept at batch formation for running sequences to grow,
+  // from --kv_cache_watermark.
+  size_t watermark_blocks_ = 0;
+
+  // free blocks restored between steps by evicting the prefix cache, from
+  // --prefix_cache_reclaim_target.
+  size_t reclaim_target_blocks_ = 0;
+
+  // number of decode sequences in the last built batch
+  size_t num_decode_seqs_in_batch_ = 0;
+
+  // number of tokens and prefill tokens in the last built batch
+  size_t num_tokens_in_batch_ = 0;
+  size_t num_prefill_tokens_in_batch_ = 0;
+
+  // estimated cost in microseconds to prefill one token, starts from
+  // --prefill_cost_per_token_us and follows the measured step latency.
+  double prefill_cost_per_token_us_ = 0;
+
+  // prefix cache lookups already exported to the metrics
+  size_t num_prefix_cache_query_tokens_ = 0;
+  size_t num_prefix_cache_hit_tokens_ = 0;
+
+  // estimated kv cache blocks of all admitted and unfinished requests
+  std::atomic<int64_t> admitted_demand_blocks_{0};
+
+  // free blocks after the last built batch, read by admission control
+  std::atomic<int64_t> num_free_blocks_{0};
+
+  // estimated kv cache blocks of the running requests after the last built
+  // batch, the rest of admitted_demand_blocks_ is still waiting.
+  std::atomic<int64_t> running_demand_blocks_{0};
+
+  // blocks per second released by finished requests
+  std::atomic<double> demand_release_rate_{0};
+
+  // blocks released since the last update of the release rate
+  int64_t released_demand_blocks_ = 0;
+  absl::Time last_release_rate_update_;
 };
 
 }  // namespace llm
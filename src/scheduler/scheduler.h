@@ -38,7 +38,14 @@ class Scheduler {
   // schedule a request. thread safe
   // return true if the request is scheduled successfully.
   // false otherwise and the ownership of the request is not transferred.
-  virtual bool schedule(std::unique_ptr<Request>& request) = 0;
+  // retry_after is set to the suggested time to wait before retrying if the
+  // request is rejected due to overload, it is optional.
+  virtual bool schedule(std::unique_ptr<Request>& request,
+                        absl::Duration* retry_after) = 0;
+
+  bool schedule(std::unique_ptr<Request>& request) {
+    return schedule(request, /*retry_after=*/nullptr);
+  }
 
   // step the scheduler forward by one step
   // may get blocked if there are no requests to process
@@ -6,6 +6,8 @@ SchedulerType SchedulerType::CONTINOUS_BATCHING("continous_batching");
 SchedulerType SchedulerType::SPECULATIVE("speculative");
 
 SchedulerPolicyType SchedulerPolicyType::FCFS("fcfs");
+SchedulerPolicyType SchedulerPolicyType::EDF("edf");
 SchedulerPolicyType SchedulerPolicyType::PSA("psa");
+SchedulerPolicyType SchedulerPolicyType::FAIR_SHARE("fair_share");
 
 } // namespace llm
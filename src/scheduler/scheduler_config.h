@@ -21,8 +21,20 @@ class SchedulerPolicyType {
  public:
   SchedulerPolicyType(const std::string& type) : type_(type) {}
 
+  // first come first served
   static SchedulerPolicyType FCFS;
+  // earliest deadline first
+  static SchedulerPolicyType EDF;
+  // shortest predicted remaining work first
   static SchedulerPolicyType PSA;
+  // weighted fair share across tenants
+  static SchedulerPolicyType FAIR_SHARE;
+
+  const std::string& type() const { return type_; }
+
+  bool operator==(const SchedulerPolicyType& other) const {
+    return type_ == other.type_;
+  }
 
  private:
   std::string type_;
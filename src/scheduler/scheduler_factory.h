@@ -1,7 +1,6 @@
 #pragma once
 
 #include "scheduler/scheduler_config.h"
-// #include "scheduler/speculative_scheduler.h"
 
 namespace llm {
 
@@ -12,8 +11,6 @@ class SchedulerFactory {
   static Scheduler* Create(const SchedulerConfig& config,
                            Engine* llm_engine,
                            Engine* ssm_engine) {
-    // static SpeculativeScheduler scheduler(config, llm_engine, ssm_engine);
-    // return &scheduler;
     // TODO: implement this function
     return nullptr;
   }
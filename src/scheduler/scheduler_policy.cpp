@@ -1,116 +1,220 @@
 #include "scheduler_policy.h"
 
-#include <absl/time/clock.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_split.h>
 #include <absl/time/time.h>
 #include <glog/logging.h>
 
-#include "memory/block_manager.h"
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <utility>
+
 #include "request/request.h"
 #include "request/sequence.h"
-#include "scheduler/response_handler.h"
+
+DEFINE_string(tenant_weights,
+              "",
+              "comma separated tenant weights for fair share scheduling, "
+              "i.e. 'tenant_a:2,tenant_b:1'. default weight is 1");
 
 namespace llm {
-constexpr size_t kRequestQueueSize = 100000;
-constexpr size_t kMaxBatchSize = 100;
-
-FCFSSchedulerPolicy::FCFSSchedulerPolicy(ResponseHandler* response_handler,
-                                         BlockManager* block_manager)
-    : response_handler_(response_handler),
-      block_manager_(block_manager),
-      waiting_queue_(kRequestQueueSize) {}
-
-FCFSSchedulerPolicy::~FCFSSchedulerPolicy() {
-  // release all requests in the queue
-  while (!waiting_queue_.isEmpty()) {
-    Request* request = nullptr;
-    waiting_queue_.read(request);
-    std::unique_ptr<Request> request_ptr(request);
+namespace {
+// weight of the new observation for the output length estimator
+constexpr double kOutputLengthAlpha = 0.1;
+// predicted output length before any request is finished
+constexpr double kDefaultOutputLength = 256;
+
+// parse tenant weights from 'tenant_a:2,tenant_b:1'
+std::unordered_map<std::string, double> parse_tenant_weights(
+    const std::string& tenant_weights) {
+  std::unordered_map<std::string, double> weights;
+  for (absl::string_view item :
+       absl::StrSplit(tenant_weights, ',', absl::SkipEmpty())) {
+    std::pair<std::string, std::string> kv = absl::StrSplit(item, ':');
+    double weight = 0;
+    CHECK(absl::SimpleAtod(kv.second, &weight) && weight > 0)
+        << "Invalid tenant weight: " << item;
+    weights[kv.first] = weight;
   }
+  return weights;
+}
+}  // namespace
 
-  // release all requests in the ready queue
-  for (Request* request : blocking_queue_) {
-    std::unique_ptr<Request> request_ptr(request);
-  }
+double FCFSSchedulerPolicy::key(const Request* request) const {
+  return static_cast<double>(request->created_time);
+}
 
-  // release all requests in the running queue
-  for (Request* request : running_queue_) {
-    std::unique_ptr<Request> request_ptr(request);
-  }
+double EDFSchedulerPolicy::key(const Request* request) const {
+  // infinite deadline is converted to infinity
+  return absl::ToDoubleSeconds(request->deadline - absl::UnixEpoch());
+}
 
-  running_queue_.clear();
-  blocking_queue_.clear();
+OutputLengthEstimator::OutputLengthEstimator(double alpha,
+                                             double default_length)
+    : alpha_(alpha), global_estimate_(default_length) {
+  CHECK(alpha > 0 && alpha <= 1) << "alpha should be in (0, 1]";
 }
 
-bool FCFSSchedulerPolicy::schedule(std::unique_ptr<Request>& request) {
-  CHECK(request != nullptr);
-  if (waiting_queue_.write(request.get())) {
-    // take over the ownership of the request
-    request.release();
-    return true;
+double OutputLengthEstimator::estimate(const std::string& tenant) const {
+  auto it = tenant_estimates_.find(tenant);
+  if (it != tenant_estimates_.end()) {
+    return it->second;
   }
-  // queue is full
-  return false;
+  return global_estimate_;
 }
 
-std::vector<Sequence*> FCFSSchedulerPolicy::build_batch() {
-  std::vector<Request*> ready_queue;
-  for (Request* request : running_queue_) {
-    if (request->is_finished()) {
-      response_handler_->on_request_finish(std::unique_ptr<Request>(request));
-      continue;
-    }
-    ready_queue.emplace_back(request);
+double OutputLengthEstimator::predict(const Request* request) const {
+  double length = estimate(request->user);
+  const size_t max_tokens = request->stopping_criteria.max_tokens;
+  if (max_tokens > 0) {
+    length = std::min(length, static_cast<double>(max_tokens));
   }
-  running_queue_.clear();
+  return std::max(length, 1.0);
+}
 
-  for (Request* request : blocking_queue_) {
-    ready_queue.emplace_back(request);
+void OutputLengthEstimator::update(const Request* request) {
+  for (const Sequence& seq : request->sequences) {
+    // only learn from sequences finished naturally
+    const auto reason = seq.finish_reason();
+    if (reason == FinishReason::STOP || reason == FinishReason::LENGTH) {
+      update(request->user, seq.num_generated_tokens());
+    }
   }
-  blocking_queue_.clear();
+}
+
+void OutputLengthEstimator::update(const std::string& tenant,
+                                   size_t num_generated_tokens) {
+  const auto observed = static_cast<double>(num_generated_tokens);
+  global_estimate_ += alpha_ * (observed - global_estimate_);
 
-  while (!waiting_queue_.isEmpty()) {
-    Request* request = nullptr;
-    waiting_queue_.read(request);
-    CHECK(request != nullptr);
-    ready_queue.emplace_back(request);
+  // use the first observation as the estimate for new tenants
+  auto [it, inserted] = tenant_estimates_.try_emplace(tenant, observed);
+  if (!inserted) {
+    it->second += alpha_ * (observed - it->second);
   }
+}
 
-  std::vector<Sequence*> running_batch;
-  running_batch.reserve(kMaxBatchSize);
-  for (Request* request : ready_queue) {
-    if (request->sequences.empty() || request->is_finished()) {
-      continue;
-    }
+PSASchedulerPolicy::PSASchedulerPolicy()
+    : estimator_(kOutputLengthAlpha, kDefaultOutputLength) {}
 
-    std::vector<Sequence*> sequences;
-    sequences.reserve(request->sequences.size());
+double PSASchedulerPolicy::predict_output_length(
+    const Request* request) const {
+  return estimator_.predict(request);
+}
 
-    for (Sequence& sequence : request->sequences) {
-      if (sequence.is_finished()) {
-        continue;
-      }
-      if (block_manager_->allocate_blocks_for(&sequence)) {
-        sequences.emplace_back(&sequence);
-      }
+double PSASchedulerPolicy::key(const Request* request) const {
+  const double output_length = predict_output_length(request);
+
+  // sequences are not expanded until the prompt is processed
+  double remaining_tokens = 0;
+  for (const Sequence& seq : request->sequences) {
+    if (seq.is_finished()) {
+      continue;
     }
-    if (sequences.empty()) {
-      blocking_queue_.emplace_back(request);
-    } else {
-      running_queue_.emplace_back(request);
-      running_batch.insert(
-          running_batch.end(), sequences.begin(), sequences.end());
+    const size_t num_kv_cache_tokens = seq.num_kv_cache_tokens();
+    const size_t num_prompt_tokens = seq.num_prompt_tokens();
+    if (num_kv_cache_tokens < num_prompt_tokens) {
+      remaining_tokens +=
+          static_cast<double>(num_prompt_tokens - num_kv_cache_tokens);
     }
+    // at least one more token to generate
+    remaining_tokens += std::max(
+        output_length - static_cast<double>(seq.num_generated_tokens()), 1.0);
   }
+  const size_t num_pending_seqs =
+      request->num_seqs > request->sequences.size()
+          ? request->num_seqs - request->sequences.size()
+          : 0;
+  remaining_tokens += static_cast<double>(num_pending_seqs) * output_length;
+  return remaining_tokens;
+}
 
-  if (running_batch.empty() && !blocking_queue_.empty()) {
-    LOG(ERROR) << "Not enough memory to schedule one sequence";
+void PSASchedulerPolicy::on_request_finish(const Request* request) {
+  estimator_.update(request);
+}
 
-    Request* request = blocking_queue_.back();
-    blocking_queue_.pop_back();
+FairShareSchedulerPolicy::FairShareSchedulerPolicy(
+    std::unordered_map<std::string, double> tenant_weights)
+    : tenant_weights_(std::move(tenant_weights)),
+      estimator_(kOutputLengthAlpha, kDefaultOutputLength) {}
 
-    // TODO: optimize the logic to only release blocks for sequences one by one
-    response_handler_->on_request_finish(std::unique_ptr<Request>(request));
+double FairShareSchedulerPolicy::weight(const std::string& tenant) const {
+  auto it = tenant_weights_.find(tenant);
+  return it != tenant_weights_.end() ? it->second : 1.0;
+}
+
+double FairShareSchedulerPolicy::estimate_tokens(const Request* request) const {
+  return static_cast<double>(request->num_prompt_tokens()) +
+         static_cast<double>(request->num_seqs) * estimator_.predict(request);
+}
+
+double FairShareSchedulerPolicy::key(const Request* request) const {
+  auto it = request_tags_.find(request);
+  CHECK(it != request_tags_.end()) << "request is not tagged on arrival";
+  return it->second.start;
+}
+
+void FairShareSchedulerPolicy::on_request_arrival(const Request* request) {
+  const std::string& tenant = request->user;
+  double& finish_tag = tenant_finish_tags_[tenant];
+  // idle tenants start from the current virtual time
+  const double start = std::max(virtual_time_, finish_tag);
+  const double estimated_tokens = estimate_tokens(request);
+  finish_tag = start + estimated_tokens / weight(tenant);
+  request_tags_[request] = {start, estimated_tokens};
+}
+
+void FairShareSchedulerPolicy::on_request_scheduled(const Request* request,
+                                                    size_t num_tokens) {
+  auto it = request_tags_.find(request);
+  if (it != request_tags_.end()) {
+    virtual_time_ = std::max(virtual_time_, it->second.start);
   }
-  return running_batch;
+  tenant_consumed_tokens_[request->user] += num_tokens;
 }
+
+void FairShareSchedulerPolicy::on_request_finish(const Request* request) {
+  estimator_.update(request);
+
+  auto it = request_tags_.find(request);
+  if (it == request_tags_.end()) {
+    return;
+  }
+  // charge the tenant with the actual number of tokens
+  double actual_tokens = static_cast<double>(request->num_prompt_tokens());
+  for (const Sequence& seq : request->sequences) {
+    actual_tokens += static_cast<double>(seq.num_generated_tokens());
+  }
+  const std::string& tenant = request->user;
+  tenant_finish_tags_[tenant] +=
+      (actual_tokens - it->second.estimated_tokens) / weight(tenant);
+  request_tags_.erase(it);
+}
+
+size_t FairShareSchedulerPolicy::num_consumed_tokens(
+    const std::string& tenant) const {
+  auto it = tenant_consumed_tokens_.find(tenant);
+  return it != tenant_consumed_tokens_.end() ? it->second : 0;
+}
+
+std::unique_ptr<SchedulerPolicy> SchedulerPolicyFactory::create(
+    const SchedulerPolicyType& type) {
+  if (type == SchedulerPolicyType::FCFS) {
+    return std::make_unique<FCFSSchedulerPolicy>();
+  }
+  if (type == SchedulerPolicyType::EDF) {
+    return std::make_unique<EDFSchedulerPolicy>();
+  }
+  if (type == SchedulerPolicyType::PSA) {
+    return std::make_unique<PSASchedulerPolicy>();
+  }
+  if (type == SchedulerPolicyType::FAIR_SHARE) {
+    return std::make_unique<FairShareSchedulerPolicy>(
+        parse_tenant_weights(FLAGS_tenant_weights));
+  }
+  LOG(FATAL) << "Unknown scheduler policy: " << type.type();
+  return nullptr;
+}
+
 }  // namespace llm
@@ -1,53 +1,159 @@
 #pragma once
 
-#include <folly/MPMCQueue.h>
-
 #include <cstdint>
 #include <memory>
+#include <string>
+#include <unordered_map>
 
 #include "scheduler/scheduler_config.h"
 
 namespace llm {
 
 class Request;
-class Sequence; 
+
+// A scheduler policy decides the order of requests within the same priority
+// level. Requests with smaller keys are processed first.
 class SchedulerPolicy {
  public:
   virtual ~SchedulerPolicy() = default;
 
-  virtual bool schedule(std::unique_ptr<Request>& request) = 0;
-  virtual std::vector<Sequence*> build_batch() = 0;
+  // returns the scheduling key of the request. the key is evaluated when the
+  // request is (re)queued, so it may depend on the progress of the request.
+  virtual double key(const Request* request) const = 0;
+
+  // called when a request arrives, before its key is evaluated.
+  virtual void on_request_arrival(const Request* /*request*/) {}
+
+  // called when tokens of the request are scheduled in a batch.
+  virtual void on_request_scheduled(const Request* /*request*/,
+                                    size_t /*num_tokens*/) {}
+
+  // called when a request is finished, i.e. to update online estimators.
+  virtual void on_request_finish(const Request* /*request*/) {}
 };
 
-class BlockManager;
-class ResponseHandler;
+// First-Come-First-Served (FCFS): order by arrival time.
 class FCFSSchedulerPolicy final : public SchedulerPolicy {
  public:
-  explicit FCFSSchedulerPolicy(ResponseHandler* response_handler,
-                               BlockManager* block_manager);
-  ~FCFSSchedulerPolicy() override;
+  double key(const Request* request) const override;
+};
+
+// Earliest-Deadline-First (EDF): order by deadline, requests without deadline
+// are processed last.
+class EDFSchedulerPolicy final : public SchedulerPolicy {
+ public:
+  double key(const Request* request) const override;
+};
+
+// Online estimator of the number of output tokens for each tenant, using
+// exponential moving average of the number of generated tokens.
+class OutputLengthEstimator {
+ public:
+  OutputLengthEstimator(double alpha, double default_length);
 
-  bool schedule(std::unique_ptr<Request>& request) override;
-  std::vector<Sequence*> build_batch() override;
+  // returns the predicted number of output tokens for the tenant, falls back
+  // to the global estimate for unseen tenants.
+  double estimate(const std::string& tenant) const;
+
+  // returns the predicted number of output tokens for each sequence of the
+  // request, capped by max_tokens.
+  double predict(const Request* request) const;
+
+  // update the estimate with the observed number of generated tokens
+  void update(const std::string& tenant, size_t num_generated_tokens);
+
+  // update the estimate with sequences of the request finished naturally
+  void update(const Request* request);
 
  private:
-  ResponseHandler* response_handler_;
-  BlockManager* block_manager_;
+  // weight of the new observation
+  double alpha_;
+
+  // estimate over all tenants
+  double global_estimate_;
+
+  // estimate for each tenant
+  std::unordered_map<std::string, double> tenant_estimates_;
+};
+
+// Predicted-Shortest-remaining-work (PSA): order by predicted remaining
+// tokens, including the remaining prompt tokens and the predicted output
+// tokens. the output length is predicted from max_tokens and an online
+// per-tenant estimator.
+class PSASchedulerPolicy final : public SchedulerPolicy {
+ public:
+  PSASchedulerPolicy();
+
+  double key(const Request* request) const override;
+
+  void on_request_finish(const Request* request) override;
+
+  // returns the predicted number of output tokens for each sequence
+  double predict_output_length(const Request* request) const;
+
+ private:
+  OutputLengthEstimator estimator_;
+};
+
+// Weighted fair share across tenants (the request's user), using start-time
+// fair queueing: each request is tagged with a virtual start time when it
+// arrives, max(global virtual time, finish tag of the tenant's last request),
+// and the tenant's finish tag advances by the estimated tokens of the request
+// divided by the tenant weight. the tag is corrected with the actual tokens
+// when the request finishes, so a tenant flooding the queue only delays its
+// own requests.
+class FairShareSchedulerPolicy final : public SchedulerPolicy {
+ public:
+  // tenants not in tenant_weights have weight 1
+  explicit FairShareSchedulerPolicy(
+      std::unordered_map<std::string, double> tenant_weights);
+
+  double key(const Request* request) const override;
+
+  void on_request_arrival(const Request* request) override;
+
+  void on_request_scheduled(const Request* request,
+                            size_t num_tokens) override;
+
+  void on_request_finish(const Request* request) override;
+
+  // returns the number of prefill and decode tokens consumed by the tenant
+  size_t num_consumed_tokens(const std::string& tenant) const;
+
+ private:
+  struct Tags {
+    // virtual start time of the request
+    double start = 0;
+    // estimated number of tokens of the request
+    double estimated_tokens = 0;
+  };
+
+  double weight(const std::string& tenant) const;
+
+  // estimated number of prompt and output tokens of the request
+  double estimate_tokens(const Request* request) const;
+
+  std::unordered_map<std::string, double> tenant_weights_;
+
+  // virtual time of the system, the max start tag of scheduled requests
+  double virtual_time_ = 0;
+
+  // finish tag of the last request for each tenant
+  std::unordered_map<std::string, double> tenant_finish_tags_;
+
+  // tags of requests that are not finished yet
+  std::unordered_map<const Request*, Tags> request_tags_;
+
+  // consumed tokens for each tenant
+  std::unordered_map<std::string, size_t> tenant_consumed_tokens_;
 
-  folly::MPMCQueue<Request*> waiting_queue_;
-  std::vector<Request*> blocking_queue_;
-  std::vector<Request*> running_queue_;
+  OutputLengthEstimator estimator_;
 };
 
 class SchedulerPolicyFactory {
  public:
-  static SchedulerPolicy* Create(const SchedulerPolicyType& type,
-                                 ResponseHandler* response_handler,
-                                 BlockManager* block_manager) {
-    static FCFSSchedulerPolicy policy(response_handler,
-                                      block_manager);
-    return &policy;
-  }
+  static std::unique_ptr<SchedulerPolicy> create(
+      const SchedulerPolicyType& type);
 };
 
 }  // namespace llm
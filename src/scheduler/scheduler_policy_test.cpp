@@ -0,0 +1,135 @@
+#include "scheduler_policy.h"
+
+#include <absl/time/clock.h>
+#include <absl/time/time.h>
+#include <gtest/gtest.h>
+
+#include <memory>
+
+#include "request/request.h"
+
+namespace llm {
+
+TEST(SchedulerPolicyTest, OutputLengthEstimator) {
+  OutputLengthEstimator estimator(/*alpha=*/0.5, /*default_length=*/100);
+  // unseen tenant uses the global estimate
+  EXPECT_DOUBLE_EQ(estimator.estimate("alice"), 100);
+
+  estimator.update("alice", 10);
+  // first observation for a tenant is used as is
+  EXPECT_DOUBLE_EQ(estimator.estimate("alice"), 10);
+  EXPECT_DOUBLE_EQ(estimator.estimate("bob"), 55);
+
+  estimator.update("alice", 20);
+  EXPECT_DOUBLE_EQ(estimator.estimate("alice"), 15);
+  EXPECT_DOUBLE_EQ(estimator.estimate("bob"), 37.5);
+}
+
+TEST(SchedulerPolicyTest, EDF) {
+  auto policy = SchedulerPolicyFactory::create(SchedulerPolicyType::EDF);
+
+  Request with_deadline("1", {1, 2, 3});
+  with_deadline.deadline = absl::Now() + absl::Seconds(1);
+  Request without_deadline("2", {1, 2, 3});
+
+  EXPECT_LT(policy->key(&with_deadline), policy->key(&without_deadline));
+}
+
+TEST(SchedulerPolicyTest, PSA) {
+  PSASchedulerPolicy policy;
+
+  // short chat turn
+  Request short_request("1", {1, 2, 3});
+  short_request.stopping_criteria.max_tokens = 16;
+  short_request.add_sequence();
+
+  // long generation
+  Request long_request("2", {1, 2, 3});
+  long_request.stopping_criteria.max_tokens = 4096;
+  long_request.add_sequence();
+
+  // max_tokens caps the predicted output length
+  EXPECT_DOUBLE_EQ(policy.predict_output_length(&short_request), 16);
+  EXPECT_LT(policy.predict_output_length(&long_request), 4096);
+  // remaining prompt tokens plus predicted output tokens
+  EXPECT_DOUBLE_EQ(policy.key(&short_request), 3 + 16);
+  EXPECT_LT(policy.key(&short_request), policy.key(&long_request));
+
+  // longer prompt means more remaining work
+  Request long_prompt("3", std::vector<int32_t>(100, 1));
+  long_prompt.stopping_criteria.max_tokens = 16;
+  long_prompt.add_sequence();
+  EXPECT_LT(policy.key(&short_request), policy.key(&long_prompt));
+
+  // pending sequences are counted as well
+  Request multi_seqs("4", "", /*n=*/2, {1, 2, 3});
+  multi_seqs.stopping_criteria.max_tokens = 16;
+  multi_seqs.add_sequence();
+  EXPECT_DOUBLE_EQ(policy.key(&multi_seqs), 3 + 16 * 2);
+
+  // sequences finished early don't update the estimator
+  multi_seqs.sequences[0].finish(FinishReason::DEADLINE_EXCEEDED);
+  const double length = policy.predict_output_length(&long_request);
+  policy.on_request_finish(&multi_seqs);
+  EXPECT_DOUBLE_EQ(policy.predict_output_length(&long_request), length);
+}
+
+TEST(SchedulerPolicyTest, FairShare) {
+  FairShareSchedulerPolicy policy({{"heavy", 1}, {"light", 1}, {"gold", 3}});
+
+  // heavy tenant floods the queue
+  std::vector<std::unique_ptr<Request>> heavy_requests;
+  for (int i = 0; i < 10; ++i) {
+    auto request =
+        std::make_unique<Request>("heavy", std::vector<int32_t>(10, 1));
+    request->user = "heavy";
+    request->stopping_criteria.max_tokens = 10;
+    request->add_sequence();
+    policy.on_request_arrival(request.get());
+    heavy_requests.push_back(std::move(request));
+  }
+  // each request costs 10 prompt tokens + 10 output tokens
+  EXPECT_DOUBLE_EQ(policy.key(heavy_requests[0].get()), 0);
+  EXPECT_DOUBLE_EQ(policy.key(heavy_requests[9].get()), 9 * 20);
+
+  // the first heavy request is scheduled
+  policy.on_request_scheduled(heavy_requests[0].get(), 10);
+  EXPECT_EQ(policy.num_consumed_tokens("heavy"), 10);
+
+  // light tenant arrives later, goes right after the scheduled request
+  Request light("light", std::vector<int32_t>(10, 1));
+  light.user = "light";
+  light.stopping_criteria.max_tokens = 10;
+  light.add_sequence();
+  policy.on_request_arrival(&light);
+  EXPECT_DOUBLE_EQ(policy.key(&light), 0);
+  EXPECT_LT(policy.key(&light), policy.key(heavy_requests[1].get()));
+
+  // tenant with higher weight advances slower in virtual time
+  std::vector<std::unique_ptr<Request>> gold_requests;
+  for (int i = 0; i < 3; ++i) {
+    auto request =
+        std::make_unique<Request>("gold", std::vector<int32_t>(10, 1));
+    request->user = "gold";
+    request->stopping_criteria.max_tokens = 10;
+    request->add_sequence();
+    policy.on_request_arrival(request.get());
+    gold_requests.push_back(std::move(request));
+  }
+  EXPECT_DOUBLE_EQ(policy.key(gold_requests[2].get()), 2 * 20.0 / 3);
+  EXPECT_LT(policy.key(gold_requests[2].get()),
+            policy.key(heavy_requests[1].get()));
+
+  // the heavy tenant is charged with the actual tokens on finish
+  heavy_requests[0]->sequences[0].finish(FinishReason::STOP);
+  policy.on_request_finish(heavy_requests[0].get());
+  auto next = std::make_unique<Request>("heavy", std::vector<int32_t>(10, 1));
+  next->user = "heavy";
+  next->stopping_criteria.max_tokens = 10;
+  next->add_sequence();
+  policy.on_request_arrival(next.get());
+  // no tokens generated, 10 tokens refunded
+  EXPECT_DOUBLE_EQ(policy.key(next.get()), 10 * 20 - 10);
+}
+
+}  // namespace llm
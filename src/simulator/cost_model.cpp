@@ -0,0 +1,21 @@
+#include "cost_model.h"
+
+#include <absl/time/time.h>
+
+namespace llm {
+
+absl::Duration CostModel::step_latency(const StepWorkload& workload) const {
+  const double latency_us =
+      step_overhead_us +
+      prefill_cost_per_token_us *
+          static_cast<double>(workload.num_prefill_tokens) +
+      decode_cost_per_token_us *
+          static_cast<double>(workload.num_decode_tokens) +
+      context_cost_per_token_us *
+          static_cast<double>(workload.num_context_tokens) +
+      swap_cost_per_block_us *
+          static_cast<double>(workload.num_swapped_blocks);
+  return absl::Microseconds(latency_us);
+}
+
+}  // namespace llm
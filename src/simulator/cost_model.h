@@ -0,0 +1,47 @@
+#pragma once
+
+#include <absl/time/time.h>
+
+#include <cstdint>
+
+namespace llm {
+
+// the work done by the model in one step
+struct StepWorkload {
+  // number of prompt tokens processed, including chunked prefill
+  int64_t num_prefill_tokens = 0;
+
+  // number of generated tokens processed
+  int64_t num_decode_tokens = 0;
+
+  // number of tokens in kv cache attended by the processed tokens, summed
+  // over all sequences
+  int64_t num_context_tokens = 0;
+
+  // number of cache blocks copied between device and host
+  int64_t num_swapped_blocks = 0;
+};
+
+// A linear cost model for the latency of one model step. the coefficients
+// can be fitted from a handful of profiled steps on the target hardware.
+struct CostModel {
+  // fixed cost per step, i.e. kernel launches and sampling
+  double step_overhead_us = 0;
+
+  // cost to process one prompt token
+  double prefill_cost_per_token_us = 0;
+
+  // cost to process one generated token
+  double decode_cost_per_token_us = 0;
+
+  // cost to read one token from kv cache in attention
+  double context_cost_per_token_us = 0;
+
+  // cost to copy one cache block between device and host
+  double swap_cost_per_block_us = 0;
+
+  // returns the estimated latency of the step
+  absl::Duration step_latency(const StepWorkload& workload) const;
+};
+
+}  // namespace llm
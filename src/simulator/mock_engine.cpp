@@ -0,0 +1,145 @@
+#include "mock_engine.h"
+
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "engine/batch.h"
+#include "request/sequence.h"
+
+namespace llm {
+namespace {
+// the token id produced for every generated token
+constexpr int32_t kGeneratedTokenId = 1;
+}  // namespace
+
+bool MockTokenizer::encode(const std::string_view& text,
+                           std::vector<int32_t>* ids) const {
+  constexpr std::string_view kWhitespaces = " \t\r\n";
+  size_t start = text.find_first_not_of(kWhitespaces);
+  while (start != std::string_view::npos) {
+    const size_t end = std::min(text.find_first_of(kWhitespaces, start),
+                                text.size());
+    const size_t hash =
+        std::hash<std::string_view>{}(text.substr(start, end - start));
+    // token id 0 is reserved for eos
+    ids->push_back(static_cast<int32_t>(1 + hash % (kMockVocabSize - 1)));
+    start = text.find_first_not_of(kWhitespaces, end);
+  }
+  return true;
+}
+
+std::string MockTokenizer::decode(const Slice<int32_t>& /*tokens*/,
+                                  bool /*skip_special_tokens*/) const {
+  return "";
+}
+
+std::unique_ptr<Tokenizer> MockTokenizer::clone() const {
+  return std::make_unique<MockTokenizer>();
+}
+
+MockEngine::MockEngine(const CostModel& cost_model,
+                       SimulatedClock* clock,
+                       std::unique_ptr<BlockManager> block_manager)
+    : cost_model_(cost_model),
+      clock_(clock),
+      block_manager_(std::move(block_manager)) {
+  CHECK(clock_ != nullptr);
+  CHECK(block_manager_ != nullptr);
+}
+
+std::unique_ptr<Tokenizer> MockEngine::tokenizer() const {
+  return std::make_unique<MockTokenizer>();
+}
+
+ModelOutput MockEngine::execute_model(Batch& batch) {
+  // kv cache progress before the step, advanced by prepare_model_input()
+  std::vector<size_t> num_kv_cache_tokens(batch.size());
+  for (size_t i = 0; i < batch.size(); ++i) {
+    num_kv_cache_tokens[i] = batch[i]->num_kv_cache_tokens();
+  }
+  const auto model_input = batch.prepare_model_input();
+  if (!model_input.token_ids.defined()) {
+    // empty input, just return
+    return {};
+  }
+
+  StepWorkload workload;
+  workload.num_swapped_blocks =
+      static_cast<int64_t>(model_input.block_swaps.size());
+  int64_t num_samples = 0;
+  for (size_t i = 0; i < batch.size(); ++i) {
+    const Sequence* sequence = batch[i];
+    const size_t start = num_kv_cache_tokens[i];
+    const size_t end = sequence->num_kv_cache_tokens();
+    const auto num_tokens = static_cast<int64_t>(end - start);
+    // tokens processed together are charged as prefill, including the
+    // recomputation of generated tokens after preemption.
+    if (num_tokens == 1 && start >= sequence->num_prompt_tokens()) {
+      workload.num_decode_tokens += 1;
+    } else {
+      workload.num_prefill_tokens += num_tokens;
+    }
+    // causal attention: token at position j attends to j + 1 tokens
+    workload.num_context_tokens +=
+        static_cast<int64_t>((end - start) * (start + end + 1) / 2);
+    if (!sequence->is_prefill_stage()) {
+      ++num_samples;
+    }
+  }
+
+  const auto latency = cost_model_.step_latency(workload);
+  clock_->advance(latency);
+  busy_time_ += latency;
+  ++num_steps_;
+
+  ModelOutput model_output;
+  if (num_samples > 0) {
+    model_output.sample_output.next_tokens =
+        torch::full({num_samples}, kGeneratedTokenId, torch::kInt64);
+  }
+  batch.process_sample_output(model_output.sample_output);
+
+  // record the timeline of sequences
+  const auto now = clock_->now();
+  absl::MutexLock lock(&mutex_);
+  for (size_t i = 0; i < batch.size(); ++i) {
+    const Sequence* sequence = batch[i];
+    auto [it, inserted] = sequence_stats_.try_emplace(sequence->id());
+    SequenceStats& stats = it->second;
+    if (inserted) {
+      stats.num_prompt_tokens = sequence->num_prompt_tokens();
+      stats.num_cached_prompt_tokens =
+          std::min(num_kv_cache_tokens[i], stats.num_prompt_tokens);
+    }
+    const size_t num_generated_tokens = sequence->num_generated_tokens();
+    if (num_generated_tokens > stats.num_generated_tokens) {
+      if (stats.num_generated_tokens == 0) {
+        stats.first_token_time = now;
+      }
+      stats.last_token_time = now;
+      stats.num_generated_tokens = num_generated_tokens;
+    }
+  }
+  return model_output;
+}
+
+std::optional<SequenceStats> MockEngine::take_sequence_stats(
+    int64_t sequence_id) {
+  absl::MutexLock lock(&mutex_);
+  auto it = sequence_stats_.find(sequence_id);
+  if (it == sequence_stats_.end()) {
+    return std::nullopt;
+  }
+  SequenceStats stats = it->second;
+  sequence_stats_.erase(it);
+  return stats;
+}
+
+}  // namespace llm
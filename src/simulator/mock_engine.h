@@ -0,0 +1,107 @@
+#pragma once
+
+#include <absl/base/thread_annotations.h>
+#include <absl/synchronization/mutex.h>
+#include <absl/time/time.h>
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common/clock.h"
+#include "cost_model.h"
+#include "engine/engine.h"
+#include "memory/block_manager.h"
+#include "models/model_args.h"
+#include "tokenizer/tokenizer.h"
+#include "tokenizer/tokenizer_args.h"
+
+namespace llm {
+
+// number of distinct token ids produced by the mock tokenizer
+constexpr int32_t kMockVocabSize = 32000;
+
+// A tokenizer that maps each whitespace separated word to a token id by
+// hashing, so that prompts sharing a text prefix share a token prefix.
+// decoding is not supported and returns an empty string.
+class MockTokenizer final : public Tokenizer {
+ public:
+  bool encode(const std::string_view& text,
+              std::vector<int32_t>* ids) const override;
+
+  std::string decode(const Slice<int32_t>& tokens,
+                     bool skip_special_tokens) const override;
+
+  size_t vocab_size() const override { return kMockVocabSize; }
+
+  std::unique_ptr<Tokenizer> clone() const override;
+};
+
+// timeline of a sequence observed by the mock engine
+struct SequenceStats {
+  // when the first and the last generated tokens were produced
+  absl::Time first_token_time = absl::InfiniteFuture();
+  absl::Time last_token_time = absl::InfiniteFuture();
+
+  size_t num_generated_tokens = 0;
+
+  size_t num_prompt_tokens = 0;
+
+  // prompt tokens found in the prefix cache when first scheduled
+  size_t num_cached_prompt_tokens = 0;
+};
+
+// A mock engine that doesn't run any model. Each step advances the simulated
+// clock by the latency from the cost model and appends one token to each
+// sequence that finished its prompt.
+class MockEngine final : public Engine {
+ public:
+  MockEngine(const CostModel& cost_model,
+             SimulatedClock* clock,
+             std::unique_ptr<BlockManager> block_manager);
+
+  ModelOutput execute_model(Batch& batch) override;
+
+  std::unique_ptr<Tokenizer> tokenizer() const override;
+
+  BlockManager* block_manager() const override { return block_manager_.get(); }
+
+  const ModelArgs& model_args() const override { return model_args_; }
+
+  const TokenizerArgs& tokenizer_args() const override {
+    return tokenizer_args_;
+  }
+
+  // returns and removes the stats of the sequence, thread safe.
+  std::optional<SequenceStats> take_sequence_stats(int64_t sequence_id);
+
+  // number of executed steps
+  int64_t num_steps() const { return num_steps_; }
+
+  // total simulated time spent in model execution
+  absl::Duration busy_time() const { return busy_time_; }
+
+ private:
+  CostModel cost_model_;
+
+  SimulatedClock* clock_;
+
+  std::unique_ptr<BlockManager> block_manager_;
+
+  ModelArgs model_args_;
+
+  TokenizerArgs tokenizer_args_;
+
+  int64_t num_steps_ = 0;
+
+  absl::Duration busy_time_;
+
+  absl::Mutex mutex_;
+  std::unordered_map<int64_t, SequenceStats> sequence_stats_
+      ABSL_GUARDED_BY(mutex_);
+};
+
+}  // namespace llm
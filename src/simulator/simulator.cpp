@@ -0,0 +1,262 @@
+#include "simulator.h"
+
+#include <absl/time/clock.h>
+#include <absl/time/time.h>
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <iomanip>
+#include <memory>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "common/metrics.h"
+#include "request/request.h"
+#include "request/sequence.h"
+#include "scheduler/continuous_scheduler.h"
+
+namespace llm {
+
+DECLARE_COUNTER(num_preemptions_total);
+DECLARE_COUNTER(num_priority_promotions_total);
+
+namespace {
+
+// stats of a request collected when it is finished
+struct RequestRecord {
+  absl::Time arrival_time;
+
+  // all sequences finished naturally, i.e. not dropped for the deadline
+  bool completed = false;
+
+  absl::Time first_token_time = absl::InfiniteFuture();
+  absl::Time last_token_time = absl::InfinitePast();
+
+  size_t num_generated_tokens = 0;
+
+  size_t num_prompt_tokens = 0;
+  size_t num_cached_prompt_tokens = 0;
+
+  // times the request was moved back to favor prefix cache hits
+  size_t num_bypassed = 0;
+
+  // time per output token for each sequence
+  std::vector<double> tpot_ms;
+};
+
+// nearest-rank percentile of sorted samples
+double percentile(const std::vector<double>& sorted, double p) {
+  const auto rank = static_cast<size_t>(
+      std::ceil(p * static_cast<double>(sorted.size())));
+  return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+}
+
+void print_latency(std::ostream& os,
+                   const std::string& name,
+                   const LatencyStats& stats) {
+  os << name << " (ms): mean " << stats.mean_ms << ", p50 " << stats.p50_ms
+     << ", p90 " << stats.p90_ms << ", p99 " << stats.p99_ms << ", max "
+     << stats.max_ms << "\n";
+}
+
+}  // namespace
+
+LatencyStats LatencyStats::from_samples(std::vector<double> samples_ms) {
+  LatencyStats stats;
+  if (samples_ms.empty()) {
+    return stats;
+  }
+  std::sort(samples_ms.begin(), samples_ms.end());
+  stats.count = samples_ms.size();
+  stats.mean_ms =
+      std::accumulate(samples_ms.begin(), samples_ms.end(), 0.0) /
+      static_cast<double>(samples_ms.size());
+  stats.p50_ms = percentile(samples_ms, 0.5);
+  stats.p90_ms = percentile(samples_ms, 0.9);
+  stats.p99_ms = percentile(samples_ms, 0.99);
+  stats.max_ms = samples_ms.back();
+  return stats;
+}
+
+std::string SimulationReport::to_string() const {
+  std::ostringstream os;
+  os << std::fixed << std::setprecision(2);
+  os << "requests: " << num_requests << ", completed: " << num_completed
+     << ", rejected: " << num_rejected << ", dropped: " << num_dropped << "\n";
+  os << "duration (s): " << absl::ToDoubleSeconds(duration)
+     << ", engine utilization: " << engine_utilization << "\n";
+  os << "throughput: " << request_throughput << " requests/s, "
+     << output_token_throughput << " output tokens/s\n";
+  print_latency(os, "ttft", ttft);
+  print_latency(os, "tpot", tpot);
+  print_latency(os, "e2e latency", e2e_latency);
+  os << "preemptions: " << num_preemptions
+     << ", priority promotions: " << num_priority_promotions << "\n";
+  os << "prefix cache hit rate: " << prefix_cache_hit_rate
+     << ", max bypassed: " << max_num_bypassed << "\n";
+  return os.str();
+}
+
+Simulator::Simulator(MockEngine* engine, SimulatedClock* clock)
+    : engine_(engine), clock_(clock) {
+  CHECK(engine_ != nullptr);
+  CHECK(clock_ != nullptr);
+}
+
+SimulationReport Simulator::run(const std::vector<TraceRequest>& trace) {
+  SimulationReport report;
+  report.num_requests = trace.size();
+
+  std::vector<RequestRecord> records(trace.size());
+  std::atomic<size_t> num_finished{0};
+  size_t num_admitted = 0;
+
+  const double num_preemptions = num_preemptions_total.Value();
+  const double num_priority_promotions = num_priority_promotions_total.Value();
+  const auto busy_time = engine_->busy_time();
+  const auto start = clock_->now();
+  {
+    // finished requests are flushed when the scheduler is destroyed
+    ContinuousScheduler scheduler(engine_, clock_);
+    size_t next = 0;
+    while (next < trace.size() ||
+           num_finished.load(std::memory_order_acquire) < num_admitted) {
+      // submit requests that have arrived
+      while (next < trace.size() &&
+             start + trace[next].arrival_time <= clock_->now()) {
+        const size_t index = next++;
+        const TraceRequest& entry = trace[index];
+        RequestRecord* record = &records[index];
+        record->arrival_time = start + entry.arrival_time;
+
+        auto request = std::make_unique<Request>(std::to_string(index),
+                                                 /*prompt=*/"",
+                                                 entry.n,
+                                                 entry.prompt_tokens);
+        request->stopping_criteria.max_tokens = entry.num_output_tokens;
+        request->stopping_criteria.ignore_eos_token = true;
+        request->priority = entry.priority;
+        request->user = entry.user;
+        request->deadline = record->arrival_time + entry.deadline;
+        // called from the response thread while the request is alive
+        request->on_finish = [this,
+                              record,
+                              request_ptr = request.get(),
+                              &num_finished](
+                                 const std::vector<SequenceResult>& results,
+                                 const Status& /*status*/,
+                                 const Statistics& /*stats*/) {
+          record->completed = std::all_of(
+              results.begin(), results.end(), [](const SequenceResult& r) {
+                return r.finish_reason == FinishReason::STOP ||
+                       r.finish_reason == FinishReason::LENGTH;
+              });
+          record->num_bypassed = request_ptr->num_bypassed;
+          for (const Sequence& sequence : request_ptr->sequences) {
+            auto stats = engine_->take_sequence_stats(sequence.id());
+            if (!stats.has_value()) {
+              continue;
+            }
+            record->num_prompt_tokens += stats->num_prompt_tokens;
+            record->num_cached_prompt_tokens +=
+                stats->num_cached_prompt_tokens;
+            if (stats->num_generated_tokens == 0) {
+              continue;
+            }
+            record->num_generated_tokens += stats->num_generated_tokens;
+            record->first_token_time =
+                std::min(record->first_token_time, stats->first_token_time);
+            record->last_token_time =
+                std::max(record->last_token_time, stats->last_token_time);
+            if (stats->num_generated_tokens > 1) {
+              const auto decode_time =
+                  stats->last_token_time - stats->first_token_time;
+              record->tpot_ms.push_back(
+                  absl::ToDoubleMilliseconds(decode_time) /
+                  static_cast<double>(stats->num_generated_tokens - 1));
+            }
+          }
+          num_finished.fetch_add(1, std::memory_order_release);
+          return true;
+        };
+        request->add_sequence();
+
+        if (scheduler.schedule(request)) {
+          ++num_admitted;
+        } else {
+          ++report.num_rejected;
+        }
+      }
+
+      const int64_t num_steps = engine_->num_steps();
+      scheduler.step(absl::ZeroDuration());
+      if (engine_->num_steps() > num_steps) {
+        continue;
+      }
+      // nothing to run, jump to the next arrival
+      if (next < trace.size()) {
+        clock_->advance_to(start + trace[next].arrival_time);
+        continue;
+      }
+      // wait for the response handler to catch up
+      absl::SleepFor(absl::Milliseconds(1));
+    }
+  }
+
+  report.duration = clock_->now() - start;
+  const double duration_s = absl::ToDoubleSeconds(report.duration);
+  if (duration_s > 0) {
+    report.engine_utilization =
+        absl::ToDoubleSeconds(engine_->busy_time() - busy_time) / duration_s;
+  }
+  report.num_preemptions =
+      static_cast<int64_t>(num_preemptions_total.Value() - num_preemptions);
+  report.num_priority_promotions = static_cast<int64_t>(
+      num_priority_promotions_total.Value() - num_priority_promotions);
+
+  std::vector<double> ttft_ms;
+  std::vector<double> tpot_ms;
+  std::vector<double> e2e_latency_ms;
+  size_t num_generated_tokens = 0;
+  size_t num_prompt_tokens = 0;
+  size_t num_cached_prompt_tokens = 0;
+  for (const RequestRecord& record : records) {
+    num_prompt_tokens += record.num_prompt_tokens;
+    num_cached_prompt_tokens += record.num_cached_prompt_tokens;
+    num_generated_tokens += record.num_generated_tokens;
+    report.max_num_bypassed =
+        std::max(report.max_num_bypassed, record.num_bypassed);
+    if (record.num_generated_tokens > 0) {
+      ttft_ms.push_back(absl::ToDoubleMilliseconds(record.first_token_time -
+                                                   record.arrival_time));
+      e2e_latency_ms.push_back(absl::ToDoubleMilliseconds(
+          record.last_token_time - record.arrival_time));
+    }
+    tpot_ms.insert(tpot_ms.end(), record.tpot_ms.begin(), record.tpot_ms.end());
+    if (record.completed) {
+      ++report.num_completed;
+    }
+  }
+  report.num_dropped = num_admitted - report.num_completed;
+  report.ttft = LatencyStats::from_samples(std::move(ttft_ms));
+  report.tpot = LatencyStats::from_samples(std::move(tpot_ms));
+  report.e2e_latency = LatencyStats::from_samples(std::move(e2e_latency_ms));
+  if (duration_s > 0) {
+    report.request_throughput =
+        static_cast<double>(report.num_completed) / duration_s;
+    report.output_token_throughput =
+        static_cast<double>(num_generated_tokens) / duration_s;
+  }
+  if (num_prompt_tokens > 0) {
+    report.prefix_cache_hit_rate =
+        static_cast<double>(num_cached_prompt_tokens) /
+        static_cast<double>(num_prompt_tokens);
+  }
+  return report;
+}
+
+}  // namespace llm
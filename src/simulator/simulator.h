@@ -0,0 +1,88 @@
+#pragma once
+
+#include <absl/time/time.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "common/clock.h"
+#include "mock_engine.h"
+#include "trace.h"
+
+namespace llm {
+
+// latency distribution in milliseconds
+struct LatencyStats {
+  size_t count = 0;
+  double mean_ms = 0;
+  double p50_ms = 0;
+  double p90_ms = 0;
+  double p99_ms = 0;
+  double max_ms = 0;
+
+  static LatencyStats from_samples(std::vector<double> samples_ms);
+};
+
+struct SimulationReport {
+  size_t num_requests = 0;
+
+  // requests with all sequences finished naturally
+  size_t num_completed = 0;
+
+  // requests rejected by admission control
+  size_t num_rejected = 0;
+
+  // admitted requests not completed, i.e. dropped for the deadline
+  size_t num_dropped = 0;
+
+  // simulated time from the first arrival to the last finish
+  absl::Duration duration;
+
+  // fraction of the duration the engine is busy
+  double engine_utilization = 0;
+
+  // time to first token, from the arrival to the first generated token
+  LatencyStats ttft;
+
+  // time per output token after the first one, for each sequence
+  LatencyStats tpot;
+
+  // end to end latency, from the arrival to the last generated token
+  LatencyStats e2e_latency;
+
+  double request_throughput = 0;
+
+  // generated tokens per second
+  double output_token_throughput = 0;
+
+  int64_t num_preemptions = 0;
+
+  // waiting requests promoted to a higher priority by aging
+  int64_t num_priority_promotions = 0;
+
+  // fraction of prompt tokens found in the prefix cache
+  double prefix_cache_hit_rate = 0;
+
+  // most times a request was moved back to favor prefix cache hits
+  size_t max_num_bypassed = 0;
+
+  std::string to_string() const;
+};
+
+// Replays an arrival trace through the ContinuousScheduler against a mock
+// engine on a simulated clock. the scheduler is configured with the same
+// flags as the server, i.e. --max_tokens_per_batch and --scheduling_policy.
+class Simulator {
+ public:
+  Simulator(MockEngine* engine, SimulatedClock* clock);
+
+  SimulationReport run(const std::vector<TraceRequest>& trace);
+
+ private:
+  MockEngine* engine_;
+
+  SimulatedClock* clock_;
+};
+
+}  // namespace llm
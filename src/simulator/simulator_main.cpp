@@ -0,0 +1,103 @@
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common/clock.h"
+#include "cost_model.h"
+#include "memory/block_manager.h"
+#include "mock_engine.h"
+#include "simulator.h"
+#include "trace.h"
+using namespace llm;
+
+DEFINE_string(trace_path,
+              "",
+              "path to the arrival trace, a json array or json lines file.");
+
+DEFINE_double(request_rate,
+              0,
+              "requests per second for traces without arrival times, 0 means "
+              "all requests arrive at once.");
+
+DEFINE_int32(output_tokens,
+             256,
+             "number of output tokens for requests without output length.");
+
+DEFINE_uint64(seed, 0, "seed for random arrivals and synthetic prompts.");
+
+DEFINE_int32(num_kv_cache_blocks, 4096, "number of blocks in the kv cache.");
+
+DEFINE_int32(num_host_kv_cache_blocks,
+             0,
+             "number of host blocks to swap out preempted sequences.");
+
+DEFINE_int64(kv_cache_bytes_per_token,
+             512 * 1024,
+             "bytes of kv cache for one token, used for the swap cost.");
+
+DEFINE_double(step_overhead_us, 10000, "fixed cost of one model step.");
+
+DEFINE_double(decode_cost_per_token_us,
+              100,
+              "cost to process one generated token.");
+
+DEFINE_double(context_cost_per_token_us,
+              0.25,
+              "cost to read one token from kv cache in attention.");
+
+// shared with the scheduler to keep the simulation consistent with its
+// estimates.
+DECLARE_double(prefill_cost_per_token_us);
+DECLARE_double(swap_bandwidth_gbps);
+DECLARE_int32(block_size);
+DECLARE_int32(num_speculative_tokens);
+
+int main(int argc, char* argv[]) {
+  // initialize glog and gflags
+  google::InitGoogleLogging(argv[0]);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  CHECK(!FLAGS_trace_path.empty()) << "trace_path is empty.";
+  CHECK_EQ(FLAGS_num_speculative_tokens, 0)
+      << "speculative decoding is not supported by the simulator.";
+
+  TraceOptions trace_options;
+  trace_options.request_rate = FLAGS_request_rate;
+  trace_options.num_output_tokens = FLAGS_output_tokens;
+  trace_options.seed = FLAGS_seed;
+  MockTokenizer tokenizer;
+  std::vector<TraceRequest> trace;
+  if (!load_trace(FLAGS_trace_path, tokenizer, trace_options, &trace)) {
+    LOG(FATAL) << "Failed to load trace from " << FLAGS_trace_path;
+  }
+
+  const int64_t block_size_in_bytes =
+      FLAGS_block_size * FLAGS_kv_cache_bytes_per_token;
+  CostModel cost_model;
+  cost_model.step_overhead_us = FLAGS_step_overhead_us;
+  cost_model.prefill_cost_per_token_us = FLAGS_prefill_cost_per_token_us;
+  cost_model.decode_cost_per_token_us = FLAGS_decode_cost_per_token_us;
+  cost_model.context_cost_per_token_us = FLAGS_context_cost_per_token_us;
+  // GB/s => bytes/us
+  cost_model.swap_cost_per_block_us =
+      static_cast<double>(block_size_in_bytes) /
+      (FLAGS_swap_bandwidth_gbps * 1e3);
+
+  SimulatedClock clock;
+  auto block_manager =
+      std::make_unique<BlockManager>(FLAGS_num_kv_cache_blocks,
+                                     FLAGS_block_size,
+                                     FLAGS_num_host_kv_cache_blocks,
+                                     block_size_in_bytes,
+                                     &clock);
+  MockEngine engine(cost_model, &clock, std::move(block_manager));
+
+  Simulator simulator(&engine, &clock);
+  const auto report = simulator.run(trace);
+  std::cout << report.to_string();
+  return 0;
+}
@@ -0,0 +1,537 @@
+#include "simulator.h"
+
+#include <absl/time/time.h>
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common/clock.h"
+#include "cost_model.h"
+#include "memory/block_manager.h"
+#include "mock_engine.h"
+#include "request/request.h"
+#include "scheduler/continuous_scheduler.h"
+#include "trace.h"
+
+DECLARE_int32(priority_aging_ms);
+DECLARE_double(low_priority_token_share);
+DECLARE_int32(num_lookahead_decode_steps);
+DECLARE_double(kv_cache_watermark);
+DECLARE_double(prefix_cache_reclaim_target);
+DECLARE_bool(enable_schedule_overlap);
+DECLARE_int32(max_prefill_tokens_per_batch);
+DECLARE_int32(max_prefill_seqs_per_batch);
+DECLARE_int32(max_queue_wait_ms);
+DECLARE_double(target_tpot_ms);
+DECLARE_int32(prefix_aware_reorder_window);
+DECLARE_double(prefill_cost_per_token_us);
+
+namespace llm {
+namespace {
+
+// replays the trace against a mock engine with block size 16, each step
+// costs 1ms plus 10us per prefill token and 100us per decode token.
+SimulationReport run_trace(const std::vector<TraceRequest>& trace,
+                           uint32_t num_blocks) {
+  CostModel cost_model;
+  cost_model.step_overhead_us = 1000;
+  cost_model.prefill_cost_per_token_us = 10;
+  cost_model.decode_cost_per_token_us = 100;
+
+  SimulatedClock clock;
+  MockEngine engine(cost_model,
+                    &clock,
+                    std::make_unique<BlockManager>(
+                        num_blocks, /*block_size=*/16, &clock));
+  Simulator simulator(&engine, &clock);
+  return simulator.run(trace);
+}
+
+}  // namespace
+
+TEST(SimulatorTest, CostModel) {
+  CostModel cost_model;
+  cost_model.step_overhead_us = 1000;
+  cost_model.prefill_cost_per_token_us = 10;
+  cost_model.decode_cost_per_token_us = 100;
+  cost_model.context_cost_per_token_us = 1;
+  cost_model.swap_cost_per_block_us = 50;
+
+  StepWorkload workload;
+  EXPECT_EQ(cost_model.step_latency(workload), absl::Microseconds(1000));
+
+  workload.num_prefill_tokens = 10;
+  workload.num_decode_tokens = 2;
+  workload.num_context_tokens = 30;
+  workload.num_swapped_blocks = 2;
+  EXPECT_EQ(cost_model.step_latency(workload),
+            absl::Microseconds(1000 + 100 + 200 + 30 + 100));
+}
+
+TEST(SimulatorTest, ParseTraceWithArrivalTimes) {
+  MockTokenizer tokenizer;
+  // absolute arrival times out of order
+  const std::string content = R"(
+{"arrival_time": 1002.5, "prompt": "hello world", "deadline_ms": 500}
+{"arrival_time": 1000, "prompt_tokens": 20, "output": "a b c", "n": 2}
+{"arrival_time": 1001, "prompt_tokens": [1, 2, 3], "user": "alice"}
+)";
+  std::vector<TraceRequest> trace;
+  ASSERT_TRUE(parse_trace(content, tokenizer, TraceOptions(), &trace));
+  ASSERT_EQ(trace.size(), 3);
+
+  // sorted and relative to the first arrival
+  EXPECT_EQ(trace[0].arrival_time, absl::ZeroDuration());
+  EXPECT_EQ(trace[0].prompt_tokens.size(), 20);
+  EXPECT_EQ(trace[0].num_output_tokens, 3);
+  EXPECT_EQ(trace[0].n, 2);
+
+  EXPECT_EQ(trace[1].arrival_time, absl::Seconds(1));
+  EXPECT_EQ(trace[1].prompt_tokens, std::vector<int32_t>({1, 2, 3}));
+  EXPECT_EQ(trace[1].user, "alice");
+  EXPECT_EQ(trace[1].priority, RequestPriority::MEDIUM);
+  EXPECT_EQ(trace[1].deadline, absl::InfiniteDuration());
+  // default output length
+  EXPECT_EQ(trace[1].num_output_tokens, TraceOptions().num_output_tokens);
+
+  EXPECT_EQ(trace[2].arrival_time, absl::Milliseconds(2500));
+  EXPECT_EQ(trace[2].prompt_tokens.size(), 2);
+  EXPECT_EQ(trace[2].deadline, absl::Milliseconds(500));
+
+  // invalid json
+  EXPECT_FALSE(
+      parse_trace("{\"prompt\": ", tokenizer, TraceOptions(), &trace));
+}
+
+TEST(SimulatorTest, ParseTraceWithSharedPrefix) {
+  MockTokenizer tokenizer;
+  const std::string content = R"([
+    {"prompt": "who is messi", "prefix_id": "system", "prefix_tokens": 16},
+    {"prompt": "who is ronaldo", "prefix_id": "system", "prefix_tokens": 16},
+    {"prompt": "who is messi", "prefix_id": "other", "prefix_tokens": 16,
+     "output_tokens": 8, "priority": "low"}
+  ])";
+  TraceOptions options;
+  options.request_rate = 10;
+  std::vector<TraceRequest> trace;
+  ASSERT_TRUE(parse_trace(content, tokenizer, options, &trace));
+  ASSERT_EQ(trace.size(), 3);
+
+  // poisson arrivals in the order of the trace
+  EXPECT_EQ(trace[0].arrival_time, absl::ZeroDuration());
+  EXPECT_LE(trace[0].arrival_time, trace[1].arrival_time);
+  EXPECT_LE(trace[1].arrival_time, trace[2].arrival_time);
+
+  // same prefix and the same words share tokens
+  ASSERT_EQ(trace[0].prompt_tokens.size(), 16 + 3);
+  ASSERT_EQ(trace[1].prompt_tokens.size(), 16 + 3);
+  EXPECT_TRUE(std::equal(trace[0].prompt_tokens.begin(),
+                         trace[0].prompt_tokens.begin() + 18,
+                         trace[1].prompt_tokens.begin()));
+  EXPECT_NE(trace[0].prompt_tokens[18], trace[1].prompt_tokens[18]);
+  // different prefix
+  EXPECT_NE(trace[0].prompt_tokens, trace[2].prompt_tokens);
+  EXPECT_EQ(trace[2].num_output_tokens, 8);
+  EXPECT_EQ(trace[2].priority, RequestPriority::LOW);
+}
+
+TEST(SimulatorTest, Run) {
+  // requests sharing a 32 tokens prefix, arriving 1 second apart
+  std::vector<TraceRequest> trace(4);
+  for (size_t i = 0; i < trace.size(); ++i) {
+    trace[i].arrival_time = absl::Seconds(i);
+    trace[i].prompt_tokens = std::vector<int32_t>(32, 1);
+    trace[i].prompt_tokens.push_back(static_cast<int32_t>(i + 2));
+    trace[i].num_output_tokens = 10;
+  }
+
+  const auto report = run_trace(trace, /*num_blocks=*/64);
+  EXPECT_EQ(report.num_requests, 4);
+  EXPECT_EQ(report.num_completed, 4);
+  EXPECT_EQ(report.num_rejected, 0);
+  EXPECT_EQ(report.num_dropped, 0);
+  EXPECT_EQ(report.ttft.count, 4);
+  EXPECT_EQ(report.tpot.count, 4);
+
+  // the first token comes out of the prefill step
+  EXPECT_GE(report.ttft.p50_ms, 1.0);
+  // requests don't overlap, each decode step costs 1.1ms
+  EXPECT_NEAR(report.tpot.max_ms, 1.1, 1e-6);
+  EXPECT_GT(report.duration, absl::Seconds(3));
+  EXPECT_GT(report.output_token_throughput, 0);
+  // the prefix is cached for the following requests
+  EXPECT_GT(report.prefix_cache_hit_rate, 0.5);
+}
+
+TEST(SimulatorTest, ReleaseTailBlocksInsteadOfPreemption) {
+  // a long request takes all 16 blocks while a short high priority request
+  // arrives and needs 2 of them.
+  std::vector<TraceRequest> trace(2);
+  trace[0].prompt_tokens = std::vector<int32_t>(230, 1);
+  trace[0].num_output_tokens = 26;
+  trace[0].priority = RequestPriority::LOW;
+  trace[1].arrival_time = absl::Milliseconds(20);
+  trace[1].prompt_tokens = std::vector<int32_t>(20, 2);
+  trace[1].num_output_tokens = 4;
+  trace[1].priority = RequestPriority::HIGH;
+
+  const auto report = run_trace(trace, /*num_blocks=*/16);
+  EXPECT_EQ(report.num_completed, 2);
+  // only the tail blocks of the long request are released and recomputed
+  EXPECT_EQ(report.num_preemptions, 0);
+}
+
+TEST(SimulatorTest, ManyConcurrentRequests) {
+  // more requests than the kv cache can hold at once, with mixed priorities
+  // arriving while others are running.
+  const RequestPriority priorities[] = {
+      RequestPriority::LOW, RequestPriority::MEDIUM, RequestPriority::HIGH};
+  std::vector<TraceRequest> trace(300);
+  for (size_t i = 0; i < trace.size(); ++i) {
+    trace[i].arrival_time = absl::Milliseconds(i);
+    trace[i].prompt_tokens =
+        std::vector<int32_t>(16 + i % 48, static_cast<int32_t>(i + 1));
+    trace[i].num_output_tokens = 8 + i % 64;
+    trace[i].priority = priorities[i % 3];
+  }
+
+  const auto report = run_trace(trace, /*num_blocks=*/128);
+  EXPECT_EQ(report.num_requests, 300);
+  EXPECT_EQ(report.num_completed, 300);
+  EXPECT_EQ(report.num_dropped, 0);
+  EXPECT_EQ(report.ttft.count, 300);
+  // running requests keep their blocks instead of being preempted over and
+  // over by the requests behind them.
+  EXPECT_LT(report.num_preemptions, 300);
+}
+
+TEST(SimulatorTest, PriorityAging) {
+  // a LOW priority request behind a steady stream of HIGH priority requests,
+  // the kv cache only holds one request at a time.
+  std::vector<TraceRequest> trace(40);
+  for (size_t i = 0; i < trace.size(); ++i) {
+    trace[i].arrival_time = absl::Milliseconds(5 * i);
+    trace[i].prompt_tokens =
+        std::vector<int32_t>(100, static_cast<int32_t>(i + 1));
+    trace[i].num_output_tokens = 20;
+    trace[i].priority = RequestPriority::HIGH;
+  }
+  trace[1].priority = RequestPriority::LOW;
+
+  auto run = [&](int32_t priority_aging_ms) {
+    gflags::FlagSaver flag_saver;
+    FLAGS_priority_aging_ms = priority_aging_ms;
+    return run_trace(trace, /*num_blocks=*/12);
+  };
+
+  const auto starved = run(/*priority_aging_ms=*/0);
+  EXPECT_EQ(starved.num_completed, trace.size());
+  EXPECT_EQ(starved.num_priority_promotions, 0);
+
+  const auto aged = run(/*priority_aging_ms=*/50);
+  EXPECT_EQ(aged.num_completed, trace.size());
+  // LOW => MEDIUM => HIGH
+  EXPECT_EQ(aged.num_priority_promotions, 2);
+  // the LOW priority request no longer waits for the whole stream
+  EXPECT_LT(aged.ttft.max_ms, starved.ttft.max_ms);
+}
+
+TEST(SimulatorTest, LowPriorityTokenShare) {
+  // a LOW priority request with a deadline queued behind a backlog of HIGH
+  // priority requests, which alone use up the token budget for a while.
+  std::vector<TraceRequest> trace(201);
+  for (size_t i = 0; i < trace.size(); ++i) {
+    trace[i].prompt_tokens =
+        std::vector<int32_t>(100, static_cast<int32_t>(i + 1));
+    trace[i].num_output_tokens = 10;
+    trace[i].priority = RequestPriority::HIGH;
+  }
+  trace.back().prompt_tokens = std::vector<int32_t>(16, 1000);
+  trace.back().num_output_tokens = 4;
+  trace.back().priority = RequestPriority::LOW;
+  trace.back().deadline = absl::Milliseconds(100);
+
+  auto run = [&](double low_priority_token_share) {
+    gflags::FlagSaver flag_saver;
+    FLAGS_low_priority_token_share = low_priority_token_share;
+    return run_trace(trace, /*num_blocks=*/4096);
+  };
+
+  const auto starved = run(/*low_priority_token_share=*/0);
+  EXPECT_EQ(starved.num_completed, trace.size() - 1);
+  EXPECT_EQ(starved.num_dropped, 1);
+
+  // the waiting LOW priority request is admitted with the reserved tokens
+  const auto shared = run(/*low_priority_token_share=*/0.25);
+  EXPECT_EQ(shared.num_completed, trace.size());
+  EXPECT_EQ(shared.num_dropped, 0);
+}
+
+TEST(SimulatorTest, MeasuredPrefillCost) {
+  // a request with a deadline arrives after a stream of short requests. the
+  // initial estimate is far above the simulated cost of about 15us per token.
+  std::vector<TraceRequest> trace(41);
+  for (size_t i = 0; i < trace.size(); ++i) {
+    trace[i].arrival_time = absl::Milliseconds(10 * i);
+    trace[i].prompt_tokens =
+        std::vector<int32_t>(256, static_cast<int32_t>(i + 1));
+    trace[i].num_output_tokens = 4;
+  }
+  trace.back().prompt_tokens = std::vector<int32_t>(512, 1000);
+  trace.back().deadline = absl::Milliseconds(50);
+
+  auto run = [&](const std::vector<TraceRequest>& trace) {
+    gflags::FlagSaver flag_saver;
+    FLAGS_prefill_cost_per_token_us = 1000;
+    return run_trace(trace, /*num_blocks=*/4096);
+  };
+
+  // nothing measured yet, the prefill is estimated to take 512ms
+  const auto cold = run({trace.back()});
+  EXPECT_EQ(cold.num_completed, 0);
+  EXPECT_EQ(cold.num_dropped, 1);
+
+  // the estimate follows the measured step latency
+  const auto warm = run(trace);
+  EXPECT_EQ(warm.num_completed, trace.size());
+  EXPECT_EQ(warm.num_dropped, 0);
+}
+
+TEST(SimulatorTest, LookaheadReservation) {
+  // long generations outgrow the kv cache while new requests keep arriving
+  std::vector<TraceRequest> trace(100);
+  for (size_t i = 0; i < trace.size(); ++i) {
+    trace[i].arrival_time = absl::Milliseconds(2 * i);
+    trace[i].prompt_tokens =
+        std::vector<int32_t>(32, static_cast<int32_t>(i + 1));
+    trace[i].num_output_tokens = 100 + i % 100;
+  }
+
+  auto run = [&](int32_t num_lookahead_decode_steps,
+                 double kv_cache_watermark) {
+    gflags::FlagSaver flag_saver;
+    FLAGS_num_lookahead_decode_steps = num_lookahead_decode_steps;
+    FLAGS_kv_cache_watermark = kv_cache_watermark;
+    return run_trace(trace, /*num_blocks=*/128);
+  };
+
+  const auto on_demand = run(/*num_lookahead_decode_steps=*/0,
+                             /*kv_cache_watermark=*/0);
+  const auto reserved = run(/*num_lookahead_decode_steps=*/16,
+                            /*kv_cache_watermark=*/0.25);
+  EXPECT_EQ(on_demand.num_completed, trace.size());
+  EXPECT_EQ(reserved.num_completed, trace.size());
+  // running sequences don't lose kv cache to make room for each other
+  EXPECT_LT(reserved.tpot.max_ms, on_demand.tpot.max_ms);
+}
+
+TEST(SimulatorTest, ScheduleOverlapUnderMemoryPressure) {
+  // a HIGH priority request grows while LOW priority requests, held back by
+  // the prefill limit, are prepared with blocks during each step.
+  std::vector<TraceRequest> trace(9);
+  trace[0].prompt_tokens = std::vector<int32_t>(100, 1);
+  trace[0].num_output_tokens = 60;
+  trace[0].priority = RequestPriority::HIGH;
+  for (size_t i = 1; i < trace.size(); ++i) {
+    trace[i].prompt_tokens =
+        std::vector<int32_t>(64, static_cast<int32_t>(i + 1));
+    trace[i].num_output_tokens = 4;
+    trace[i].priority = RequestPriority::LOW;
+  }
+
+  gflags::FlagSaver flag_saver;
+  FLAGS_enable_schedule_overlap = true;
+  FLAGS_max_prefill_tokens_per_batch = 256;
+  FLAGS_max_prefill_seqs_per_batch = 1;
+  const auto report = run_trace(trace, /*num_blocks=*/16);
+  // the prepared requests give their blocks back to the growing request
+  // instead of leaving it without memory.
+  EXPECT_EQ(report.num_completed, trace.size());
+  EXPECT_EQ(report.num_dropped, 0);
+}
+
+TEST(SimulatorTest, PrefixCacheReclaim) {
+  const std::vector<int32_t> shared_prompt(128, 1);
+  std::vector<int32_t> prompt = shared_prompt;
+  prompt.insert(prompt.end(), 16, 4);
+
+  for (const bool enable_schedule_overlap : {false, true}) {
+    SCOPED_TRACE(enable_schedule_overlap);
+    gflags::FlagSaver flag_saver;
+    FLAGS_enable_schedule_overlap = enable_schedule_overlap;
+    // keep 46 of 64 blocks free
+    FLAGS_prefix_cache_reclaim_target = 0.72;
+    const size_t reclaim_target_blocks = 46;
+    // one prefill sequence per step, the others wait in the queue
+    FLAGS_max_prefill_tokens_per_batch = 256;
+    FLAGS_max_prefill_seqs_per_batch = 1;
+
+    SimulatedClock clock;
+    MockEngine engine(CostModel(),
+                      &clock,
+                      std::make_unique<BlockManager>(
+                          /*num_blocks=*/64, /*block_size=*/16, &clock));
+    const BlockManager* block_manager = engine.block_manager();
+    ContinuousScheduler scheduler(&engine, &clock);
+    // returns the id of the sequence of the request
+    size_t num_requests = 0;
+    auto submit = [&](const std::vector<int32_t>& prompt_tokens,
+                      size_t max_tokens) {
+      auto request = std::make_unique<Request>(std::to_string(num_requests++),
+                                               prompt_tokens);
+      request->stopping_criteria.max_tokens = max_tokens;
+      request->stopping_criteria.ignore_eos_token = true;
+      request->on_finish = [](const std::vector<SequenceResult>& /*results*/,
+                              const Status& /*status*/,
+                              const Statistics& /*stats*/) { return true; };
+      request->add_sequence();
+      const int64_t sequence_id = request->sequences[0].id();
+      EXPECT_TRUE(scheduler.schedule(request));
+      return sequence_id;
+    };
+
+    // finished requests are released in the next step, the first one leaves
+    // 8 blocks in the prefix cache while the second one runs.
+    submit(shared_prompt, /*max_tokens=*/1);
+    scheduler.step(absl::ZeroDuration());
+    submit(std::vector<int32_t>(128, 2), /*max_tokens=*/1);
+    scheduler.step(absl::ZeroDuration());
+    EXPECT_EQ(block_manager->num_free_blocks(), 48);
+    EXPECT_EQ(block_manager->prefix_cache().num_blocks(), 8);
+
+    // the second request leaves another 8 blocks. the request sharing the
+    // prompt of the first one waits behind a 4 blocks prefill.
+    submit(std::vector<int32_t>(64, 3), /*max_tokens=*/4);
+    const int64_t sequence_id = submit(prompt, /*max_tokens=*/4);
+    scheduler.step(absl::ZeroDuration());
+    EXPECT_EQ(block_manager->num_free_blocks(), reclaim_target_blocks);
+    if (enable_schedule_overlap) {
+      // the waiting request is prepared with the 8 shared blocks and one more
+      // before the reclaim, which evicts 3 blocks of the second request.
+      EXPECT_EQ(block_manager->prefix_cache().num_blocks(), 13);
+    } else {
+      // the reclaim skips the least recently used blocks, which belong to
+      // the prompt the waiting request is about to hit, and evicts 2 blocks
+      // of the second request instead.
+      EXPECT_EQ(block_manager->prefix_cache().num_blocks(), 14);
+    }
+
+    scheduler.step(absl::ZeroDuration());
+    const auto stats = engine.take_sequence_stats(sequence_id);
+    ASSERT_TRUE(stats.has_value());
+    // the waiting request keeps its prefix during the reclaim
+    EXPECT_EQ(stats->num_cached_prompt_tokens, 128);
+  }
+}
+
+TEST(SimulatorTest, MaxQueueWait) {
+  // each request needs 8 blocks of kv cache, 8 of them fit at once.
+  auto make_trace = [](size_t num_requests, absl::Duration interval) {
+    std::vector<TraceRequest> trace(num_requests);
+    for (size_t i = 0; i < trace.size(); ++i) {
+      trace[i].arrival_time = interval * i;
+      trace[i].prompt_tokens =
+          std::vector<int32_t>(64, static_cast<int32_t>(i + 1));
+      trace[i].num_output_tokens = 64;
+    }
+    return trace;
+  };
+
+  gflags::FlagSaver flag_saver;
+  FLAGS_max_queue_wait_ms = 200;
+
+  // requests arrive much faster than they finish
+  const auto overload =
+      run_trace(make_trace(400, absl::Milliseconds(1)), /*num_blocks=*/64);
+  EXPECT_EQ(overload.num_requests, 400);
+  EXPECT_GT(overload.num_rejected, 0);
+  EXPECT_EQ(overload.num_completed + overload.num_rejected, 400);
+  EXPECT_EQ(overload.num_dropped, 0);
+
+  // every request finishes before the next one arrives
+  const auto light_load =
+      run_trace(make_trace(20, absl::Milliseconds(200)), /*num_blocks=*/64);
+  EXPECT_EQ(light_load.num_rejected, 0);
+  EXPECT_EQ(light_load.num_completed, 20);
+}
+
+TEST(SimulatorTest, TargetTpot) {
+  // a few long decodes while a steady stream of long prompts arrives
+  std::vector<TraceRequest> trace(4);
+  for (size_t i = 0; i < trace.size(); ++i) {
+    trace[i].prompt_tokens =
+        std::vector<int32_t>(16, static_cast<int32_t>(i + 1));
+    trace[i].num_output_tokens = 100;
+  }
+  for (size_t i = 0; i < 60; ++i) {
+    TraceRequest request;
+    request.arrival_time = absl::Milliseconds(1 + 5 * i);
+    request.prompt_tokens =
+        std::vector<int32_t>(1024, static_cast<int32_t>(100 + i));
+    // no decode steps, only the decode sequences count towards tpot
+    request.num_output_tokens = 1;
+    trace.push_back(std::move(request));
+  }
+
+  auto run = [&](double target_tpot_ms) {
+    gflags::FlagSaver flag_saver;
+    FLAGS_max_prefill_tokens_per_batch = 1024;
+    FLAGS_max_prefill_seqs_per_batch = 1;
+    FLAGS_target_tpot_ms = target_tpot_ms;
+    return run_trace(trace, /*num_blocks=*/4096);
+  };
+
+  // a full prefill chunk stalls decode steps by 10ms
+  const double target_tpot_ms = 4;
+  const auto fixed_budget = run(/*target_tpot_ms=*/0);
+  EXPECT_EQ(fixed_budget.num_completed, trace.size());
+  EXPECT_EQ(fixed_budget.tpot.count, 4);
+  EXPECT_GT(fixed_budget.tpot.mean_ms, 1.5 * target_tpot_ms);
+
+  // the prefill budget shrinks until decode steps meet the target
+  const auto adaptive_budget = run(target_tpot_ms);
+  EXPECT_EQ(adaptive_budget.tpot.count, 4);
+  EXPECT_LT(adaptive_budget.tpot.max_ms, 1.25 * target_tpot_ms);
+  EXPECT_GT(adaptive_budget.tpot.mean_ms, 0.75 * target_tpot_ms);
+  // prefill still makes progress
+  EXPECT_EQ(adaptive_budget.num_completed, trace.size());
+  EXPECT_EQ(adaptive_budget.num_dropped, 0);
+}
+
+TEST(SimulatorTest, PrefixAwareReorder) {
+  // requests of 2 system prompts arrive at once, interleaved. without
+  // reordering, the followers are prefilled before the first request of their
+  // group is cached.
+  const size_t num_groups = 2;
+  std::vector<TraceRequest> trace(16);
+  for (size_t i = 0; i < trace.size(); ++i) {
+    const auto group = static_cast<int32_t>(i % num_groups);
+    trace[i].prompt_tokens = std::vector<int32_t>(256, group + 1);
+    trace[i].prompt_tokens.push_back(static_cast<int32_t>(100 + i));
+    trace[i].num_output_tokens = 8;
+  }
+
+  const int32_t window = 8;
+  auto run = [&](int32_t prefix_aware_reorder_window) {
+    gflags::FlagSaver flag_saver;
+    FLAGS_prefix_aware_reorder_window = prefix_aware_reorder_window;
+    return run_trace(trace, /*num_blocks=*/512);
+  };
+
+  const auto fcfs = run(/*prefix_aware_reorder_window=*/0);
+  EXPECT_EQ(fcfs.num_completed, trace.size());
+  EXPECT_EQ(fcfs.max_num_bypassed, 0);
+
+  const auto reordered = run(window);
+  EXPECT_EQ(reordered.num_completed, trace.size());
+  EXPECT_EQ(reordered.num_dropped, 0);
+  EXPECT_GT(reordered.prefix_cache_hit_rate, fcfs.prefix_cache_hit_rate);
+  // bypassed requests keep their position after being moved back too often
+  EXPECT_GT(reordered.max_num_bypassed, 0);
+  EXPECT_LE(reordered.max_num_bypassed, window);
+}
+
+}  // namespace llm
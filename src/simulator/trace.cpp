@@ -0,0 +1,230 @@
+#include "trace.h"
+
+#include <absl/strings/ascii.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <absl/time/time.h>
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace llm {
+namespace {
+
+// deterministic pseudo random token ids, the same key yields the same tokens
+std::vector<int32_t> synthetic_tokens(const std::string& key,
+                                      size_t num_tokens,
+                                      size_t vocab_size) {
+  std::mt19937_64 rng(std::hash<std::string>{}(key));
+  // token id 0 is reserved for eos
+  std::uniform_int_distribution<int32_t> dist(
+      1, static_cast<int32_t>(std::max<size_t>(vocab_size, 2) - 1));
+  std::vector<int32_t> tokens(num_tokens);
+  for (auto& token : tokens) {
+    token = dist(rng);
+  }
+  return tokens;
+}
+
+std::optional<std::string> text_field(const nlohmann::json& record,
+                                      const std::vector<std::string>& keys) {
+  for (const auto& key : keys) {
+    auto it = record.find(key);
+    if (it != record.end() && it->is_string()) {
+      return it->get<std::string>();
+    }
+  }
+  return std::nullopt;
+}
+
+bool parse_priority(const std::string& value, RequestPriority* priority) {
+  const std::string lower = absl::AsciiStrToLower(value);
+  if (lower == "high") {
+    *priority = RequestPriority::HIGH;
+  } else if (lower == "medium") {
+    *priority = RequestPriority::MEDIUM;
+  } else if (lower == "low") {
+    *priority = RequestPriority::LOW;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// parse one request from the record, arrival time is handled by the caller
+bool parse_request(const nlohmann::json& record,
+                   size_t index,
+                   const Tokenizer& tokenizer,
+                   const TraceOptions& options,
+                   TraceRequest* request) {
+  if (!record.is_object()) {
+    LOG(ERROR) << "Request " << index << " is not a json object";
+    return false;
+  }
+  const size_t vocab_size = tokenizer.vocab_size();
+
+  // shared synthetic prefix
+  const size_t num_prefix_tokens = record.value("prefix_tokens", 0);
+  if (num_prefix_tokens > 0) {
+    const auto prefix_id = record.value("prefix_id", nlohmann::json());
+    const auto key = absl::StrCat(options.seed, ":prefix:", prefix_id.dump());
+    request->prompt_tokens =
+        synthetic_tokens(key, num_prefix_tokens, vocab_size);
+  }
+
+  std::vector<int32_t> prompt_tokens;
+  const auto tokens_it = record.find("prompt_tokens");
+  if (tokens_it != record.end() && tokens_it->is_array()) {
+    prompt_tokens = tokens_it->get<std::vector<int32_t>>();
+  } else if (tokens_it != record.end() && tokens_it->is_number_unsigned()) {
+    prompt_tokens =
+        synthetic_tokens(absl::StrCat(options.seed, ":request:", index),
+                         tokens_it->get<size_t>(),
+                         vocab_size);
+  } else if (auto text = text_field(record, {"prompt", "text", "body"})) {
+    if (!tokenizer.encode(*text, &prompt_tokens)) {
+      LOG(ERROR) << "Failed to encode the prompt of request " << index;
+      return false;
+    }
+  }
+  request->prompt_tokens.insert(
+      request->prompt_tokens.end(), prompt_tokens.begin(), prompt_tokens.end());
+  if (request->prompt_tokens.empty()) {
+    LOG(ERROR) << "Request " << index << " has no prompt";
+    return false;
+  }
+
+  request->num_output_tokens = options.num_output_tokens;
+  const auto output_it = record.find("output_tokens");
+  if (output_it != record.end() && output_it->is_number_unsigned()) {
+    request->num_output_tokens = output_it->get<size_t>();
+  } else if (auto output = text_field(record, {"output"})) {
+    std::vector<int32_t> output_tokens;
+    if (tokenizer.encode(*output, &output_tokens)) {
+      request->num_output_tokens = output_tokens.size();
+    }
+  }
+  // at least one token is generated
+  request->num_output_tokens = std::max<size_t>(request->num_output_tokens, 1);
+
+  request->n = std::max<size_t>(record.value("n", 1), 1);
+  request->user = record.value("user", "");
+  if (auto priority = text_field(record, {"priority"})) {
+    if (!parse_priority(*priority, &request->priority)) {
+      LOG(ERROR) << "Invalid priority of request " << index << ": "
+                 << *priority;
+      return false;
+    }
+  }
+  const int64_t deadline_ms = record.value("deadline_ms", 0);
+  if (deadline_ms > 0) {
+    request->deadline = absl::Milliseconds(deadline_ms);
+  }
+  return true;
+}
+
+}  // namespace
+
+bool parse_trace(const std::string& content,
+                 const Tokenizer& tokenizer,
+                 const TraceOptions& options,
+                 std::vector<TraceRequest>* requests) {
+  // a json array or json lines
+  std::vector<nlohmann::json> records;
+  const auto first = content.find_first_not_of(" \t\r\n");
+  if (first != std::string::npos && content[first] == '[') {
+    auto data = nlohmann::json::parse(content,
+                                      /*cb=*/nullptr,
+                                      /*allow_exceptions=*/false);
+    if (!data.is_array()) {
+      LOG(ERROR) << "Failed to parse the trace as a json array";
+      return false;
+    }
+    records.assign(data.begin(), data.end());
+  } else {
+    size_t line_no = 0;
+    for (absl::string_view line : absl::StrSplit(content, '\n')) {
+      ++line_no;
+      if (absl::StripAsciiWhitespace(line).empty()) {
+        continue;
+      }
+      auto data = nlohmann::json::parse(line,
+                                        /*cb=*/nullptr,
+                                        /*allow_exceptions=*/false);
+      if (data.is_discarded()) {
+        LOG(ERROR) << "Failed to parse line " << line_no << " of the trace";
+        return false;
+      }
+      records.push_back(std::move(data));
+    }
+  }
+
+  std::vector<TraceRequest> parsed(records.size());
+  bool has_arrival_times = true;
+  double min_arrival_time = 0;
+  for (size_t i = 0; i < records.size(); ++i) {
+    if (!parse_request(records[i], i, tokenizer, options, &parsed[i])) {
+      return false;
+    }
+    const auto it = records[i].find("arrival_time");
+    if (it == records[i].end() || !it->is_number()) {
+      has_arrival_times = false;
+      continue;
+    }
+    const double arrival_time = it->get<double>();
+    min_arrival_time =
+        i == 0 ? arrival_time : std::min(min_arrival_time, arrival_time);
+    parsed[i].arrival_time = absl::Seconds(arrival_time);
+  }
+
+  if (has_arrival_times) {
+    // relative to the first arrival
+    for (auto& request : parsed) {
+      request.arrival_time -= absl::Seconds(min_arrival_time);
+    }
+  } else {
+    // poisson arrivals in the order of the trace
+    std::mt19937_64 rng(options.seed);
+    std::exponential_distribution<double> interval(
+        options.request_rate > 0 ? options.request_rate : 1.0);
+    double arrival_time = 0;
+    for (auto& request : parsed) {
+      request.arrival_time = absl::Seconds(arrival_time);
+      if (options.request_rate > 0) {
+        arrival_time += interval(rng);
+      }
+    }
+  }
+
+  std::stable_sort(parsed.begin(),
+                   parsed.end(),
+                   [](const TraceRequest& a, const TraceRequest& b) {
+                     return a.arrival_time < b.arrival_time;
+                   });
+  *requests = std::move(parsed);
+  return true;
+}
+
+bool load_trace(const std::string& path,
+                const Tokenizer& tokenizer,
+                const TraceOptions& options,
+                std::vector<TraceRequest>* requests) {
+  std::ifstream file(path);
+  if (!file.is_open()) {
+    LOG(ERROR) << "Failed to open trace file: " << path;
+    return false;
+  }
+  std::stringstream buffer;
+  buffer << file.rdbuf();
+  return parse_trace(buffer.str(), tokenizer, options, requests);
+}
+
+}  // namespace llm
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <absl/time/time.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "request/request.h"
+#include "tokenizer/tokenizer.h"
+
+namespace llm {
+
+// A request in an arrival trace.
+struct TraceRequest {
+  // arrival time relative to the start of the trace
+  absl::Duration arrival_time;
+
+  std::vector<int32_t> prompt_tokens;
+
+  // number of tokens to generate for each sequence
+  size_t num_output_tokens = 0;
+
+  // number of sequences to generate
+  size_t n = 1;
+
+  RequestPriority priority = RequestPriority::MEDIUM;
+
+  // the tenant of the request
+  std::string user;
+
+  // deadline relative to the arrival time
+  absl::Duration deadline = absl::InfiniteDuration();
+};
+
+struct TraceOptions {
+  // arrival rate in requests per second for traces without arrival times,
+  // following a poisson process. 0 means all requests arrive at once.
+  double request_rate = 0;
+
+  // number of output tokens for requests without the output length
+  size_t num_output_tokens = 256;
+
+  // seed for the random arrivals and synthetic prompts
+  uint64_t seed = 0;
+};
+
+// Parse an arrival trace, either a json array or json lines with one request
+// per line. recognized fields of each request:
+// * arrival_time: arrival time in seconds, absolute or relative. arrivals are
+//   generated from options.request_rate if any request doesn't have one.
+// * prompt_tokens: number of synthetic prompt tokens, or a list of token ids.
+//   falls back to tokenizing the text in prompt, text or body.
+// * prefix_id, prefix_tokens: a synthetic prefix of prefix_tokens tokens
+//   shared by requests with the same prefix_id, i.e. a system prompt.
+// * output_tokens: number of tokens to generate, or tokenized from output.
+// * n, user, deadline_ms and priority (high, medium or low).
+// requests are sorted by arrival time. returns false if the trace is invalid.
+bool parse_trace(const std::string& content,
+                 const Tokenizer& tokenizer,
+                 const TraceOptions& options,
+                 std::vector<TraceRequest>* requests);
+
+// load the arrival trace from a file, see parse_trace() for the format.
+bool load_trace(const std::string& path,
+                const Tokenizer& tokenizer,
+                const TraceOptions& options,
+                std::vector<TraceRequest>* requests);
+
+}  // namespace llm
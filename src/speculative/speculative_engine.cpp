@@ -10,6 +10,7 @@
 
 DECLARE_int32(block_size);
 DECLARE_int32(num_speculative_tokens);
+DECLARE_int64(max_swap_space);
 
 namespace llm {
 
@@ -84,9 +85,26 @@ bool SpeculativeEngine::init_kv_cache() {
     n_blocks = std::min(target_blocks, draft_blocks);
   }
   CHECK_GT(n_blocks, 0) << "no memory for kv cache";
+
+  // both engines share block ids, so use the same number of host blocks
+  int64_t n_host_blocks = 0;
+  if (FLAGS_max_swap_space > 0 &&
+      engine_->calculate_host_kv_cache_blocks() > 0 &&
+      draft_engine_->calculate_host_kv_cache_blocks() > 0) {
+    n_host_blocks = calculate_kv_cache_blocks(FLAGS_max_swap_space);
+  }
   // init kv cache
-  return engine_->init_kv_cache(n_blocks) &&
-         draft_engine_->init_kv_cache(n_blocks);
+  if (!engine_->init_kv_cache(n_blocks, n_host_blocks) ||
+      !draft_engine_->init_kv_cache(n_blocks, n_host_blocks)) {
+    return false;
+  }
+  // both models read the blocks of the target model, keep all of them unless
+  // both models attend to the same sliding window.
+  if (engine_->model_args().sliding_window() !=
+      draft_engine_->model_args().sliding_window()) {
+    engine_->block_manager()->set_sliding_window(0);
+  }
+  return true;
 }
 
 ModelOutput SpeculativeEngine::execute_model(Batch& batch) {